@@ -0,0 +1,114 @@
+/**
+* arena.c => Bump allocator reused between steps of an operation
+*/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crush.h"
+#include "arena.h"
+
+/**
+* A block of arena memory. Blocks past the
+* first are only kept until the next reset.
+*/
+struct Arena_Block {
+    struct Arena_Block *next;
+    size_t size;
+    size_t used;
+    unsigned char *data;
+};
+
+struct Arena_Struct {
+    struct Arena_Block *blocks;
+    size_t total;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static struct Arena_Block *new_block(size_t size);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+ARENA new_arena(size_t size) {
+    ARENA arena = malloc(sizeof(*arena));
+    if (!arena)
+        handle_error("Failed to allocate arena");
+
+    arena->blocks = new_block(size);
+    arena->total = size;
+    return arena;
+}
+
+
+void *arena_alloc(ARENA arena, size_t size) {
+    struct Arena_Block *block = arena->blocks;
+    size_t start = (block->used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (start + size > block->size) {
+        // Grow geometrically so a big step
+        // takes few blocks.
+        size_t grow = block->size * 2;
+        if (grow < size)
+            grow = size;
+
+        struct Arena_Block *bigger = new_block(grow);
+        bigger->next = block;
+        arena->blocks = bigger;
+        arena->total += grow;
+        block = bigger;
+        start = 0;
+    }
+
+    block->used = start + size;
+    return block->data + start;
+}
+
+
+void arena_reset(ARENA arena) {
+    if (!arena->blocks->next) {
+        arena->blocks->used = 0;
+        return;
+    }
+
+    size_t total = arena->total;
+    struct Arena_Block *block = arena->blocks;
+    while (block) {
+        struct Arena_Block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->blocks = new_block(total);
+}
+
+
+void free_arena(ARENA arena) {
+    struct Arena_Block *block = arena->blocks;
+    while (block) {
+        struct Arena_Block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
+
+
+/**
+* Allocates a block with its
+* data straight after it.
+*/
+static struct Arena_Block *new_block(size_t size) {
+    struct Arena_Block *block = malloc(sizeof(*block) + size + ARENA_ALIGN);
+    if (!block)
+        handle_error("Failed to allocate arena");
+
+    uintptr_t data = (uintptr_t) (block + 1);
+    block->data = (unsigned char *) ((data + ARENA_ALIGN - 1) &
+                                     ~(uintptr_t) (ARENA_ALIGN - 1));
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+
+#include <stddef.h>
+
+// every allocation is aligned to this
+#define ARENA_ALIGN               16
+
+/**
+* A bump allocator for memory that only lives
+* as long as one step of an operation, such
+* as the header and pathname of the CAN being
+* read. Everything is handed back at once by
+* arena_reset, after which the same memory is
+* reused, so a loop over many CANs needs only
+* as much as its biggest step.
+*/
+typedef struct Arena_Struct *ARENA;
+
+
+/**
+* Creates an arena whose first
+* block holds size bytes.
+*/
+ARENA new_arena(size_t size);
+
+
+/**
+* Returns size bytes from the arena,
+* adding a block if they don't fit.
+*/
+void *arena_alloc(ARENA arena, size_t size);
+
+
+/**
+* Frees everything allocated from the arena.
+* If the last step needed more than one block
+* they are merged so the next step fits
+* in one.
+*/
+void arena_reset(ARENA arena);
+
+
+/**
+* Frees an arena and its blocks.
+*/
+void free_arena(ARENA arena);
+
+
+#endif
@@ -0,0 +1,283 @@
+/**
+* batch_io.c => Small file create and extract through io_uring
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "can.h"
+#include "crush.h"
+#include "arena.h"
+#include "ring.h"
+#include "sparse.h"
+#include "batch_io.h"
+
+// which step of a file's chain
+// a completion belongs to
+#define BATCH_OPEN                0
+#define BATCH_DATA                1
+#define BATCH_CLOSE               2
+
+/**
+* One queued file. data holds its contents,
+* read in when creating or to be written
+* out when extracting.
+*/
+struct Batch_File {
+    char *path;
+    struct stat st;
+    uint8_t *data;
+    size_t length;
+    int32_t results[3];
+};
+
+struct Batch_IO_Struct {
+    RING ring;
+    CAN_WRITER writer;
+    ARENA arena;
+    struct Batch_File files[BATCH_IO_MAX_FILES];
+    size_t count;
+    size_t bytes;
+    mode_t umask;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static struct Batch_File *queue_file(BATCH_IO batch, char *path, struct stat *s,
+                                     size_t length);
+static void submit_files(BATCH_IO batch);
+static void finish_created(BATCH_IO batch);
+static void finish_extracted(BATCH_IO batch);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+BATCH_IO new_batch_io(CAN_WRITER writer) {
+    RING ring = new_ring(BATCH_IO_RING_DEPTH, BATCH_IO_MAX_FILES);
+    if (!ring)
+        return NULL;
+
+    BATCH_IO batch = calloc(1, sizeof(*batch));
+    if (!batch)
+        handle_error("Failed to allocate batch");
+
+    batch->ring = ring;
+    batch->writer = writer;
+    batch->arena = new_arena(1 << 20);
+
+    // Extracted files are opened with their
+    // mode and only chmod'ed if the umask
+    // takes bits away.
+    batch->umask = umask(0);
+    umask(batch->umask);
+
+    return batch;
+}
+
+
+void batch_create_file(void *batch_ptr, char *path, struct stat *s) {
+    BATCH_IO batch = batch_ptr;
+
+    if (!S_ISREG(s->st_mode) || s->st_size > BATCH_IO_SMALL_FILE ||
+        (batch->writer->sparse && may_be_sparse(s))) {
+        batch_io_flush(batch);
+        write_file(batch->writer, path, s);
+        return;
+    }
+
+    printf("Adding: %s\n", path);
+    queue_file(batch, path, s, s->st_size);
+}
+
+
+int batch_extract_file(BATCH_IO batch, CAN_READER reader, char *path) {
+    struct Libcan_Entry *CAN = &reader->entry;
+    if (!S_ISREG(CAN->mode) || (CAN->flags & CAN_SIZED_FLAGS) ||
+        CAN->content_length > BATCH_IO_SMALL_FILE) {
+        batch_io_flush(batch);
+        return 0;
+    }
+
+    printf("Extracting: %s\n", path);
+
+    struct stat s = {.st_mode = CAN->mode};
+    struct Batch_File *file = queue_file(batch, path, &s, CAN->content_length);
+
+    // libcan checks the checksum as the
+    // last of the contents is read.
+    size_t have = 0, got;
+    int status;
+    do {
+        status = can_read(reader->reader, file->data + have, file->length - have, &got);
+        have += got;
+    } while (status == LIBCAN_OK && got);
+
+    // Whatever was queued before a
+    // bad CAN still gets written.
+    if (status != LIBCAN_OK) {
+        batch->count--;
+        batch_io_flush(batch);
+        handle_error((char *) can_strerror(status));
+    }
+
+    return 1;
+}
+
+
+void batch_io_flush(BATCH_IO batch) {
+    if (!batch->count)
+        return;
+
+    submit_files(batch);
+
+    if (batch->writer)
+        finish_created(batch);
+    else
+        finish_extracted(batch);
+
+    batch->count = 0;
+    batch->bytes = 0;
+    arena_reset(batch->arena);
+}
+
+
+void free_batch_io(BATCH_IO batch) {
+    batch_io_flush(batch);
+
+    free_ring(batch->ring);
+    free_arena(batch->arena);
+    free(batch);
+}
+
+
+/**
+* Adds a file of length bytes to the batch,
+* submitting the batch first if it is full.
+*/
+static struct Batch_File *queue_file(BATCH_IO batch, char *path, struct stat *s,
+                                     size_t length) {
+    if (batch->count == BATCH_IO_MAX_FILES ||
+        batch->bytes + length > BATCH_IO_MAX_BYTES)
+        batch_io_flush(batch);
+
+    struct Batch_File *file = &batch->files[batch->count++];
+    size_t path_length = strlen(path);
+
+    file->path = arena_alloc(batch->arena, path_length + 1);
+    memcpy(file->path, path, path_length + 1);
+    file->st = *s;
+    file->length = length;
+    file->data = arena_alloc(batch->arena, length ? length : 1);
+    batch->bytes += length;
+
+    return file;
+}
+
+
+/**
+* Queues an open, read or write, and close
+* for every file, each chain on the file's
+* own direct descriptor, then submits them
+* all at once and collects the results.
+*/
+static void submit_files(BATCH_IO batch) {
+    int creating = batch->writer != NULL;
+    unsigned expected = 0;
+
+    for (size_t f = 0; f < batch->count; f++) {
+        struct Batch_File *file = &batch->files[f];
+        int with_data = file->length > 0;
+
+        struct io_uring_sqe *sqe = ring_get_sqe(batch->ring);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) file->path;
+        // Direct descriptors are never inherited,
+        // and the kernel refuses O_CLOEXEC on them.
+        sqe->open_flags = creating ? O_RDONLY : O_WRONLY | O_CREAT | O_EXCL;
+        sqe->len = file->st.st_mode & 07777;
+        sqe->file_index = f + 1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = f << 2 | BATCH_OPEN;
+
+        if (with_data) {
+            sqe = ring_get_sqe(batch->ring);
+            sqe->opcode = creating ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->fd = f;
+            sqe->addr = (uintptr_t) file->data;
+            sqe->len = file->length;
+            sqe->off = 0;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            sqe->user_data = f << 2 | BATCH_DATA;
+        }
+
+        sqe = ring_get_sqe(batch->ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = f + 1;
+        sqe->user_data = f << 2 | BATCH_CLOSE;
+
+        file->results[BATCH_DATA] = file->length;
+        expected += with_data ? 3 : 2;
+    }
+
+    ring_submit(batch->ring, expected);
+
+    while (expected) {
+        uint64_t user_data;
+        int32_t res;
+        if (!ring_next_cqe(batch->ring, &user_data, &res)) {
+            ring_submit(batch->ring, 1);
+            continue;
+        }
+
+        batch->files[user_data >> 2].results[user_data & 3] = res;
+        expected--;
+    }
+}
+
+
+/**
+* Writes the CANs of a batch of read
+* files in the order they were added.
+*/
+static void finish_created(BATCH_IO batch) {
+    for (size_t f = 0; f < batch->count; f++) {
+        struct Batch_File *file = &batch->files[f];
+
+        if (file->results[BATCH_OPEN] < 0)
+            handle_error("Failed to open file steam");
+        if (file->results[BATCH_DATA] < 0)
+            handle_error("Failed to read file");
+        if ((size_t) file->results[BATCH_DATA] != file->length)
+            handle_error("File changed size while archiving");
+
+        write_loaded_file(batch->writer, file->path, &file->st, file->data);
+    }
+}
+
+
+/**
+* Checks a batch of written files went out
+* whole and gives them their exact modes.
+*/
+static void finish_extracted(BATCH_IO batch) {
+    for (size_t f = 0; f < batch->count; f++) {
+        struct Batch_File *file = &batch->files[f];
+
+        if (file->results[BATCH_OPEN] == -EEXIST) {
+            fprintf(stderr, "ERROR: %s Permission denied\n", file->path);
+            exit(1);
+        }
+        if (file->results[BATCH_OPEN] < 0)
+            handle_error("Failed to create file");
+        if (file->results[BATCH_DATA] < 0 ||
+            (size_t) file->results[BATCH_DATA] != file->length)
+            handle_error("Failed to write file");
+
+        mode_t mode = file->st.st_mode & 07777;
+        if ((mode & batch->umask) && chmod(file->path, file->st.st_mode) != 0)
+            handle_error("Failed to change permissions");
+    }
+}
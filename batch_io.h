@@ -0,0 +1,77 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+
+#include <sys/stat.h>
+
+#include "can.h"
+
+// files up to this size are batched, larger
+// ones are copied a block at a time as usual
+#define BATCH_IO_SMALL_FILE       65536
+
+// most files and content bytes held
+// before a batch is submitted
+#define BATCH_IO_MAX_FILES        256
+#define BATCH_IO_MAX_BYTES        (16 << 20)
+
+// submission queue depth, deep enough for
+// the open, read or write and close of
+// every file in a full batch
+#define BATCH_IO_RING_DEPTH       1024
+
+/**
+* Small files queued on an io_uring. Each file's
+* open, read or write and close go in as one
+* linked chain on a direct descriptor, and a
+* whole batch of chains is submitted with a
+* single syscall so the kernel can overlap
+* them. Files still reach the can, or the
+* disk, in the order they were queued.
+*/
+typedef struct Batch_IO_Struct *BATCH_IO;
+
+
+/**
+* Creates a batch writing created CANs to
+* writer, or NULL when extracting. Returns
+* NULL if io_uring isn't available, in which
+* case the usual paths should be used.
+*/
+BATCH_IO new_batch_io(CAN_WRITER writer);
+
+
+/**
+* A CAN_EMIT taking a BATCH_IO as ctx. Small
+* regular files are queued to be read, while
+* anything else is written with write_file
+* once the files queued before it are.
+*/
+void batch_create_file(void *batch, char *path, struct stat *s);
+
+
+/**
+* Queues the file of the CAN reader is on
+* to be written to path. Its contents and
+* checksum are read and checked now, so 1
+* is returned with the CAN fully consumed.
+* For any CAN it doesn't take, the files
+* queued so far are written and 0 is
+* returned.
+*/
+int batch_extract_file(BATCH_IO batch, CAN_READER reader, char *path);
+
+
+/**
+* Submits and completes every queued file.
+*/
+void batch_io_flush(BATCH_IO batch);
+
+
+/**
+* Flushes and frees a batch.
+*/
+void free_batch_io(BATCH_IO batch);
+
+
+#endif
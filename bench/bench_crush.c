@@ -0,0 +1,339 @@
+/**
+* bench_crush.c => Times crush creating, listing, verifying
+* and extracting each tree of a gen_tree corpus. Every run
+* prints one line of key=value pairs, always the same keys
+* in the same order, so CI can diff results across commits:
+*
+*   bench tree=tiny op=create files=... bytes=... can_bytes=...
+*         reps=... seconds=... mbps=... files_per_sec=...
+*         peak_rss_kib=... syscalls=...
+*
+* seconds is the fastest of reps runs and peak_rss_kib the
+* largest. syscalls comes from one more run under ptrace,
+* kept apart so tracing doesn't slow the timed runs, and
+* is -1 where ptrace isn't allowed. Any crush-flags are
+* passed to crush when creating.
+*
+* Build: gcc -O2 -I.. -o bench_crush bench_crush.c ../helpers.c ../errors.c
+* Usage: ./bench_crush [-r reps] <crush-binary> <corpus-dir> <scratch-dir>
+*                      [crush-flags ...]
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "crush.h"
+
+#define MAX_ARGS                  64
+#define MAX_TRACED                4096
+#define PATH_BYTES                4096
+
+static const char *trees[] = {"tiny", "large", "deep", "mixed"};
+static const char *ops[] = {"create", "list", "verify", "extract"};
+
+/**
+* What one run of crush cost.
+*/
+struct Run {
+    double secs;
+    long peak_rss;
+    long syscalls;
+};
+
+// totals for the tree being walked by count_entry
+static uint64_t tree_files;
+static uint64_t tree_bytes;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int count_entry(const char *path, const struct stat *s, int flag,
+                       struct FTW *ftw) {
+    (void) path;
+    (void) flag;
+    (void) ftw;
+    tree_files++;
+    if (S_ISREG(s->st_mode))
+        tree_bytes += s->st_size;
+    return 0;
+}
+
+
+static int remove_entry(const char *path, const struct stat *s, int flag,
+                        struct FTW *ftw) {
+    (void) s;
+    (void) flag;
+    (void) ftw;
+    return remove(path);
+}
+
+
+/**
+* Empties and recreates dir.
+*/
+static void fresh_dir(char *dir) {
+    if (access(dir, F_OK) == 0 &&
+        nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0)
+        handle_error("Failed to clear scratch directory");
+    if (mkdir(dir, 0755) != 0)
+        handle_error("Failed to make scratch directory");
+}
+
+
+/**
+* In the child, runs argv in dir with
+* its output thrown away.
+*/
+static void exec_in(char *dir, char **argv) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null < 0 || dup2(null, STDOUT_FILENO) < 0 || chdir(dir) != 0)
+        _exit(127);
+
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+
+/**
+* Counts the syscalls of a traced process and
+* every thread it starts. Each syscall stops a
+* thread on entry and again on exit, so only
+* the stops entering one are counted.
+*/
+static long count_syscalls(pid_t pid, int *status) {
+    pid_t inside[MAX_TRACED];
+    int traced = 0;
+    long calls = 0;
+
+    ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD |
+           PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, 0, 0);
+
+    for (;;) {
+        int st;
+        pid_t tid = waitpid(-1, &st, __WALL);
+        if (tid < 0)
+            break;
+
+        if (WIFEXITED(st) || WIFSIGNALED(st)) {
+            if (tid == pid)
+                *status = st;
+            continue;
+        }
+
+        int sig = WSTOPSIG(st);
+        int deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            // Toggle whether the thread is inside
+            // a syscall, counting it on entry.
+            int t = 0;
+            while (t < traced && inside[t] != tid && inside[t] != -tid)
+                t++;
+            if (t == traced && traced < MAX_TRACED)
+                inside[traced++] = -tid;
+            if (t < traced) {
+                inside[t] = -inside[t];
+                if (inside[t] > 0)
+                    calls++;
+            }
+        } else if (sig != SIGTRAP && sig != SIGSTOP) {
+            deliver = sig;
+        }
+
+        ptrace(PTRACE_SYSCALL, tid, 0, deliver);
+    }
+
+    return calls;
+}
+
+
+/**
+* Runs argv in dir, timing it and taking its
+* peak resident set, or counting its syscalls
+* if trace is set. Exits if crush fails.
+*/
+static void run(char *dir, char **argv, int trace, struct Run *out) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0)
+        handle_error("Failed to fork");
+
+    if (pid == 0) {
+        if (trace) {
+            if (ptrace(PTRACE_TRACEME, 0, 0, 0) != 0)
+                _exit(126);
+            raise(SIGSTOP);
+        }
+        exec_in(dir, argv);
+    }
+
+    int status = 0;
+    struct rusage usage;
+    if (trace) {
+        if (waitpid(pid, &status, 0) < 0)
+            handle_error("Failed to wait for crush");
+
+        // No ptrace here, so no count.
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 126) {
+            out->syscalls = -1;
+            return;
+        }
+        out->syscalls = count_syscalls(pid, &status);
+    } else {
+        if (wait4(pid, &status, 0, &usage) < 0)
+            handle_error("Failed to wait for crush");
+
+        out->secs = now() - start;
+        out->peak_rss = usage.ru_maxrss;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench_crush: %s %s failed in %s\n", argv[0],
+                argv[1], dir);
+        exit(1);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    int reps = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "+r:")) != -1) {
+        if (opt == 'r' && atoi(optarg) > 0) {
+            reps = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+
+    if (argc - optind < 3) {
+        fprintf(stderr, "Usage: %s [-r reps] <crush-binary> <corpus-dir> "
+                        "<scratch-dir> [crush-flags ...]\n", argv[0]);
+        return 1;
+    }
+
+    // Paths given to crush are made absolute
+    // as it runs in different directories.
+    char crush[PATH_BYTES], corpus[PATH_BYTES], scratch[PATH_BYTES];
+    if (!realpath(argv[optind], crush) || !realpath(argv[optind + 1], corpus))
+        handle_error("Failed to find crush or the corpus");
+    mkdir(argv[optind + 2], 0755);
+    if (!realpath(argv[optind + 2], scratch))
+        handle_error("Failed to find scratch directory");
+    char **flags = &argv[optind + 3];
+    int flag_count = argc - optind - 3;
+    if (flag_count > MAX_ARGS - 8)
+        handle_error("Too many crush flags");
+
+    char can[PATH_BYTES + 16], out_dir[PATH_BYTES + 16];
+    snprintf(can, sizeof(can), "%s/bench.can", scratch);
+    snprintf(out_dir, sizeof(out_dir), "%s/out", scratch);
+
+    int version = 0;
+    double scale = 0;
+    char stamp[PATH_BYTES + 16];
+    snprintf(stamp, sizeof(stamp), "%s/.stamp", corpus);
+    FILE *in = fopen(stamp, "r");
+    if (!in || fscanf(in, "gen_tree %d scale %lf", &version, &scale) != 2)
+        handle_error("Corpus wasn't made by gen_tree");
+    fclose(in);
+
+    printf("corpus version=%d scale=%g reps=%d flags=", version, scale, reps);
+    for (int f = 0; f < flag_count; f++)
+        printf("%s%s", f ? "," : "", flags[f]);
+    printf("\n");
+
+    for (size_t t = 0; t < sizeof(trees) / sizeof(trees[0]); t++) {
+        char tree[PATH_BYTES + 16];
+        snprintf(tree, sizeof(tree), "%s/%s", corpus, trees[t]);
+        if (access(tree, F_OK) != 0)
+            continue;
+
+        tree_files = 0;
+        tree_bytes = 0;
+        if (nftw(tree, count_entry, 64, FTW_PHYS) != 0)
+            handle_error("Failed to walk tree");
+
+        for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+            char *args[MAX_ARGS];
+            int a = 0;
+            char *dir = corpus;
+
+            args[a++] = crush;
+            if (o == 0) {
+                for (int f = 0; f < flag_count; f++)
+                    args[a++] = flags[f];
+                args[a++] = "-c";
+                args[a++] = can;
+                args[a++] = (char *) trees[t];
+            } else if (o == 1) {
+                args[a++] = "-l";
+                args[a++] = can;
+            } else if (o == 2) {
+                args[a++] = "-t";
+                args[a++] = can;
+            } else {
+                args[a++] = "-x";
+                args[a++] = can;
+                dir = out_dir;
+            }
+            args[a] = NULL;
+
+            struct Run best = {0};
+            for (int r = 0; r <= reps; r++) {
+                struct Run this = {0};
+                if (o == 3)
+                    fresh_dir(out_dir);
+                run(dir, args, r == reps, &this);
+
+                if (r == reps) {
+                    best.syscalls = this.syscalls;
+                    continue;
+                }
+                if (r == 0 || this.secs < best.secs)
+                    best.secs = this.secs;
+                if (this.peak_rss > best.peak_rss)
+                    best.peak_rss = this.peak_rss;
+            }
+
+            struct stat s;
+            if (stat(can, &s) != 0)
+                handle_error("Failed to stat bench can");
+
+            printf("bench tree=%s op=%s files=%llu bytes=%llu can_bytes=%llu "
+                   "reps=%d seconds=%.4f mbps=%.1f files_per_sec=%.0f "
+                   "peak_rss_kib=%ld syscalls=%ld\n",
+                   trees[t], ops[o], (unsigned long long) tree_files,
+                   (unsigned long long) tree_bytes, (unsigned long long) s.st_size,
+                   reps, best.secs, tree_bytes / 1e6 / best.secs,
+                   tree_files / best.secs, best.peak_rss, best.syscalls);
+            fflush(stdout);
+        }
+    }
+
+    fresh_dir(out_dir);
+    rmdir(out_dir);
+    unlink(can);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/**
+* bench_hash.c => Bytes per cycle of the v1 Pearson
+* hash against the v2 sum64 checksum over an in
+* memory buffer, so only the hash is measured.
+* Then the Pearson hash of many buffers one after
+* another against crush_hash_lanes on each kernel
+* the CPU has, over a mix of small files and one
+* of large ones, checking every lane's result.
+*
+* Build: gcc -O2 -I.. -o bench_hash bench_hash.c ../helpers.c ../errors.c ../sum64.c
+* Usage: ./bench_hash [size-in-MiB] [rounds]
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "crush.h"
+#include "sum64.h"
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+/**
+* Fills buf with size bytes of pseudo random data.
+*/
+static void make_input(uint8_t *buf, size_t size) {
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        buf[i] = state;
+    }
+}
+
+
+/**
+* Prints throughput, and bytes per cycle when
+* the time stamp counter can be read. The
+* counter ticks at the nominal clock rate so
+* turbo can make the figure look slightly
+* better than it is.
+*/
+static void report(char *name, double secs, uint64_t ticks, uint64_t bytes) {
+    printf("%-8s %8.3f s %10.1f MB/s", name, secs, bytes / secs / 1e6);
+    if (ticks)
+        printf(" %8.3f bytes/cycle", (double) bytes / ticks);
+    printf("\n");
+}
+
+
+/**
+* Splits size bytes of buf into buffers between
+* min and max bytes long, returning how many.
+*/
+static int split_input(uint8_t *buf, size_t size, size_t min, size_t max,
+                       const uint8_t **bufs, size_t *lens, int most) {
+    uint32_t state = 88172645u;
+    size_t at = 0;
+    int count = 0;
+    while (at < size && count < most) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        size_t len = min + state % (max - min + 1);
+        if (len > size - at)
+            len = size - at;
+        bufs[count] = buf + at;
+        lens[count++] = len;
+        at += len;
+    }
+    return count;
+}
+
+
+/**
+* Hashes every buffer of a mix one after another,
+* then in lanes on each kernel, exiting if any
+* lane's hash differs.
+*/
+static void bench_mix(char *mix, const uint8_t **bufs, size_t *lens, int count,
+                      int rounds) {
+    uint8_t *want = calloc(count, 1);
+    uint8_t *got = calloc(count, 1);
+    if (!want || !got)
+        handle_error("Failed to allocate bench hashes");
+
+    uint64_t bytes = 0;
+    for (int b = 0; b < count; b++)
+        bytes += lens[b];
+    bytes *= rounds;
+    printf("%s: %d buffers\n", mix, count);
+
+    double start = now();
+    uint64_t first = cycles();
+    for (int r = 0; r < rounds; r++)
+        for (int b = 0; b < count; b++)
+            want[b] = crush_hash_buf(want[b], bufs[b], lens[b]);
+    report("serial", now() - start, cycles() - first, bytes);
+
+    char *names[] = {"scalar", "avx2", "avx512"};
+    int widest = crush_hash_widest_kernel();
+    for (int kernel = CRUSH_HASH_SCALAR; kernel <= widest; kernel++) {
+        memset(got, 0, count);
+        start = now();
+        first = cycles();
+        for (int r = 0; r < rounds; r++)
+            crush_hash_lanes_on(kernel, got, bufs, lens, count);
+        report(names[kernel], now() - start, cycles() - first, bytes);
+
+        if (memcmp(want, got, count) != 0)
+            handle_error("Lanes hash differs from crush_hash_buf");
+    }
+
+    free(want);
+    free(got);
+}
+
+
+int main(int argc, char *argv[]) {
+    size_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) : 64) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 8;
+
+    uint8_t *buf = malloc(size);
+    if (!buf)
+        handle_error("Failed to allocate bench input");
+    make_input(buf, size);
+
+    // Chain each round's result into the next
+    // so none of the work can be dropped.
+    uint8_t hash = 0;
+    double start = now();
+    uint64_t first = cycles();
+    for (int r = 0; r < rounds; r++)
+        hash = crush_hash_buf(hash, buf, size);
+    report("pearson", now() - start, cycles() - first, (uint64_t) size * rounds);
+
+    uint64_t sum = 0;
+    start = now();
+    first = cycles();
+    for (int r = 0; r < rounds; r++)
+        sum = sum64(sum, buf, size);
+    report("sum64", now() - start, cycles() - first, (uint64_t) size * rounds);
+
+    printf("pearson %02x sum64 %016llx\n", hash, (unsigned long long) sum);
+
+    // Small files are 1 byte to 4 KiB, large
+    // ones split the buffer between 16 lanes.
+    int most = size;
+    const uint8_t **bufs = malloc(most * sizeof(*bufs));
+    size_t *lens = malloc(most * sizeof(*lens));
+    if (!bufs || !lens)
+        handle_error("Failed to allocate bench buffers");
+
+    int count = split_input(buf, size, 1, 4096, bufs, lens, most);
+    bench_mix("small", bufs, lens, count, rounds);
+
+    size_t large = size / CRUSH_HASH_LANES;
+    count = split_input(buf, size, large - large / 4, large, bufs, lens, most);
+    bench_mix("large", bufs, lens, count, rounds);
+
+    free(bufs);
+    free(lens);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,178 @@
+/**
+* bench_io.c => Throughput of the per-byte stdio path
+* against the block_io path for copying and hashing
+* file contents, as done by create and extract.
+*
+* Build: gcc -O2 -pthread -I.. -o bench_io bench_io.c ../block_io.c ../stats.c \
+*        ../helpers.c ../errors.c
+* Usage: ./bench_io [size-in-MiB] [scratch-dir]
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "block_io.h"
+#include "crush.h"
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+* Fills path with size bytes of pseudo random data.
+*/
+static void make_input(char *path, uint64_t size) {
+    FILE *out = fopen(path, "w");
+    if (!out)
+        handle_error("Failed to create bench input");
+
+    uint32_t state = 2463534242u;
+    for (uint64_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        fputc(state & 0xff, out);
+    }
+
+    fclose(out);
+}
+
+
+/**
+* The original create path: one fgetc, one
+* fputc and one crush_hash per byte.
+*/
+static uint8_t copy_stdio(char *in_path, char *out_path) {
+    FILE *in = fopen(in_path, "r");
+    FILE *out = fopen(out_path, "w");
+    if (!in || !out)
+        handle_error("Failed to open bench files");
+
+    uint8_t hash = 0;
+    int c;
+    while ( (c = fgetc(in)) != EOF ) {
+        fputc(c, out);
+        hash = crush_hash(hash, c);
+    }
+
+    fclose(in);
+    fclose(out);
+    return hash;
+}
+
+
+/**
+* The block create path: read straight into the
+* output buffer and hash each block in one call.
+*/
+static uint8_t copy_block(char *in_path, char *out_path) {
+    int in = open(in_path, O_RDONLY);
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (in < 0 || out < 0)
+        handle_error("Failed to open bench files");
+
+    BLOCK_IO io = block_io_open_write(out);
+    uint8_t hash = 0;
+    for (;;) {
+        size_t avail = 0;
+        unsigned char *block = block_io_space(io, &avail);
+        ssize_t got = read(in, block, avail);
+        if (got <= 0)
+            break;
+        hash = crush_hash_buf(hash, block, got);
+        block_io_commit(io, got);
+    }
+
+    close(in);
+    block_io_close(io);
+    return hash;
+}
+
+
+/**
+* The original extract/list read path.
+*/
+static uint8_t read_stdio(char *in_path) {
+    FILE *in = fopen(in_path, "r");
+    if (!in)
+        handle_error("Failed to open bench input");
+
+    uint8_t hash = 0;
+    int c;
+    while ( (c = fgetc(in)) != EOF )
+        hash = crush_hash(hash, c);
+
+    fclose(in);
+    return hash;
+}
+
+
+/**
+* The block extract/list read path.
+*/
+static uint8_t read_block(char *in_path) {
+    int in = open(in_path, O_RDONLY);
+    if (in < 0)
+        handle_error("Failed to open bench input");
+
+    BLOCK_IO io = block_io_open_read(in);
+    uint8_t hash = 0;
+    size_t got = 0;
+    const unsigned char *block;
+    while ( (block = block_io_next(io, BLOCK_IO_SIZE, &got)) )
+        hash = crush_hash_buf(hash, block, got);
+
+    block_io_close(io);
+    return hash;
+}
+
+
+static void report(char *name, double secs, uint64_t size) {
+    printf("%-12s %8.3f s %10.1f MB/s\n", name, secs, size / secs / 1e6);
+}
+
+
+int main(int argc, char *argv[]) {
+    uint64_t size = (argc > 1 ? strtoull(argv[1], NULL, 10) : 256) << 20;
+    char *dir = argc > 2 ? argv[2] : "/tmp";
+
+    char in_path[4096], out_path[4096];
+    snprintf(in_path, sizeof(in_path), "%s/bench_io.in", dir);
+    snprintf(out_path, sizeof(out_path), "%s/bench_io.out", dir);
+
+    make_input(in_path, size);
+
+    double start = now();
+    uint8_t old_hash = copy_stdio(in_path, out_path);
+    report("copy stdio", now() - start, size);
+
+    start = now();
+    uint8_t new_hash = copy_block(in_path, out_path);
+    report("copy block", now() - start, size);
+
+    start = now();
+    uint8_t old_read = read_stdio(in_path);
+    report("read stdio", now() - start, size);
+
+    start = now();
+    uint8_t new_read = read_block(in_path);
+    report("read block", now() - start, size);
+
+    unlink(in_path);
+    unlink(out_path);
+
+    if (old_hash != new_hash || old_read != new_read)
+        handle_error("block path hash differs from stdio path");
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+/**
+* bench_order.c => How far the disk head travels reading
+* every file of a tree in walk order, inode order and
+* first extent order, the orders crush -L can read in.
+* Each file's extents come from FIEMAP and the distance
+* counts every jump from where one extent ends to where
+* the next read starts, those past SEEK_GAP as seeks.
+* Run as root, each order is also timed reading the
+* files from a cold page cache.
+*
+*   order walk files=... seeks=... seek_mib=... seconds=...
+*
+* seconds is -1 where the page cache can't be dropped.
+*
+* Build: gcc -O2 -I.. -o bench_order bench_order.c ../helpers.c ../errors.c
+* Usage: ./bench_order <tree>
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "crush.h"
+
+// most extents mapped for each file
+#define MAX_EXTENTS               64
+#define READ_BYTES                (1 << 20)
+
+// smallest jump counted as a seek, any
+// closer costing about as much as
+// reading the gap
+#define SEEK_GAP                  (128 << 10)
+
+/**
+* A regular file of the tree and where
+* its extents lie on disk.
+*/
+struct File {
+    char *path;
+    ino_t ino;
+    uint64_t first;
+    int extents;
+    uint64_t starts[MAX_EXTENTS];
+    uint64_t ends[MAX_EXTENTS];
+};
+
+static struct File *files;
+static size_t count;
+static size_t capacity;
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+* Maps the extents of a file, leaving it
+* with none if it is empty or the
+* filesystem can't say.
+*/
+static void map_file(struct File *file) {
+    int fd = open(file->path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    size_t size = sizeof(struct fiemap) + MAX_EXTENTS * sizeof(struct fiemap_extent);
+    struct fiemap *map = calloc(1, size);
+    if (!map)
+        handle_error("Failed to allocate extent map");
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = MAX_EXTENTS;
+
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0) {
+        file->extents = map->fm_mapped_extents;
+        for (int e = 0; e < file->extents; e++) {
+            file->starts[e] = map->fm_extents[e].fe_physical;
+            file->ends[e] = file->starts[e] + map->fm_extents[e].fe_length;
+        }
+        if (file->extents)
+            file->first = file->starts[0];
+    }
+
+    free(map);
+    close(fd);
+}
+
+
+static int add_entry(const char *path, const struct stat *s, int flag,
+                     struct FTW *ftw) {
+    (void) flag;
+    (void) ftw;
+    if (!S_ISREG(s->st_mode))
+        return 0;
+
+    if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        files = realloc(files, capacity * sizeof(*files));
+        if (!files)
+            handle_error("Failed to grow file list");
+    }
+
+    struct File *file = &files[count++];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    file->ino = s->st_ino;
+    map_file(file);
+    return 0;
+}
+
+
+static int by_inode(const void *a, const void *b) {
+    const struct File *left = a;
+    const struct File *right = b;
+    return (left->ino > right->ino) - (left->ino < right->ino);
+}
+
+
+static int by_extent(const void *a, const void *b) {
+    const struct File *left = a;
+    const struct File *right = b;
+    return (left->first > right->first) - (left->first < right->first);
+}
+
+
+/**
+* Drops the page cache so every read goes
+* to disk, returning 0 if it can't be.
+*/
+static int drop_cache(void) {
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0)
+        return 0;
+
+    int dropped = write(fd, "3", 1) == 1;
+    close(fd);
+    return dropped;
+}
+
+
+/**
+* Reads every file in the order given,
+* returning how long it took.
+*/
+static double read_files(uint8_t *buf) {
+    double start = now();
+    for (size_t f = 0; f < count; f++) {
+        int fd = open(files[f].path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        while (read(fd, buf, READ_BYTES) > 0)
+            ;
+        close(fd);
+    }
+    return now() - start;
+}
+
+
+/**
+* Prints the seeks between the extents of
+* the files in the order they are in now.
+*/
+static void report(char *order, uint8_t *buf) {
+    uint64_t seeks = 0;
+    uint64_t distance = 0;
+    uint64_t at = 0;
+    int started = 0;
+
+    for (size_t f = 0; f < count; f++) {
+        for (int e = 0; e < files[f].extents; e++) {
+            uint64_t start = files[f].starts[e];
+            uint64_t jump = start > at ? start - at : at - start;
+            if (started && jump > SEEK_GAP)
+                seeks++;
+            if (started)
+                distance += jump;
+            at = files[f].ends[e];
+            started = 1;
+        }
+    }
+
+    double secs = drop_cache() ? read_files(buf) : -1;
+    printf("order %s files=%zu seeks=%llu seek_mib=%.1f seconds=%.3f\n", order, count,
+           (unsigned long long) seeks, distance / 1048576.0, secs);
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <tree>\n", argv[0]);
+        return 1;
+    }
+
+    if (nftw(argv[1], add_entry, 64, FTW_PHYS) != 0)
+        handle_error("Failed to walk tree");
+
+    uint8_t *buf = malloc(READ_BYTES);
+    if (!buf)
+        handle_error("Failed to allocate read buffer");
+
+    report("walk", buf);
+    qsort(files, count, sizeof(*files), by_inode);
+    report("inode", buf);
+    qsort(files, count, sizeof(*files), by_extent);
+    report("extent", buf);
+
+    for (size_t f = 0; f < count; f++)
+        free(files[f].path);
+    free(files);
+    free(buf);
+    return 0;
+}
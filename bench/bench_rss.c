@@ -0,0 +1,130 @@
+/**
+* bench_rss.c => Peak resident memory of listing and
+* verifying a can as its number of entries grows, so
+* per-entry allocations show up as a rising line.
+*
+* Build: gcc -O2 -I.. -o bench_rss bench_rss.c ../helpers.c ../errors.c
+* Usage: ./bench_rss <crush-binary> [max-entries] [scratch-dir]
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "crush.h"
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+* Writes a v1 can of count small files straight
+* from their headers, without touching the
+* file system for each one.
+*/
+static void make_can(char *path, long count) {
+    FILE *out = fopen(path, "w");
+    if (!out)
+        handle_error("Failed to create bench can");
+
+    for (long entry = 0; entry < count; entry++) {
+        char name[64];
+        int name_length = snprintf(name, sizeof(name), "bench/d%ld/file%ld",
+                                   entry / 1000, entry);
+        uint8_t content[8];
+        int content_length = snprintf((char *) content, sizeof(content), "%ld\n",
+                                      entry % 1000000);
+
+        // magic, mode, pathname length, content length
+        uint8_t header[12] = {0x42, 0x00, 0x81, 0xa4};
+        header[4] = name_length >> 8;
+        header[5] = name_length;
+        header[11] = content_length;
+
+        uint8_t hash = crush_hash_buf(0, header, sizeof(header));
+        hash = crush_hash_buf(hash, (uint8_t *) name, name_length);
+        hash = crush_hash_buf(hash, content, content_length);
+
+        fwrite(header, 1, sizeof(header), out);
+        fwrite(name, 1, name_length, out);
+        fwrite(content, 1, content_length, out);
+        fputc(hash, out);
+    }
+
+    fclose(out);
+}
+
+
+/**
+* Runs crush with the given action on the can,
+* output discarded, and returns its peak
+* resident set in KiB.
+*/
+static long peak_rss(char *crush, char *action, char *can, double *secs) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0)
+        handle_error("Failed to fork");
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(crush, crush, action, can, (char *) NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        handle_error("Failed to wait for crush");
+    *secs = now() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "warning: %s %s exited abnormally\n", crush, action);
+
+    return usage.ru_maxrss;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <crush-binary> [max-entries] [scratch-dir]\n",
+                argv[0]);
+        return 1;
+    }
+
+    char *crush = argv[1];
+    long max_entries = argc > 2 ? atol(argv[2]) : 1000000;
+    char *dir = argc > 3 ? argv[3] : "/tmp";
+
+    char can[4096];
+    snprintf(can, sizeof(can), "%s/bench_rss.can", dir);
+
+    printf("%10s %12s %8s %12s %8s\n", "entries", "list KiB", "secs",
+           "verify KiB", "secs");
+
+    for (long entries = 1000; entries <= max_entries; entries *= 10) {
+        make_can(can, entries);
+
+        double list_secs, verify_secs;
+        long list_rss = peak_rss(crush, "-l", can, &list_secs);
+        long verify_rss = peak_rss(crush, "-t", can, &verify_secs);
+
+        printf("%10ld %12ld %8.3f %12ld %8.3f\n", entries, list_rss, list_secs,
+               verify_rss, verify_secs);
+    }
+
+    unlink(can);
+    return 0;
+}
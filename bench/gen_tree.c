@@ -0,0 +1,345 @@
+/**
+* gen_tree.c => Deterministic trees for benchmarking crush.
+* Every run with the same scale writes the same paths,
+* contents, modes and times, so results can be compared
+* across commits. The corpus has four trees:
+*
+*   tiny   millions of files of up to 512 bytes
+*   large  a few multi-GB files
+*   deep   chains of directories nested 128 deep
+*   mixed  files of every size, text and random
+*          bytes, some repeated
+*
+* Build: gcc -O2 -o gen_tree gen_tree.c
+* Usage: ./gen_tree <corpus-dir> [scale]
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// bumped whenever the trees change so
+// an old corpus isn't reused
+#define GEN_TREE_VERSION          1
+
+// sizes of each tree at scale 1
+#define TINY_FILES                2000000
+#define TINY_MAX_SIZE             512
+#define FILES_PER_DIR             1000
+#define LARGE_FILES               3
+#define LARGE_SIZE                (2ULL << 30)
+#define DEEP_CHAINS               256
+#define DEEP_DEPTH                128
+#define MIXED_FILES               10000
+#define MIXED_MIN_SIZE            512
+#define MIXED_MAX_SIZE            (4 << 20)
+
+// every file and directory gets this mtime
+#define GEN_TREE_TIME             1700000000
+
+#define WRITE_CHUNK               (1 << 20)
+#define PATH_BYTES                8192
+
+/**
+* splitmix64, small and the same
+* on every platform.
+*/
+struct Rng {
+    uint64_t state;
+};
+
+static unsigned char chunk[WRITE_CHUNK];
+static char words[256][10];
+
+
+static uint64_t next(struct Rng *rng) {
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+static void die(const char *what, const char *path) {
+    fprintf(stderr, "gen_tree: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+
+/**
+* Scales a count or size, never
+* letting it drop below minimum.
+*/
+static uint64_t scaled(uint64_t full, double scale, uint64_t minimum) {
+    uint64_t value = full * scale + 0.5;
+    return value < minimum ? minimum : value;
+}
+
+
+/**
+* A vocabulary of made up words
+* for compressible text.
+*/
+static void make_words(void) {
+    struct Rng rng = {42};
+
+    for (int w = 0; w < 256; w++) {
+        int length = 2 + next(&rng) % 8;
+        for (int c = 0; c < length; c++)
+            words[w][c] = 'a' + next(&rng) % 26;
+        words[w][length] = '\0';
+    }
+}
+
+
+/**
+* Fills buf with len bytes of either
+* text built from the vocabulary or
+* random bytes.
+*/
+static void fill(struct Rng *rng, unsigned char *buf, size_t len, int text) {
+    size_t at = 0;
+
+    if (!text) {
+        while (at < len) {
+            uint64_t bits = next(rng);
+            for (int byte = 0; byte < 8 && at < len; byte++)
+                buf[at++] = bits >> (byte * 8);
+        }
+        return;
+    }
+
+    while (at < len) {
+        uint64_t bits = next(rng);
+        const char *word = words[bits & 0xff];
+        size_t length = strlen(word);
+        for (size_t c = 0; c < length && at < len; c++)
+            buf[at++] = word[c];
+        if (at < len)
+            buf[at++] = (bits >> 8) % 12 == 0 ? '\n' : ' ';
+    }
+}
+
+
+/**
+* Writes a file of size bytes. kind is 0 for
+* random bytes, 1 for text and 2 for both
+* alternating a chunk at a time.
+*/
+static void write_file(char *path, uint64_t size, int kind, mode_t mode,
+                       struct Rng *rng) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        die("can't create", path);
+
+    uint64_t done = 0;
+    for (int block = 0; done < size; block++) {
+        size_t step = size - done < WRITE_CHUNK ? size - done : WRITE_CHUNK;
+        int text = kind == 2 ? block & 1 : kind;
+        fill(rng, chunk, step, text);
+
+        if (write(fd, chunk, step) != (ssize_t) step)
+            die("can't write", path);
+        done += step;
+    }
+
+    if (fchmod(fd, mode) != 0 || close(fd) != 0)
+        die("can't finish", path);
+}
+
+
+static void make_dir(char *path) {
+    if (mkdir(path, 0755) != 0)
+        die("can't create", path);
+    if (chmod(path, 0755) != 0)
+        die("can't chmod", path);
+}
+
+
+static void gen_tiny(char *root, double scale) {
+    struct Rng rng = {1};
+    uint64_t files = scaled(TINY_FILES, scale, 1);
+    char path[PATH_BYTES];
+
+    make_dir(root);
+    for (uint64_t f = 0; f < files; f++) {
+        if (f % FILES_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "%s/d%04llu", root,
+                     (unsigned long long) (f / FILES_PER_DIR));
+            make_dir(path);
+        }
+
+        snprintf(path, sizeof(path), "%s/d%04llu/f%07llu", root,
+                 (unsigned long long) (f / FILES_PER_DIR), (unsigned long long) f);
+        uint64_t bits = next(&rng);
+        write_file(path, bits % (TINY_MAX_SIZE + 1), (bits >> 16) & 1,
+                   (bits >> 17) % 7 ? 0644 : 0755, &rng);
+    }
+}
+
+
+static void gen_large(char *root, double scale) {
+    struct Rng rng = {2};
+    uint64_t size = scaled(LARGE_SIZE, scale, WRITE_CHUNK);
+    char path[PATH_BYTES];
+
+    make_dir(root);
+    for (int f = 0; f < LARGE_FILES; f++) {
+        snprintf(path, sizeof(path), "%s/large%d.bin", root, f);
+        write_file(path, size, f % 3, 0644, &rng);
+    }
+}
+
+
+static void gen_deep(char *root, double scale) {
+    struct Rng rng = {3};
+    uint64_t chains = scaled(DEEP_CHAINS, scale, 2);
+    char path[PATH_BYTES];
+
+    make_dir(root);
+    for (uint64_t c = 0; c < chains; c++) {
+        int length = snprintf(path, sizeof(path), "%s/c%03llu", root,
+                              (unsigned long long) c);
+        make_dir(path);
+
+        for (int depth = 0; depth < DEEP_DEPTH; depth++) {
+            length += snprintf(path + length, sizeof(path) - length, "/n");
+            make_dir(path);
+
+            snprintf(path + length, sizeof(path) - length, "/leaf");
+            write_file(path, next(&rng) % 4096, 1, 0644, &rng);
+            path[length] = '\0';
+        }
+    }
+}
+
+
+static void gen_mixed(char *root, double scale) {
+    struct Rng rng = {4};
+    uint64_t files = scaled(MIXED_FILES, scale, 4);
+    uint64_t last_seed = 0;
+    char path[PATH_BYTES];
+
+    make_dir(root);
+    for (uint64_t f = 0; f < files; f++) {
+        if (f % 100 == 0) {
+            snprintf(path, sizeof(path), "%s/d%03llu", root,
+                     (unsigned long long) (f / 100));
+            make_dir(path);
+        }
+        snprintf(path, sizeof(path), "%s/d%03llu/m%05llu", root,
+                 (unsigned long long) (f / 100), (unsigned long long) f);
+
+        // Sizes spread evenly over each power
+        // of two, and one file in ten repeats
+        // the contents of the file before it.
+        uint64_t bits = next(&rng);
+        uint64_t low = (uint64_t) MIXED_MIN_SIZE << (bits % 14);
+        uint64_t size = low + next(&rng) % low;
+        if (size > MIXED_MAX_SIZE)
+            size = MIXED_MAX_SIZE;
+
+        uint64_t seed = bits;
+        if (f && (bits >> 20) % 10 == 0)
+            seed = last_seed;
+        last_seed = seed;
+
+        struct Rng contents = {seed};
+        write_file(path, size, (seed >> 8) % 3, 0644, &contents);
+    }
+}
+
+
+/**
+* Gives every path below the corpus the
+* same mtime whenever it is made.
+*/
+static int set_time(const char *path, const struct stat *s, int flag,
+                    struct FTW *ftw) {
+    (void) s;
+    (void) flag;
+    (void) ftw;
+    struct timespec times[2] = {
+        {GEN_TREE_TIME, 0},
+        {GEN_TREE_TIME, 0},
+    };
+
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0)
+        die("can't set time of", (char *) path);
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <corpus-dir> [scale]\n", argv[0]);
+        return 1;
+    }
+
+    char *corpus = argv[1];
+    if (strlen(corpus) > PATH_BYTES / 4) {
+        fprintf(stderr, "gen_tree: corpus path too long\n");
+        return 1;
+    }
+    double scale = argc > 2 ? atof(argv[2]) : 1.0;
+    if (scale <= 0) {
+        fprintf(stderr, "gen_tree: scale must be above 0\n");
+        return 1;
+    }
+
+    // A corpus is made once per scale and
+    // version, and never written over.
+    char stamp[PATH_BYTES], want[64], have[64] = "";
+    snprintf(stamp, sizeof(stamp), "%s/.stamp", corpus);
+    snprintf(want, sizeof(want), "gen_tree %d scale %g\n", GEN_TREE_VERSION, scale);
+
+    FILE *in = fopen(stamp, "r");
+    if (in) {
+        if (!fgets(have, sizeof(have), in))
+            have[0] = '\0';
+        fclose(in);
+        if (strcmp(have, want) == 0) {
+            printf("gen_tree: %s is up to date\n", corpus);
+            return 0;
+        }
+    }
+    if (access(corpus, F_OK) == 0) {
+        fprintf(stderr, "gen_tree: %s holds another corpus, remove it first\n",
+                corpus);
+        return 1;
+    }
+
+    make_words();
+    make_dir(corpus);
+
+    // Leave room below each tree's root
+    // for the paths inside it.
+    char root[PATH_BYTES / 2];
+    snprintf(root, sizeof(root), "%s/tiny", corpus);
+    gen_tiny(root, scale);
+    snprintf(root, sizeof(root), "%s/large", corpus);
+    gen_large(root, scale);
+    snprintf(root, sizeof(root), "%s/deep", corpus);
+    gen_deep(root, scale);
+    snprintf(root, sizeof(root), "%s/mixed", corpus);
+    gen_mixed(root, scale);
+
+    if (nftw(corpus, set_time, 64, FTW_DEPTH | FTW_PHYS) != 0)
+        die("can't walk", corpus);
+
+    FILE *out = fopen(stamp, "w");
+    if (!out || fputs(want, out) == EOF || fclose(out) != 0)
+        die("can't write", stamp);
+
+    printf("gen_tree: made %s at scale %g\n", corpus, scale);
+    return 0;
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "block_io.h"
+#include "crush.h"
+#include "stats.h"
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static BLOCK_IO block_io_alloc(int fd, int writing);
+static size_t block_io_fill(BLOCK_IO io);
+static size_t block_io_input(BLOCK_IO io, unsigned char *dst, size_t cap);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+/**
+* Allocates a stream and its aligned
+* buffer for the given fd.
+*/
+static BLOCK_IO block_io_alloc(int fd, int writing) {
+    BLOCK_IO io = malloc(sizeof(*io));
+    if (!io)
+        handle_error("Failed to allocate block stream");
+
+    void *buf = NULL;
+    if (posix_memalign(&buf, BLOCK_IO_ALIGN, BLOCK_IO_SIZE) != 0)
+        handle_error("Failed to allocate block buffer");
+
+    io->fd = fd;
+    io->writing = writing;
+    io->buf = buf;
+    io->pos = 0;
+    io->len = 0;
+    io->offset = fd < 0 ? 0 : lseek(fd, 0, SEEK_CUR);
+    io->seekable = fd >= 0 && io->offset >= 0;
+    if (io->offset < 0)
+        io->offset = 0;
+
+    // Let a pipe hold a whole block so each
+    // read or write moves as much as it can,
+    // and note where a file being read ends.
+    struct stat s;
+    io->size = -1;
+    if (fd >= 0 && fstat(fd, &s) == 0) {
+        if (S_ISFIFO(s.st_mode))
+            fcntl(fd, F_SETPIPE_SZ, BLOCK_IO_SIZE);
+        else if (S_ISREG(s.st_mode) && !writing)
+            io->size = s.st_size;
+    }
+    io->source = NULL;
+    io->sink = NULL;
+    io->release = NULL;
+    io->pread = NULL;
+    io->ctx = NULL;
+
+    return io;
+}
+
+
+BLOCK_IO block_io_open_read(int fd) {
+    return block_io_alloc(fd, 0);
+}
+
+
+BLOCK_IO block_io_open_write(int fd) {
+    return block_io_alloc(fd, 1);
+}
+
+
+BLOCK_IO block_io_open_source(BLOCK_IO_SOURCE source, BLOCK_IO_RELEASE release,
+                              void *ctx) {
+    BLOCK_IO io = block_io_alloc(-1, 0);
+    io->source = source;
+    io->release = release;
+    io->ctx = ctx;
+
+    return io;
+}
+
+
+void block_io_set_pread(BLOCK_IO io, BLOCK_IO_PREAD pread) {
+    io->pread = pread;
+}
+
+
+BLOCK_IO block_io_open_sink(BLOCK_IO_SINK sink, BLOCK_IO_RELEASE release,
+                            void *ctx) {
+    BLOCK_IO io = block_io_alloc(-1, 1);
+    io->sink = sink;
+    io->release = release;
+    io->ctx = ctx;
+
+    return io;
+}
+
+
+void block_io_close(BLOCK_IO io) {
+    if (io->writing)
+        block_io_flush(io);
+
+    if (io->fd >= 0) {
+        close(io->fd);
+        stats_call(STATS_CALL_CLOSE);
+    }
+    if (io->release)
+        io->release(io->ctx);
+    free(io->buf);
+    free(io);
+}
+
+
+/**
+* Replaces the consumed contents of the
+* buffer with the next block of the fd.
+* Returns the number of bytes now buffered.
+*/
+static size_t block_io_fill(BLOCK_IO io) {
+    io->offset += io->len;
+    io->pos = 0;
+    io->len = 0;
+
+    io->len = block_io_input(io, io->buf, BLOCK_IO_SIZE);
+    return io->len;
+}
+
+
+/**
+* Takes up to cap bytes of input from the
+* source or fd into dst, returning how
+* many, 0 at EOF.
+*/
+static size_t block_io_input(BLOCK_IO io, unsigned char *dst, size_t cap) {
+    if (io->source)
+        return io->source(io->ctx, dst, cap);
+
+    ssize_t got;
+    uint64_t since = stats_clock();
+    do {
+        got = read(io->fd, dst, cap);
+        stats_call(STATS_CALL_READ);
+    } while (got < 0 && errno == EINTR);
+    stats_phase(STATS_READ, since);
+
+    if (got < 0)
+        handle_error("Failed to read can");
+
+    return got;
+}
+
+
+int block_io_getc(BLOCK_IO io) {
+    if (io->pos == io->len && block_io_fill(io) == 0)
+        return EOF;
+
+    return io->buf[io->pos++];
+}
+
+
+int block_io_eof(BLOCK_IO io) {
+    return io->pos == io->len && block_io_fill(io) == 0;
+}
+
+
+size_t block_io_read(BLOCK_IO io, void *dst, size_t n) {
+    unsigned char *out = dst;
+    size_t done = 0;
+
+    while (done < n) {
+        // Half a block or more wanted with
+        // nothing buffered is read straight
+        // into dst rather than copied.
+        if (io->pos == io->len && n - done >= BLOCK_IO_SIZE / 2) {
+            io->offset += io->len;
+            io->pos = 0;
+            io->len = 0;
+
+            size_t got = block_io_input(io, out + done, n - done);
+            if (!got)
+                break;
+            io->offset += got;
+            done += got;
+            continue;
+        }
+
+        size_t got = 0;
+        const unsigned char *src = block_io_next(io, n - done, &got);
+        if (!got)
+            break;
+        memcpy(out + done, src, got);
+        done += got;
+    }
+
+    return done;
+}
+
+
+const unsigned char *block_io_next(BLOCK_IO io, size_t max, size_t *got) {
+    if (io->pos == io->len && block_io_fill(io) == 0) {
+        *got = 0;
+        return NULL;
+    }
+
+    size_t avail = io->len - io->pos;
+    if (avail > max)
+        avail = max;
+
+    const unsigned char *start = io->buf + io->pos;
+    io->pos += avail;
+    *got = avail;
+
+    return start;
+}
+
+
+void block_io_skip(BLOCK_IO io, uint64_t n) {
+    size_t buffered = io->len - io->pos;
+    if (n <= buffered) {
+        io->pos += n;
+        return;
+    }
+
+    // Seek past whatever isn't buffered,
+    // or read it off a block at a time
+    // if the fd can't seek.
+    off_t target = io->offset + io->len + (n - buffered);
+    if (io->size >= 0 && target > io->size)
+        handle_error("Unexpected end of can");
+    if (io->seekable && lseek(io->fd, target, SEEK_SET) == target) {
+        io->offset = target;
+        io->pos = 0;
+        io->len = 0;
+        return;
+    }
+
+    n -= buffered;
+    io->pos = io->len;
+    while (n) {
+        if (block_io_fill(io) == 0)
+            handle_error("Unexpected end of can");
+        size_t step = n < io->len ? n : io->len;
+        io->pos = step;
+        n -= step;
+    }
+}
+
+
+void block_io_pread(BLOCK_IO io, void *dst, size_t n, off_t offset) {
+    unsigned char *out = dst;
+
+    if ((io->fd < 0 || !io->seekable) && !io->pread)
+        handle_error("Can't read back from a can that isn't a file");
+
+    while (n) {
+        ssize_t got;
+        if (io->pread) {
+            got = io->pread(io->ctx, out, n, offset);
+        } else {
+            uint64_t since = stats_clock();
+            got = pread(io->fd, out, n, offset);
+            stats_phase(STATS_READ, since);
+            stats_call(STATS_CALL_READ);
+        }
+
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read can");
+        if (got == 0)
+            handle_error("Unexpected end of can");
+        out += got;
+        n -= got;
+        offset += got;
+    }
+}
+
+
+void block_io_putc(BLOCK_IO io, int c) {
+    if (io->pos == BLOCK_IO_SIZE)
+        block_io_flush(io);
+
+    io->buf[io->pos++] = c;
+}
+
+
+void block_io_write(BLOCK_IO io, const void *src, size_t n) {
+    const unsigned char *in = src;
+
+    while (n) {
+        size_t avail = 0;
+        unsigned char *dst = block_io_space(io, &avail);
+        size_t step = n < avail ? n : avail;
+        memcpy(dst, in, step);
+        block_io_commit(io, step);
+        in += step;
+        n -= step;
+    }
+}
+
+
+unsigned char *block_io_space(BLOCK_IO io, size_t *avail) {
+    if (io->pos == BLOCK_IO_SIZE)
+        block_io_flush(io);
+
+    *avail = BLOCK_IO_SIZE - io->pos;
+    return io->buf + io->pos;
+}
+
+
+void block_io_commit(BLOCK_IO io, size_t n) {
+    io->pos += n;
+}
+
+
+void block_io_flush(BLOCK_IO io) {
+    size_t done = 0;
+
+    if (io->sink && io->pos) {
+        io->sink(io->ctx, io->buf, io->pos);
+        done = io->pos;
+    }
+
+    while (done < io->pos) {
+        ssize_t put;
+        uint64_t since = stats_clock();
+        if (io->seekable)
+            put = pwrite(io->fd, io->buf + done, io->pos - done, io->offset + done);
+        else
+            put = write(io->fd, io->buf + done, io->pos - done);
+        stats_phase(STATS_WRITE, since);
+        stats_call(STATS_CALL_WRITE);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            handle_error("Failed to write can");
+        done += put;
+    }
+
+    io->offset += io->pos;
+    io->pos = 0;
+}
+
+
+off_t block_io_tell(BLOCK_IO io) {
+    return io->offset + io->pos;
+}
+
+
+int block_io_fd(BLOCK_IO io) {
+    return io->seekable ? io->fd : -1;
+}
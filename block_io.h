@@ -0,0 +1,218 @@
+#ifndef BLOCK_IO_H
+#define BLOCK_IO_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// size and alignment of the buffer
+// behind every block stream
+#define BLOCK_IO_SIZE             (1 << 20)
+#define BLOCK_IO_ALIGN            4096
+
+/**
+* Supplies up to cap bytes of input in buf,
+* returning how many were given, 0 at EOF.
+*/
+typedef size_t (*BLOCK_IO_SOURCE)(void *ctx, unsigned char *buf, size_t cap);
+
+/**
+* Takes len bytes of output from buf.
+*/
+typedef void (*BLOCK_IO_SINK)(void *ctx, const unsigned char *buf, size_t len);
+
+/**
+* Called with a source or sink's ctx once
+* its stream has been closed.
+*/
+typedef void (*BLOCK_IO_RELEASE)(void *ctx);
+
+/**
+* Reads up to len bytes at offset of a
+* source's stream into buf without moving
+* the stream, returning how many were read.
+*/
+typedef size_t (*BLOCK_IO_PREAD)(void *ctx, unsigned char *buf, size_t len,
+                                 off_t offset);
+
+/**
+* A block oriented stream over a file
+* descriptor. Bytes are moved in and out
+* of the fd in BLOCK_IO_SIZE chunks
+* using read/pwrite rather than one
+* stdio call per byte.
+*
+* A stream can instead be fed by a source or
+* drained by a sink, in which case fd is -1.
+* An fd which can't seek, like a pipe, is
+* only ever read or written in order. size
+* is where a regular file being read ends,
+* or -1 when that isn't known.
+*/
+struct Block_IO_Struct {
+    int fd;
+    int writing;
+    int seekable;
+    unsigned char *buf;
+    size_t pos;
+    size_t len;
+    off_t offset;
+    off_t size;
+
+    BLOCK_IO_SOURCE source;
+    BLOCK_IO_SINK sink;
+    BLOCK_IO_RELEASE release;
+    BLOCK_IO_PREAD pread;
+    void *ctx;
+};
+
+typedef struct Block_IO_Struct *BLOCK_IO;
+
+
+/**
+* Opens a block stream for reading
+* from the given file descriptor.
+*/
+BLOCK_IO block_io_open_read(int fd);
+
+
+/**
+* Opens a block stream for writing
+* to the given file descriptor starting
+* at its current offset.
+*/
+BLOCK_IO block_io_open_write(int fd);
+
+
+/**
+* Opens a block stream which reads
+* whatever source supplies. release,
+* if given, is called on close.
+*/
+BLOCK_IO block_io_open_source(BLOCK_IO_SOURCE source, BLOCK_IO_RELEASE release,
+                              void *ctx);
+
+
+/**
+* Opens a block stream which hands each
+* full buffer to sink. release, if given,
+* is called on close after the last
+* buffer has been handed over.
+*/
+BLOCK_IO block_io_open_sink(BLOCK_IO_SINK sink, BLOCK_IO_RELEASE release,
+                            void *ctx);
+
+
+/**
+* Lets a source stream be read at any offset
+* with block_io_pread, using the source's ctx.
+*/
+void block_io_set_pread(BLOCK_IO io, BLOCK_IO_PREAD pread);
+
+
+/**
+* Flushes any pending output, closes the
+* underlying fd and frees the stream.
+*/
+void block_io_close(BLOCK_IO io);
+
+
+/**
+* Returns the next byte of the stream
+* or EOF if the stream is exhausted.
+*/
+int block_io_getc(BLOCK_IO io);
+
+
+/**
+* Returns 1 once every byte of the
+* stream has been consumed.
+*/
+int block_io_eof(BLOCK_IO io);
+
+
+/**
+* Reads up to n bytes into dst and returns
+* the number of bytes actually read.
+*/
+size_t block_io_read(BLOCK_IO io, void *dst, size_t n);
+
+
+/**
+* Returns a pointer to up to max buffered
+* bytes, refilling the buffer if it is empty,
+* and consumes them. The number of bytes
+* available is stored in got, 0 at EOF.
+*/
+const unsigned char *block_io_next(BLOCK_IO io, size_t max, size_t *got);
+
+
+/**
+* Skips n bytes of input, seeking past
+* them when the fd allows it and
+* otherwise reading them off. It is an
+* error for the stream to end first.
+*/
+void block_io_skip(BLOCK_IO io, uint64_t n);
+
+
+/**
+* Reads n bytes at an earlier or later offset
+* of the stream into dst without disturbing
+* sequential reads. It is an error for the
+* stream not to support it or to end first.
+*/
+void block_io_pread(BLOCK_IO io, void *dst, size_t n, off_t offset);
+
+
+/**
+* Appends a single byte to the stream.
+*/
+void block_io_putc(BLOCK_IO io, int c);
+
+
+/**
+* Appends n bytes from src to the stream.
+*/
+void block_io_write(BLOCK_IO io, const void *src, size_t n);
+
+
+/**
+* Returns a pointer to the free space at the
+* end of the output buffer, flushing first if
+* it is full. The caller fills up to avail bytes
+* and then calls block_io_commit.
+*/
+unsigned char *block_io_space(BLOCK_IO io, size_t *avail);
+
+
+/**
+* Marks n bytes of the space returned by
+* block_io_space as written.
+*/
+void block_io_commit(BLOCK_IO io, size_t n);
+
+
+/**
+* Writes out any buffered output.
+*/
+void block_io_flush(BLOCK_IO io);
+
+
+/**
+* Returns the logical offset of the
+* stream in the underlying file.
+*/
+off_t block_io_tell(BLOCK_IO io);
+
+
+/**
+* Returns the fd of a stream over a file
+* that can be read at any offset, or -1
+* for a pipe or a source.
+*/
+int block_io_fd(BLOCK_IO io);
+
+
+#endif
@@ -1,42 +1,40 @@
 #include "can.h"
+#include "copy_range.h"
 #include "crush.h"
-
-// the first byte of every CAN has this value
-#define CAN_MAGIC_NUMBER          0x42
-
-// number of bytes in fixed-length CAN fields
-#define CAN_MAGIC_NUMBER_BYTES    1
-#define CAN_MODE_LENGTH_BYTES     3
-#define CAN_PATHNAME_LENGTH_BYTES 2
-#define CAN_CONTENT_LENGTH_BYTES  6
-#define CAN_HASH_BYTES            1
-
-// maximum number of bytes in variable-length CAN fields
-#define CAN_MAX_PATHNAME_LENGTH   65535
-#define CAN_MAX_CONTENT_LENGTH    281474976710655
+#include "dedup.h"
+#include "pieces.h"
+#include "sparse.h"
+#include "stats.h"
+#include "walk.h"
 
 /////////////////////// Function Prototypes /////////////////////////////////////
 // static uint8_t calculate_prelim_hash(CAN CAN);
 // static int is_dir(FILE *file_ptr);
 // static CAN create_CAN_header(FILE *CAN);
 static struct stat get_stat(char *file_path);
-static void traverse_dir(FILE *can_file, char *file_path);
-static void write_file(FILE *can_file, char *file);
-static uint8_t write_magic(FILE *can, uint8_t hash);
-static uint8_t write_mode(FILE *can, uint8_t hash, struct stat);
-static uint8_t write_pathname_length(FILE *can, uint8_t hash, char *path_name);
-static uint8_t write_content_length(FILE *can, uint8_t hash, struct stat); 
-static uint8_t write_pathname(FILE *can, uint8_t hash, char *path_name);
-static uint8_t write_contents(FILE *can, uint8_t hash, char *file_to_write);
+static void store_file(CAN_WRITER writer, char *file, struct stat *file_stat,
+                       const uint8_t *data);
+static void write_contents(BLOCK_IO can, struct CAN_Sum *sum, char *file_to_write,
+                           uint64_t content_length);
+static void remove_partial_file(void);
+static ssize_t block_source(void *ctx, void *buf, size_t cap);
+static int64_t block_skip(void *ctx, uint64_t n);
+static size_t stored_source(void *ctx, unsigned char *buf, size_t cap);
+static size_t stored_pread(void *ctx, unsigned char *buf, size_t len, off_t offset);
 /////////////////////////////////////////////////////////////////////////////////
 
+// the file extraction has created but not
+// finished checking, removed if the run
+// exits before it is
+static char *partial_path;
+
 /**
 * Creates a new empty CAN
 * struct and returns it for use
 * in building a CAN.
 */
-CAN new_CAN(void) {
-    CAN CAN = malloc(sizeof(*CAN));
+CAN new_CAN(ARENA arena) {
+    CAN CAN = arena_alloc(arena, sizeof(*CAN));
 
     return CAN;
 }
@@ -45,8 +43,9 @@ CAN new_CAN(void) {
 /**
 * Builds the header components of a CAN
 * given a file_ptr and an emptye CAN.
+* Returns NULL at the end of the can.
 */
-CAN build_CAN(CAN CAN, FILE *file_ptr) {
+CAN build_CAN(CAN CAN, BLOCK_IO file_ptr) {
 
     int component = 0;
     int byte = 0;
@@ -55,15 +54,27 @@ CAN build_CAN(CAN CAN, FILE *file_ptr) {
 
         switch (component) {
             case 0:
-                byte = fgetc(file_ptr);
-                // If byte is eof
-                // exit instead.
+                byte = block_io_getc(file_ptr);
+                // There is no CAN
+                // past the end.
                 if (byte == EOF) 
-                    exit(0);
+                    return NULL;
                 CAN->magic_number = byte;
-                if (CAN->magic_number != CAN_MAGIC_NUMBER) 
+                if (CAN->magic_number == CAN_MAGIC_NUMBER)
+                    CAN->version = CAN_FORMAT_V1;
+                else if (CAN->magic_number == CAN_V2_MAGIC_NUMBER)
+                    CAN->version = CAN_FORMAT_V2;
+                else
                     handle_error("Magic byte of CAN incorrect");
                 CAN->hash = crush_hash(hash, byte);
+
+                // v2 CANs carry a flags byte.
+                CAN->flags = 0;
+                if (CAN->version == CAN_FORMAT_V2) {
+                    CAN->flags = block_io_getc(file_ptr);
+                    if (CAN->flags < 0 || (CAN->flags & ~CAN_KNOWN_FLAGS))
+                        handle_error("CAN uses unsupported format flags");
+                }
                 component = 1;
                 break;
             case 1:
@@ -91,71 +102,327 @@ CAN build_CAN(CAN CAN, FILE *file_ptr) {
 
 
 /**
-* Reads the bytes of a CAN pathname
-* and returns the read number of bytes
-* as a string.
+* Reads the bytes of a CAN pathname into
+* last and returns it as a string. Only
+* the part of a prefixed pathname that
+* differs from the last one is read.
 */
-char *read_CAN_path_name(CAN CAN, FILE *file_ptr) {
-    char *path_name = NULL; 
-    path_name = calloc(CAN_MAX_PATHNAME_LENGTH, sizeof(char));
+char *read_CAN_path_name(CAN CAN, BLOCK_IO file_ptr, struct CAN_Path *last) {
+    size_t length = CAN->path_length;
+    size_t shared = 0;
+
+    if (CAN->flags & CAN_FLAG_PREFIXED) {
+        uint8_t prefix[CAN_PREFIX_BYTES];
+        if (length < CAN_PREFIX_BYTES)
+            handle_error("CAN pathname corrupt");
+        if (block_io_read(file_ptr, prefix, CAN_PREFIX_BYTES) != CAN_PREFIX_BYTES)
+            handle_error("Unexpected end of can");
+
+        shared = prefix[0] << 8 | prefix[1];
+        length -= CAN_PREFIX_BYTES;
+        if (shared > last->length || shared + length > CAN_MAX_PATHNAME_LENGTH)
+            handle_error("CAN pathname corrupt");
+    }
 
-    for (int count = 0; count < CAN->path_length; count++) {
-        path_name[count] = fgetc(file_ptr);
-        CAN->hash = crush_hash(CAN->hash, path_name[count]);
+    char *path_name = last->name;
+    if (block_io_read(file_ptr, path_name + shared, length) != length)
+        handle_error("Unexpected end of can");
+    last->length = shared + length;
+    path_name[last->length] = '\0';
+
+    // v1 hashes the header as it is read, v2
+    // checksums it whole once the pathname
+    // is known.
+    if (CAN->version == CAN_FORMAT_V1) {
+        CAN->hash = crush_hash_buf(CAN->hash, (uint8_t *) path_name,
+                                   CAN->path_length);
+    } else {
+        uint8_t header[CAN_MAX_HEADER_LENGTH];
+        size_t header_length = encode_prefixed_CAN_header(header, CAN->version,
+                                                          CAN->flags, shared, path_name,
+                                                          CAN->mode,
+                                                          CAN->content_length);
+        CAN->hash = CAN_header_sum(CAN->version, header, header_length);
     }
 
+    // Aligned contents start past
+    // the header's padding.
+    block_io_skip(file_ptr, CAN_pad_bytes(CAN->flags, block_io_tell(file_ptr)));
+
     return path_name;
 }
 
 
+CAN_READER new_CAN_reader(BLOCK_IO io) {
+    CAN_READER reader = calloc(1, sizeof(*reader));
+    if (!reader)
+        handle_error("Failed to allocate can reader");
+
+    reader->buf = malloc(BLOCK_IO_SIZE);
+    reader->path = malloc(LIBCAN_PATH_BYTES);
+    if (!reader->buf || !reader->path)
+        handle_error("Failed to allocate can reader");
+
+    // libcan is fed from the block stream so its
+    // reads are counted, and decompressed if need
+    // be, and its skips seek where they can.
+    int status = can_open_source(&reader->reader, block_source, io, reader->buf,
+                                 BLOCK_IO_SIZE);
+    if (status != LIBCAN_OK)
+        handle_error((char *) can_strerror(status));
+    can_set_skip(reader->reader, block_skip);
+
+    reader->io = io;
+    reader->start = block_io_tell(io);
+    return reader;
+}
+
+
+struct Libcan_Entry *next_CAN_entry(CAN_READER reader) {
+    int status = can_next_entry(reader->reader, &reader->entry, reader->path,
+                                LIBCAN_PATH_BYTES);
+    if (status == LIBCAN_END)
+        return NULL;
+    if (status != LIBCAN_OK)
+        handle_error((char *) can_strerror(status));
+
+    return &reader->entry;
+}
+
+
+void free_CAN_reader(CAN_READER reader) {
+    can_close(reader->reader);
+    if (reader->stored)
+        block_io_close(reader->stored);
+    free(reader->buf);
+    free(reader->out);
+    free(reader->path);
+    free(reader);
+}
+
+
 /**
 * Writes the contents of an extracted 
-* CAN to disk given a file pointer 
+* CAN to disk given a reader on it
 * and a file name with the permissions
 * defined in mode.
 */
-void write_extracted_CAN(FILE *file_ptr, CAN CAN, char *file_name) {
-    mode_t mode = CAN->mode;
+void write_extracted_CAN(CAN_READER reader, char *file_name) {
+    mode_t mode = reader->entry.mode;
     
-    // Check if it already exists.
     if (S_ISDIR(mode)) {
-        // Create a dir to check for
-        // existance of dir.
-        DIR *dir = opendir(file_name);
-        // if the dir exists return otherwise
-        // create it.
-        if (dir) {
-            return;
-        } else if (ENOENT == errno) { // from stackoverflow
-            printf("Creating directory: %s\n", file_name);
-            
-            if (mkdir(file_name, mode) != 0) 
-                handle_error("Failed to make directory");
-
-            return;
-        } else {
-            handle_error("Failed to open dir");
+        make_extracted_dir(file_name, mode);
+        check_empty_CAN(reader);
+        return;
+    }
+
+    int new_file = open_extracted_file(file_name);
+    mark_partial_file(file_name);
+    write_CAN_contents(reader, new_file);
+
+    if (chmod(file_name, mode) != 0) 
+        handle_error("Failed to change permissions");
+    
+    close(new_file);
+    stats_call(STATS_CALL_CHMOD);
+    stats_call(STATS_CALL_CLOSE);
+    mark_partial_file(NULL);
+}
+
+
+/**
+* Writes out the file a CAN holds, rebuilding
+* chunked and sparse ones from their stored
+* contents. libcan checks the checksum as
+* the last of them is read.
+*/
+void write_CAN_contents(CAN_READER reader, int fd) {
+    struct Libcan_Entry *entry = &reader->entry;
+
+    if (entry->flags & (CAN_FLAG_CHUNKED | CAN_FLAG_SPARSE)) {
+        if (!reader->stored) {
+            reader->stored = block_io_open_source(stored_source, NULL, reader);
+            block_io_set_pread(reader->stored, stored_pread);
         }
+
+        // The rebuild's own running sum goes
+        // unused, libcan having the real one.
+        struct CAN_Sum sum;
+        CAN_sum_start(&sum, entry->version, entry->header_sum);
+        if (entry->flags & CAN_FLAG_CHUNKED)
+            extract_chunked(reader->stored, &sum, entry->content_length, fd);
+        else
+            extract_sparse(reader->stored, &sum, entry->content_length, fd);
+        return;
+    }
+
+    if (!reader->out && !(reader->out = malloc(BLOCK_IO_SIZE)))
+        handle_error("Failed to allocate block buffer");
+
+    size_t got;
+    do {
+        int status = can_read(reader->reader, reader->out, BLOCK_IO_SIZE, &got);
+        if (status != LIBCAN_OK)
+            handle_error((char *) can_strerror(status));
+        write_block(fd, reader->out, got);
+    } while (got);
+}
+
+
+/**
+* Only a seekable can lets the contents be
+* copied by offset, libcan seeking over
+* them once it moves on, so a stream reads
+* them through libcan instead.
+*/
+int copy_extracted_CAN(CAN_READER reader, char *file_name, int check) {
+    struct Libcan_Entry *entry = &reader->entry;
+    int can_fd = block_io_fd(reader->io);
+    if (!(entry->flags & CAN_FLAG_ALIGNED) || !S_ISREG(entry->mode) || can_fd < 0)
+        return 0;
+
+    off_t payload = reader->start + entry->payload;
+    int new_file = open_extracted_file(file_name);
+    mark_partial_file(file_name);
+    copy_range(can_fd, payload, entry->content_length, new_file);
+
+    // The contents never pass through
+    // libcan, so checking them means
+    // mapping them back in.
+    if (check == CAN_CHECK_MMAP) {
+        uint8_t stored[CAN_MAX_SUM_BYTES];
+        block_io_pread(reader->io, stored, CAN_sum_bytes(entry->version),
+                       payload + entry->content_length);
+
+        struct CAN_Sum sum;
+        CAN_sum_start(&sum, entry->version, entry->header_sum);
+        sum_mapped_range(&sum, can_fd, payload, entry->content_length);
+        if (CAN_sum_final(&sum) != get_CAN_sum(stored, entry->version))
+            handle_error("can hash incorrect");
+    }
+
+    if (chmod(file_name, entry->mode) != 0)
+        handle_error("Failed to change permissions");
+
+    close(new_file);
+    stats_call(STATS_CALL_CHMOD);
+    stats_call(STATS_CALL_CLOSE);
+    mark_partial_file(NULL);
+
+    return 1;
+}
+
+
+void check_empty_CAN(CAN_READER reader) {
+    size_t got;
+    if (reader->entry.content_length)
+        handle_error("can hash incorrect");
+
+    int status = can_read(reader->reader, NULL, 0, &got);
+    if (status != LIBCAN_OK)
+        handle_error((char *) can_strerror(status));
+}
+
+
+/**
+* Reads the checksum at the end of a CAN
+* and compares it with the one worked
+* out while reading the CAN.
+*/
+int check_CAN_sum(BLOCK_IO file_ptr, CAN CAN) {
+    uint8_t stored[CAN_MAX_SUM_BYTES];
+    size_t sum_bytes = CAN_sum_bytes(CAN->version);
+
+    if (block_io_read(file_ptr, stored, sum_bytes) != sum_bytes)
+        handle_error("Unexpected end of can");
+
+    return get_CAN_sum(stored, CAN->version) == CAN->hash;
+}
+
+
+/**
+* Creates the directory for an extracted
+* CAN unless it already exists.
+*/
+void make_extracted_dir(char *file_name, mode_t mode) {
+    // Create a dir to check for
+    // existance of dir.
+    DIR *dir = opendir(file_name);
+    // if the dir exists return otherwise
+    // create it.
+    if (dir) {
+        closedir(dir);
+        return;
+    } else if (ENOENT == errno) { // from stackoverflow
+        printf("Creating directory: %s\n", file_name);
+        
+        if (mkdir(file_name, mode) != 0) 
+            handle_error("Failed to make directory");
+        stats_call(STATS_CALL_MKDIR);
+    } else {
+        handle_error("Failed to open dir");
     }
+}
+
+
+/**
+* Removes the file or directory a deleted
+* CAN names. Something already gone is
+* left be, as a delta applied on a chain
+* never extracted it in the first place.
+*/
+void remove_extracted_path(char *file_name, mode_t mode) {
+    int removed = S_ISDIR(mode) ? rmdir(file_name) : unlink(file_name);
+    if (removed != 0 && errno != ENOENT)
+        handle_error("Failed to remove deleted path");
+
+    if (removed == 0)
+        printf("Removing: %s\n", file_name);
+}
+
 
+/**
+* Creates the file for an extracted CAN,
+* refusing to overwrite an existing one,
+* and returns its fd.
+*/
+int open_extracted_file(char *file_name) {
     printf("Extracting: %s\n", file_name);
-    if(access(file_name, R_OK ) != -1 ) // From stack overflow
-        handle_error(strcat(file_name, " Permission denied"));
+    if(access(file_name, R_OK ) != -1 ) { // From stack overflow
+        fprintf(stderr, "ERROR: %s Permission denied\n", file_name);
+        exit(1);
+    }
     
     // file doesn't exist.
-    FILE *new_file = fopen(file_name, "w");
-    
-    int crt_byte = 0;
-    for (int byte = 0; byte < CAN->content_length; byte++) {
-        crt_byte = fgetc(file_ptr);
-        fputc(crt_byte, new_file);
-        CAN->hash = crush_hash(CAN->hash, crt_byte);
+    int new_file = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (new_file < 0)
+        handle_error("Failed to create file");
+    stats_call(STATS_CALL_OPEN);
+
+    return new_file;
+}
+
+
+void mark_partial_file(char *path) {
+    static int registered;
+    if (path && !registered) {
+        if (atexit(remove_partial_file) != 0)
+            handle_error("Failed to register cleanup");
+        registered = 1;
     }
 
-    if (chmod(file_name, mode) != 0) 
-        handle_error("Failed to change permissions");
-    
-    fclose(new_file);
+    partial_path = path;
+}
+
+
+/**
+* Removes a file left partway
+* through being extracted.
+*/
+static void remove_partial_file(void) {
+    if (partial_path)
+        unlink(partial_path);
 }
 
 
@@ -166,13 +433,13 @@ void write_extracted_CAN(FILE *file_ptr, CAN CAN, char *file_name) {
 * it in the CAN hash feild for use
 * in error checking.
 */
-long get_CAN_mode(FILE *file_ptr, CAN CAN) {
+long get_CAN_mode(BLOCK_IO file_ptr, CAN CAN) {
     long mode = 0;
     int byte;
     int sub = 2;
     int mode_byte = 0;
     for (byte = 0; byte < CAN_MODE_LENGTH_BYTES; byte++, sub--) {
-        mode_byte = fgetc(file_ptr);
+        mode_byte = block_io_getc(file_ptr);
         mode |= (mode_byte << (sub * 8)); 
         CAN->hash = crush_hash(CAN->hash, mode_byte);
     }
@@ -188,13 +455,13 @@ long get_CAN_mode(FILE *file_ptr, CAN CAN) {
 * it in the CAN hash feild for use
 * in error checking.
 */
-int get_path_length(FILE *file_ptr, CAN CAN) {
+int get_path_length(BLOCK_IO file_ptr, CAN CAN) {
 
     int path_length = 0;
     int byte, sub;
     int path_bytes = 0;
     for (byte = 0, sub = 1; byte < CAN_PATHNAME_LENGTH_BYTES; byte++, sub--) {
-        path_bytes = fgetc(file_ptr);
+        path_bytes = block_io_getc(file_ptr);
         path_length |= (path_bytes << (sub * 8)); 
         CAN->hash = crush_hash(CAN->hash, path_bytes);
     }
@@ -210,13 +477,13 @@ int get_path_length(FILE *file_ptr, CAN CAN) {
 * CANs hash value for using in
 * error checking.
 */
-uint64_t get_content_length(FILE *file_ptr, CAN CAN) {
+uint64_t get_content_length(BLOCK_IO file_ptr, CAN CAN) {
     uint64_t content_length = 0;
     int byte;
     int sub;
     uint64_t fp_byte = 0;
     for (byte = 0, sub = 5; byte < CAN_CONTENT_LENGTH_BYTES; byte++, sub--) {
-        fp_byte = fgetc(file_ptr);
+        fp_byte = block_io_getc(file_ptr);
         content_length |= (fp_byte << (sub * 8)); 
         CAN->hash = crush_hash(CAN->hash, fp_byte);
     }
@@ -235,12 +502,12 @@ uint64_t get_content_length(FILE *file_ptr, CAN CAN) {
 * to CAN.c for use in the main 
 * program.
 */
-void add_dir(FILE *can_file, char *file_path) {
+void add_dir(CAN_EMIT emit, void *ctx, char *file_path, int workers, int sorted) {
 
     struct stat file_stat = get_stat(file_path);
 
     if (S_ISDIR(file_stat.st_mode)) {
-        traverse_dir(can_file, file_path);    
+        walk_dir(emit, ctx, file_path, workers, sorted);    
     }
 }
 
@@ -252,66 +519,25 @@ void add_dir(FILE *can_file, char *file_path) {
 static struct stat get_stat(char *file_path) {
 
     struct stat s;
+    uint64_t since = stats_clock();
     if (stat(file_path, &s) != 0) {
         handle_error("failed to get struct stats");
     }
+    stats_phase(STATS_STAT, since);
+    stats_call(STATS_CALL_STAT);
 
     return s;
 }
 
 
-/**
-* Recursively traverses down a direcotry to discovery
-* subdirectories and files to add to a given can.
-*/
-static void traverse_dir(FILE *can_file, char *file_path) {
-    char running_path[CAN_MAX_PATHNAME_LENGTH];
-    struct dirent *dir;
-    struct stat s = get_stat(file_path);
-
-    DIR *dir_ptr = opendir(file_path);
-    
-    if (!dir_ptr)
-        handle_error("couldn't open dir");
-    
-    if (file_path[strlen(file_path) -1 ] != '/')
-        strcat(file_path, "/");
-
-    while ( (dir = readdir(dir_ptr)) ) {
-        char *current = dir->d_name;
-
-        // if file is hiddel file or last directory
-        // dont add and skip to next file.
-        if (strcmp(current, ".") == 0 || strcmp(current, "..") == 0)
-            continue;
-
-        strcpy(running_path, file_path);
-        strcat(running_path, current);
-        printf("Adding: %s\n", running_path);
-        
-        s = get_stat(running_path);
-        write_file(can_file, running_path);
-        
-        // if the file is a subdirectory
-        // explore it.
-        if (S_ISDIR(s.st_mode)) {
-            strcat(running_path, "/");
-            traverse_dir(can_file, running_path);
-        } 
-    }
-
-    closedir(dir_ptr);
-}
-
-
 /**
 * A wrapper function which is used to
 * add files to the given can. Allows
 * the CAN interface to be simplistic.
 */
-void add_file(FILE *can_file, char *dir_path) {
-    printf("Adding: %s\n", dir_path);
-    write_file(can_file, dir_path);
+void add_file(CAN_EMIT emit, void *ctx, char *dir_path) {
+    struct stat file_stat = get_stat(dir_path);
+    emit(ctx, dir_path, &file_stat);
 }
 
 
@@ -321,131 +547,225 @@ void add_file(FILE *can_file, char *dir_path) {
 * wrapper for numerous subroutines which build
 * out the header and body of a CAN.
 */
-static void write_file(FILE *can_file, char *file) {
+void write_file(void *can_writer, char *file, struct stat *file_stat) {
+    printf("Adding: %s\n", file);
+    write_loaded_file(can_writer, file, file_stat, NULL);
+}
 
-    struct stat file_stat = get_stat(file);
 
-    uint8_t hash = 0;
-    
-    hash = write_magic(can_file, hash);
-    hash = write_mode(can_file, hash, file_stat);
-    hash = write_pathname_length(can_file, hash, file);
+/**
+* Writes the CAN for a file whose contents
+* may already be in memory, reading them
+* from the file itself if data is NULL.
+*/
+void write_loaded_file(CAN_WRITER writer, char *file, struct stat *file_stat,
+                       const uint8_t *data) {
+    uint64_t since = stats_clock();
+    store_file(writer, file, file_stat, data);
+    stats_entry(file, S_ISDIR(file_stat->st_mode) ? 0 : file_stat->st_size, since);
+}
+
+
+/**
+* Stores a file as a plain, sparse,
+* chunked or pieced CAN.
+*/
+static void store_file(CAN_WRITER writer, char *file, struct stat *file_stat,
+                       const uint8_t *data) {
+    BLOCK_IO can_file = writer->io;
 
-    hash = write_content_length(can_file, hash, file_stat);
-    
-    hash = write_pathname(can_file, hash, file);
-    
     // Don't write dir contents which 
     // should always be 0 in size.
-    if (!S_ISDIR(file_stat.st_mode))
-        hash = write_contents(can_file, hash, file); 
+    uint64_t content_length = 0;
+    if (!S_ISDIR(file_stat->st_mode))
+        content_length = file_stat->st_size;
+    if (content_length > CAN_MAX_CONTENT_LENGTH)
+        handle_error("File too large for a CAN");
+
+    // Files with holes keep just their data,
+    // unless it has already been read in.
+    if (writer->sparse && !data && may_be_sparse(file_stat) &&
+        write_sparse_file(writer, file, file_stat))
+        return;
+
+    // Deduplicated files are stored
+    // as chunks instead.
+    if (writer->chunks && content_length) {
+        struct Chunk_List chunks = {0};
+        if (data)
+            chunk_buffer(&chunks, data, content_length);
+        else
+            chunk_file(&chunks, file, content_length);
+        write_deduped_file(writer, file, file_stat, &chunks, data);
+        free_chunk_list(&chunks);
+        return;
+    }
+
+    // Big files are cut into pieces so
+    // they can be checked in parallel.
+    if (is_pieced(writer, file_stat)) {
+        write_pieced_file(writer, file, file_stat, data);
+        return;
+    }
+
+    int flags = writer->aligned && content_length ? CAN_FLAG_ALIGNED : 0;
+    size_t shared = next_CAN_shared(writer, file, &flags);
+
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_prefixed_CAN_header(header, writer->version, flags,
+                                                      shared, file, file_stat->st_mode,
+                                                      content_length);
+
+    off_t offset = block_io_tell(can_file);
+    block_io_write(can_file, header, header_length);
+    write_CAN_pad(can_file, flags);
+    uint64_t header_hash = CAN_header_sum(writer->version, header, header_length);
+    off_t payload = block_io_tell(can_file);
+    
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, writer->version, header_hash);
+    if (data) {
+        block_io_write(can_file, data, content_length);
+        CAN_sum_update(&sum, data, content_length);
+    } else if (content_length) {
+        write_contents(can_file, &sum, file, content_length); 
+    }
 
     // Add the final hash for
     // the CAN.
-    fputc(hash, can_file);
+    uint64_t hash = CAN_sum_final(&sum);
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, writer->version, hash);
+    block_io_write(can_file, trailer, CAN_sum_bytes(writer->version));
+
+    struct CAN_Entry entry = {
+        .path = file,
+        .flags = flags,
+        .mode = file_stat->st_mode,
+        .content_length = content_length,
+        .offset = offset,
+        .payload = payload,
+        .header_hash = header_hash,
+        .hash = hash,
+        .mtime = file_stat->st_mtim,
+    };
+    record_CAN(writer, &entry);
 }
 
 
-/**
-* Writes the magic number of a CAN, additionally
-* returning the updated hash for error checking in
-* extraction subroutines.
-*/
-static uint8_t write_magic(FILE *can, uint8_t hash) {
-    fputc(CAN_MAGIC_NUMBER, can);
-    return crush_hash(hash, 0x42);
+size_t next_CAN_shared(CAN_WRITER writer, char *path, int *flags) {
+    if (!writer->prefixed)
+        return 0;
+
+    size_t shared = front_code_CAN_path(&writer->last, path);
+    if (shared)
+        *flags |= CAN_FLAG_PREFIXED;
+
+    return shared;
+}
+
+
+void write_CAN_pad(BLOCK_IO can_file, int flags) {
+    static const uint8_t zeros[CAN_ALIGN];
+
+    block_io_write(can_file, zeros, CAN_pad_bytes(flags, block_io_tell(can_file)));
 }
 
 
 /**
-* Writes the mode bytes for a given file to a supplied can. Computes
-* the updated hash and returns for error checking in extraction
-* subroutines.
+* Creates a writer over the block stream of
+* a new can, collecting an index of what is
+* written when with_index is set.
 */
-static uint8_t write_mode(FILE *can, uint8_t hash, struct stat s) {
-    int mode_byte = 0;
-    
-    long mode = s.st_mode;
-    int sub = 2;
-
-    for (int byte = 0; byte < CAN_MODE_LENGTH_BYTES; byte++, sub--) {
-        mode_byte = mode >> (sub * 8);
-        fputc(mode_byte, can);
-        hash = crush_hash(hash, mode_byte);
+CAN_WRITER new_CAN_writer(BLOCK_IO io, int with_index, int version) {
+    CAN_WRITER writer = malloc(sizeof(*writer));
+    if (!writer)
+        handle_error("Failed to allocate can writer");
+
+    writer->io = io;
+    writer->version = version;
+    writer->sparse = 0;
+    writer->aligned = 0;
+    writer->prefixed = 0;
+    writer->last.length = 0;
+    writer->last.name[0] = '\0';
+    writer->chunks = NULL;
+    writer->index = NULL;
+    if (with_index) {
+        writer->index = calloc(1, sizeof(*writer->index));
+        if (!writer->index)
+            handle_error("Failed to allocate can index");
     }
 
-    return hash;
+    return writer;
 }
 
 
-/**
-* Writes the path_length header feild for a supplied
-* CAN to a given can. Computes the updated 
-* hash and returns it for error checking in 
-* extraction subroutines.
-*/
-static uint8_t write_pathname_length(FILE *can, uint8_t hash, char *path_name) {
-    int sub, byte;
-    int path_length = strlen(path_name);
-    int path_byte = 0;
-    
-    for (byte = 0, sub = 1; byte < CAN_PATHNAME_LENGTH_BYTES; byte++, sub--) {
-        path_byte = path_length >> (sub * 8);
-        fputc(path_byte, can);
-        hash = crush_hash(hash, path_byte);
-    }  
-    return hash;
+void resume_CAN_writer(CAN_WRITER writer, int fd, CAN_INDEX existing) {
+    if (writer->chunks)
+        restore_chunks(writer->chunks, fd, existing);
+
+    // The first CAN added follows
+    // the can's last member.
+    if (existing->count)
+        front_code_CAN_path(&writer->last, existing->entries[existing->count - 1].path);
+
+    if (!writer->index)
+        return;
+
+    // A scanned can leaves the CAN checksums
+    // unknown, so take them from each trailer.
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    size_t sum_bytes = CAN_sum_bytes(writer->version);
+    for (size_t e = 0; e < existing->count; e++) {
+        struct CAN_Entry *entry = &existing->entries[e];
+        if (pread(fd, trailer, sum_bytes, entry->payload + entry->content_length)
+            != (ssize_t) sum_bytes)
+            handle_error("Unexpected end of can");
+
+        struct CAN_Entry *copy = append_CAN_entry(writer->index);
+        *copy = *entry;
+        copy->path = strdup(entry->path);
+        copy->hash = get_CAN_sum(trailer, writer->version);
+    }
 }
 
 
 /**
-* Writes the content_length header feild for a supplied
-* CAN. Computes the updated hash and returns it for
-* error checking in extraction subroutines.
+* Notes a CAN that has just been written
+* so it can be put in the trailing index.
 */
-static uint8_t write_content_length(FILE *can, uint8_t hash, struct stat s) {
-    
-    // Fill directory bytes with 0s.
-    if (S_ISDIR(s.st_mode)) {
-        for (int d = 0; d < CAN_CONTENT_LENGTH_BYTES; d++) {
-            fputc(0, can);
-            hash = crush_hash(hash, 0);
-        }
-        return hash;
-    }
-
-    // Write content length as specified 
-    // in stat.st_size.
-    uint64_t content_length = s.st_size;
-    int byte;
-    int sub;
-    uint64_t ct_byte = 0;
-    for (byte = 0, sub = 5; byte < CAN_CONTENT_LENGTH_BYTES; byte++, sub--) {
-        ct_byte = content_length >> (sub * 8);
-        fputc(ct_byte, can);
-        hash = crush_hash(hash, ct_byte);
-    }    
-    
-    return hash;
+void record_CAN(CAN_WRITER writer, struct CAN_Entry *entry) {
+    if (!writer->index)
+        return;
+
+    struct CAN_Entry *copy = append_CAN_entry(writer->index);
+    *copy = *entry;
+    copy->path = strdup(entry->path);
+    copy->version = writer->version;
+
+    // Padding and front coding leave the
+    // writer to say where the CAN starts.
+    if (!(entry->flags & (CAN_FLAG_ALIGNED | CAN_FLAG_PREFIXED)))
+        copy->offset = entry->payload - CAN_header_length(writer->version,
+                                                          strlen(entry->path));
 }
 
 
 /**
-* Writes the pathname for a given CAN being
-* added to a can. Advances the can file pointer foward
-* in order to maintain canbies archive format. 
-*
-* Also returns the updated hash to reflect the added 
-* content bytes.
+* Writes the trailing index if there is one,
+* flushes and closes the can.
 */
-static uint8_t write_pathname(FILE *can, uint8_t hash, char *path_name) {
-    
-    for (int c = 0; c < strlen(path_name); c++) {
-        fputc(path_name[c], can);
-        hash = crush_hash(hash, path_name[c]);
+void close_CAN_writer(CAN_WRITER writer) {
+    if (writer->index) {
+        write_CAN_index(writer->io, writer->index, writer->version);
+        free_CAN_index(writer->index);
     }
-    
-    return hash;
+    if (writer->chunks)
+        free_chunk_store(writer->chunks);
+
+    block_io_close(writer->io);
+    free(writer);
 }
 
 
@@ -454,19 +774,109 @@ static uint8_t write_pathname(FILE *can, uint8_t hash, char *path_name) {
 * to a given can file stream. Computes the 
 * updated hash for use in error checking 
 * in later extraction subroutines.
+*
+* Exactly content_length bytes are stored so
+* the body always agrees with the header.
 */
-static uint8_t write_contents(FILE *can, uint8_t hash, char *file_to_write) {
-    int c;
-    FILE *input_stream = fopen(file_to_write, "r");
+static void write_contents(BLOCK_IO can, struct CAN_Sum *sum, char *file_to_write,
+                           uint64_t content_length) {
+    int input_stream = open(file_to_write, O_RDONLY);
 
-    if (!input_stream)
+    if (input_stream < 0)
         handle_error("Failed to open file steam");
+    stats_call(STATS_CALL_OPEN);
+
+    // Read straight into the free space
+    // of the can's output buffer.
+    while (content_length) {
+        size_t avail = 0;
+        unsigned char *block = block_io_space(can, &avail);
+        if (avail > content_length)
+            avail = content_length;
+
+        uint64_t since = stats_clock();
+        ssize_t got = read(input_stream, block, avail);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read file");
+        if (got == 0)
+            handle_error("File changed size while archiving");
+
+        CAN_sum_update(sum, block, got);
+        block_io_commit(can, got);
+        content_length -= got;
+    }
+
+    close(input_stream);
+    stats_call(STATS_CALL_CLOSE);
+}
 
-    while ( (c = fgetc(input_stream)) != EOF ) {
-        fputc(c, can);
-        hash = crush_hash(hash, c);
+
+/**
+* Writes len bytes of block to fd,
+* retrying on short writes.
+*/
+void write_block(int fd, const unsigned char *block, size_t len) {
+    while (len) {
+        uint64_t since = stats_clock();
+        ssize_t put = write(fd, block, len);
+        stats_phase(STATS_WRITE, since);
+        stats_call(STATS_CALL_WRITE);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            handle_error("Failed to write file");
+        block += put;
+        len -= put;
     }
+}
+
+
+/**
+* Feeds libcan from a block stream.
+*/
+static ssize_t block_source(void *ctx, void *buf, size_t cap) {
+    return block_io_read(ctx, buf, cap);
+}
+
+
+/**
+* Lets libcan pass over a block stream
+* as block_io_skip does, seeking if it
+* can and failing at the can's end.
+*/
+static int64_t block_skip(void *ctx, uint64_t n) {
+    block_io_skip(ctx, n);
+    return n;
+}
+
+
+/**
+* Feeds a rebuild the stored contents of
+* the CAN a reader is on, which end the
+* stream until the next CAN's are read.
+*/
+static size_t stored_source(void *ctx, unsigned char *buf, size_t cap) {
+    CAN_READER reader = ctx;
+    size_t got;
+
+    int status = can_read_stored(reader->reader, buf, cap, &got);
+    if (status != LIBCAN_OK)
+        handle_error((char *) can_strerror(status));
+    return got;
+}
+
+
+/**
+* Reads the chunks a rebuild refers
+* to from the can itself.
+*/
+static size_t stored_pread(void *ctx, unsigned char *buf, size_t len, off_t offset) {
+    CAN_READER reader = ctx;
 
-    fclose(input_stream);
-    return hash;
+    block_io_pread(reader->io, buf, len, offset);
+    return len;
 }
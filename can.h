@@ -12,6 +12,100 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+
+#include "arena.h"
+#include "block_io.h"
+#include "can_index.h"
+#include "libcan.h"
+#include "sum64.h"
+
+// the first byte of every CAN has this value,
+// which also gives its format version
+#define CAN_MAGIC_NUMBER          0x42
+#define CAN_V2_MAGIC_NUMBER       0x43
+
+// CAN format versions, v1 ends with a one
+// byte Pearson hash and v2 adds a flags byte
+// after the magic and ends with a 64-bit
+// xxh64 checksum
+#define CAN_FORMAT_V1             1
+#define CAN_FORMAT_V2             2
+#define CAN_DEFAULT_FORMAT        CAN_FORMAT_V1
+
+// flags of a v2 CAN, a chunked CAN's contents
+// are a dedup recipe rather than the file, a
+// sparse CAN's are its data extents, an
+// aligned CAN's are padded to start on a
+// CAN_ALIGN boundary of the can, a pieced
+// CAN's are the file cut into pieces that
+// each have a checksum of their own, a
+// prefixed CAN's pathname only holds what
+// differs from the CAN before it and a
+// deleted CAN has no contents, saying its
+// pathname is gone since the can a delta
+// was made against
+#define CAN_FLAG_CHUNKED          0x01
+#define CAN_FLAG_SPARSE           0x02
+#define CAN_FLAG_ALIGNED          0x04
+#define CAN_FLAG_PIECED           0x08
+#define CAN_FLAG_PREFIXED         0x10
+#define CAN_FLAG_DELETED          0x20
+#define CAN_KNOWN_FLAGS           (CAN_FLAG_CHUNKED | CAN_FLAG_SPARSE | \
+                                   CAN_FLAG_ALIGNED | CAN_FLAG_PIECED | \
+                                   CAN_FLAG_PREFIXED | CAN_FLAG_DELETED)
+
+// v2 cans store files bigger than this
+// as pieced CANs with pieces this big
+#define CAN_PIECE_BYTES           (1 << 24)
+
+// boundary the contents of aligned CANs
+// start on, a page and a file system block
+#define CAN_ALIGN                 4096
+
+// how the contents of an aligned CAN copied
+// out without being read are checked, not
+// at all or by mapping them from the can
+#define CAN_CHECK_OFF             0
+#define CAN_CHECK_MMAP            1
+
+// CANs with these flags start their contents
+// with the size of the file they hold
+#define CAN_SIZED_FLAGS           (CAN_FLAG_CHUNKED | CAN_FLAG_SPARSE | \
+                                   CAN_FLAG_PIECED)
+#define CAN_FILE_SIZE_BYTES       8
+
+// number of bytes in fixed-length CAN fields
+#define CAN_MAGIC_NUMBER_BYTES    1
+#define CAN_MODE_LENGTH_BYTES     3
+#define CAN_PATHNAME_LENGTH_BYTES 2
+#define CAN_CONTENT_LENGTH_BYTES  6
+#define CAN_HASH_BYTES            1
+#define CAN_FLAGS_BYTES           1
+#define CAN_SUM64_BYTES           8
+
+// a prefixed CAN's pathname starts with how many
+// bytes it shares with the last CAN's pathname,
+// the rest of it following
+#define CAN_PREFIX_BYTES          2
+
+// maximum number of bytes in variable-length CAN fields
+#define CAN_MAX_PATHNAME_LENGTH   65535
+#define CAN_MAX_CONTENT_LENGTH    281474976710655
+
+// bytes of a v1 CAN header before the pathname
+#define CAN_FIXED_HEADER_LENGTH   (CAN_MAGIC_NUMBER_BYTES + \
+                                   CAN_MODE_LENGTH_BYTES + \
+                                   CAN_PATHNAME_LENGTH_BYTES + \
+                                   CAN_CONTENT_LENGTH_BYTES)
+
+// largest header a CAN can have, pathname included
+#define CAN_MAX_HEADER_LENGTH     (CAN_FIXED_HEADER_LENGTH + \
+                                   CAN_FLAGS_BYTES + \
+                                   CAN_MAX_PATHNAME_LENGTH)
+
+// largest checksum at the end of a CAN
+#define CAN_MAX_SUM_BYTES         CAN_SUM64_BYTES
 
 /**
 * Stores the header like 
@@ -21,29 +115,116 @@
 */
 struct CAN_Struct {
     int magic_number;
+    int version;
+    int flags;
     long mode;
     int path_length;
     uint64_t content_length;
-    uint8_t hash;
+    uint64_t hash;
     long next_CAN;
 };
 
 typedef struct CAN_Struct *CAN;
 
 
+/**
+* Running checksum over the contents of a
+* CAN, continuing from the checksum of its
+* header. v1 CANs use the Pearson byte and
+* v2 CANs an xxh64 seeded with the header's.
+*/
+struct CAN_Sum {
+    int version;
+    uint8_t hash;
+    struct Sum64_State state;
+};
+
+
+/**
+* The full pathname of the last CAN read or
+* written, which a prefixed CAN's pathname
+* is rebuilt on in place.
+*/
+struct CAN_Path {
+    size_t length;
+    char name[CAN_MAX_PATHNAME_LENGTH + 1];
+};
+
+
+/**
+* Called once for every path visited while
+* adding to a can, in the order the CANs
+* should appear. ctx is passed through
+* untouched.
+*/
+typedef void (*CAN_EMIT)(void *ctx, char *path, struct stat *s);
+
+
+/**
+* Where new CANs are written along with,
+* when the can gets a trailing index,
+* the entries written so far and, when
+* deduplicating, every chunk stored.
+* sparse is set to store only the data
+* of files with holes, and aligned to
+* pad plain file CANs so their contents
+* start on a CAN_ALIGN boundary. prefixed
+* front codes each CAN's pathname against
+* last, the pathname of the CAN before it.
+*/
+struct CAN_Writer_Struct {
+    BLOCK_IO io;
+    CAN_INDEX index;
+    int version;
+    int sparse;
+    int aligned;
+    int prefixed;
+    struct CAN_Path last;
+    struct Chunk_Store_Struct *chunks;
+};
+
+typedef struct CAN_Writer_Struct *CAN_WRITER;
+
+
+/**
+* A can read through libcan from the block
+* stream io, which started at start. entry
+* is the CAN last read, its pathname in
+* path. stored streams the contents of
+* a chunked or sparse CAN as stored, to
+* be rebuilt, reading any chunks it refers
+* to back from io, and out carries the
+* contents of other files. buf is the
+* buffer libcan reads io into.
+*/
+struct CAN_Reader_Struct {
+    LIBCAN_READER reader;
+    BLOCK_IO io;
+    off_t start;
+    struct Libcan_Entry entry;
+    char *path;
+    BLOCK_IO stored;
+    unsigned char *buf;
+    unsigned char *out;
+};
+
+typedef struct CAN_Reader_Struct *CAN_READER;
+
+
 
 /**
-* Creates a new empty CAN
-* struct and returns it.
+* Creates a new empty CAN struct in
+* arena and returns it.
 */
-CAN new_CAN(void);
+CAN new_CAN(ARENA arena);
 
 
 /**
 * Builds the header components of a CAN
-* given a file_ptr and an emptye CAN.
+* given a block stream and an emptye CAN,
+* or returns NULL at the end of the can.
 */
-CAN build_CAN(CAN CAN, FILE *file_ptr);
+CAN build_CAN(CAN CAN, BLOCK_IO file_ptr);
 
 
 /**
@@ -53,50 +234,318 @@ CAN build_CAN(CAN CAN, FILE *file_ptr);
 
 
 /**
-* Reads the bytes of a CAN pathname
-* and returns the read number of bytes
-* as a string.
+* Reads the bytes of a CAN pathname and
+* returns the full pathname, rebuilt in
+* last over the pathname of the CAN read
+* before it.
+*/
+char *read_CAN_path_name(CAN CAN, BLOCK_IO file_ptr, struct CAN_Path *last);
+
+
+/**
+* Rebuilds in last the pathname of a CAN
+* with flags from the length bytes of its
+* pathname feild. Returns 0 if a prefixed
+* pathname doesn't fit on the last one.
+*/
+int rebuild_CAN_path(struct CAN_Path *last, int flags, const uint8_t *stored,
+                     size_t length);
+
+
+/**
+* Makes path the last pathname, copying
+* only what differs, and returns how many
+* bytes of it a prefixed CAN would share
+* with the old one, or 0 if storing them
+* again takes no more room.
+*/
+size_t front_code_CAN_path(struct CAN_Path *last, char *path);
+
+
+/**
+* Creates a reader for the can
+* from the current offset of io.
+*/
+CAN_READER new_CAN_reader(BLOCK_IO io);
+
+
+/**
+* Moves reader on to its next CAN and
+* returns it, or NULL at the end of
+* the can.
+*/
+struct Libcan_Entry *next_CAN_entry(CAN_READER reader);
+
+
+/**
+* Frees a reader, leaving its
+* block stream open.
+*/
+void free_CAN_reader(CAN_READER reader);
+
+
+/**
+* Writes the file or directory of the CAN
+* reader is on to disk as file_name. The
+* file is removed if its checksum is
+* wrong.
+*/
+void write_extracted_CAN(CAN_READER reader, char *file_name);
+
+
+/**
+* Writes the file the CAN reader is on
+* holds to fd, which can be a pipe, and
+* checks its checksum.
+*/
+void write_CAN_contents(CAN_READER reader, int fd);
+
+
+/**
+* Extracts the aligned CAN reader is on by
+* copying its contents straight from the
+* can to the file, checking them as check
+* says. Returns 0 and does nothing if the
+* can isn't a file or the CAN isn't aligned.
+*/
+int copy_extracted_CAN(CAN_READER reader, char *file_name, int check);
+
+
+/**
+* Checks the checksum of the CAN reader is
+* on, which must have no contents, like a
+* directory's or a deleted CAN.
+*/
+void check_empty_CAN(CAN_READER reader);
+
+
+/**
+* Reads the checksum ending a CAN whose
+* contents have been read and returns 1
+* if it matches CAN->hash.
+*/
+int check_CAN_sum(BLOCK_IO file_ptr, CAN CAN);
+
+/**
+* Creates the directory for an extracted
+* CAN if it doesn't already exist.
+*/
+void make_extracted_dir(char *file_name, mode_t mode);
+
+
+/**
+* Removes what a deleted CAN with mode
+* names, if it is there at all.
 */
-char *read_CAN_path_name(CAN CAN, FILE *file_ptr);
+void remove_extracted_path(char *file_name, mode_t mode);
 
 
 /**
-* Writes the contents of an extracted 
-* CAN to disk given a file pointer 
-* and a file name.
+* Creates the file for an extracted CAN
+* and returns its fd. It is an error
+* for the file to already exist.
 */
-void write_extracted_CAN(FILE *file_ptr, CAN canbete, char *file_name);
+int open_extracted_file(char *file_name);
+
+
+/**
+* Notes path as a file extraction has created
+* but not yet checked, or that none is if it
+* is NULL. A file still noted when crush
+* exits is removed.
+*/
+void mark_partial_file(char *path);
+
+
+/**
+* Writes all len bytes of block to fd.
+*/
+void write_block(int fd, const unsigned char *block, size_t len);
+
 
 /**
 * Gets the mode/permisions associates
 * with a given CAN and returns
 * it as a long.
 */
-long get_CAN_mode(FILE *file_ptr, CAN CAN);
+long get_CAN_mode(BLOCK_IO file_ptr, CAN CAN);
 
 
-int get_path_length(FILE *file_ptr, CAN CAN);
+int get_path_length(BLOCK_IO file_ptr, CAN CAN);
 
 /**
 * Retrives the content length feild 
 * of a CAN header and returns 
 * it as a 64 bit int.
 */
-uint64_t get_content_length(FILE *file_ptr, CAN CAN);
+uint64_t get_content_length(BLOCK_IO file_ptr, CAN CAN);
+
+
+/**
+* Stats a single path and passes
+* it to emit. 
+*/
+void add_file(CAN_EMIT emit, void *ctx, char *file_path);
+
+
+/**
+* Walks the contents of a directory passing
+* every path below it to emit, on workers
+* threads if above one, and in name order
+* within each directory if sorted is set.
+*/
+void add_dir(CAN_EMIT emit, void *ctx, char *file_path, int workers, int sorted);
+
+
+/**
+* A CAN_EMIT which writes the CAN for path
+* to the CAN_WRITER passed as can_writer.
+* Like every emitter that takes a path into
+* the can, it prints the path as added.
+*/
+void write_file(void *can_writer, char *file, struct stat *file_stat);
+
+
+/**
+* Writes the CAN for file like write_file,
+* taking its contents from data unless
+* it is NULL.
+*/
+void write_loaded_file(CAN_WRITER writer, char *file, struct stat *file_stat,
+                       const uint8_t *data);
+
+
+/**
+* Serialises the header and pathname of
+* a CAN of the given format version into
+* header, which must hold
+* CAN_MAX_HEADER_LENGTH bytes, and
+* returns its length. flags are only
+* stored by v2 CANs.
+*/
+size_t encode_CAN_header(uint8_t *header, int version, int flags, char *path_name,
+                         long mode, uint64_t content_length);
+
+
+/**
+* Serialises a header like encode_CAN_header
+* whose pathname shares its first shared
+* bytes with the last CAN's. A CAN sharing
+* any is flagged prefixed and stores only
+* the rest of its pathname.
+*/
+size_t encode_prefixed_CAN_header(uint8_t *header, int version, int flags,
+                                  size_t shared, char *path_name, long mode,
+                                  uint64_t content_length);
+
+
+/**
+* Returns how many bytes of path the next
+* CAN of writer shares with the last one,
+* adding CAN_FLAG_PREFIXED to flags if any.
+* Always 0 unless writer front codes.
+*/
+size_t next_CAN_shared(CAN_WRITER writer, char *path, int *flags);
+
+
+/**
+* Bytes of header, pathname included,
+* and of the checksum a CAN of the
+* given version has.
+*/
+size_t CAN_header_length(int version, size_t path_length);
+size_t CAN_sum_bytes(int version);
+
+
+/**
+* Bytes of the pathname feild of a CAN
+* for path sharing shared bytes with
+* the last CAN's.
+*/
+size_t CAN_stored_path_length(char *path_name, size_t shared);
+
+
+/**
+* Checksums the encoded header of a CAN,
+* giving the value its contents' checksum
+* continues from.
+*/
+uint64_t CAN_header_sum(int version, const uint8_t *header, size_t length);
+
+
+/**
+* Returns the size of the file a CAN with
+* one of CAN_SIZED_FLAGS holds, given the
+* first CAN_FILE_SIZE_BYTES of its contents.
+*/
+uint64_t CAN_file_size(const uint8_t *contents);
+
+
+/**
+* Returns how many zero bytes come between
+* the header of a CAN with flags, ending at
+* offset of the can, and its contents. The
+* padding isn't part of the checksum.
+*/
+size_t CAN_pad_bytes(int flags, off_t offset);
+
+
+/**
+* Writes the zeros padding a CAN with flags
+* whose header has just been written.
+*/
+void write_CAN_pad(BLOCK_IO can_file, int flags);
+
+
+/**
+* Start, extend and finish the checksum
+* of a CAN's contents.
+*/
+void CAN_sum_start(struct CAN_Sum *sum, int version, uint64_t header_sum);
+void CAN_sum_update(struct CAN_Sum *sum, const void *buf, size_t len);
+uint64_t CAN_sum_final(struct CAN_Sum *sum);
+
+
+/**
+* Stores or loads the checksum ending a
+* CAN as CAN_sum_bytes(version) bytes.
+*/
+void put_CAN_sum(uint8_t *out, int version, uint64_t sum);
+uint64_t get_CAN_sum(const uint8_t *in, int version);
+
+
+/**
+* Creates a writer for a new can on io
+* writing CANs of the given format version,
+* collecting a trailing index if with_index
+* is set.
+*/
+CAN_WRITER new_CAN_writer(BLOCK_IO io, int with_index, int version);
+
+
+/**
+* Carries on a writer from the CANs already
+* in the can open on fd, listed in existing,
+* so its trailing index and chunk store
+* cover them as well as what is added.
+*/
+void resume_CAN_writer(CAN_WRITER writer, int fd, CAN_INDEX existing);
 
 
 /**
-* Writes a CAN to a given can
-* file pointer. 
+* Records a CAN just written through writer
+* for the trailing index, if it has one.
+* The entry's path is copied and its
+* version and offset filled in.
 */
-void add_file(FILE *can_file, char *file_path);
+void record_CAN(CAN_WRITER writer, struct CAN_Entry *entry);
 
 
 /**
-* Adds a directory to the supplied can
-* file.
+* Writes the trailing index, if any, then
+* flushes and closes the can.
 */
-void add_dir(FILE *can_file, char *file_path);
+void close_CAN_writer(CAN_WRITER writer);
 
 
 
@@ -0,0 +1,411 @@
+/**
+* can_format.c => Encoding and checking CANs in memory, shared with libcan
+*
+* Nothing here does I/O or ends the run
+* on an error, so libcan.a is built from
+* this and not from can.c or pieces.c.
+*/
+
+
+#include <string.h>
+
+#include "can.h"
+#include "can_index.h"
+#include "crush.h"
+#include "pieces.h"
+#include "stats.h"
+
+// what part of a pieced CAN's contents
+// a Piece_Check is taking
+#define PIECE_PART_HEADER         0
+#define PIECE_PART_DATA           1
+#define PIECE_PART_SUM            2
+#define PIECE_PART_END            3
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static uint8_t *write_magic(uint8_t *header, int version);
+static uint8_t *write_flags(uint8_t *header, int version, int flags);
+static uint8_t *write_mode(uint8_t *header, long mode);
+static uint8_t *write_pathname_length(uint8_t *header, size_t path_length);
+static uint8_t *write_content_length(uint8_t *header, uint64_t content_length);
+static uint8_t *write_prefix(uint8_t *header, int flags, size_t shared);
+static uint8_t *write_pathname(uint8_t *header, char *path_name);
+static void next_part(struct Piece_Check *check);
+static void start_piece(struct Piece_Check *check);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+int rebuild_CAN_path(struct CAN_Path *last, int flags, const uint8_t *stored,
+                     size_t length) {
+    size_t shared = 0;
+
+    if (flags & CAN_FLAG_PREFIXED) {
+        if (length < CAN_PREFIX_BYTES)
+            return 0;
+        shared = stored[0] << 8 | stored[1];
+        stored += CAN_PREFIX_BYTES;
+        length -= CAN_PREFIX_BYTES;
+        if (shared > last->length || shared + length > CAN_MAX_PATHNAME_LENGTH)
+            return 0;
+    }
+
+    memcpy(last->name + shared, stored, length);
+    last->length = shared + length;
+    last->name[last->length] = '\0';
+    return 1;
+}
+
+size_t front_code_CAN_path(struct CAN_Path *last, char *path) {
+    size_t length = strlen(path);
+    size_t shared = 0;
+    while (shared < length && shared < last->length &&
+           last->name[shared] == path[shared])
+        shared++;
+
+    memcpy(last->name + shared, path + shared, length - shared + 1);
+    last->length = length;
+
+    return shared > CAN_PREFIX_BYTES ? shared : 0;
+}
+
+/**
+* Serialises the header feilds and pathname of
+* a CAN into header and returns the number of
+* bytes used, at most CAN_MAX_HEADER_LENGTH.
+*/
+size_t encode_CAN_header(uint8_t *header, int version, int flags, char *path_name,
+                         long mode, uint64_t content_length) {
+    return encode_prefixed_CAN_header(header, version, flags, 0, path_name, mode,
+                                      content_length);
+}
+
+/**
+* Only a prefixed CAN stores how much of
+* its pathname is shared, so the pathname
+* length counts those bytes too.
+*/
+size_t encode_prefixed_CAN_header(uint8_t *header, int version, int flags,
+                                  size_t shared, char *path_name, long mode,
+                                  uint64_t content_length) {
+    uint8_t *end = header;
+    if (shared)
+        flags |= CAN_FLAG_PREFIXED;
+
+    size_t path_length = strlen(path_name) - shared;
+    if (flags & CAN_FLAG_PREFIXED)
+        path_length += CAN_PREFIX_BYTES;
+
+    end = write_magic(end, version);
+    end = write_flags(end, version, flags);
+    end = write_mode(end, mode);
+    end = write_pathname_length(end, path_length);
+    end = write_content_length(end, content_length);
+    end = write_prefix(end, flags, shared);
+    end = write_pathname(end, path_name + shared);
+
+    return end - header;
+}
+
+size_t CAN_header_length(int version, size_t path_length) {
+    size_t length = CAN_FIXED_HEADER_LENGTH + path_length;
+    if (version == CAN_FORMAT_V2)
+        length += CAN_FLAGS_BYTES;
+
+    return length;
+}
+
+size_t CAN_stored_path_length(char *path_name, size_t shared) {
+    size_t length = strlen(path_name) - shared;
+    if (shared)
+        length += CAN_PREFIX_BYTES;
+
+    return length;
+}
+
+size_t CAN_pad_bytes(int flags, off_t offset) {
+    if (!(flags & CAN_FLAG_ALIGNED))
+        return 0;
+
+    return -offset & (CAN_ALIGN - 1);
+}
+
+size_t CAN_sum_bytes(int version) {
+    return version == CAN_FORMAT_V2 ? CAN_SUM64_BYTES : CAN_HASH_BYTES;
+}
+
+uint64_t CAN_file_size(const uint8_t *contents) {
+    uint64_t size = 0;
+    for (int byte = 0; byte < CAN_FILE_SIZE_BYTES; byte++)
+        size = (size << 8) | contents[byte];
+
+    return size;
+}
+
+uint64_t CAN_header_sum(int version, const uint8_t *header, size_t length) {
+    if (version == CAN_FORMAT_V2)
+        return sum64(0, header, length);
+
+    return crush_hash_buf(0, header, length);
+}
+
+void CAN_sum_start(struct CAN_Sum *sum, int version, uint64_t header_sum) {
+    sum->version = version;
+    if (version == CAN_FORMAT_V2)
+        sum64_start(&sum->state, header_sum);
+    else
+        sum->hash = header_sum;
+}
+
+void CAN_sum_update(struct CAN_Sum *sum, const void *buf, size_t len) {
+    uint64_t since = stats_clock();
+    if (sum->version == CAN_FORMAT_V2)
+        sum64_update(&sum->state, buf, len);
+    else
+        sum->hash = crush_hash_buf(sum->hash, buf, len);
+    stats_phase(STATS_HASH, since);
+}
+
+uint64_t CAN_sum_final(struct CAN_Sum *sum) {
+    if (sum->version == CAN_FORMAT_V2)
+        return sum64_final(&sum->state);
+
+    return sum->hash;
+}
+
+/**
+* Checksums are stored most significant
+* byte first like the header feilds.
+*/
+void put_CAN_sum(uint8_t *out, int version, uint64_t sum) {
+    for (int sub = CAN_sum_bytes(version) - 1; sub >= 0; sub--)
+        *out++ = sum >> (sub * 8);
+}
+
+uint64_t get_CAN_sum(const uint8_t *in, int version) {
+    uint64_t sum = 0;
+    for (size_t byte = 0; byte < CAN_sum_bytes(version); byte++)
+        sum = (sum << 8) | in[byte];
+
+    return sum;
+}
+
+int is_index_CAN(char *path, long mode) {
+    return mode == CAN_INDEX_MODE && strcmp(path, CAN_INDEX_PATHNAME) == 0;
+}
+
+uint64_t pieces_count(uint64_t size, uint64_t piece_bytes) {
+    return size / piece_bytes + (size % piece_bytes != 0);
+}
+
+uint64_t piece_offset(uint64_t piece_bytes, uint64_t piece) {
+    return PIECES_HEADER_BYTES + piece * (piece_bytes + CAN_SUM64_BYTES);
+}
+
+uint64_t pieces_length(uint64_t size, uint64_t piece_bytes) {
+    return PIECES_HEADER_BYTES + size + pieces_count(size, piece_bytes) * CAN_SUM64_BYTES;
+}
+
+size_t piece_length(uint64_t size, uint64_t piece_bytes, uint64_t piece) {
+    uint64_t start = piece * piece_bytes;
+
+    return size - start < piece_bytes ? size - start : piece_bytes;
+}
+
+void piece_sum_start(struct CAN_Sum *sum, uint64_t header_hash, uint64_t piece) {
+    CAN_sum_start(sum, CAN_FORMAT_V2, header_hash + piece);
+}
+
+void put_pieces_header(uint8_t *out, uint64_t size, uint64_t piece_bytes) {
+    put_bytes(out, size, 8);
+    put_bytes(out + 8, piece_bytes, 8);
+}
+
+int get_pieces_header(const uint8_t *in, uint64_t content_length, uint64_t *size,
+                      uint64_t *piece_bytes) {
+    *size = get_bytes(in, 8);
+    *piece_bytes = get_bytes(in + 8, 8);
+
+    // Sizes past what a CAN can hold
+    // can't overflow the sum below.
+    return *piece_bytes && *size <= CAN_MAX_CONTENT_LENGTH &&
+           pieces_length(*size, *piece_bytes) == content_length;
+}
+
+void piece_check_start(struct Piece_Check *check, uint64_t header_hash,
+                       uint64_t content_length) {
+    memset(check, 0, sizeof(*check));
+    check->header_hash = header_hash;
+    check->content_length = content_length;
+    check->part = PIECE_PART_HEADER;
+    check->left = PIECES_HEADER_BYTES;
+}
+
+size_t piece_check_update(struct Piece_Check *check, struct CAN_Sum *sum,
+                          const uint8_t *buf, size_t len, int *data) {
+    *data = check->part == PIECE_PART_DATA;
+
+    // Anything past the last piece's
+    // checksum doesn't belong.
+    if (check->part == PIECE_PART_END) {
+        check->bad = 1;
+        return len;
+    }
+
+    size_t step = len < check->left ? len : check->left;
+    if (*data) {
+        CAN_sum_update(&check->data, buf, step);
+    } else {
+        memcpy(check->held + check->held_length, buf, step);
+        check->held_length += step;
+        CAN_sum_update(sum, buf, step);
+    }
+
+    check->left -= step;
+    if (!check->left)
+        next_part(check);
+
+    return step;
+}
+
+int piece_check_ok(struct Piece_Check *check) {
+    return !check->bad && check->part == PIECE_PART_END;
+}
+
+/**
+* Writes the magic number of a CAN and
+* returns the end of the header so far.
+*/
+static uint8_t *write_magic(uint8_t *header, int version) {
+    if (version == CAN_FORMAT_V2)
+        *header++ = CAN_V2_MAGIC_NUMBER;
+    else
+        *header++ = CAN_MAGIC_NUMBER;
+    return header;
+}
+
+/**
+* Writes the flags byte of a v2 CAN and
+* returns the end of the header so far.
+*/
+static uint8_t *write_flags(uint8_t *header, int version, int flags) {
+    if (version == CAN_FORMAT_V2)
+        *header++ = flags;
+    return header;
+}
+
+/**
+* Writes the mode bytes for a given file 
+* to a CAN header and returns the end 
+* of the header so far.
+*/
+static uint8_t *write_mode(uint8_t *header, long mode) {
+    int sub = 2;
+
+    for (int byte = 0; byte < CAN_MODE_LENGTH_BYTES; byte++, sub--) {
+        *header++ = mode >> (sub * 8);
+    }
+
+    return header;
+}
+
+/**
+* Writes the path_length header feild for a 
+* supplied CAN and returns the end of the 
+* header so far.
+*/
+static uint8_t *write_pathname_length(uint8_t *header, size_t path_length) {
+    int sub, byte;
+    
+    for (byte = 0, sub = 1; byte < CAN_PATHNAME_LENGTH_BYTES; byte++, sub--) {
+        *header++ = path_length >> (sub * 8);
+    }  
+    return header;
+}
+
+/**
+* Writes the content_length header feild for a 
+* supplied CAN and returns the end of the
+* header so far.
+*/
+static uint8_t *write_content_length(uint8_t *header, uint64_t content_length) {
+    int byte;
+    int sub;
+    for (byte = 0, sub = 5; byte < CAN_CONTENT_LENGTH_BYTES; byte++, sub--) {
+        *header++ = content_length >> (sub * 8);
+    }    
+    
+    return header;
+}
+
+/**
+* Writes how many bytes a prefixed CAN's
+* pathname shares with the last one and
+* returns the end of the header so far.
+*/
+static uint8_t *write_prefix(uint8_t *header, int flags, size_t shared) {
+    if (flags & CAN_FLAG_PREFIXED) {
+        *header++ = shared >> 8;
+        *header++ = shared;
+    }
+    return header;
+}
+
+/**
+* Writes the pathname for a given CAN being
+* added to a can header and returns the end
+* of the header.
+*/
+static uint8_t *write_pathname(uint8_t *header, char *path_name) {
+    size_t path_length = strlen(path_name);
+
+    memcpy(header, path_name, path_length);
+    
+    return header + path_length;
+}
+
+/**
+* Moves on once a part of the
+* contents has all been taken.
+*/
+static void next_part(struct Piece_Check *check) {
+    switch (check->part) {
+    case PIECE_PART_HEADER:
+        if (!get_pieces_header(check->held, check->content_length, &check->rest,
+                               &check->piece_bytes)) {
+            check->bad = 1;
+            check->part = PIECE_PART_END;
+            return;
+        }
+        start_piece(check);
+        break;
+
+    case PIECE_PART_DATA:
+        check->part = PIECE_PART_SUM;
+        check->left = CAN_SUM64_BYTES;
+        check->held_length = 0;
+        break;
+
+    case PIECE_PART_SUM:
+        if (get_CAN_sum(check->held, CAN_FORMAT_V2) != CAN_sum_final(&check->data))
+            check->bad = 1;
+        check->piece++;
+        start_piece(check);
+        break;
+    }
+}
+
+/**
+* Gets ready for the next piece's
+* bytes, if there are any left.
+*/
+static void start_piece(struct Piece_Check *check) {
+    if (!check->rest) {
+        check->part = PIECE_PART_END;
+        return;
+    }
+
+    check->left = check->rest < check->piece_bytes ? check->rest : check->piece_bytes;
+    check->rest -= check->left;
+    check->part = PIECE_PART_DATA;
+    piece_sum_start(&check->data, check->header_hash, check->piece);
+}
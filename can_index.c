@@ -0,0 +1,322 @@
+#include "can.h"
+#include "crush.h"
+#include "can_index.h"
+#include "path_set.h"
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static size_t index_entry_bytes(int version, int timed);
+static CAN_INDEX load_CAN_index(int fd, off_t size, int version);
+static void write_summed(BLOCK_IO can_file, struct CAN_Sum *sum, const void *buf,
+                         size_t len);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+CAN_INDEX scan_CAN_index(BLOCK_IO file_ptr) {
+    CAN_INDEX index = calloc(1, sizeof(*index));
+    struct CAN_Path *last = calloc(1, sizeof(*last));
+    if (!index || !last)
+        handle_error("Failed to allocate can index");
+
+    while (!block_io_eof(file_ptr)) {
+        off_t offset = block_io_tell(file_ptr);
+
+        struct CAN_Struct can;
+        build_CAN(&can, file_ptr);
+        char *path_name = read_CAN_path_name(&can, file_ptr, last);
+
+        struct CAN_Entry *entry = append_CAN_entry(index);
+        entry->path = strdup(path_name);
+        entry->version = can.version;
+        entry->flags = can.flags;
+        entry->mode = can.mode;
+        entry->content_length = can.content_length;
+        entry->offset = offset;
+        entry->payload = block_io_tell(file_ptr);
+        entry->header_hash = can.hash;
+        entry->hash = 0;
+
+        // Move to next CAN.
+        block_io_skip(file_ptr, can.content_length + CAN_sum_bytes(can.version));
+    }
+
+    index->end = block_io_tell(file_ptr);
+    free(last);
+    return index;
+}
+
+
+CAN_INDEX read_CAN_index(int fd) {
+    struct stat s;
+    if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode))
+        return NULL;
+
+    // The index CAN is written in the can's
+    // own format, so try each in turn.
+    CAN_INDEX index = load_CAN_index(fd, s.st_size, CAN_FORMAT_V1);
+    if (!index)
+        index = load_CAN_index(fd, s.st_size, CAN_FORMAT_V2);
+
+    return index;
+}
+
+
+void write_CAN_index(BLOCK_IO can_file, CAN_INDEX index, int version) {
+    off_t index_offset = block_io_tell(can_file);
+    size_t sum_bytes = CAN_sum_bytes(version);
+    size_t entry_bytes = index_entry_bytes(version, 1);
+
+    uint64_t content_length = CAN_INDEX_FOOTER_BYTES;
+    for (size_t e = 0; e < index->count; e++)
+        content_length += entry_bytes + strlen(index->entries[e].path);
+
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_CAN_header(header, version, 0, CAN_INDEX_PATHNAME,
+                                             CAN_INDEX_MODE, content_length);
+    block_io_write(can_file, header, header_length);
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, version, CAN_header_sum(version, header, header_length));
+
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        size_t path_length = strlen(entry->path);
+
+        uint8_t record[CAN_INDEX_ENTRY_BYTES + CAN_FLAGS_BYTES + 2 * CAN_MAX_SUM_BYTES +
+                       CAN_INDEX_TIME_BYTES];
+        put_bytes(record, entry->mode, CAN_MODE_LENGTH_BYTES);
+        put_bytes(record + 3, path_length, CAN_PATHNAME_LENGTH_BYTES);
+        put_bytes(record + 5, entry->content_length, CAN_CONTENT_LENGTH_BYTES);
+        put_bytes(record + 11, entry->payload, 8);
+        put_CAN_sum(record + 19, version, entry->header_hash);
+        put_CAN_sum(record + 19 + sum_bytes, version, entry->hash);
+        if (version == CAN_FORMAT_V2)
+            record[19 + 2 * sum_bytes] = entry->flags;
+        uint8_t *time = record + entry_bytes - CAN_INDEX_TIME_BYTES;
+        put_bytes(time, entry->mtime.tv_sec, 8);
+        put_bytes(time + 8, entry->mtime.tv_nsec, 4);
+
+        write_summed(can_file, &sum, record, entry_bytes);
+        write_summed(can_file, &sum, entry->path, path_length);
+    }
+
+    uint8_t footer[CAN_INDEX_FOOTER_BYTES];
+    put_bytes(footer, index_offset, 8);
+    put_bytes(footer + 8, index->count, 8);
+    memcpy(footer + 16, CAN_INDEX_TIMED_MAGIC, 8);
+    write_summed(can_file, &sum, footer, sizeof(footer));
+
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, version, CAN_sum_final(&sum));
+    block_io_write(can_file, trailer, sum_bytes);
+}
+
+
+struct CAN_Entry *append_CAN_entry(CAN_INDEX index) {
+    if (index->count == index->capacity) {
+        index->capacity = index->capacity ? index->capacity * 2 : 256;
+        index->entries = realloc(index->entries,
+                                 index->capacity * sizeof(struct CAN_Entry));
+        if (!index->entries)
+            handle_error("Failed to grow can index");
+    }
+
+    struct CAN_Entry *entry = &index->entries[index->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+
+void drop_replaced_CAN_entries(CAN_INDEX index) {
+    PATH_SET latest = new_path_set(index->count);
+    struct CAN_Entry *kept = malloc((index->count + 1) * sizeof(struct CAN_Entry));
+    char *chosen = calloc(index->count + 1, 1);
+    if (!kept || !chosen)
+        handle_error("Failed to allocate can index");
+
+    for (size_t e = 0; e < index->count; e++)
+        path_set_add(latest, index->entries[e].path, e);
+
+    // The latest CAN of a path takes the place
+    // of its first, so directories still come
+    // before what they hold.
+    size_t count = 0;
+    for (size_t e = 0; e < index->count; e++) {
+        size_t last;
+        char *path = index->entries[e].path;
+        path_set_find(latest, path, strlen(path), &last);
+        if (last == SIZE_MAX)
+            continue;
+
+        kept[count++] = index->entries[last];
+        chosen[last] = 1;
+        path_set_add(latest, path, SIZE_MAX);
+    }
+
+    for (size_t e = 0; e < index->count; e++) {
+        if (!chosen[e])
+            free(index->entries[e].path);
+    }
+
+    memcpy(index->entries, kept, count * sizeof(struct CAN_Entry));
+    index->count = count;
+
+    free_path_set(latest);
+    free(chosen);
+    free(kept);
+}
+
+
+int is_kept_mtime(struct timespec kept, struct timespec mtime) {
+    if (!kept.tv_sec && !kept.tv_nsec)
+        return 0;
+
+    return kept.tv_sec == mtime.tv_sec && kept.tv_nsec == mtime.tv_nsec;
+}
+
+
+void free_CAN_index(CAN_INDEX index) {
+    for (size_t e = 0; e < index->count; e++)
+        free(index->entries[e].path);
+
+    free(index->entries);
+    free(index);
+}
+
+
+/**
+* Bytes of an index entry before its
+* pathname in a can of the given version,
+* timed if the index keeps mtimes.
+*/
+static size_t index_entry_bytes(int version, int timed) {
+    size_t bytes = CAN_INDEX_ENTRY_BYTES + 2 * CAN_sum_bytes(version);
+    if (version == CAN_FORMAT_V2)
+        bytes += CAN_FLAGS_BYTES;
+    if (timed)
+        bytes += CAN_INDEX_TIME_BYTES;
+
+    return bytes;
+}
+
+
+/**
+* Loads the trailing index of a can of size
+* bytes if it holds an index CAN of the
+* given format version. An index from
+* before mtimes were kept loads with
+* them zero.
+*/
+static CAN_INDEX load_CAN_index(int fd, off_t size, int version) {
+    size_t sum_bytes = CAN_sum_bytes(version);
+
+    // The footer sits just before the
+    // index CAN's checksum.
+    uint8_t footer[CAN_INDEX_FOOTER_BYTES];
+    off_t footer_offset = size - sum_bytes - sizeof(footer);
+    if (footer_offset < 0)
+        return NULL;
+    if (pread(fd, footer, sizeof(footer), footer_offset) != (ssize_t) sizeof(footer))
+        return NULL;
+    int timed = memcmp(footer + 16, CAN_INDEX_TIMED_MAGIC, 8) == 0;
+    if (!timed && memcmp(footer + 16, CAN_INDEX_MAGIC, 8) != 0)
+        return NULL;
+    size_t entry_bytes = index_entry_bytes(version, timed);
+
+    off_t index_offset = get_bytes(footer, 8);
+    uint64_t count = get_bytes(footer + 8, 8);
+
+    size_t header_length = CAN_header_length(version, strlen(CAN_INDEX_PATHNAME));
+    if (index_offset < 0 ||
+        index_offset + (off_t) (header_length + sizeof(footer) + sum_bytes) > size)
+        return NULL;
+
+    size_t length = size - index_offset;
+    uint64_t content_length = length - header_length - sum_bytes;
+
+    uint8_t *buf = malloc(length);
+    if (!buf)
+        handle_error("Failed to allocate can index");
+    if (pread(fd, buf, length, index_offset) != (ssize_t) length)
+        handle_error("Failed to read can index");
+
+    // Only trust the footer if it really
+    // belongs to an index CAN.
+    uint8_t expected[CAN_MAX_HEADER_LENGTH];
+    encode_CAN_header(expected, version, 0, CAN_INDEX_PATHNAME, CAN_INDEX_MODE,
+                      content_length);
+    if (memcmp(buf, expected, header_length) != 0) {
+        free(buf);
+        return NULL;
+    }
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, version, CAN_header_sum(version, buf, header_length));
+    CAN_sum_update(&sum, buf + header_length, content_length);
+    if (CAN_sum_final(&sum) != get_CAN_sum(buf + length - sum_bytes, version))
+        handle_error("can index hash incorrect");
+
+    CAN_INDEX index = calloc(1, sizeof(*index));
+    if (!index)
+        handle_error("Failed to allocate can index");
+    index->end = index_offset;
+
+    uint8_t *record = buf + header_length;
+    uint8_t *table_end = buf + length - sum_bytes - sizeof(footer);
+    for (uint64_t e = 0; e < count; e++) {
+        if ((size_t) (table_end - record) < entry_bytes)
+            handle_error("can index corrupt");
+
+        size_t path_length = get_bytes(record + 3, CAN_PATHNAME_LENGTH_BYTES);
+        if ((size_t) (table_end - record) - entry_bytes < path_length)
+            handle_error("can index corrupt");
+
+        struct CAN_Entry *entry = append_CAN_entry(index);
+        entry->version = version;
+        entry->mode = get_bytes(record, CAN_MODE_LENGTH_BYTES);
+        entry->content_length = get_bytes(record + 5, CAN_CONTENT_LENGTH_BYTES);
+        entry->payload = get_bytes(record + 11, 8);
+        entry->header_hash = get_CAN_sum(record + 19, version);
+        entry->hash = get_CAN_sum(record + 19 + sum_bytes, version);
+        entry->flags = 0;
+        if (version == CAN_FORMAT_V2)
+            entry->flags = record[19 + 2 * sum_bytes];
+        entry->offset = entry->payload - CAN_header_length(version, path_length);
+        if (timed) {
+            uint8_t *time = record + entry_bytes - CAN_INDEX_TIME_BYTES;
+            entry->mtime.tv_sec = get_bytes(time, 8);
+            entry->mtime.tv_nsec = get_bytes(time + 8, 4);
+        }
+
+        // The index doesn't keep how much
+        // padding an aligned CAN has, nor
+        // how much of a prefixed CAN's
+        // pathname it stores.
+        if (entry->flags & (CAN_FLAG_ALIGNED | CAN_FLAG_PREFIXED))
+            entry->offset = -1;
+
+        entry->path = malloc(path_length + 1);
+        if (!entry->path)
+            handle_error("Failed to allocate can index");
+        memcpy(entry->path, record + entry_bytes, path_length);
+        entry->path[path_length] = '\0';
+
+        record += entry_bytes + path_length;
+    }
+
+    if (record != table_end)
+        handle_error("can index corrupt");
+
+    free(buf);
+    return index;
+}
+
+
+/**
+* Writes buf to the can and folds
+* its bytes into sum.
+*/
+static void write_summed(BLOCK_IO can_file, struct CAN_Sum *sum, const void *buf,
+                         size_t len) {
+    block_io_write(can_file, buf, len);
+    CAN_sum_update(sum, buf, len);
+}
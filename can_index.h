@@ -0,0 +1,136 @@
+#ifndef CAN_INDEX_H
+#define CAN_INDEX_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "block_io.h"
+
+// the trailing index is stored as the last
+// CAN of a can under this pathname
+#define CAN_INDEX_PATHNAME        ".crush_index"
+#define CAN_INDEX_MODE            0100444
+
+// bytes of each index entry before its header
+// and CAN checksums, which are as wide as the
+// can's format version uses, and pathname.
+// v2 entries also keep the CAN's flags.
+#define CAN_INDEX_ENTRY_BYTES     19
+
+// the index CAN's contents end with a footer of
+// the index CAN's offset, the entry count and
+// this magic value
+#define CAN_INDEX_MAGIC           "CRUSHIDX"
+#define CAN_INDEX_FOOTER_BYTES    24
+
+// an index ending with this magic instead keeps
+// the seconds and nanoseconds of the mtime of
+// each entry's file after the rest of its bytes
+#define CAN_INDEX_TIMED_MAGIC     "CRUSHIDT"
+#define CAN_INDEX_TIME_BYTES      12
+
+/**
+* Where one CAN lives in a can, along with
+* its header feilds and the hash of its
+* header and pathname so the rest of the
+* CAN can be checked on its own. hash is
+* only known when read from a trailing index,
+* and offset isn't for an aligned or prefixed
+* CAN read from one, being -1 instead. volume
+* is which volume of a multi-volume can
+* holds it, 0 for any other can. mtime is
+* when the file it holds was modified as
+* it was added, zero if the can didn't
+* keep it.
+*/
+struct CAN_Entry {
+    char *path;
+    int version;
+    int volume;
+    int flags;
+    long mode;
+    uint64_t content_length;
+    off_t offset;
+    off_t payload;
+    uint64_t header_hash;
+    uint64_t hash;
+    struct timespec mtime;
+};
+
+/**
+* Every CAN of a can in archive order.
+* end is the offset just past the last
+* member, where any index CAN starts.
+*/
+struct CAN_Index_Struct {
+    struct CAN_Entry *entries;
+    size_t count;
+    size_t capacity;
+    off_t end;
+};
+
+typedef struct CAN_Index_Struct *CAN_INDEX;
+
+
+/**
+* Builds an index by reading each header of the
+* can and seeking over its contents.
+*/
+CAN_INDEX scan_CAN_index(BLOCK_IO file_ptr);
+
+
+/**
+* Loads the trailing index of the can open on
+* fd, returning NULL if it doesn't have one.
+*/
+CAN_INDEX read_CAN_index(int fd);
+
+
+/**
+* Writes index as a CAN of the given format
+* version at the current end of the can,
+* keeping the mtime of every entry.
+*/
+void write_CAN_index(BLOCK_IO can_file, CAN_INDEX index, int version);
+
+
+/**
+* Returns 1 if a CAN with this path and
+* mode is a trailing index rather than
+* a member of the can.
+*/
+int is_index_CAN(char *path, long mode);
+
+
+/**
+* Drops every entry that a later entry
+* for the same pathname replaces, as
+* when a can has been appended to.
+*/
+void drop_replaced_CAN_entries(CAN_INDEX index);
+
+
+/**
+* Grows an index by one entry
+* and returns the new, zeroed entry.
+*/
+struct CAN_Entry *append_CAN_entry(CAN_INDEX index);
+
+
+/**
+* Returns 1 if kept, an entry's mtime, is
+* known and the same as mtime.
+*/
+int is_kept_mtime(struct timespec kept, struct timespec mtime);
+
+
+/**
+* Frees an index and its paths.
+*/
+void free_CAN_index(CAN_INDEX index);
+
+
+#endif
@@ -0,0 +1,156 @@
+/**
+* copy_range.c => Copying and checking can contents without reading them in
+*/
+
+
+// for copy_file_range
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+
+#include "block_io.h"
+#include "copy_range.h"
+#include "crush.h"
+#include "stats.h"
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static uint64_t clone_blocks(int can_fd, off_t offset, uint64_t length, int fd);
+static uint64_t kernel_copy(int can_fd, off_t offset, uint64_t length, int fd,
+                            off_t to);
+static void read_copy(int can_fd, off_t offset, uint64_t length, int fd, off_t to);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+void copy_range(int can_fd, off_t offset, uint64_t length, int fd) {
+    uint64_t done = clone_blocks(can_fd, offset, length, fd);
+    done += kernel_copy(can_fd, offset + done, length - done, fd, done);
+    if (done < length)
+        read_copy(can_fd, offset + done, length - done, fd, done);
+}
+
+
+void sum_mapped_range(struct CAN_Sum *sum, int can_fd, off_t offset,
+                      uint64_t length) {
+    // A map has to start on a page, which
+    // an aligned CAN's contents always do
+    // unless pages are bigger than CAN_ALIGN.
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t lead = offset % page;
+    offset -= lead;
+
+    while (length) {
+        size_t step = length < COPY_RANGE_MAP_BYTES ? length : COPY_RANGE_MAP_BYTES;
+
+        uint64_t since = stats_clock();
+        uint8_t *map = mmap(NULL, lead + step, PROT_READ, MAP_PRIVATE, can_fd, offset);
+        if (map == MAP_FAILED)
+            handle_error("Failed to map can");
+        madvise(map, lead + step, MADV_SEQUENTIAL);
+        stats_phase(STATS_READ, since);
+
+        CAN_sum_update(sum, map + lead, step);
+        munmap(map, lead + step);
+
+        offset += lead + step;
+        length -= step;
+        lead = 0;
+    }
+}
+
+
+/**
+* Clones the whole blocks at the start of
+* the range, returning how many bytes were
+* shared, 0 if the file system can't.
+*/
+static uint64_t clone_blocks(int can_fd, off_t offset, uint64_t length, int fd) {
+    struct file_clone_range range = {
+        .src_fd = can_fd,
+        .src_offset = offset,
+        .src_length = length & ~(uint64_t) (CAN_ALIGN - 1),
+        .dest_offset = 0,
+    };
+    if (!range.src_length || offset % CAN_ALIGN)
+        return 0;
+
+    uint64_t since = stats_clock();
+    int cloned = ioctl(fd, FICLONERANGE, &range) == 0;
+    stats_phase(STATS_WRITE, since);
+    stats_call(STATS_CALL_WRITE);
+
+    return cloned ? range.src_length : 0;
+}
+
+
+/**
+* Has the kernel copy the range from one
+* file to the other, returning how much it
+* did before it gave up, so whatever is
+* left can be copied by hand.
+*/
+static uint64_t kernel_copy(int can_fd, off_t offset, uint64_t length, int fd,
+                            off_t to) {
+    uint64_t done = 0;
+
+    while (done < length) {
+        loff_t from = offset + done;
+        loff_t into = to + done;
+
+        uint64_t since = stats_clock();
+        ssize_t put = copy_file_range(can_fd, &from, fd, &into, length - done, 0);
+        stats_phase(STATS_WRITE, since);
+        stats_call(STATS_CALL_WRITE);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                        errno == EOPNOTSUPP))
+            break;
+        if (put < 0)
+            handle_error("Failed to write file");
+        if (put == 0)
+            handle_error("Unexpected end of can");
+        done += put;
+    }
+
+    return done;
+}
+
+
+/**
+* Copies the range a block at a time
+* through a buffer of crush's own.
+*/
+static void read_copy(int can_fd, off_t offset, uint64_t length, int fd, off_t to) {
+    unsigned char *buf = malloc(BLOCK_IO_SIZE);
+    if (!buf)
+        handle_error("Failed to allocate block buffer");
+
+    if (lseek(fd, to, SEEK_SET) != to)
+        handle_error("Failed to seek file");
+
+    while (length) {
+        size_t step = length < BLOCK_IO_SIZE ? length : BLOCK_IO_SIZE;
+
+        uint64_t since = stats_clock();
+        ssize_t got = pread(can_fd, buf, step, offset);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read can");
+        if (got == 0)
+            handle_error("Unexpected end of can");
+
+        write_block(fd, buf, got);
+        offset += got;
+        length -= got;
+    }
+
+    free(buf);
+}
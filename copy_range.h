@@ -0,0 +1,35 @@
+#ifndef COPY_RANGE_H
+#define COPY_RANGE_H
+
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "can.h"
+
+// most of a can mapped at once while
+// checking contents through a map
+#define COPY_RANGE_MAP_BYTES      (1 << 28)
+
+/**
+* Copies length bytes from offset of the can
+* open on can_fd to the start of the empty
+* file fd, without reading them into crush.
+* Whole blocks are cloned when the file
+* system shares them, the rest is copied
+* by the kernel, and pread and write
+* take over when neither can.
+*/
+void copy_range(int can_fd, off_t offset, uint64_t length, int fd);
+
+
+/**
+* Adds length bytes from offset of the can
+* open on can_fd to sum by mapping them
+* rather than reading them.
+*/
+void sum_mapped_range(struct CAN_Sum *sum, int can_fd, off_t offset,
+                      uint64_t length);
+
+
+#endif
@@ -0,0 +1,726 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "can.h"
+#include "crush.h"
+#include "create_pool.h"
+#include "dedup.h"
+#include "pieces.h"
+#include "sparse.h"
+#include "stats.h"
+
+/**
+* One CAN waiting to be written. Unless it is
+* streamed the whole serialised CAN, header,
+* contents and hash, is built in data by a
+* reader thread. A chunked job instead has
+* just the file's contents in data, cut
+* into chunks ready for the writer to
+* deduplicate. A pieced file is queued as
+* a job per piece, holding the piece and
+* its checksum, the first after the CAN's
+* header, so readers load them at once.
+* A front coded job's pathname shares
+* shared bytes with the job before it.
+* key places the job's file on disk for
+* an ordered pool and number is its place
+* in the queue. claimed is set once a
+* reader takes it and hinted once the
+* kernel was asked to read it.
+*/
+struct Create_Job {
+    char *path;
+    struct stat st;
+    int version;
+    int flags;
+    uint64_t piece;
+    uint64_t pieces;
+    size_t shared;
+    size_t length;
+    size_t header_length;
+    size_t sum_bytes;
+    uint64_t header_hash;
+    uint64_t hash;
+    int streamed;
+    int chunked;
+    int done;
+    uint64_t key;
+    uint64_t number;
+    int claimed;
+    int hinted;
+    uint64_t load_time;
+    uint8_t *data;
+    struct Chunk_List chunks;
+    struct Create_Job *next;
+};
+
+struct Create_Pool_Struct {
+    CAN_WRITER writer;
+    size_t budget;
+    size_t in_flight;
+    int queued;
+    uint64_t numbered;
+    int closed;
+
+    // head is the next CAN to write, claim
+    // the next one a reader should load.
+    struct Create_Job *head;
+    struct Create_Job *tail;
+    struct Create_Job *claim;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+
+    int workers;
+    int order;
+
+    // Set once the filesystem turns out not
+    // to map extents, by the thread adding.
+    int no_extents;
+    pthread_t *readers;
+    pthread_t writer_id;
+
+    // Where the pieced CAN being written
+    // starts and the checksum of what it
+    // holds besides its pieces.
+    off_t pieced_payload;
+    struct CAN_Sum pieced_sum;
+
+    // The pathname of the last job queued,
+    // which the next is front coded on.
+    struct CAN_Path last;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static struct Create_Job *new_job(char *path, struct stat *s);
+static void queue_job(CREATE_POOL pool, struct Create_Job *job);
+static void queue_pieces(CREATE_POOL pool, char *path, struct stat *s, size_t shared);
+static uint64_t order_key(CREATE_POOL pool, char *path, struct stat *s);
+static struct Create_Job *nearest_job(CREATE_POOL pool, struct Create_Job *first,
+                                      char **hints);
+static void hint_reads(char **hints);
+static void *reader_thread(void *arg);
+static void *writer_thread(void *arg);
+static void write_piece(CREATE_POOL pool, struct Create_Job *job);
+static void load_job(struct Create_Job *job);
+static void load_piece(struct Create_Job *job);
+static void read_contents(struct Create_Job *job, uint8_t *dst, size_t content_length,
+                          off_t offset);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+CREATE_POOL create_pool_start(CAN_WRITER writer, int workers, size_t budget,
+                              int order) {
+    CREATE_POOL pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        handle_error("Failed to allocate create pool");
+
+    pool->writer = writer;
+    pool->last = writer->last;
+    pool->budget = budget;
+    pool->workers = workers;
+    pool->order = order;
+    pool->readers = calloc(workers, sizeof(pthread_t));
+    if (!pool->readers)
+        handle_error("Failed to allocate create pool");
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_cond_init(&pool->room, NULL);
+
+    for (int w = 0; w < workers; w++) {
+        if (pthread_create(&pool->readers[w], NULL, reader_thread, pool) != 0)
+            handle_error("Failed to start reader thread");
+    }
+
+    if (pthread_create(&pool->writer_id, NULL, writer_thread, pool) != 0)
+        handle_error("Failed to start writer thread");
+
+    return pool;
+}
+
+
+void create_pool_add(void *pool_ptr, char *path, struct stat *s) {
+    CREATE_POOL pool = pool_ptr;
+    CAN_WRITER writer = pool->writer;
+    printf("Adding: %s\n", path);
+
+    // Jobs are written in the order they are
+    // queued, so they can be front coded now.
+    size_t shared = 0;
+    if (writer->prefixed)
+        shared = front_code_CAN_path(&pool->last, path);
+
+    // Files that may be stored sparse or
+    // chunked never are pieced, nor are
+    // pieces bigger than the budget.
+    if (is_pieced(writer, s) && !writer->chunks &&
+        !(writer->sparse && may_be_sparse(s)) &&
+        CAN_MAX_HEADER_LENGTH + PIECES_HEADER_BYTES + CAN_PIECE_BYTES +
+        CAN_SUM64_BYTES <= pool->budget) {
+        queue_pieces(pool, path, s, shared);
+        return;
+    }
+
+    struct Create_Job *job = new_job(path, s);
+    job->shared = shared;
+    if (shared)
+        job->flags = CAN_FLAG_PREFIXED;
+
+    // Header, contents and the trailing hash.
+    job->version = pool->writer->version;
+    job->header_length = CAN_header_length(job->version,
+                                           CAN_stored_path_length(path, shared));
+    job->sum_bytes = CAN_sum_bytes(job->version);
+    job->length = job->header_length + job->sum_bytes;
+    if (!S_ISDIR(s->st_mode))
+        job->length += s->st_size;
+
+    // Anything that can never fit in the
+    // budget is left for the writer to
+    // stream straight into the can.
+    job->streamed = job->length > pool->budget;
+
+    // As are files that may have holes,
+    // so only their data is read.
+    if (pool->writer->sparse && may_be_sparse(s))
+        job->streamed = 1;
+    job->chunked = pool->writer->chunks && !S_ISDIR(s->st_mode) && s->st_size;
+
+    // The padding before aligned contents
+    // depends on where the CAN lands, so
+    // the writer adds it.
+    if (pool->writer->aligned && !job->chunked && !S_ISDIR(s->st_mode) && s->st_size)
+        job->flags |= CAN_FLAG_ALIGNED;
+
+    if (pool->order && !job->streamed)
+        job->key = order_key(pool, path, s);
+
+    queue_job(pool, job);
+}
+
+
+void create_pool_finish(CREATE_POOL pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int w = 0; w < pool->workers; w++)
+        pthread_join(pool->readers[w], NULL);
+    pthread_join(pool->writer_id, NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->room);
+    free(pool->readers);
+    free(pool);
+}
+
+
+static struct Create_Job *new_job(char *path, struct stat *s) {
+    struct Create_Job *job = calloc(1, sizeof(*job));
+    if (!job)
+        handle_error("Failed to allocate create job");
+
+    job->path = strdup(path);
+    job->st = *s;
+    return job;
+}
+
+
+/**
+* Adds a job to the end of the queue,
+* waiting for room first.
+*/
+static void queue_job(CREATE_POOL pool, struct Create_Job *job) {
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->queued >= CREATE_POOL_MAX_QUEUED)
+        pthread_cond_wait(&pool->room, &pool->lock);
+
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+
+    if (!pool->claim)
+        pool->claim = job;
+    pool->queued++;
+    job->number = pool->numbered++;
+
+    pthread_cond_broadcast(&pool->work);
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+* Queues a job for each piece of a file.
+* Every piece's checksum is seeded from
+* the header, which is known up front.
+*/
+static void queue_pieces(CREATE_POOL pool, char *path, struct stat *s, size_t shared) {
+    uint64_t size = s->st_size;
+    uint64_t content_length = pieces_length(size, CAN_PIECE_BYTES);
+    if (content_length > CAN_MAX_CONTENT_LENGTH)
+        handle_error("File too large for a CAN");
+
+    int flags = CAN_FLAG_PIECED;
+    if (shared)
+        flags |= CAN_FLAG_PREFIXED;
+
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_prefixed_CAN_header(header, CAN_FORMAT_V2, flags,
+                                                      shared, path, s->st_mode,
+                                                      content_length);
+    uint64_t header_hash = CAN_header_sum(CAN_FORMAT_V2, header, header_length);
+
+    // Pieces share their file's key, so an
+    // ordered pool still loads them in turn.
+    uint64_t key = pool->order ? order_key(pool, path, s) : 0;
+
+    uint64_t pieces = pieces_count(size, CAN_PIECE_BYTES);
+    for (uint64_t piece = 0; piece < pieces; piece++) {
+        struct Create_Job *job = new_job(path, s);
+        job->version = CAN_FORMAT_V2;
+        job->flags = flags;
+        job->shared = shared;
+        job->piece = piece;
+        job->pieces = pieces;
+        job->header_length = header_length;
+        job->header_hash = header_hash;
+        job->sum_bytes = CAN_SUM64_BYTES;
+        job->key = key;
+        job->length = piece_length(size, CAN_PIECE_BYTES, piece) + CAN_SUM64_BYTES;
+        if (piece == 0)
+            job->length += header_length + PIECES_HEADER_BYTES;
+
+        queue_job(pool, job);
+    }
+}
+
+
+/**
+* Where a file sits on disk, for an ordered
+* pool: its inode number, or the physical
+* offset of its first extent. A file with
+* no extents yet, being empty or held
+* inline, costs no seek and goes first,
+* as does anything that isn't a file.
+* If the filesystem can't map extents
+* the pool falls back to inode order,
+* the best guess at layout left.
+*/
+static uint64_t order_key(CREATE_POOL pool, char *path, struct stat *s) {
+    if (pool->order == CREATE_POOL_ORDER_INODE || pool->no_extents)
+        return s->st_ino;
+    if (!S_ISREG(s->st_mode))
+        return 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    stats_call(STATS_CALL_OPEN);
+
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+
+    uint64_t key = 0;
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) != 0)
+        pool->no_extents = 1;
+    else if (request.map.fm_mapped_extents)
+        key = request.extent.fe_physical;
+
+    close(fd);
+    stats_call(STATS_CALL_CLOSE);
+
+    return pool->no_extents ? s->st_ino : key;
+}
+
+
+/**
+* Picks the unclaimed job with the lowest key
+* among those from first on whose lengths,
+* all together, fit what is left of the
+* budget. Loading any of them leaves room
+* for the ones before it, so the writer's
+* next job is never starved, and none are
+* more than CREATE_POOL_ORDER_WINDOW jobs
+* past it, so it is never kept waiting
+* long either. The next
+* CREATE_POOL_HINT_AHEAD jobs by key not
+* hinted yet have their paths copied to
+* hints, NULL after the last.
+*/
+static struct Create_Job *nearest_job(CREATE_POOL pool, struct Create_Job *first,
+                                      char **hints) {
+    struct Create_Job *ahead[CREATE_POOL_HINT_AHEAD + 1];
+    int count = 0;
+    size_t room = pool->budget - pool->in_flight;
+    size_t wanted = 0;
+
+    uint64_t last = pool->head->number + CREATE_POOL_ORDER_WINDOW;
+    for (struct Create_Job *job = first; job && job->number < last; job = job->next) {
+        if (job->streamed || job->claimed)
+            continue;
+        wanted += job->length;
+        if (wanted > room)
+            break;
+
+        // Keep the lowest keys in order, the
+        // first queued winning a tie.
+        if (count < CREATE_POOL_HINT_AHEAD + 1)
+            count++;
+        else if (job->key >= ahead[count - 1]->key)
+            continue;
+
+        int at = count - 1;
+        for (; at > 0 && ahead[at - 1]->key > job->key; at--)
+            ahead[at] = ahead[at - 1];
+        ahead[at] = job;
+    }
+
+    int hinted = 0;
+    for (int a = 1; a < count; a++) {
+        if (ahead[a]->hinted || S_ISDIR(ahead[a]->st.st_mode))
+            continue;
+        ahead[a]->hinted = 1;
+        hints[hinted++] = strdup(ahead[a]->path);
+    }
+    hints[hinted] = NULL;
+
+    // Nothing fits, so wait on the
+    // first job as an unordered
+    // pool would.
+    return count ? ahead[0] : first;
+}
+
+
+/**
+* Asks the kernel to start reading each
+* file named in hints, freeing the names.
+*/
+static void hint_reads(char **hints) {
+    for (int h = 0; hints[h]; h++) {
+        int fd = open(hints[h], O_RDONLY);
+        if (fd >= 0) {
+            stats_call(STATS_CALL_OPEN);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+            stats_call(STATS_CALL_CLOSE);
+        }
+        free(hints[h]);
+    }
+}
+
+
+/**
+* Claims jobs in the order they were queued,
+* waiting for room in the budget before
+* loading each one. Claiming in order means
+* the writer's next job is always either
+* loaded or being loaded. An ordered pool
+* claims the nearest job on disk instead,
+* hinting the ones after it.
+*/
+static void *reader_thread(void *arg) {
+    CREATE_POOL pool = arg;
+    char *hints[CREATE_POOL_HINT_AHEAD + 1] = {NULL};
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct Create_Job *job = pool->claim;
+
+        if (job && (job->streamed || job->claimed)) {
+            pool->claim = job->next;
+            continue;
+        }
+
+        if (job && pool->order)
+            job = nearest_job(pool, job, hints);
+
+        if (!job || pool->in_flight + job->length > pool->budget) {
+            if (!job && pool->closed)
+                break;
+            pthread_cond_wait(&pool->work, &pool->lock);
+            continue;
+        }
+
+        if (pool->claim == job)
+            pool->claim = job->next;
+        job->claimed = 1;
+        pool->in_flight += job->length;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool->order)
+            hint_reads(hints);
+
+        uint64_t since = stats_clock();
+        load_job(job);
+        job->load_time = stats_clock() - since;
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/**
+* Writes jobs to the can in queue order,
+* streaming any job too large for the
+* budget directly from its file.
+*/
+static void *writer_thread(void *arg) {
+    CREATE_POOL pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        struct Create_Job *job = pool->head;
+
+        if (!job || (!job->streamed && !job->done)) {
+            if (!job && pool->closed)
+                break;
+            pthread_cond_wait(&pool->ready, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        // A loaded job's time counts
+        // from when it was read.
+        uint64_t since = stats_clock() - job->load_time;
+
+        // Loaded CANs were front coded when
+        // queued, the writer only follows on
+        // for the CANs it names itself.
+        if (pool->writer->prefixed && !job->streamed && !job->chunked && !job->piece)
+            front_code_CAN_path(&pool->writer->last, job->path);
+        if (job->streamed) {
+            write_loaded_file(pool->writer, job->path, &job->st, NULL);
+        } else if (job->flags & CAN_FLAG_PIECED) {
+            write_piece(pool, job);
+        } else if (job->chunked) {
+            write_deduped_file(pool->writer, job->path, &job->st, &job->chunks,
+                               job->data);
+            free_chunk_list(&job->chunks);
+        } else {
+            BLOCK_IO can_file = pool->writer->io;
+            off_t offset = block_io_tell(can_file);
+            block_io_write(can_file, job->data, job->header_length);
+            write_CAN_pad(can_file, job->flags);
+            off_t payload = block_io_tell(can_file);
+            block_io_write(can_file, job->data + job->header_length,
+                           job->length - job->header_length);
+
+            struct CAN_Entry entry = {
+                .path = job->path,
+                .flags = job->flags,
+                .mode = job->st.st_mode,
+                .content_length = job->length - job->header_length - job->sum_bytes,
+                .offset = offset,
+                .payload = payload,
+                .header_hash = job->header_hash,
+                .hash = job->hash,
+                .mtime = job->st.st_mtim,
+            };
+            record_CAN(pool->writer, &entry);
+        }
+        // A pieced file counts once, when
+        // its last piece is written.
+        if (!job->streamed && job->piece + 1 >= job->pieces)
+            stats_entry(job->path, S_ISDIR(job->st.st_mode) ? 0 : job->st.st_size,
+                        since);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+        if (pool->claim == job)
+            pool->claim = job->next;
+        if (!job->streamed)
+            pool->in_flight -= job->length;
+        pool->queued--;
+
+        pthread_cond_broadcast(&pool->work);
+        pthread_cond_signal(&pool->room);
+
+        free(job->data);
+        free(job->path);
+        free(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/**
+* Writes a loaded piece, starting its CAN
+* with the first and finishing it with the
+* last. The CAN's checksum takes in each
+* piece's checksum rather than its bytes.
+*/
+static void write_piece(CREATE_POOL pool, struct Create_Job *job) {
+    BLOCK_IO can_file = pool->writer->io;
+
+    if (job->piece == 0) {
+        pool->pieced_payload = block_io_tell(can_file) + job->header_length;
+        CAN_sum_start(&pool->pieced_sum, CAN_FORMAT_V2, job->header_hash);
+        CAN_sum_update(&pool->pieced_sum, job->data + job->header_length,
+                       PIECES_HEADER_BYTES);
+    }
+
+    block_io_write(can_file, job->data, job->length);
+    CAN_sum_update(&pool->pieced_sum, job->data + job->length - CAN_SUM64_BYTES,
+                   CAN_SUM64_BYTES);
+    if (job->piece + 1 < job->pieces)
+        return;
+
+    uint64_t hash = CAN_sum_final(&pool->pieced_sum);
+    uint8_t trailer[CAN_SUM64_BYTES];
+    put_CAN_sum(trailer, CAN_FORMAT_V2, hash);
+    block_io_write(can_file, trailer, CAN_SUM64_BYTES);
+
+    struct CAN_Entry entry = {
+        .path = job->path,
+        .flags = job->flags,
+        .mode = job->st.st_mode,
+        .content_length = pieces_length(job->st.st_size, CAN_PIECE_BYTES),
+        .offset = pool->pieced_payload - job->header_length,
+        .payload = pool->pieced_payload,
+        .header_hash = job->header_hash,
+        .hash = hash,
+        .mtime = job->st.st_mtim,
+    };
+    record_CAN(pool->writer, &entry);
+}
+
+
+/**
+* Serialises a whole CAN into job->data,
+* reading the file's contents with pread
+* and hashing everything in one pass.
+*/
+static void load_job(struct Create_Job *job) {
+    size_t header_length = job->header_length;
+    size_t content_length = job->length - header_length - job->sum_bytes;
+
+    if (job->flags & CAN_FLAG_PIECED) {
+        load_piece(job);
+        return;
+    }
+
+    if (job->chunked) {
+        job->data = malloc(content_length);
+        if (!job->data)
+            handle_error("Failed to allocate file buffer");
+
+        read_contents(job, job->data, content_length, 0);
+        chunk_buffer(&job->chunks, job->data, content_length);
+        return;
+    }
+
+    job->data = malloc(job->length);
+    if (!job->data)
+        handle_error("Failed to allocate file buffer");
+
+    encode_prefixed_CAN_header(job->data, job->version, job->flags, job->shared,
+                               job->path, job->st.st_mode, content_length);
+
+    if (content_length)
+        read_contents(job, job->data + header_length, content_length, 0);
+
+    job->header_hash = CAN_header_sum(job->version, job->data, header_length);
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, job->version, job->header_hash);
+    CAN_sum_update(&sum, job->data + header_length, content_length);
+    job->hash = CAN_sum_final(&sum);
+    put_CAN_sum(job->data + header_length + content_length, job->version,
+                job->hash);
+}
+
+
+/**
+* Reads one piece of a file into job->data
+* with its checksum after it, and the CAN's
+* header first if it is the first piece.
+*/
+static void load_piece(struct Create_Job *job) {
+    uint64_t size = job->st.st_size;
+    job->data = malloc(job->length);
+    if (!job->data)
+        handle_error("Failed to allocate file buffer");
+
+    uint8_t *dst = job->data;
+    if (job->piece == 0) {
+        encode_prefixed_CAN_header(dst, CAN_FORMAT_V2, job->flags, job->shared,
+                                   job->path, job->st.st_mode,
+                                   pieces_length(size, CAN_PIECE_BYTES));
+        dst += job->header_length;
+        put_pieces_header(dst, size, CAN_PIECE_BYTES);
+        dst += PIECES_HEADER_BYTES;
+    }
+
+    size_t length = piece_length(size, CAN_PIECE_BYTES, job->piece);
+    read_contents(job, dst, length, job->piece * CAN_PIECE_BYTES);
+
+    struct CAN_Sum sum;
+    piece_sum_start(&sum, job->header_hash, job->piece);
+    CAN_sum_update(&sum, dst, length);
+    put_CAN_sum(dst + length, CAN_FORMAT_V2, CAN_sum_final(&sum));
+}
+
+
+/**
+* preads exactly content_length bytes of a
+* job's file, from offset on, into dst.
+*/
+static void read_contents(struct Create_Job *job, uint8_t *dst, size_t content_length,
+                          off_t offset) {
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0)
+        handle_error("Failed to open file steam");
+    stats_call(STATS_CALL_OPEN);
+
+    size_t done = 0;
+    while (done < content_length) {
+        uint64_t since = stats_clock();
+        ssize_t got = pread(fd, dst + done, content_length - done, offset + done);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read file");
+        if (got == 0)
+            handle_error("File changed size while archiving");
+        done += got;
+    }
+
+    close(fd);
+    stats_call(STATS_CALL_CLOSE);
+}
@@ -0,0 +1,70 @@
+#ifndef CREATE_POOL_H
+#define CREATE_POOL_H
+
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "can.h"
+
+// default cap on file contents held in memory
+#define CREATE_POOL_DEFAULT_BUDGET  (256UL << 20)
+
+// most CANs the walker may queue ahead of the writer
+#define CREATE_POOL_MAX_QUEUED      65536
+
+// the order readers load queued files in, as
+// queued, by inode number or by where the
+// filesystem put the start of each file
+#define CREATE_POOL_ORDER_QUEUE     0
+#define CREATE_POOL_ORDER_INODE     1
+#define CREATE_POOL_ORDER_EXTENT    2
+
+// how far past the writer's next CAN an
+// ordered reader may load, and how many
+// files past the one it takes it asks
+// the kernel to start reading
+#define CREATE_POOL_ORDER_WINDOW    1024
+#define CREATE_POOL_HINT_AHEAD      4
+
+/**
+* A pool of reader threads which load and hash
+* file contents ahead of a single writer thread.
+* The writer emits CANs in the order they were
+* added so the can matches a single threaded
+* create byte for byte.
+*/
+typedef struct Create_Pool_Struct *CREATE_POOL;
+
+
+/**
+* Starts workers reader threads and the writer
+* thread for writer. At most budget bytes of
+* file contents are buffered at once, larger
+* files are streamed by the writer itself.
+* Unless order is CREATE_POOL_ORDER_QUEUE,
+* readers load the queued file nearest the
+* start of the disk that fits the budget,
+* so reads sweep across it rather than
+* seeking, while the writer still
+* writes CANs in queue order.
+*/
+CREATE_POOL create_pool_start(CAN_WRITER writer, int workers, size_t budget,
+                              int order);
+
+
+/**
+* A CAN_EMIT which queues path for the
+* pool passed as pool.
+*/
+void create_pool_add(void *pool, char *path, struct stat *s);
+
+
+/**
+* Waits for every queued CAN to be written
+* and stops the pool's threads.
+*/
+void create_pool_finish(CREATE_POOL pool);
+
+
+#endif
@@ -4,72 +4,166 @@
 */
 
 
-#include "can.h"
-
-// the first byte of every CAN has this value
-#define CAN_MAGIC_NUMBER          0x42
-
-// number of bytes in fixed-length CAN fields
-#define CAN_MAGIC_NUMBER_BYTES    1
-#define CAN_MODE_LENGTH_BYTES     3
-#define CAN_PATHNAME_LENGTH_BYTES 2
-#define CAN_CONTENT_LENGTH_BYTES  6
-#define CAN_HASH_BYTES            1
-
-// maximum number of bytes in variable-length CAN fields
-#define CAN_MAX_PATHNAME_LENGTH   65535
-#define CAN_MAX_CONTENT_LENGTH    281474976710655
+#include <getopt.h>
 
-
-// ADD YOUR #defines HERE
+#include "can.h"
+#include "crush.h"
+#include "create_pool.h"
+#include "can_index.h"
+#include "extract_pool.h"
+#include "match.h"
+#include "crusher.h"
+#include "verify.h"
+#include "dedup.h"
+#include "batch_io.h"
+#include "libcan.h"
+#include "stats.h"
+#include "delta.h"
+#include "volume.h"
+
+
+// a can pathname meaning stdin,
+// or stdout when creating
+#define STDIO_PATHNAME            "-"
+
+// getopt values of --stats and --base,
+// which have no short options
+#define STATS_OPTION              256
+#define BASE_OPTION               257
 
 
 typedef enum action {
     a_invalid,
     a_list,
     a_extract,
-    a_create
+    a_create,
+    a_verify
 } action_t;
 
 
-void usage(char *myname);
-action_t process_arguments(int argc, char *argv[], char **can_pathname,
-                           char ***pathnames, int *compress_can);
-void list_can(char *can_pathname);
-void extract_can(char *can_pathname);
-void create_can(char *can_pathname, char *pathnames[], int compress_can);
-uint8_t crush_hash(uint8_t hash, uint8_t byte);
+/**
+* Settings gathered from the command
+* line for the chosen action.
+*/
+struct options {
+    char *can_pathname;
+    char **pathnames;
+    int compress_can;
+    int jobs;
+    size_t budget;
+    int with_index;
+    int format;
+    int dedup;
+    int sparse;
+    int aligned;
+    int prefixed;
+    int check;
+    int append;
+    int update;
+    int ring;
+    int to_stdout;
+    int stats;
+    int stats_json;
+    char **bases;
+    int base_count;
+    int volumes;
+    uint64_t volume_bytes;
+    int order;
+};
+
+
+/**
+* How extract_stream is to extract a can,
+* each field as described there. out_fd
+* is -1 when unused.
+*/
+struct Extract_Options {
+    PATH_MATCHER matcher;
+    PATH_SET latest;
+    size_t link;
+    PATH_SET newest;
+    BATCH_IO batch;
+    int out_fd;
+    int check;
+};
+
+/**
+* Wraps the emit of a -u run, passing on
+* only paths that are new, or that
+* is_unchanged_file says differ from
+* their latest CAN.
+*/
+struct Update_Filter {
+    CAN_EMIT emit;
+    void *ctx;
+    CAN_INDEX existing;
+    PATH_SET latest;
+    struct Delta_Entry *kept;
+};
 
 
-////////////////////////////////////////////////////////////////////////////////
-void handle_error(char *error_desc);
-////////////////////////////////////////////////////////////////////////////////
+void usage(char *myname);
+action_t process_arguments(int argc, char *argv[], struct options *opts);
+void list_can(struct options *opts);
+void extract_can(struct options *opts);
+void create_can(struct options *opts);
+void verify_can(struct options *opts);
+static void extract_stream(BLOCK_IO file_ptr, struct Extract_Options *how);
+static void extract_volumes(struct options *opts, int fd);
+static void extract_chain(struct options *opts);
+static void remove_deleted_entries(CAN_INDEX index);
+static PATH_SET newest_payloads(int fd);
+static void add_pathnames(struct options *opts, CAN_EMIT emit, void *ctx);
+static void create_volumes(struct options *opts);
+static void list_index(int *fds, CAN_INDEX index, uint64_t *totals);
+static void list_CAN(long mode, uint64_t size, char *path_name, uint64_t stored,
+                     int sized, uint64_t *totals, uint64_t since);
+static void list_deleted(long mode, char *path_name, uint64_t since);
+static void list_stream(CAN_READER reader, uint64_t *totals);
+static int worker_threads(struct options *opts);
+static int open_can_input(char *can_pathname);
+static int take_stdout(void);
+static CAN_INDEX open_existing_can(int fd, struct options *opts);
+static void start_update(struct Update_Filter *filter, int fd, CAN_INDEX existing);
+static void update_emit(void *ctx, char *path, struct stat *s);
 
 
 int main(int argc, char *argv[]) {
-    char *can_pathname = NULL;
-    char **pathnames = NULL;
-    int compress_can = 0;
-    action_t action = process_arguments(argc, argv, &can_pathname, &pathnames,
-                                        &compress_can);
+    struct options opts = {
+        .jobs = 1,
+        .budget = CREATE_POOL_DEFAULT_BUDGET,
+        .format = CAN_DEFAULT_FORMAT,
+        .check = CAN_CHECK_MMAP,
+    };
+    action_t action = process_arguments(argc, argv, &opts);
+    if (opts.stats && action != a_invalid)
+        stats_enable();
 
     switch (action) {
     case a_list:
-        list_can(can_pathname);
+        list_can(&opts);
         break;
 
     case a_extract:
-        extract_can(can_pathname);
+        extract_can(&opts);
         break;
 
     case a_create:
-        create_can(can_pathname, pathnames, compress_can);
+        create_can(&opts);
+        break;
+
+    case a_verify:
+        verify_can(&opts);
         break;
 
     default:
         usage(argv[0]);
     }
 
+    // Stats go to stderr, clear
+    // of a can on stdout.
+    stats_report(stderr, opts.stats_json);
+    free(opts.bases);
     return 0;
 }
 
@@ -77,45 +171,206 @@ int main(int argc, char *argv[]) {
 
 void usage(char *myname) {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "\t%s -l <can-file>\n", myname);
-    fprintf(stderr, "\t%s -x <can-file>\n", myname);
-    fprintf(stderr, "\t%s [-z] -c <can-file> pathnames [...]\n", myname);
+    fprintf(stderr, "\t%s [-j jobs] -l <can-file>\n", myname);
+    fprintf(stderr, "\t%s [-r] [-j jobs] [-H off|mmap] -x <can-file> "
+                    "[pathnames-or-globs ...]\n", myname);
+    fprintf(stderr, "\t%s -O -x <can-file> [pathnames-or-globs ...]\n", myname);
+    fprintf(stderr, "\t%s [-j jobs] -t <can-file>\n", myname);
+    fprintf(stderr, "\t%s [-z] [-i] [-d] [-s] [-A] [-P] [-r] [-f format] [-j jobs] "
+                    "[-b budget-MiB]\n\t\t[-L inode|extent] -c <can-file> pathnames [...]\n",
+            myname);
+    fprintf(stderr, "\t%s [-i] [-d] [-s] [-A] [-P] [-r] [-j jobs] [-b budget-MiB] "
+                    "[-L inode|extent]\n\t\t-a|-u <can-file> pathnames [...]\n", myname);
+    fprintf(stderr, "\t%s [-d] [-s] [-A] [-P] [-f format] [-j jobs] [-b budget-MiB] "
+                    "-V volumes|-S volume-MiB\n\t\t-c <can-file> pathnames [...]\n",
+            myname);
+    fprintf(stderr, "\t%s [options] -c <can-file> --base <can-file> [--base ...] "
+                    "pathnames [...]\n", myname);
+    fprintf(stderr, "\t%s [-r] [-H off|mmap] -x <can-file> --base <can-file> "
+                    "[--base ...]\n", myname);
+    fprintf(stderr, "A <can-file> of - reads stdin, or writes stdout with -c.\n");
+    fprintf(stderr, "-O writes only the latest version of each file, so it "
+                    "stops at a file\nreplaced by -a or -u in a can read "
+                    "from a pipe.\n");
+    fprintf(stderr, "-A starts file contents on %d byte boundaries so -x can copy "
+                    "them\nwithout reading them, checking them as -H says.\n",
+            CAN_ALIGN);
+    fprintf(stderr, "-P walks directories in name order and stores each pathname "
+                    "as what\nit shares with the one before and the rest.\n");
+    fprintf(stderr, "-L reads files in inode order or where their first extent "
+                    "lies on disk,\nhinting the next ones, while CANs keep the "
+                    "order the walk found.\n");
+    fprintf(stderr, "-V and -S write <can-file> as a manifest of volumes beside it, "
+                    "filled at\nonce, which -l, -x and -t read at once.\n");
+    fprintf(stderr, "--base makes -c store only what changed since the chain of "
+                    "cans given,\noldest first, with deleted CANs for what is gone, "
+                    "and -x restore the\nchain ending in <can-file> in one pass.\n");
+    fprintf(stderr, "Any action takes --stats or --stats=json to report where "
+                    "its time went on stderr.\n");
     exit(1);
 }
 
 // process command-line arguments
 // check we have a valid set of arguments
 // and return appropriate action
-// *can_pathname set to pathname for canfile
-// *pathname and *compress_can set for create action
-
-action_t process_arguments(int argc, char *argv[], char **can_pathname,
-                           char ***pathnames, int *compress_can) {
+// opts->can_pathname set to pathname for canfile
+// opts->pathnames, compress_can, with_index,
+// format, dedup, sparse, aligned, prefixed, jobs and budget set for create action
+// opts->append set for -a and -u, opts->update for -u
+// opts->ring set to batch small files through io_uring
+// opts->pathnames set to any members to extract
+// opts->to_stdout set to write their contents to stdout
+// opts->check set to how copied aligned contents are checked
+// opts->stats set by --stats, and opts->stats_json by --stats=json
+// opts->bases and base_count set to the chain of cans given by --base
+// opts->volumes set by -V, and opts->volume_bytes by -S, to write volumes
+// opts->order set by -L to the order files are read in
+
+action_t process_arguments(int argc, char *argv[], struct options *opts) {
     extern char *optarg;
     extern int optind, optopt;
     int create_can_flag = 0;
     int extract_can_flag = 0;
     int list_can_flag = 0;
+    int verify_can_flag = 0;
     int opt;
-    while ((opt = getopt(argc, argv, ":l:c:x:z")) != -1) {
+    char *end;
+    static struct option long_options[] = {
+        {"stats", optional_argument, NULL, STATS_OPTION},
+        {"base", required_argument, NULL, BASE_OPTION},
+        {NULL, 0, NULL, 0},
+    };
+
+    // Every --base could be
+    // an argument of its own.
+    opts->bases = malloc(argc * sizeof(char *));
+    if (!opts->bases)
+        handle_error("Failed to allocate base cans");
+
+    while ((opt = getopt_long(argc, argv, ":l:c:a:u:x:t:zidsAPrOH:j:b:f:V:S:L:",
+                              long_options, NULL)) != -1) {
         switch (opt) {
         case 'c':
             create_can_flag++;
-            *can_pathname = optarg;
+            opts->can_pathname = optarg;
+            break;
+
+        case 'u':
+            opts->update++;
+            // fall through
+
+        case 'a':
+            create_can_flag++;
+            opts->append++;
+            opts->can_pathname = optarg;
             break;
 
         case 'x':
             extract_can_flag++;
-            *can_pathname = optarg;
+            opts->can_pathname = optarg;
             break;
 
         case 'l':
             list_can_flag++;
-            *can_pathname = optarg;
+            opts->can_pathname = optarg;
+            break;
+
+        case 't':
+            verify_can_flag++;
+            opts->can_pathname = optarg;
             break;
 
         case 'z':
-            (*compress_can)++;
+            opts->compress_can++;
+            break;
+
+        case 'i':
+            opts->with_index++;
+            break;
+
+        case 'd':
+            opts->dedup++;
+            break;
+
+        case 's':
+            opts->sparse++;
+            break;
+
+        case 'A':
+            opts->aligned++;
+            break;
+
+        case 'P':
+            opts->prefixed++;
+            break;
+
+        case 'r':
+            opts->ring++;
+            break;
+
+        case 'O':
+            opts->to_stdout++;
+            break;
+
+        case 'H':
+            if (strcmp(optarg, "off") == 0)
+                opts->check = CAN_CHECK_OFF;
+            else if (strcmp(optarg, "mmap") == 0)
+                opts->check = CAN_CHECK_MMAP;
+            else
+                return a_invalid;
+            break;
+
+        case 'L':
+            if (strcmp(optarg, "inode") == 0)
+                opts->order = CREATE_POOL_ORDER_INODE;
+            else if (strcmp(optarg, "extent") == 0)
+                opts->order = CREATE_POOL_ORDER_EXTENT;
+            else
+                return a_invalid;
+            break;
+
+        case 'j':
+            opts->jobs = strtol(optarg, &end, 10);
+            if (*end || opts->jobs < 1)
+                return a_invalid;
+            break;
+
+        case 'b':
+            opts->budget = strtoul(optarg, &end, 10) << 20;
+            if (*end || opts->budget == 0)
+                return a_invalid;
+            break;
+
+        case 'V':
+            opts->volumes = strtol(optarg, &end, 10);
+            if (*end || opts->volumes < 1 || opts->volumes > VOLUME_MAX_COUNT)
+                return a_invalid;
+            break;
+
+        case 'S':
+            opts->volume_bytes = strtoull(optarg, &end, 10) << 20;
+            if (*end || opts->volume_bytes == 0)
+                return a_invalid;
+            break;
+
+        case 'f':
+            opts->format = strtol(optarg, &end, 10);
+            if (*end || (opts->format != CAN_FORMAT_V1 &&
+                         opts->format != CAN_FORMAT_V2))
+                return a_invalid;
+            break;
+
+        case STATS_OPTION:
+            opts->stats++;
+            if (optarg && strcmp(optarg, "json") == 0)
+                opts->stats_json++;
+            else if (optarg)
+                return a_invalid;
+            break;
+
+        case BASE_OPTION:
+            opts->bases[opts->base_count++] = optarg;
             break;
 
         default:
@@ -123,16 +378,78 @@ action_t process_arguments(int argc, char *argv[], char **can_pathname,
         }
     }
 
-    if (create_can_flag + extract_can_flag + list_can_flag != 1) {
+    if (create_can_flag + extract_can_flag + list_can_flag + verify_can_flag != 1) {
+        return a_invalid;
+    }
+
+    // The CANs already in a can aren't
+    // compressed, and are read back
+    // from a file.
+    if (opts->append && (opts->compress_can ||
+                         strcmp(opts->can_pathname, STDIO_PATHNAME) == 0))
+        return a_invalid;
+
+    if (opts->to_stdout && !extract_can_flag)
+        return a_invalid;
+
+    // Reads are only reordered
+    // when adding files.
+    if (opts->order && !create_can_flag)
+        return a_invalid;
+
+    // Padding only lines up with the
+    // can's blocks uncompressed.
+    if (opts->aligned && opts->compress_can)
         return a_invalid;
+
+    // A delta is written as a can of its own and
+    // restored as a whole. Only the oldest can of
+    // a chain is read once, so only it can come
+    // from stdin.
+    if (opts->base_count) {
+        if (list_can_flag || verify_can_flag || opts->append || opts->to_stdout ||
+            (extract_can_flag && argv[optind] != NULL))
+            return a_invalid;
+        for (int b = create_can_flag ? 0 : 1; b < opts->base_count; b++) {
+            if (strcmp(opts->bases[b], STDIO_PATHNAME) == 0)
+                return a_invalid;
+        }
+        if (extract_can_flag && strcmp(opts->can_pathname, STDIO_PATHNAME) == 0)
+            return a_invalid;
+    }
+
+    // Volumes are new cans of their own on disk,
+    // each with a trailing index to list them.
+    if (opts->volumes || opts->volume_bytes) {
+        if ((opts->volumes && opts->volume_bytes) || !create_can_flag ||
+            opts->append || opts->compress_can || opts->base_count ||
+            strcmp(opts->can_pathname, STDIO_PATHNAME) == 0)
+            return a_invalid;
+        opts->with_index = 1;
     }
 
+    // -u and deltas judge a file by the mtime
+    // the index keeps for its CAN, so the cans
+    // they write keep one for the next run.
+    if (opts->update || opts->base_count)
+        opts->with_index = 1;
+
+    // Chunked, sparse, aligned, prefixed and
+    // deleted CANs need v2's flags byte.
+    if (opts->dedup || opts->sparse || opts->aligned || opts->prefixed ||
+        opts->base_count)
+        opts->format = CAN_FORMAT_V2;
+
     if (list_can_flag && argv[optind] == NULL) {
         return a_list;
-    } else if (extract_can_flag && argv[optind] == NULL) {
+    } else if (verify_can_flag && argv[optind] == NULL) {
+        return a_verify;
+    } else if (extract_can_flag) {
+        if (argv[optind] != NULL)
+            opts->pathnames = &argv[optind];
         return a_extract;
     } else if (create_can_flag && argv[optind] != NULL) {
-        *pathnames = &argv[optind];
+        opts->pathnames = &argv[optind];
         return a_create;
     }
 
@@ -145,88 +462,678 @@ action_t process_arguments(int argc, char *argv[], char **can_pathname,
 * provided all the cans are valid 
 * as determined by their magic number.
 */
-void list_can(char *can_pathname) {
+void list_can(struct options *opts) {
 
-    // if(is_compressed(can_pathname)) {
-    //     read_compressed_can(can_pathname);
-    //     return;
-    // }
+    int fd = open_can_input(opts->can_pathname);
 
-    FILE *input_stream = fopen(can_pathname, "r");
-
-    if (!input_stream) 
+    if (fd < 0) 
         handle_error("File stream error");
-    
-    while (input_stream) { 
-        CAN CAN = new_CAN();
-        CAN = build_CAN(CAN, input_stream);
 
-        printf("%06lo %5lu %s\n", CAN->mode, CAN->content_length, 
-                read_CAN_path_name(CAN, input_stream));
-        
-        // Move to next CAN.
-        fseek(input_stream, (long) CAN->content_length + CAN_HASH_BYTES, SEEK_CUR);        
+    // Chunked and sparse CANs are listed with the
+    // size of the file they rebuild, and if there
+    // are any the listing ends with how much
+    // storing them that way saved.
+    uint64_t totals[3] = {0};
+
+    // A multi-volume can is listed from
+    // the indexes of all its volumes.
+    if (is_volume_manifest(fd)) {
+        VOLUME_CAN volumes = open_volume_can(opts->can_pathname, fd);
+        list_index(volumes->fds, volumes->index, totals);
+        free_volume_can(volumes);
+        close(fd);
+        if (totals[2])
+            printf("total %llu bytes stored as %llu\n", (unsigned long long) totals[0],
+                   (unsigned long long) totals[1]);
+        return;
+    }
+
+    // A compressed can is listed from its
+    // decompressed stream, otherwise a trailing
+    // index lists the can without any seeking.
+    BLOCK_IO input_stream = NULL;
+    CAN_INDEX index = NULL;
+    if (is_compressed(fd))
+        input_stream = read_compressed_can(fd, worker_threads(opts));
+    else
+        index = read_CAN_index(fd);
+
+    if (index) {
+        list_index(&fd, index, totals);
+        free_CAN_index(index);
+        close(fd);
+    } else {
+        // Anything else is read through libcan,
+        // fed from a block stream so its reads
+        // are counted like extract's and its
+        // skips seek where the stream can.
+        if (!input_stream)
+            input_stream = block_io_open_read(fd);
+
+        CAN_READER reader = new_CAN_reader(input_stream);
+        list_stream(reader, totals);
+        free_CAN_reader(reader);
+        block_io_close(input_stream);
     }
 
-    fclose(input_stream); 
+    if (totals[2])
+        printf("total %llu bytes stored as %llu\n", (unsigned long long) totals[0],
+               (unsigned long long) totals[1]);
+}
+
+
+/**
+* Lists every CAN of an index, reading the
+* size of chunked and sparse files from
+* fds[entry->volume].
+*/
+static void list_index(int *fds, CAN_INDEX index, uint64_t *totals) {
+    uint8_t head[CAN_FILE_SIZE_BYTES];
+
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        uint64_t since = stats_clock();
+        if (entry->flags & CAN_FLAG_DELETED) {
+            list_deleted(entry->mode, entry->path, since);
+            continue;
+        }
+
+        int sized = entry->flags & CAN_SIZED_FLAGS;
+        uint64_t size = entry->content_length;
+        if (sized) {
+            ssize_t got = pread(fds[entry->volume], head, CAN_FILE_SIZE_BYTES,
+                                entry->payload);
+            stats_phase(STATS_READ, since);
+            stats_call(STATS_CALL_READ);
+            if (got != CAN_FILE_SIZE_BYTES)
+                handle_error("Unexpected end of can");
+            size = CAN_file_size(head);
+        }
+        list_CAN(entry->mode, size, entry->path, entry->content_length, sized, totals,
+                 since);
+    }
 }
 
 
+/**
+* Lists every CAN a reader gives.
+*/
+static void list_stream(CAN_READER reader, uint64_t *totals) {
+    struct Libcan_Entry *entry;
+    uint64_t since = stats_clock();
+    while ((entry = next_CAN_entry(reader))) {
+        if (entry->flags & CAN_FLAG_DELETED) {
+            list_deleted(entry->mode, entry->path, since);
+            since = stats_clock();
+            continue;
+        }
+
+        list_CAN(entry->mode, entry->file_size, entry->path, entry->content_length,
+                 entry->flags & CAN_SIZED_FLAGS, totals, since);
+        since = stats_clock();
+    }
+}
+
+
+/**
+* Prints one line of a listing and adds
+* the CAN to totals of file bytes, bytes
+* stored and chunked or sparse CANs, and
+* to the stats as an entry of its stored
+* bytes listed since since.
+*/
+static void list_CAN(long mode, uint64_t size, char *path_name, uint64_t stored,
+                     int sized, uint64_t *totals, uint64_t since) {
+    printf("%06lo %5lu %s\n", mode, (unsigned long) size, path_name);
+    stats_entry(path_name, stored, since);
+
+    totals[0] += size;
+    totals[1] += stored;
+    totals[2] += sized != 0;
+}
+
+
+/**
+* Prints the line of a deleted CAN,
+* which has no size to give.
+*/
+static void list_deleted(long mode, char *path_name, uint64_t since) {
+    printf("%06lo %5s %s\n", mode, "-", path_name);
+    stats_entry(path_name, 0, since);
+}
+
+
+
 /**
 * Extracts the contents of a can, writing
 * extracted files to disk.
 * 
 * Performs error checking.
 */
-void extract_can(char *can_pathname) {
+void extract_can(struct options *opts) {
+
+    if (opts->base_count) {
+        extract_chain(opts);
+        return;
+    }
 
-    FILE *file_ptr = fopen(can_pathname, "r");
+    int fd = open_can_input(opts->can_pathname);
 
-    if (!file_ptr)
+    if (fd < 0)
         handle_error("File stream error");
 
-    char *path_name = NULL;
-    int hash_byte = 0;
-    // Extract each CAN
-    while (file_ptr) {
-        CAN CAN = new_CAN();
-        CAN = build_CAN(CAN, file_ptr);
+    if (is_volume_manifest(fd)) {
+        extract_volumes(opts, fd);
+        return;
+    }
+
+    int out_fd = -1;
+    if (opts->to_stdout)
+        out_fd = take_stdout();
+
+    // Compressed cans, cans read from a pipe
+    // and -O can only be extracted as a stream.
+    int compressed = is_compressed(fd);
+    if (compressed || lseek(fd, 0, SEEK_CUR) < 0 || out_fd >= 0) {
+        BLOCK_IO file_ptr;
+        if (compressed)
+            file_ptr = read_compressed_can(fd, worker_threads(opts));
+        else
+            file_ptr = block_io_open_read(fd);
+
+        PATH_MATCHER matcher = NULL;
+        if (opts->pathnames)
+            matcher = new_path_matcher(opts->pathnames);
+
+        // Small files can be written
+        // through io_uring when streaming.
+        struct Extract_Options how = {
+            .matcher = matcher,
+            .out_fd = out_fd,
+            .check = opts->check,
+        };
+        if (opts->ring && out_fd < 0)
+            how.batch = new_batch_io(NULL);
+        if (out_fd >= 0 && !compressed && lseek(fd, 0, SEEK_CUR) >= 0)
+            how.newest = newest_payloads(fd);
+        extract_stream(file_ptr, &how);
+        block_io_close(file_ptr);
+        if (out_fd >= 0)
+            close(out_fd);
+        if (how.newest)
+            free_path_set(how.newest);
+
+        if (matcher) {
+            int unmatched = report_unmatched(matcher);
+            free_path_matcher(matcher);
+            if (unmatched)
+                exit(1);
+        }
+        return;
+    }
+
+    BLOCK_IO file_ptr = block_io_open_read(fd);
+
+    // With -j or a list of members find every
+    // CAN first, seeking over the contents, then
+    // extract only the ones wanted.
+    if (opts->jobs > 1 || opts->pathnames) {
+        CAN_INDEX index = read_CAN_index(fd);
+        if (!index)
+            index = scan_CAN_index(file_ptr);
+        drop_replaced_CAN_entries(index);
+
+        PATH_MATCHER matcher = NULL;
+        if (opts->pathnames) {
+            matcher = new_path_matcher(opts->pathnames);
+            select_CAN_entries(index, matcher);
+        }
+        remove_deleted_entries(index);
+
+        extract_pool_run(fd, index, opts->jobs, opts->check);
+        free_CAN_index(index);
+        block_io_close(file_ptr);
+
+        if (matcher) {
+            int unmatched = report_unmatched(matcher);
+            free_path_matcher(matcher);
+            if (unmatched)
+                exit(1);
+        }
+        return;
+    }
+
+    // Extract each CAN in turn, libcan
+    // passing over any trailing index.
+    struct Extract_Options how = {
+        .batch = opts->ring ? new_batch_io(NULL) : NULL,
+        .out_fd = -1,
+        .check = opts->check,
+    };
+    extract_stream(file_ptr, &how);
+    block_io_close(file_ptr);
+}
 
-        path_name = read_CAN_path_name(CAN, file_ptr);
+
+/**
+* Extracts a multi-volume can from the
+* manifest open on fd, the volumes read
+* at once, a thread to each unless -j
+* says otherwise.
+*/
+static void extract_volumes(struct options *opts, int fd) {
+    if (opts->to_stdout)
+        handle_error("Can't stream a multi-volume can");
+
+    VOLUME_CAN volumes = open_volume_can(opts->can_pathname, fd);
+    close(fd);
+
+    PATH_MATCHER matcher = NULL;
+    if (opts->pathnames) {
+        matcher = new_path_matcher(opts->pathnames);
+        select_CAN_entries(volumes->index, matcher);
+    }
+    remove_deleted_entries(volumes->index);
+
+    int workers = opts->jobs > 1 ? opts->jobs : volumes->count;
+    extract_volumes_run(volumes->fds, volumes->index, workers, opts->check);
+    free_volume_can(volumes);
+
+    if (matcher) {
+        int unmatched = report_unmatched(matcher);
+        free_path_matcher(matcher);
+        if (unmatched)
+            exit(1);
+    }
+}
+
+
+/**
+* Extracts CANs one after another from a
+* stream as how says, read through libcan.
+* With a matcher, CANs that don't match
+* are skipped and the directories above
+* a match are created as it is reached.
+* A CAN for a path already extracted, as
+* -a and -u leave, replaces the older file.
+* With a batch, small files are queued on
+* it and written once it fills. If out_fd
+* isn't -1 the contents of every file are
+* written to it instead, one after another.
+* newest then holds the payload offset of
+* each replaced path's latest CAN, the only
+* one written, and without it a replaced
+* path is an error, as what was written
+* can't be taken back.
+* Aligned CANs of a can on disk are copied
+* out without being read, checked as
+* check says. With latest, only the CANs
+* is_latest_link picks for this link of a
+* chain are extracted. A deleted CAN
+* removes what it names.
+*/
+static void extract_stream(BLOCK_IO file_ptr, struct Extract_Options *how) {
+    PATH_MATCHER matcher = how->matcher;
+    BATCH_IO batch = how->batch;
+    int out_fd = how->out_fd;
+
+    // Directories seen so far, in case
+    // a later match lives in them.
+    PATH_SET dirs = NULL;
+    if (matcher)
+        dirs = new_path_set(0);
+    PATH_SET extracted = new_path_set(0);
+
+    // libcan passes over the trailing index
+    // and seeks past the CANs skipped here.
+    CAN_READER reader = new_CAN_reader(file_ptr);
+    struct Libcan_Entry *CAN;
+    uint64_t since = stats_clock();
+    for (; (CAN = next_CAN_entry(reader)); since = stats_clock()) {
+        char *path_name = CAN->path;
+        if (is_manifest_CAN(path_name, CAN->mode))
+            handle_error("Can't stream a multi-volume can");
+
+        size_t payload;
+        if (out_fd >= 0 && !how->newest &&
+            path_set_find(extracted, path_name, strlen(path_name), NULL))
+            handle_error("Can't write a replaced file to stdout from a pipe");
+
+        if ((how->newest &&
+             path_set_find(how->newest, path_name, strlen(path_name), &payload) &&
+             payload != reader->start + CAN->payload) ||
+            (matcher && !path_matches(matcher, path_name)) ||
+            (how->latest && !is_latest_link(how->latest, path_name, CAN->flags,
+                                            CAN->mode, how->link)) ||
+            (out_fd >= 0 && (CAN->flags & CAN_FLAG_DELETED))) {
+            if (dirs && S_ISDIR(CAN->mode) && !(CAN->flags & CAN_FLAG_DELETED))
+                path_set_add(dirs, path_name, CAN->mode);
+            continue;
+        }
+
+        if (out_fd >= 0) {
+            path_set_add(extracted, path_name, 0);
+            write_CAN_contents(reader, out_fd);
+            stats_entry(path_name, CAN->content_length, since);
+            continue;
+        }
+
+        if (CAN->flags & CAN_FLAG_DELETED) {
+            // The file may still be
+            // queued on the batch.
+            if (batch)
+                batch_io_flush(batch);
+            remove_extracted_path(path_name, CAN->mode);
+            check_empty_CAN(reader);
+            stats_entry(path_name, 0, since);
+            continue;
+        }
+
+        if (dirs) {
+            size_t mode;
+            for (char *slash = strchr(path_name + 1, '/'); slash;
+                 slash = strchr(slash + 1, '/')) {
+                if (path_set_find(dirs, path_name, slash - path_name, &mode)) {
+                    *slash = '\0';
+                    make_extracted_dir(path_name, mode);
+                    *slash = '/';
+                }
+            }
+        }
         
-        write_extracted_CAN(file_ptr, CAN, path_name);
+        // A file removed by a deleted CAN
+        // may be added again after it.
+        if (!path_set_add(extracted, path_name, 0) && !S_ISDIR(CAN->mode)) {
+            if (batch)
+                batch_io_flush(batch);
+            if (unlink(path_name) != 0 && errno != ENOENT)
+                handle_error("Failed to replace file");
+        }
+
+        if (copy_extracted_CAN(reader, path_name, how->check)) {
+            stats_entry(path_name, CAN->content_length, since);
+            continue;
+        }
 
-        // Check hash integirity.
-        hash_byte = fgetc(file_ptr);
-        if (hash_byte != CAN->hash) 
-            handle_error("can hash incorrect");
+        if (batch && batch_extract_file(batch, reader, path_name)) {
+            stats_entry(path_name, CAN->content_length, since);
+            continue;
+        }
+
+        write_extracted_CAN(reader, path_name);
+        stats_entry(path_name, CAN->content_length, since);
     }
 
-    fclose(file_ptr);
+    free_CAN_reader(reader);
+    if (batch)
+        free_batch_io(batch);
+    if (dirs)
+        free_path_set(dirs);
+    free_path_set(extracted);
+}
+
+
+/**
+* Restores a chain of cans, the --base cans
+* oldest first then the can given to -x,
+* by streaming each in turn. The deltas are
+* listed up front so only the newest CAN of
+* each pathname is extracted, and nothing
+* a later delta replaces or deletes is
+* written on the way.
+*/
+static void extract_chain(struct options *opts) {
+    int links = opts->base_count + 1;
+    char **chain = malloc(links * sizeof(char *));
+    if (!chain)
+        handle_error("Failed to allocate can chain");
+    memcpy(chain, opts->bases, opts->base_count * sizeof(char *));
+    chain[opts->base_count] = opts->can_pathname;
+
+    PATH_SET latest = latest_CAN_links(chain, links, worker_threads(opts));
+
+    for (int link = 0; link < links; link++) {
+        int fd = open_can_input(chain[link]);
+        if (fd < 0)
+            handle_error("File stream error");
+
+        BLOCK_IO file_ptr;
+        if (is_compressed(fd))
+            file_ptr = read_compressed_can(fd, worker_threads(opts));
+        else
+            file_ptr = block_io_open_read(fd);
+
+        struct Extract_Options how = {
+            .latest = latest,
+            .link = link,
+            .batch = opts->ring ? new_batch_io(NULL) : NULL,
+            .out_fd = -1,
+            .check = opts->check,
+        };
+        extract_stream(file_ptr, &how);
+        block_io_close(file_ptr);
+    }
+
+    free_path_set(latest);
+    free(chain);
+}
+
+
+/**
+* Removes what each deleted CAN of index
+* names, in can order as a stream would,
+* and drops them from the index.
+*/
+static void remove_deleted_entries(CAN_INDEX index) {
+    size_t kept = 0;
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        if (entry->flags & CAN_FLAG_DELETED) {
+            remove_extracted_path(entry->path, entry->mode);
+            free(entry->path);
+        } else {
+            index->entries[kept++] = *entry;
+        }
+    }
+    index->count = kept;
+}
+
+
+/**
+* Maps each path the can open on fd holds
+* more than once to the payload offset of
+* its latest CAN, reading the headers first
+* if there is no trailing index. Returns
+* NULL if no path is replaced. fd is left
+* where it was.
+*/
+static PATH_SET newest_payloads(int fd) {
+    CAN_INDEX index = read_CAN_index(fd);
+    if (!index) {
+        off_t start = lseek(fd, 0, SEEK_CUR);
+        int scan_fd = dup(fd);
+        if (scan_fd < 0)
+            handle_error("Failed to open can");
+        BLOCK_IO scan = block_io_open_read(scan_fd);
+        index = scan_CAN_index(scan);
+        block_io_close(scan);
+        if (lseek(fd, start, SEEK_SET) != start)
+            handle_error("Failed to seek can");
+    }
+
+    PATH_SET newest = new_path_set(index->count);
+    int replaced = 0;
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        if (!path_set_add(newest, entry->path, entry->payload))
+            replaced = 1;
+    }
+    free_CAN_index(index);
+
+    if (!replaced) {
+        free_path_set(newest);
+        return NULL;
+    }
+    return newest;
 }
 
 // create can_pathname from NULL-terminated array pathnames
 // compress with xz if compress_can non-zero (subset 4)
+// store repeated chunks of files once if dedup non-zero
+// store only the data of files with holes if sparse non-zero
+// read files on jobs threads if jobs is above one,
+// or small files through io_uring if ring non-zero
+// add to the end of an existing can if append non-zero,
+// only what changed since it was written if update non-zero
+// or since the chain of cans in bases if base_count non-zero
+
+void create_can(struct options *opts) {
+    if (opts->volumes || opts->volume_bytes) {
+        create_volumes(opts);
+        return;
+    }
 
-void create_can(char *can_pathname, char *pathnames[], int compress_can) {
+    // Writing over a can of the chain would
+    // lose what the delta is made against.
+    DELTA_BASE base = NULL;
+    if (opts->base_count) {
+        struct stat out, in;
+        for (int b = 0; b < opts->base_count; b++) {
+            if (stat(opts->can_pathname, &out) == 0 && stat(opts->bases[b], &in) == 0 &&
+                out.st_dev == in.st_dev && out.st_ino == in.st_ino)
+                handle_error("Can't write a delta over its base");
+        }
+        base = open_delta_base(opts->bases, opts->base_count);
+    }
 
     // Open can to write
-    FILE *can_file = fopen(can_pathname, "w");
-
-    if (!can_file) 
+    int fd;
+    CAN_INDEX existing = NULL;
+    if (strcmp(opts->can_pathname, STDIO_PATHNAME) == 0) {
+        if (isatty(STDOUT_FILENO))
+            handle_error("Won't write a can to a terminal");
+        if (opts->compress_can && lseek(STDOUT_FILENO, 0, SEEK_CUR) < 0)
+            handle_error("Can't write a compressed can to a pipe");
+        fd = take_stdout();
+    } else if (opts->append)
+        fd = open(opts->can_pathname, O_RDWR | O_CREAT, 0666);
+    else
+        fd = open(opts->can_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) 
         handle_error("file stream error");
 
+    struct Update_Filter filter = {0};
+    if (opts->append) {
+        existing = open_existing_can(fd, opts);
+        if (opts->update)
+            start_update(&filter, fd, existing);
+    }
+
+    BLOCK_IO output_stream;
+    if (opts->compress_can)
+        output_stream = write_compressed_can(fd, worker_threads(opts));
+    else
+        output_stream = block_io_open_write(fd);
+
+    CAN_WRITER can_file = new_CAN_writer(output_stream, opts->with_index,
+                                         opts->format);
+    if (opts->dedup)
+        can_file->chunks = new_chunk_store();
+    can_file->sparse = opts->sparse;
+    can_file->aligned = opts->aligned;
+    can_file->prefixed = opts->prefixed;
+    if (existing)
+        resume_CAN_writer(can_file, fd, existing);
+
+    // CANs go straight to the can or through
+    // a pool of reader threads for -j, or
+    // for -L to read them in disk order.
+    CAN_EMIT emit = write_file;
+    void *ctx = can_file;
+    CREATE_POOL pool = NULL;
+    if (opts->jobs > 1 || opts->order) {
+        pool = create_pool_start(can_file, opts->jobs > 1 ? opts->jobs : 1,
+                                 opts->budget, opts->order);
+        emit = create_pool_add;
+        ctx = pool;
+    }
+
+    // Or small files are read in
+    // batches through io_uring.
+    BATCH_IO batch = NULL;
+    if (!pool && opts->ring)
+        batch = new_batch_io(can_file);
+    if (batch) {
+        emit = batch_create_file;
+        ctx = batch;
+    }
+
+    if (opts->update) {
+        filter.emit = emit;
+        filter.ctx = ctx;
+        emit = update_emit;
+        ctx = &filter;
+    }
+
+    if (base) {
+        base->emit = emit;
+        base->ctx = ctx;
+        emit = delta_emit;
+        ctx = base;
+    }
+
+    add_pathnames(opts, emit, ctx);
+
+    if (pool)
+        create_pool_finish(pool);
+    if (batch)
+        free_batch_io(batch);
+
+    // Whatever the walk didn't come across
+    // has gone since the base was written.
+    if (base) {
+        write_tombstones(base, can_file);
+        free_delta_base(base);
+    }
+
+    // Flush can file.
+    close_CAN_writer(can_file);
+
+    if (existing) {
+        if (filter.latest) {
+            free_path_set(filter.latest);
+            free(filter.kept);
+        }
+        free_CAN_index(existing);
+    }
+}
+
+
+/**
+* Passes each of the pathnames to emit, with
+* the directories leading to it first and
+* everything below it after.
+*/
+static void add_pathnames(struct options *opts, CAN_EMIT emit, void *ctx) {
+    char **pathnames = opts->pathnames;
+
     // Split folder pathnames
     // to descend from file path root.
     char *split_hurstic = "/";
     char *adjusted_path = NULL;
+    ARENA arena = new_arena(4096);
     
 
     for (int p = 0; pathnames[p]; p++) {
         
-        char *on_going_path = malloc(CAN_MAX_PATHNAME_LENGTH * sizeof(char));
-        char *pre_path = malloc(CAN_MAX_PATHNAME_LENGTH * sizeof(char));
-        char *goal_path = malloc(CAN_MAX_PATHNAME_LENGTH * sizeof(char));
+        // Sized for the pathname with every
+        // component followed by a slash.
+        size_t length = strlen(pathnames[p]) + 2;
+        arena_reset(arena);
+        char *on_going_path = arena_alloc(arena, length);
+        char *pre_path = arena_alloc(arena, length);
+        char *goal_path = arena_alloc(arena, length);
 
         strcpy(pre_path, pathnames[p]);
         strcpy(goal_path, pathnames[p]);
@@ -238,65 +1145,200 @@ void create_can(char *can_pathname, char *pathnames[], int compress_can) {
             strcpy(on_going_path, adjusted_path);
 
         while (adjusted_path) {
-            add_file(can_file, on_going_path);
+            add_file(emit, ctx, on_going_path);
             strcat(on_going_path, "/");
             adjusted_path = strtok(NULL, split_hurstic);
             if (adjusted_path) 
                 strcat(on_going_path, adjusted_path);
         }
 
-        add_dir(can_file, goal_path);
+        add_dir(emit, ctx, goal_path, opts->jobs, opts->prefixed);
+    }
+    free_arena(arena);
+}
+
+
+/**
+* Writes a multi-volume can, its volumes
+* filled at once by a create pool each,
+* then the manifest naming them.
+*/
+static void create_volumes(struct options *opts) {
+    VOLUME_SET set = new_volume_set(opts->can_pathname, opts->format, opts->jobs,
+                                    opts->budget);
+    set->count = opts->volumes;
+    set->size = opts->volume_bytes;
+    set->dedup = opts->dedup;
+    set->sparse = opts->sparse;
+    set->aligned = opts->aligned;
+    set->prefixed = opts->prefixed;
+    set->read_order = opts->order;
+
+    add_pathnames(opts, volume_add, set);
+    close_volume_set(set);
+}
 
-        free(on_going_path);
-        free(pre_path);
+
+/**
+* Checks every CAN of a can without
+* extracting anything, exiting non-zero
+* if any are corrupt.
+*/
+void verify_can(struct options *opts) {
+    int fd = open_can_input(opts->can_pathname);
+
+    if (fd < 0) 
+        handle_error("File stream error");
+
+    // A multi-volume can is checked a volume
+    // after another, with one verdict on
+    // the manifest and all its volumes.
+    if (is_volume_manifest(fd)) {
+        VOLUME_CAN volumes = open_volume_can(opts->can_pathname, fd);
+        struct Verify_Summary summary = {.complete = 1};
+        check_can_part(fd, worker_threads(opts), stdout, &summary);
+        for (int volume = 0; volume < volumes->count; volume++) {
+            int volume_fd = dup(volumes->fds[volume]);
+            if (volume_fd < 0)
+                handle_error("Failed to read volume");
+            summary.volume = volume + 1;
+            check_can_part(volume_fd, worker_threads(opts), stdout, &summary);
+        }
+        free_volume_can(volumes);
+        print_verify_summary(stdout, &summary);
+        if (summary.corrupt)
+            exit(1);
+        return;
     }
 
-    // Flush can file.
-    fclose(can_file);
+    if (check_can(fd, worker_threads(opts), stdout))
+        exit(1);
+}
 
-    // compress the can if 
-    // -z option is supplied.
+
+/**
+* Threads to compress, decompress or verify
+* with, every core unless -j says otherwise.
+*/
+static int worker_threads(struct options *opts) {
+    if (opts->jobs > 1)
+        return opts->jobs;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 1 ? cores : 1;
 }
 
 
-//                                  HELPERS
-////////////////////////////////////////////////////////////////////////////////
+/**
+* Opens a can to read from,
+* or stdin for a pathname of -.
+*/
+static int open_can_input(char *can_pathname) {
+    if (strcmp(can_pathname, STDIO_PATHNAME) == 0)
+        return STDIN_FILENO;
+
+    return open(can_pathname, O_RDONLY);
+}
 
 
 /**
-* prints an error msg to standerr.
+* Hands stdout over to a can or extracted
+* contents, returning a new fd for it, and
+* points stdout at stderr so messages
+* printed on the way don't get mixed in.
 */
-void handle_error(char *error_desc){
-    fprintf(stderr, "ERROR: %s\n", error_desc);
-    exit(1);
+static int take_stdout(void) {
+    fflush(stdout);
+
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        handle_error("Failed to take stdout");
+
+    return fd;
 }
 
 
-// Lookup table for a simple Pearson hash
-
-const uint8_t crush_hash_table[256] = {
-    241, 18,  181, 164, 92,  237, 100, 216, 183, 107, 2,   12,  43,  246, 90,
-    143, 251, 49,  228, 134, 215, 20,  193, 172, 140, 227, 148, 118, 57,  72,
-    119, 174, 78,  14,  97,  3,   208, 252, 11,  195, 31,  28,  121, 206, 149,
-    23,  83,  154, 223, 109, 89,  10,  178, 243, 42,  194, 221, 131, 212, 94,
-    205, 240, 161, 7,   62,  214, 222, 219, 1,   84,  95,  58,  103, 60,  33,
-    111, 188, 218, 186, 166, 146, 189, 201, 155, 68,  145, 44,  163, 69,  196,
-    115, 231, 61,  157, 165, 213, 139, 112, 173, 191, 142, 88,  106, 250, 8,
-    127, 26,  126, 0,   96,  52,  182, 113, 38,  242, 48,  204, 160, 15,  54,
-    158, 192, 81,  125, 245, 239, 101, 17,  136, 110, 24,  53,  132, 117, 102,
-    153, 226, 4,   203, 199, 16,  249, 211, 167, 55,  255, 254, 116, 122, 13,
-    236, 93,  144, 86,  59,  76,  150, 162, 207, 77,  176, 32,  124, 171, 29,
-    45,  30,  67,  184, 51,  22,  105, 170, 253, 180, 187, 130, 156, 98,  159,
-    220, 40,  133, 135, 114, 147, 75,  73,  210, 21,  129, 39,  138, 91,  41,
-    235, 47,  185, 9,   82,  64,  87,  244, 50,  74,  233, 175, 247, 120, 6,
-    169, 85,  66,  104, 80,  71,  230, 152, 225, 34,  248, 198, 63,  168, 179,
-    141, 137, 5,   19,  79,  232, 128, 202, 46,  70,  37,  209, 217, 123, 27,
-    177, 25,  56,  65,  229, 36,  197, 234, 108, 35,  151, 238, 200, 224, 99,
-    190
-};
+/**
+* Lists the CANs of a can being added to and
+* leaves fd at the end of its last member,
+* where the new CANs go over any trailing
+* index. The can keeps its format version
+* and its index if it has one.
+*/
+static CAN_INDEX open_existing_can(int fd, struct options *opts) {
+    if (is_compressed(fd))
+        handle_error("Can't add to a compressed can");
+    if (is_volume_manifest(fd))
+        handle_error("Can't add to a multi-volume can");
+
+    CAN_INDEX existing = read_CAN_index(fd);
+    if (existing) {
+        opts->with_index = 1;
+    } else {
+        // The scan's stream closes its
+        // fd, so give it one of its own.
+        int scan_fd = dup(fd);
+        if (scan_fd < 0)
+            handle_error("Failed to read can");
+
+        BLOCK_IO scan = block_io_open_read(scan_fd);
+        existing = scan_CAN_index(scan);
+        block_io_close(scan);
+    }
+
+    if (existing->count) {
+        opts->format = existing->entries[0].version;
+        if (opts->dedup && opts->format != CAN_FORMAT_V2)
+            handle_error("Can't deduplicate into a v1 can");
+        if (opts->sparse && opts->format != CAN_FORMAT_V2)
+            handle_error("Can't store sparse files in a v1 can");
+        if (opts->aligned && opts->format != CAN_FORMAT_V2)
+            handle_error("Can't align CANs in a v1 can");
+        if (opts->prefixed && opts->format != CAN_FORMAT_V2)
+            handle_error("Can't front code pathnames in a v1 can");
+    }
+
+    if (ftruncate(fd, existing->end) != 0 ||
+        lseek(fd, existing->end, SEEK_SET) != existing->end)
+        handle_error("Failed to truncate can");
+
+    return existing;
+}
+
+
+/**
+* Notes the latest CAN of each path in
+* existing and what it holds. Checksums
+* are read from the can when needed,
+* whether it was scanned or not.
+*/
+static void start_update(struct Update_Filter *filter, int fd, CAN_INDEX existing) {
+    filter->existing = existing;
+    filter->latest = new_path_set(existing->count);
+    filter->kept = malloc((existing->count + 1) * sizeof(struct Delta_Entry));
+    if (!filter->kept)
+        handle_error("Failed to allocate update entries");
+
+    for (size_t e = 0; e < existing->count; e++) {
+        struct CAN_Entry *entry = &existing->entries[e];
+        path_set_add(filter->latest, entry->path, e);
+        set_delta_entry(&filter->kept[e], entry, fd, 1);
+    }
+}
+
+
+/**
+* Passes path on unless the can
+* already holds it as it is.
+*/
+static void update_emit(void *ctx, char *path, struct stat *s) {
+    struct Update_Filter *filter = ctx;
+    size_t e;
+
+    if (path_set_find(filter->latest, path, strlen(path), &e) &&
+        !(filter->kept[e].flags & CAN_FLAG_DELETED) &&
+        is_unchanged_file(&filter->kept[e], path, s))
+        return;
 
-// Given the current hash value and a byte
-// crush_hash returns the new hash value
-uint8_t crush_hash(uint8_t hash, uint8_t byte) {
-    return crush_hash_table[hash ^ byte];
+    filter->emit(filter->ctx, path, s);
 }
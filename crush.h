@@ -1,11 +1,69 @@
 #ifndef crush_H
 #define crush_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 /**
-* Wrapper for implementation in crush.c
+* Wrapper for implementation in helpers.c
 */
 uint8_t crush_hash(uint8_t hash, uint8_t byte);
 
+/**
+* Hashes a whole buffer in one call,
+* giving the same result as feeding
+* each byte through crush_hash.
+*/
+uint8_t crush_hash_buf(uint8_t hash, const uint8_t *buf, size_t len);
+
+// the most buffers crush_hash_lanes
+// advances in lockstep at once
+#define CRUSH_HASH_LANES   16
+
+// the kernels crush_hash_lanes can run
+#define CRUSH_HASH_SCALAR  0
+#define CRUSH_HASH_AVX2    1
+#define CRUSH_HASH_AVX512  2
+
+/**
+* Hashes lanes independent buffers at once,
+* folding bufs[l], lens[l] bytes long, into
+* hashes[l] just as crush_hash_buf would.
+* Up to CRUSH_HASH_LANES lanes step
+* together so their table lookups
+* overlap. This runs on scalar code,
+* which beats a gather per byte on
+* the CPUs bench_hash has been run on.
+*/
+void crush_hash_lanes(uint8_t *hashes, const uint8_t **bufs, const size_t *lens,
+                      int lanes);
+
+/**
+* crush_hash_lanes on a given kernel, or
+* on scalar code if the CPU lacks it.
+*/
+void crush_hash_lanes_on(int kernel, uint8_t *hashes, const uint8_t **bufs,
+                         const size_t *lens, int lanes);
+
+/**
+* The widest gather kernel this CPU has,
+* or scalar if it has none.
+*/
+int crush_hash_widest_kernel(void);
+
+/**
+* Stores value in the given number
+* of bytes, most significant first,
+* like the CAN header feilds.
+*/
+void put_bytes(uint8_t *out, uint64_t value, int bytes);
+
+/**
+* Reads back a value stored
+* with put_bytes.
+*/
+uint64_t get_bytes(const uint8_t *in, int bytes);
+
 void handle_error(char *error_desc);
 
-#endif
\ No newline at end of file
+#endif
@@ -2,3 +2,563 @@
  * Handler for file compression and decompression
 */
 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <lzma.h>
+
+#include "crush.h"
+#include "crusher.h"
+
+// states of a block slot
+#define SLOT_FREE                 0
+#define SLOT_QUEUED               1
+#define SLOT_BUSY                 2
+#define SLOT_DONE                 3
+
+/**
+* One block in flight, raw holds the
+* uncompressed bytes and packed the
+* compressed ones.
+*/
+struct Crusher_Slot {
+    uint8_t *raw;
+    size_t raw_length;
+    uint8_t *packed;
+    size_t packed_length;
+    int state;
+};
+
+/**
+* Shared by compression and decompression. Block
+* seq lives in slot seq % window; blocks are
+* produced and consumed strictly in order while
+* the workers handle any queued slot.
+*/
+struct Crusher_Struct {
+    int fd;
+    int writing;
+    off_t offset;
+
+    struct Crusher_Slot *slots;
+    int window;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t next_job;
+    size_t head_pos;
+
+    uint64_t count;
+    uint64_t capacity;
+    uint32_t *packed_lengths;
+    uint32_t *raw_lengths;
+    off_t *offsets;
+
+    struct Crusher_Slot *lookup;
+    uint64_t lookup_seq;
+
+    int closing;
+    int workers;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+typedef struct Crusher_Struct *CRUSHER;
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static CRUSHER new_crusher(int fd, int writing, int workers);
+static void free_crusher(CRUSHER crusher);
+static void *crusher_thread(void *arg);
+static void pack_slot(struct Crusher_Slot *slot);
+static void unpack_slot(CRUSHER crusher, uint64_t seq, struct Crusher_Slot *slot);
+static void crusher_sink(void *ctx, const unsigned char *buf, size_t len);
+static void crusher_finish(void *ctx);
+static void submit_block(CRUSHER crusher);
+static void write_done_blocks(CRUSHER crusher, int all);
+static size_t crusher_source(void *ctx, unsigned char *buf, size_t cap);
+static void crusher_release(void *ctx);
+static size_t crusher_pread(void *ctx, unsigned char *buf, size_t len, off_t offset);
+static void read_block_table(CRUSHER crusher);
+static void pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+int is_compressed(int fd) {
+    char magic[CRUSHER_MAGIC_BYTES];
+
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, CRUSHER_MAGIC, CRUSHER_MAGIC_BYTES) == 0;
+}
+
+
+BLOCK_IO read_compressed_can(int fd, int workers) {
+    CRUSHER crusher = new_crusher(fd, 0, workers);
+    read_block_table(crusher);
+
+    BLOCK_IO io = block_io_open_source(crusher_source, crusher_release, crusher);
+    block_io_set_pread(io, crusher_pread);
+    return io;
+}
+
+
+BLOCK_IO write_compressed_can(int fd, int workers) {
+    uint8_t header[CRUSHER_HEADER_BYTES];
+    memcpy(header, CRUSHER_MAGIC, CRUSHER_MAGIC_BYTES);
+    put_bytes(header + CRUSHER_MAGIC_BYTES, CRUSHER_BLOCK_SIZE, 4);
+    pwrite_all(fd, header, sizeof(header), 0);
+
+    CRUSHER crusher = new_crusher(fd, 1, workers);
+    crusher->offset = CRUSHER_HEADER_BYTES;
+
+    return block_io_open_sink(crusher_sink, crusher_finish, crusher);
+}
+
+
+/**
+* Sets up the slots and starts the
+* worker threads for either direction.
+*/
+static CRUSHER new_crusher(int fd, int writing, int workers) {
+    CRUSHER crusher = calloc(1, sizeof(*crusher));
+    if (!crusher)
+        handle_error("Failed to allocate crusher");
+
+    crusher->fd = fd;
+    crusher->writing = writing;
+    crusher->workers = workers;
+    crusher->window = workers * 2;
+
+    crusher->slots = calloc(crusher->window, sizeof(struct Crusher_Slot));
+    crusher->threads = calloc(workers, sizeof(pthread_t));
+    if (!crusher->slots || !crusher->threads)
+        handle_error("Failed to allocate crusher");
+
+    size_t bound = lzma_stream_buffer_bound(CRUSHER_BLOCK_SIZE);
+    for (int s = 0; s < crusher->window; s++) {
+        crusher->slots[s].raw = malloc(CRUSHER_BLOCK_SIZE);
+        crusher->slots[s].packed = malloc(bound);
+        if (!crusher->slots[s].raw || !crusher->slots[s].packed)
+            handle_error("Failed to allocate crusher block");
+    }
+
+    pthread_mutex_init(&crusher->lock, NULL);
+    pthread_cond_init(&crusher->changed, NULL);
+
+    for (int w = 0; w < workers; w++) {
+        if (pthread_create(&crusher->threads[w], NULL, crusher_thread, crusher) != 0)
+            handle_error("Failed to start crusher thread");
+    }
+
+    return crusher;
+}
+
+
+/**
+* Stops the workers and frees everything
+* including the fd.
+*/
+static void free_crusher(CRUSHER crusher) {
+    pthread_mutex_lock(&crusher->lock);
+    crusher->closing = 1;
+    pthread_cond_broadcast(&crusher->changed);
+    pthread_mutex_unlock(&crusher->lock);
+
+    for (int w = 0; w < crusher->workers; w++)
+        pthread_join(crusher->threads[w], NULL);
+
+    for (int s = 0; s < crusher->window; s++) {
+        free(crusher->slots[s].raw);
+        free(crusher->slots[s].packed);
+    }
+
+    if (crusher->lookup) {
+        free(crusher->lookup->raw);
+        free(crusher->lookup->packed);
+        free(crusher->lookup);
+    }
+
+    close(crusher->fd);
+    pthread_mutex_destroy(&crusher->lock);
+    pthread_cond_destroy(&crusher->changed);
+    free(crusher->slots);
+    free(crusher->threads);
+    free(crusher->packed_lengths);
+    free(crusher->raw_lengths);
+    free(crusher->offsets);
+    free(crusher);
+}
+
+
+/**
+* Compresses or decompresses queued
+* blocks in any order.
+*/
+static void *crusher_thread(void *arg) {
+    CRUSHER crusher = arg;
+
+    pthread_mutex_lock(&crusher->lock);
+    for (;;) {
+        uint64_t seq = crusher->next_job;
+        struct Crusher_Slot *slot = &crusher->slots[seq % crusher->window];
+
+        // Compression queues slots for us, when
+        // decompressing any free slot can be
+        // filled with the next block.
+        int ready = crusher->writing
+                    ? seq < crusher->tail && slot->state == SLOT_QUEUED
+                    : seq < crusher->count && slot->state == SLOT_FREE;
+
+        if (!ready) {
+            if (crusher->closing)
+                break;
+            pthread_cond_wait(&crusher->changed, &crusher->lock);
+            continue;
+        }
+
+        crusher->next_job++;
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&crusher->lock);
+
+        if (crusher->writing)
+            pack_slot(slot);
+        else
+            unpack_slot(crusher, seq, slot);
+
+        pthread_mutex_lock(&crusher->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&crusher->changed);
+    }
+    pthread_mutex_unlock(&crusher->lock);
+
+    return NULL;
+}
+
+
+/**
+* Compresses a slot's raw bytes
+* into its packed buffer.
+*/
+static void pack_slot(struct Crusher_Slot *slot) {
+    size_t bound = lzma_stream_buffer_bound(CRUSHER_BLOCK_SIZE);
+
+    slot->packed_length = 0;
+    if (lzma_easy_buffer_encode(CRUSHER_PRESET, LZMA_CHECK_CRC32, NULL,
+                                slot->raw, slot->raw_length, slot->packed,
+                                &slot->packed_length, bound) != LZMA_OK)
+        handle_error("Failed to compress can");
+}
+
+
+/**
+* Reads block seq of the can and
+* decompresses it into the slot.
+*/
+static void unpack_slot(CRUSHER crusher, uint64_t seq, struct Crusher_Slot *slot) {
+    size_t packed_length = crusher->packed_lengths[seq];
+    if (pread(crusher->fd, slot->packed, packed_length, crusher->offsets[seq])
+        != (ssize_t) packed_length)
+        handle_error("Unexpected end of compressed can");
+
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos = 0;
+    slot->raw_length = 0;
+    if (lzma_stream_buffer_decode(&memlimit, 0, NULL, slot->packed, &in_pos,
+                                  packed_length, slot->raw, &slot->raw_length,
+                                  CRUSHER_BLOCK_SIZE) != LZMA_OK ||
+        slot->raw_length != crusher->raw_lengths[seq])
+        handle_error("Compressed can corrupt");
+}
+
+
+/**
+* BLOCK_IO_SINK filling the current
+* block and queueing it once full.
+*/
+static void crusher_sink(void *ctx, const unsigned char *buf, size_t len) {
+    CRUSHER crusher = ctx;
+
+    while (len) {
+        struct Crusher_Slot *slot = &crusher->slots[crusher->tail % crusher->window];
+        size_t step = CRUSHER_BLOCK_SIZE - slot->raw_length;
+        if (step > len)
+            step = len;
+
+        memcpy(slot->raw + slot->raw_length, buf, step);
+        slot->raw_length += step;
+        buf += step;
+        len -= step;
+
+        if (slot->raw_length == CRUSHER_BLOCK_SIZE)
+            submit_block(crusher);
+    }
+}
+
+
+/**
+* Queues the block being filled and waits
+* for the slot of the next one to be free,
+* writing out finished blocks meanwhile.
+*/
+static void submit_block(CRUSHER crusher) {
+    pthread_mutex_lock(&crusher->lock);
+    crusher->slots[crusher->tail % crusher->window].state = SLOT_QUEUED;
+    crusher->tail++;
+    pthread_cond_broadcast(&crusher->changed);
+    pthread_mutex_unlock(&crusher->lock);
+
+    write_done_blocks(crusher, 0);
+}
+
+
+/**
+* Writes finished blocks in order. Stops once
+* the next slot to fill is free, or, if all
+* is set, once every queued block is out.
+*/
+static void write_done_blocks(CRUSHER crusher, int all) {
+    pthread_mutex_lock(&crusher->lock);
+    for (;;) {
+        if (crusher->head == crusher->tail)
+            break;
+        if (!all && crusher->slots[crusher->tail % crusher->window].state == SLOT_FREE)
+            break;
+
+        struct Crusher_Slot *slot = &crusher->slots[crusher->head % crusher->window];
+        if (slot->state != SLOT_DONE) {
+            pthread_cond_wait(&crusher->changed, &crusher->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&crusher->lock);
+
+        pwrite_all(crusher->fd, slot->packed, slot->packed_length, crusher->offset);
+        crusher->offset += slot->packed_length;
+
+        if (crusher->count == crusher->capacity) {
+            crusher->capacity = crusher->capacity ? crusher->capacity * 2 : 64;
+            crusher->packed_lengths = realloc(crusher->packed_lengths,
+                                              crusher->capacity * sizeof(uint32_t));
+            crusher->raw_lengths = realloc(crusher->raw_lengths,
+                                           crusher->capacity * sizeof(uint32_t));
+            if (!crusher->packed_lengths || !crusher->raw_lengths)
+                handle_error("Failed to grow block table");
+        }
+        crusher->packed_lengths[crusher->count] = slot->packed_length;
+        crusher->raw_lengths[crusher->count] = slot->raw_length;
+        crusher->count++;
+
+        pthread_mutex_lock(&crusher->lock);
+        slot->raw_length = 0;
+        slot->state = SLOT_FREE;
+        crusher->head++;
+    }
+    pthread_mutex_unlock(&crusher->lock);
+}
+
+
+/**
+* BLOCK_IO_RELEASE for compression, queues the
+* last partial block, writes everything out
+* followed by the block table and footer.
+*/
+static void crusher_finish(void *ctx) {
+    CRUSHER crusher = ctx;
+
+    if (crusher->slots[crusher->tail % crusher->window].raw_length)
+        submit_block(crusher);
+    write_done_blocks(crusher, 1);
+
+    size_t table_length = crusher->count * CRUSHER_TABLE_ENTRY_BYTES;
+    uint8_t *table = malloc(table_length + CRUSHER_FOOTER_BYTES);
+    if (!table)
+        handle_error("Failed to allocate block table");
+
+    for (uint64_t b = 0; b < crusher->count; b++) {
+        put_bytes(table + b * CRUSHER_TABLE_ENTRY_BYTES, crusher->packed_lengths[b], 4);
+        put_bytes(table + b * CRUSHER_TABLE_ENTRY_BYTES + 4, crusher->raw_lengths[b], 4);
+    }
+
+    uint8_t *footer = table + table_length;
+    put_bytes(footer, crusher->offset, 8);
+    put_bytes(footer + 8, crusher->count, 8);
+    memcpy(footer + 16, CRUSHER_MAGIC, CRUSHER_MAGIC_BYTES);
+
+    pwrite_all(crusher->fd, table, table_length + CRUSHER_FOOTER_BYTES,
+               crusher->offset);
+
+    free(table);
+    free_crusher(crusher);
+}
+
+
+/**
+* BLOCK_IO_SOURCE handing out decompressed
+* blocks in order as the workers finish them.
+*/
+static size_t crusher_source(void *ctx, unsigned char *buf, size_t cap) {
+    CRUSHER crusher = ctx;
+
+    pthread_mutex_lock(&crusher->lock);
+    if (crusher->head == crusher->count) {
+        pthread_mutex_unlock(&crusher->lock);
+        return 0;
+    }
+
+    struct Crusher_Slot *slot = &crusher->slots[crusher->head % crusher->window];
+    while (slot->state != SLOT_DONE)
+        pthread_cond_wait(&crusher->changed, &crusher->lock);
+    pthread_mutex_unlock(&crusher->lock);
+
+    size_t step = slot->raw_length - crusher->head_pos;
+    if (step > cap)
+        step = cap;
+    memcpy(buf, slot->raw + crusher->head_pos, step);
+    crusher->head_pos += step;
+
+    // Hand a used up slot back
+    // to the workers.
+    if (crusher->head_pos == slot->raw_length) {
+        pthread_mutex_lock(&crusher->lock);
+        slot->state = SLOT_FREE;
+        crusher->head++;
+        crusher->head_pos = 0;
+        pthread_cond_broadcast(&crusher->changed);
+        pthread_mutex_unlock(&crusher->lock);
+    }
+
+    return step;
+}
+
+
+/**
+* BLOCK_IO_RELEASE for decompression.
+*/
+static void crusher_release(void *ctx) {
+    free_crusher(ctx);
+}
+
+
+/**
+* BLOCK_IO_PREAD for decompression. Every
+* block but the last is full, so the block
+* holding offset is found by division and
+* decompressed into a slot of its own,
+* kept for the next lookup.
+*/
+static size_t crusher_pread(void *ctx, unsigned char *buf, size_t len, off_t offset) {
+    CRUSHER crusher = ctx;
+    uint64_t seq = offset / CRUSHER_BLOCK_SIZE;
+    size_t pos = offset % CRUSHER_BLOCK_SIZE;
+
+    if (seq >= crusher->count)
+        return 0;
+
+    if (!crusher->lookup) {
+        crusher->lookup = calloc(1, sizeof(struct Crusher_Slot));
+        if (!crusher->lookup)
+            handle_error("Failed to allocate crusher");
+        crusher->lookup->raw = malloc(CRUSHER_BLOCK_SIZE);
+        crusher->lookup->packed = malloc(lzma_stream_buffer_bound(CRUSHER_BLOCK_SIZE));
+        if (!crusher->lookup->raw || !crusher->lookup->packed)
+            handle_error("Failed to allocate crusher");
+        crusher->lookup_seq = UINT64_MAX;
+    }
+
+    if (crusher->lookup_seq != seq) {
+        unpack_slot(crusher, seq, crusher->lookup);
+        crusher->lookup_seq = seq;
+    }
+
+    if (pos >= crusher->lookup->raw_length)
+        return 0;
+
+    size_t step = crusher->lookup->raw_length - pos;
+    if (step > len)
+        step = len;
+    memcpy(buf, crusher->lookup->raw + pos, step);
+
+    return step;
+}
+
+
+/**
+* Loads the block table of a compressed
+* can and works out where each block is.
+*/
+static void read_block_table(CRUSHER crusher) {
+    off_t size = lseek(crusher->fd, 0, SEEK_END);
+    uint8_t header[CRUSHER_HEADER_BYTES];
+    uint8_t footer[CRUSHER_FOOTER_BYTES];
+
+    if (size < CRUSHER_HEADER_BYTES + CRUSHER_FOOTER_BYTES ||
+        pread(crusher->fd, header, sizeof(header), 0) != sizeof(header) ||
+        pread(crusher->fd, footer, sizeof(footer), size - sizeof(footer))
+        != sizeof(footer) ||
+        memcmp(footer + 16, CRUSHER_MAGIC, CRUSHER_MAGIC_BYTES) != 0 ||
+        get_bytes(header + CRUSHER_MAGIC_BYTES, 4) != CRUSHER_BLOCK_SIZE)
+        handle_error("Compressed can corrupt");
+
+    off_t table_offset = get_bytes(footer, 8);
+    uint64_t count = get_bytes(footer + 8, 8);
+    if (table_offset < CRUSHER_HEADER_BYTES ||
+        (uint64_t) (size - CRUSHER_FOOTER_BYTES - table_offset)
+        != count * CRUSHER_TABLE_ENTRY_BYTES)
+        handle_error("Compressed can corrupt");
+
+    size_t table_length = count * CRUSHER_TABLE_ENTRY_BYTES;
+    uint8_t *table = malloc(table_length + 1);
+    crusher->packed_lengths = malloc((count + 1) * sizeof(uint32_t));
+    crusher->raw_lengths = malloc((count + 1) * sizeof(uint32_t));
+    crusher->offsets = malloc((count + 1) * sizeof(off_t));
+    if (!table || !crusher->packed_lengths || !crusher->raw_lengths ||
+        !crusher->offsets)
+        handle_error("Failed to allocate block table");
+
+    if (pread(crusher->fd, table, table_length, table_offset)
+        != (ssize_t) table_length)
+        handle_error("Compressed can corrupt");
+
+    off_t offset = CRUSHER_HEADER_BYTES;
+    size_t bound = lzma_stream_buffer_bound(CRUSHER_BLOCK_SIZE);
+    for (uint64_t b = 0; b < count; b++) {
+        crusher->packed_lengths[b] = get_bytes(table + b * CRUSHER_TABLE_ENTRY_BYTES, 4);
+        crusher->raw_lengths[b] = get_bytes(table + b * CRUSHER_TABLE_ENTRY_BYTES + 4, 4);
+        crusher->offsets[b] = offset;
+        offset += crusher->packed_lengths[b];
+
+        if (crusher->packed_lengths[b] > bound ||
+            crusher->raw_lengths[b] > CRUSHER_BLOCK_SIZE || offset > table_offset ||
+            (b + 1 < count && crusher->raw_lengths[b] != CRUSHER_BLOCK_SIZE))
+            handle_error("Compressed can corrupt");
+    }
+    free(table);
+
+    // Let the workers start on
+    // the first blocks.
+    pthread_mutex_lock(&crusher->lock);
+    crusher->count = count;
+    pthread_cond_broadcast(&crusher->changed);
+    pthread_mutex_unlock(&crusher->lock);
+}
+
+
+/**
+* pwrites all of buf at offset.
+*/
+static void pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    const uint8_t *out = buf;
+
+    while (len) {
+        ssize_t put = pwrite(fd, out, len, offset);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            handle_error("Failed to write compressed can");
+        out += put;
+        len -= put;
+        offset += put;
+    }
+}
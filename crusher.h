@@ -0,0 +1,56 @@
+#ifndef CRUSHER_H
+#define CRUSHER_H
+
+
+#include <stdint.h>
+
+#include "block_io.h"
+
+// a compressed can starts with this magic
+// and the size of its uncompressed blocks
+#define CRUSHER_MAGIC             "CRZ1"
+#define CRUSHER_MAGIC_BYTES       4
+#define CRUSHER_HEADER_BYTES      8
+
+// each block of the CAN stream is compressed
+// on its own as an xz stream at this preset,
+// every block but the last being full
+#define CRUSHER_BLOCK_SIZE        (4 << 20)
+#define CRUSHER_PRESET            3
+
+// the block table holds the compressed and
+// uncompressed length of every block and is
+// followed by a footer of the table's offset,
+// the block count and the magic
+#define CRUSHER_TABLE_ENTRY_BYTES 8
+#define CRUSHER_FOOTER_BYTES      20
+
+
+/**
+* Returns 1 if the can open on
+* fd is a compressed can.
+*/
+int is_compressed(int fd);
+
+
+/**
+* Returns a block stream over the CANs of
+* the compressed can open on fd. workers
+* threads decompress blocks ahead of the
+* reader. The stream can also be read at
+* any offset with block_io_pread. Closing
+* the stream closes fd.
+*/
+BLOCK_IO read_compressed_can(int fd, int workers);
+
+
+/**
+* Returns a block stream whose output is
+* compressed by workers threads into a
+* compressed can on fd. Closing the stream
+* writes the block table and closes fd.
+*/
+BLOCK_IO write_compressed_can(int fd, int workers);
+
+
+#endif
@@ -0,0 +1,568 @@
+/**
+* dedup.c => Content defined chunking and the chunk store
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "can.h"
+#include "crush.h"
+#include "dedup.h"
+#include "stats.h"
+#include "sum64.h"
+
+// FastCDC masks for an 8 KiB average, a harder
+// one before the average size and an easier
+// one after, which keeps chunk sizes close
+// to the average
+#define DEDUP_MASK_HARD           0x0003590703530000ULL
+#define DEDUP_MASK_EASY           0x0000d90003530000ULL
+
+// seed of the second sum64 of a chunk
+#define DEDUP_PRINT_SEED          0x9E3779B97F4A7C15ULL
+
+/**
+* Where a chunk's bytes are in the can.
+* An empty slot has length 0.
+*/
+struct Chunk_Slot {
+    uint64_t print[2];
+    uint32_t length;
+    off_t offset;
+};
+
+/**
+* Open addressing table of every chunk
+* written to the can so far.
+*/
+struct Chunk_Store_Struct {
+    struct Chunk_Slot *slots;
+    size_t capacity;
+    size_t count;
+};
+
+static uint64_t gear_table[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static void make_gear_table(void);
+static size_t cut_point(const uint8_t *data, size_t len);
+static void add_chunk(struct Chunk_List *list, const uint8_t *data, size_t len);
+static struct Chunk_Slot *find_slot(CHUNK_STORE store, struct Chunk *chunk);
+static void store_chunk(CHUNK_STORE store, struct Chunk_Slot *slot,
+                        struct Chunk *chunk, off_t offset);
+static void grow_store(CHUNK_STORE store);
+static void read_at(int fd, uint8_t *dst, size_t len, off_t offset);
+static void read_recipe(BLOCK_IO file_ptr, struct CAN_Sum *sum, uint8_t *dst,
+                        size_t len, uint64_t *remaining);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+CHUNK_STORE new_chunk_store(void) {
+    CHUNK_STORE store = calloc(1, sizeof(*store));
+    if (!store)
+        handle_error("Failed to allocate chunk store");
+
+    store->capacity = 1024;
+    store->slots = calloc(store->capacity, sizeof(struct Chunk_Slot));
+    if (!store->slots)
+        handle_error("Failed to allocate chunk store");
+
+    return store;
+}
+
+
+void free_chunk_store(CHUNK_STORE store) {
+    free(store->slots);
+    free(store);
+}
+
+
+void chunk_buffer(struct Chunk_List *list, const uint8_t *data, size_t len) {
+    pthread_once(&gear_once, make_gear_table);
+
+    list->size = len;
+    list->sum = sum64(0, data, len);
+
+    while (len) {
+        size_t cut = cut_point(data, len);
+        add_chunk(list, data, cut);
+        data += cut;
+        len -= cut;
+    }
+}
+
+
+void chunk_file(struct Chunk_List *list, char *path, uint64_t size) {
+    pthread_once(&gear_once, make_gear_table);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        handle_error("Failed to open file steam");
+    stats_call(STATS_CALL_OPEN);
+
+    uint8_t *buf = malloc(BLOCK_IO_SIZE);
+    if (!buf)
+        handle_error("Failed to allocate file buffer");
+
+    struct Sum64_State state;
+    sum64_start(&state, 0);
+    list->size = size;
+
+    // Keep the buffer topped up so a cut is
+    // only made short of the maximum chunk
+    // at the end of the file.
+    size_t held = 0;
+    uint64_t unread = size;
+    while (held || unread) {
+        while (unread && held < BLOCK_IO_SIZE) {
+            size_t want = BLOCK_IO_SIZE - held;
+            if (want > unread)
+                want = unread;
+
+            uint64_t since = stats_clock();
+            ssize_t got = read(fd, buf + held, want);
+            stats_phase(STATS_READ, since);
+            stats_call(STATS_CALL_READ);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                handle_error("Failed to read file");
+            if (got == 0)
+                handle_error("File changed size while archiving");
+
+            since = stats_clock();
+            sum64_update(&state, buf + held, got);
+            stats_phase(STATS_HASH, since);
+            held += got;
+            unread -= got;
+        }
+
+        size_t pos = 0;
+        while (pos < held && (held - pos >= DEDUP_MAX_CHUNK || !unread)) {
+            size_t cut = cut_point(buf + pos, held - pos);
+            add_chunk(list, buf + pos, cut);
+            pos += cut;
+        }
+
+        memmove(buf, buf + pos, held - pos);
+        held -= pos;
+    }
+
+    list->sum = sum64_final(&state);
+    free(buf);
+    close(fd);
+    stats_call(STATS_CALL_CLOSE);
+}
+
+
+void free_chunk_list(struct Chunk_List *list) {
+    free(list->chunks);
+    memset(list, 0, sizeof(*list));
+}
+
+
+void write_deduped_file(CAN_WRITER writer, char *path, struct stat *file_stat,
+                        struct Chunk_List *list, const uint8_t *data) {
+    BLOCK_IO can_file = writer->io;
+    CHUNK_STORE store = writer->chunks;
+    int flags = CAN_FLAG_CHUNKED;
+    size_t shared = next_CAN_shared(writer, path, &flags);
+    size_t header_length = CAN_header_length(writer->version,
+                                             CAN_stored_path_length(path, shared));
+    off_t payload = block_io_tell(can_file) + header_length;
+
+    // Decide which chunks are new before writing
+    // anything as the header needs the length of
+    // the recipe. A new chunk goes in the store
+    // straight away so repeats within the file
+    // refer back to it too.
+    off_t *refers = malloc(list->count * sizeof(off_t));
+    if (!refers)
+        handle_error("Failed to allocate chunk recipe");
+
+    uint64_t content_length = DEDUP_RECIPE_HEADER_BYTES;
+    for (size_t c = 0; c < list->count; c++) {
+        struct Chunk *chunk = &list->chunks[c];
+        struct Chunk_Slot *slot = find_slot(store, chunk);
+
+        if (slot->length) {
+            refers[c] = slot->offset;
+            content_length += DEDUP_REFERENCE_BYTES;
+            continue;
+        }
+
+        refers[c] = -1;
+        store_chunk(store, slot, chunk, payload + content_length + DEDUP_LITERAL_BYTES);
+        content_length += DEDUP_LITERAL_BYTES + chunk->length;
+    }
+
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    encode_prefixed_CAN_header(header, writer->version, flags, shared, path,
+                               file_stat->st_mode, content_length);
+    block_io_write(can_file, header, header_length);
+
+    uint64_t header_hash = CAN_header_sum(writer->version, header, header_length);
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, writer->version, header_hash);
+
+    uint8_t record[DEDUP_RECIPE_HEADER_BYTES];
+    put_bytes(record, list->size, 8);
+    put_bytes(record + 8, list->sum, 8);
+    block_io_write(can_file, record, DEDUP_RECIPE_HEADER_BYTES);
+    CAN_sum_update(&sum, record, DEDUP_RECIPE_HEADER_BYTES);
+
+    // Without the contents in memory read the
+    // file again, making sure it still cuts
+    // into the same chunks.
+    BLOCK_IO input_stream = NULL;
+    uint8_t *chunk_buf = NULL;
+    if (!data) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            handle_error("Failed to open file steam");
+        stats_call(STATS_CALL_OPEN);
+        input_stream = block_io_open_read(fd);
+
+        chunk_buf = malloc(DEDUP_MAX_CHUNK);
+        if (!chunk_buf)
+            handle_error("Failed to allocate file buffer");
+    }
+
+    for (size_t c = 0; c < list->count; c++) {
+        struct Chunk *chunk = &list->chunks[c];
+        const uint8_t *bytes = data;
+
+        if (input_stream) {
+            if (block_io_read(input_stream, chunk_buf, chunk->length) != chunk->length ||
+                sum64(0, chunk_buf, chunk->length) != chunk->print[0] ||
+                sum64(DEDUP_PRINT_SEED, chunk_buf, chunk->length) != chunk->print[1])
+                handle_error("File changed while archiving");
+            bytes = chunk_buf;
+        }
+
+        if (refers[c] < 0) {
+            record[0] = DEDUP_LITERAL;
+            put_bytes(record + 1, chunk->length, 4);
+            block_io_write(can_file, record, DEDUP_LITERAL_BYTES);
+            block_io_write(can_file, bytes, chunk->length);
+            CAN_sum_update(&sum, record, DEDUP_LITERAL_BYTES);
+            CAN_sum_update(&sum, bytes, chunk->length);
+        } else {
+            record[0] = DEDUP_REFERENCE;
+            put_bytes(record + 1, refers[c], 8);
+            put_bytes(record + 9, chunk->length, 4);
+            block_io_write(can_file, record, DEDUP_REFERENCE_BYTES);
+            CAN_sum_update(&sum, record, DEDUP_REFERENCE_BYTES);
+        }
+
+        if (data)
+            data += chunk->length;
+    }
+
+    if (input_stream) {
+        if (!block_io_eof(input_stream))
+            handle_error("File changed size while archiving");
+        block_io_close(input_stream);
+        free(chunk_buf);
+    }
+    free(refers);
+
+    uint64_t hash = CAN_sum_final(&sum);
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, writer->version, hash);
+    block_io_write(can_file, trailer, CAN_sum_bytes(writer->version));
+
+    struct CAN_Entry entry = {
+        .path = path,
+        .flags = flags,
+        .mode = file_stat->st_mode,
+        .content_length = content_length,
+        .offset = payload - header_length,
+        .payload = payload,
+        .header_hash = header_hash,
+        .hash = hash,
+        .mtime = file_stat->st_mtim,
+    };
+    record_CAN(writer, &entry);
+}
+
+
+void extract_chunked(BLOCK_IO file_ptr, struct CAN_Sum *sum,
+                     uint64_t content_length, int fd) {
+    uint64_t remaining = content_length;
+    uint8_t record[DEDUP_RECIPE_HEADER_BYTES];
+
+    read_recipe(file_ptr, sum, record, DEDUP_RECIPE_HEADER_BYTES, &remaining);
+    uint64_t size = get_bytes(record, 8);
+    uint64_t expected = get_bytes(record + 8, 8);
+
+    uint8_t *chunk_buf = malloc(DEDUP_MAX_CHUNK);
+    if (!chunk_buf)
+        handle_error("Failed to allocate file buffer");
+
+    struct Sum64_State state;
+    sum64_start(&state, 0);
+    uint64_t written = 0;
+
+    while (remaining) {
+        read_recipe(file_ptr, sum, record, 1, &remaining);
+
+        if (record[0] == DEDUP_LITERAL) {
+            read_recipe(file_ptr, sum, record + 1, DEDUP_LITERAL_BYTES - 1, &remaining);
+            uint32_t length = get_bytes(record + 1, 4);
+            if (length > DEDUP_MAX_CHUNK)
+                handle_error("Chunked CAN corrupt");
+
+            read_recipe(file_ptr, sum, chunk_buf, length, &remaining);
+            sum64_update(&state, chunk_buf, length);
+            write_block(fd, chunk_buf, length);
+            written += length;
+        } else if (record[0] == DEDUP_REFERENCE) {
+            read_recipe(file_ptr, sum, record + 1, DEDUP_REFERENCE_BYTES - 1,
+                        &remaining);
+            off_t offset = get_bytes(record + 1, 8);
+            uint32_t length = get_bytes(record + 9, 4);
+            if (length > DEDUP_MAX_CHUNK)
+                handle_error("Chunked CAN corrupt");
+
+            block_io_pread(file_ptr, chunk_buf, length, offset);
+            sum64_update(&state, chunk_buf, length);
+            write_block(fd, chunk_buf, length);
+            written += length;
+        } else {
+            handle_error("Chunked CAN corrupt");
+        }
+    }
+
+    // Referenced chunks aren't covered by this
+    // CAN's checksum, so check the rebuilt file.
+    if (written != size || sum64_final(&state) != expected)
+        handle_error("can hash incorrect");
+
+    free(chunk_buf);
+}
+
+
+void restore_chunks(CHUNK_STORE store, int fd, CAN_INDEX index) {
+    uint8_t *chunk_buf = malloc(DEDUP_MAX_CHUNK);
+    if (!chunk_buf)
+        handle_error("Failed to allocate file buffer");
+
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        if (!(entry->flags & CAN_FLAG_CHUNKED))
+            continue;
+
+        // Only literals hold chunk bytes, the
+        // rest of the recipe is stepped over.
+        off_t at = entry->payload + DEDUP_RECIPE_HEADER_BYTES;
+        off_t end = entry->payload + entry->content_length;
+        while (at < end) {
+            uint8_t record[DEDUP_REFERENCE_BYTES];
+            read_at(fd, record, 1, at);
+
+            if (record[0] == DEDUP_REFERENCE) {
+                at += DEDUP_REFERENCE_BYTES;
+                continue;
+            }
+            if (record[0] != DEDUP_LITERAL)
+                handle_error("Chunked CAN corrupt");
+
+            read_at(fd, record, DEDUP_LITERAL_BYTES, at);
+            struct Chunk chunk = {.length = get_bytes(record + 1, 4)};
+            if (chunk.length > DEDUP_MAX_CHUNK)
+                handle_error("Chunked CAN corrupt");
+
+            at += DEDUP_LITERAL_BYTES;
+            read_at(fd, chunk_buf, chunk.length, at);
+            chunk.print[0] = sum64(0, chunk_buf, chunk.length);
+            chunk.print[1] = sum64(DEDUP_PRINT_SEED, chunk_buf, chunk.length);
+
+            struct Chunk_Slot *slot = find_slot(store, &chunk);
+            if (!slot->length)
+                store_chunk(store, slot, &chunk, at);
+            at += chunk.length;
+        }
+    }
+
+    free(chunk_buf);
+}
+
+
+/**
+* Fills the gear table from a fixed seed
+* so chunk boundaries are the same in
+* every can.
+*/
+static void make_gear_table(void) {
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+
+    for (int entry = 0; entry < 256; entry++) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear_table[entry] = z ^ (z >> 31);
+    }
+}
+
+
+/**
+* Returns the length of the chunk starting
+* at data, found with a gear rolling hash
+* using FastCDC's normalised chunking. Each
+* step depends on the last so this runs a
+* byte at a time, but it is only a shift,
+* an add and a test.
+*/
+static size_t cut_point(const uint8_t *data, size_t len) {
+    if (len <= DEDUP_MIN_CHUNK)
+        return len;
+    if (len > DEDUP_MAX_CHUNK)
+        len = DEDUP_MAX_CHUNK;
+
+    size_t normal = len < DEDUP_AVG_CHUNK ? len : DEDUP_AVG_CHUNK;
+    uint64_t hash = 0;
+    size_t pos = DEDUP_MIN_CHUNK;
+
+    for (; pos < normal; pos++) {
+        hash = (hash << 1) + gear_table[data[pos]];
+        if (!(hash & DEDUP_MASK_HARD))
+            return pos;
+    }
+
+    for (; pos < len; pos++) {
+        hash = (hash << 1) + gear_table[data[pos]];
+        if (!(hash & DEDUP_MASK_EASY))
+            return pos;
+    }
+
+    return len;
+}
+
+
+/**
+* Appends a chunk of len bytes of data.
+*/
+static void add_chunk(struct Chunk_List *list, const uint8_t *data, size_t len) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->chunks = realloc(list->chunks, list->capacity * sizeof(struct Chunk));
+        if (!list->chunks)
+            handle_error("Failed to grow chunk list");
+    }
+
+    struct Chunk *chunk = &list->chunks[list->count++];
+    chunk->length = len;
+    chunk->print[0] = sum64(0, data, len);
+    chunk->print[1] = sum64(DEDUP_PRINT_SEED, data, len);
+}
+
+
+/**
+* Returns the slot holding chunk, or the
+* empty slot where it belongs.
+*/
+static struct Chunk_Slot *find_slot(CHUNK_STORE store, struct Chunk *chunk) {
+    size_t mask = store->capacity - 1;
+    size_t at = chunk->print[0] & mask;
+
+    for (;;) {
+        struct Chunk_Slot *slot = &store->slots[at];
+        if (!slot->length ||
+            (slot->length == chunk->length && slot->print[0] == chunk->print[0] &&
+             slot->print[1] == chunk->print[1]))
+            return slot;
+        at = (at + 1) & mask;
+    }
+}
+
+
+/**
+* Fills the empty slot find_slot gave
+* for chunk, whose bytes are at offset.
+*/
+static void store_chunk(CHUNK_STORE store, struct Chunk_Slot *slot,
+                        struct Chunk *chunk, off_t offset) {
+    slot->print[0] = chunk->print[0];
+    slot->print[1] = chunk->print[1];
+    slot->length = chunk->length;
+    slot->offset = offset;
+
+    if (++store->count * 2 > store->capacity)
+        grow_store(store);
+}
+
+
+/**
+* Doubles the table, keeping it
+* at most half full.
+*/
+static void grow_store(CHUNK_STORE store) {
+    struct Chunk_Slot *old = store->slots;
+    size_t old_capacity = store->capacity;
+
+    store->capacity *= 2;
+    store->slots = calloc(store->capacity, sizeof(struct Chunk_Slot));
+    if (!store->slots)
+        handle_error("Failed to grow chunk store");
+
+    for (size_t s = 0; s < old_capacity; s++) {
+        if (!old[s].length)
+            continue;
+
+        struct Chunk chunk = {
+            .length = old[s].length,
+            .print = {old[s].print[0], old[s].print[1]},
+        };
+        *find_slot(store, &chunk) = old[s];
+    }
+
+    free(old);
+}
+
+
+/**
+* preads exactly len bytes at offset.
+*/
+static void read_at(int fd, uint8_t *dst, size_t len, off_t offset) {
+    while (len) {
+        uint64_t since = stats_clock();
+        ssize_t got = pread(fd, dst, len, offset);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read can");
+        if (got == 0)
+            handle_error("Unexpected end of can");
+        dst += got;
+        len -= got;
+        offset += got;
+    }
+}
+
+
+/**
+* Reads the next len bytes of a recipe,
+* which has remaining bytes left, adding
+* them to the CAN's checksum.
+*/
+static void read_recipe(BLOCK_IO file_ptr, struct CAN_Sum *sum, uint8_t *dst,
+                        size_t len, uint64_t *remaining) {
+    if (len > *remaining)
+        handle_error("Chunked CAN corrupt");
+
+    if (block_io_read(file_ptr, dst, len) != len)
+        handle_error("Unexpected end of can");
+
+    CAN_sum_update(sum, dst, len);
+    *remaining -= len;
+}
@@ -0,0 +1,124 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "can.h"
+#include "can_index.h"
+
+// contents are cut into chunks of about the
+// average size, never smaller than the minimum
+// (bar a file's last chunk) or larger than
+// the maximum
+#define DEDUP_MIN_CHUNK           2048
+#define DEDUP_AVG_CHUNK           8192
+#define DEDUP_MAX_CHUNK           65536
+
+// a chunked CAN's contents start with the size
+// and sum64 of the whole file, followed by a
+// record for each chunk
+#define DEDUP_RECIPE_HEADER_BYTES 16
+
+// a literal record is its type and length
+// followed by the chunk's bytes
+#define DEDUP_LITERAL             'L'
+#define DEDUP_LITERAL_BYTES       5
+
+// a reference record is its type, the offset in
+// the can of an earlier literal's bytes and the
+// chunk's length
+#define DEDUP_REFERENCE           'R'
+#define DEDUP_REFERENCE_BYTES     13
+
+/**
+* One chunk of a file, identified by
+* two sum64s of its bytes.
+*/
+struct Chunk {
+    uint32_t length;
+    uint64_t print[2];
+};
+
+/**
+* The chunks of a whole file along with
+* its size and sum64.
+*/
+struct Chunk_List {
+    struct Chunk *chunks;
+    size_t count;
+    size_t capacity;
+    uint64_t size;
+    uint64_t sum;
+};
+
+typedef struct Chunk_Store_Struct *CHUNK_STORE;
+
+
+/**
+* Creates an empty store of the
+* chunks written to a can.
+*/
+CHUNK_STORE new_chunk_store(void);
+
+
+/**
+* Frees a chunk store.
+*/
+void free_chunk_store(CHUNK_STORE store);
+
+
+/**
+* Cuts len bytes of data into chunks.
+*/
+void chunk_buffer(struct Chunk_List *list, const uint8_t *data, size_t len);
+
+
+/**
+* Cuts the size bytes of the file
+* at path into chunks.
+*/
+void chunk_file(struct Chunk_List *list, char *path, uint64_t size);
+
+
+/**
+* Frees the chunks of a list.
+*/
+void free_chunk_list(struct Chunk_List *list);
+
+
+/**
+* Writes a chunked CAN for path to writer,
+* storing the bytes of chunks new to the can
+* and referring back to the rest. data holds
+* the file's contents or is NULL to read
+* them again from path.
+*/
+void write_deduped_file(CAN_WRITER writer, char *path, struct stat *file_stat,
+                        struct Chunk_List *list, const uint8_t *data);
+
+
+/**
+* Rebuilds a file from the recipe making up
+* the content_length byte contents of a
+* chunked CAN, writing it to fd. Referenced
+* chunks are read back from the can with
+* block_io_pread. Every byte of the recipe
+* is added to sum.
+*/
+void extract_chunked(BLOCK_IO file_ptr, struct CAN_Sum *sum,
+                     uint64_t content_length, int fd);
+
+
+/**
+* Adds every chunk stored in the chunked CANs of
+* index, from the can open on fd, so more can
+* be appended to it deduplicating against
+* what it already holds.
+*/
+void restore_chunks(CHUNK_STORE store, int fd, CAN_INDEX index);
+
+
+#endif
@@ -0,0 +1,417 @@
+/**
+* delta.c => Cans holding only what changed since a chain of base cans
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "can.h"
+#include "crush.h"
+#include "crusher.h"
+#include "delta.h"
+#include "stats.h"
+#include "volume.h"
+
+// a link's value in latest_CAN_links
+// notes if the CAN there is a directory
+#define DELTA_LINK_DIR            1
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static CAN_INDEX list_base_can(int fd, int workers, int *scanned);
+static void add_base_entries(DELTA_BASE base, int fd, CAN_INDEX index, int scanned);
+static int is_plain(struct Delta_Entry *entry);
+static uint64_t hash_file(struct Delta_Entry *entry, char *path);
+static int is_same_contents(struct Delta_Entry *entry, char *path);
+static int compare_gone(const void *a, const void *b);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+DELTA_BASE open_delta_base(char **pathnames, int count) {
+    DELTA_BASE base = calloc(1, sizeof(*base));
+    if (base) {
+        base->indexes = calloc(count, sizeof(CAN_INDEX));
+        base->fds = calloc(count, sizeof(int));
+    }
+    if (!base || !base->indexes || !base->fds)
+        handle_error("Failed to allocate delta base");
+
+    for (int link = 0; link < count; link++) {
+        int fd = open(pathnames[link], O_RDONLY);
+        if (fd < 0)
+            handle_error("Failed to open base can");
+        if (is_compressed(fd))
+            handle_error("Can't use a compressed can as a base");
+
+        int scanned;
+        base->fds[link] = fd;
+        base->indexes[link] = list_base_can(fd, 1, &scanned);
+        base->links++;
+        add_base_entries(base, fd, base->indexes[link], scanned);
+    }
+
+    base->latest = new_path_set(base->count);
+    base->seen = calloc(base->count + 1, 1);
+    if (!base->seen)
+        handle_error("Failed to allocate delta base");
+
+    for (size_t e = 0; e < base->count; e++)
+        path_set_add(base->latest, base->entries[e].path, e);
+
+    return base;
+}
+
+
+void delta_emit(void *delta_base, char *path, struct stat *s) {
+    DELTA_BASE base = delta_base;
+    size_t e;
+
+    if (path_set_find(base->latest, path, strlen(path), &e)) {
+        struct Delta_Entry *entry = &base->entries[e];
+        base->seen[e] = 1;
+
+        if (!(entry->flags & CAN_FLAG_DELETED) && is_unchanged_file(entry, path, s))
+            return;
+    }
+
+    base->emit(base->ctx, path, s);
+}
+
+
+void write_tombstones(DELTA_BASE base, CAN_WRITER writer) {
+    struct Delta_Entry **gone = malloc((base->count + 1) * sizeof(*gone));
+    if (!gone)
+        handle_error("Failed to allocate tombstones");
+
+    size_t count = 0;
+    for (size_t e = 0; e < base->count; e++) {
+        struct Delta_Entry *entry = &base->entries[e];
+        size_t latest;
+        path_set_find(base->latest, entry->path, strlen(entry->path), &latest);
+
+        if (latest == e && !base->seen[e] && !(entry->flags & CAN_FLAG_DELETED))
+            gone[count++] = entry;
+    }
+
+    // Taking the pathnames in reverse order
+    // removes what a directory holds first.
+    if (count)
+        qsort(gone, count, sizeof(*gone), compare_gone);
+    for (size_t g = 0; g < count; g++)
+        write_deleted_CAN(writer, gone[g]->path, gone[g]->mode);
+
+    free(gone);
+}
+
+
+void write_deleted_CAN(CAN_WRITER writer, char *path, long mode) {
+    BLOCK_IO can_file = writer->io;
+    int flags = CAN_FLAG_DELETED;
+    size_t shared = next_CAN_shared(writer, path, &flags);
+
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_prefixed_CAN_header(header, writer->version, flags,
+                                                      shared, path, mode, 0);
+    block_io_write(can_file, header, header_length);
+    off_t payload = block_io_tell(can_file);
+
+    // There are no contents, but the
+    // checksum is still finished.
+    uint64_t header_hash = CAN_header_sum(writer->version, header, header_length);
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, writer->version, header_hash);
+    uint64_t hash = CAN_sum_final(&sum);
+
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, writer->version, hash);
+    block_io_write(can_file, trailer, CAN_sum_bytes(writer->version));
+
+    struct CAN_Entry entry = {
+        .path = path,
+        .flags = flags,
+        .mode = mode,
+        .content_length = 0,
+        .offset = payload - header_length,
+        .payload = payload,
+        .header_hash = header_hash,
+        .hash = hash,
+    };
+    record_CAN(writer, &entry);
+}
+
+
+void free_delta_base(DELTA_BASE base) {
+    for (int link = 0; link < base->links; link++) {
+        free_CAN_index(base->indexes[link]);
+        close(base->fds[link]);
+    }
+
+    free_path_set(base->latest);
+    free(base->seen);
+    free(base->entries);
+    free(base->indexes);
+    free(base->fds);
+    free(base);
+}
+
+
+PATH_SET latest_CAN_links(char **chain, int links, int workers) {
+    PATH_SET latest = new_path_set(0);
+
+    for (int link = 1; link < links; link++) {
+        int fd = open(chain[link], O_RDONLY);
+        if (fd < 0)
+            handle_error("Failed to open delta can");
+
+        int scanned;
+        CAN_INDEX index = list_base_can(fd, workers, &scanned);
+        for (size_t e = 0; e < index->count; e++) {
+            struct CAN_Entry *entry = &index->entries[e];
+            int dir = S_ISDIR(entry->mode) && !(entry->flags & CAN_FLAG_DELETED);
+            path_set_add(latest, entry->path, (link << 1) | (dir ? DELTA_LINK_DIR : 0));
+        }
+
+        free_CAN_index(index);
+        close(fd);
+    }
+
+    return latest;
+}
+
+
+int is_latest_link(PATH_SET latest, char *path, int flags, long mode, size_t link) {
+    size_t value;
+    if (!path_set_find(latest, path, strlen(path), &value))
+        return link == 0;
+    if (value >> 1 == link)
+        return 1;
+
+    return (value & DELTA_LINK_DIR) && S_ISDIR(mode) && !(flags & CAN_FLAG_DELETED);
+}
+
+
+/**
+* Lists every CAN of the can open on fd,
+* from its trailing index if it has one.
+* scanned is set if it had to be read
+* CAN by CAN instead.
+*/
+static CAN_INDEX list_base_can(int fd, int workers, int *scanned) {
+    if (is_volume_manifest(fd))
+        handle_error("Can't use a multi-volume can in a chain");
+
+    CAN_INDEX index = NULL;
+    int compressed = is_compressed(fd);
+    if (!compressed)
+        index = read_CAN_index(fd);
+    *scanned = !index;
+    if (index)
+        return index;
+
+    // The scan's stream closes its
+    // fd, so give it one of its own.
+    int scan_fd = dup(fd);
+    if (scan_fd < 0)
+        handle_error("Failed to read can");
+
+    BLOCK_IO scan;
+    if (compressed)
+        scan = read_compressed_can(scan_fd, workers);
+    else
+        scan = block_io_open_read(scan_fd);
+    index = scan_CAN_index(scan);
+    block_io_close(scan);
+
+    return index;
+}
+
+
+/**
+* Adds the CANs of a base can open on fd.
+* A scanned can leaves the CAN checksums
+* unknown until they are needed.
+*/
+static void add_base_entries(DELTA_BASE base, int fd, CAN_INDEX index, int scanned) {
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *from = &index->entries[e];
+        if (is_index_CAN(from->path, from->mode))
+            continue;
+
+        if (base->count == base->capacity) {
+            base->capacity = base->capacity ? base->capacity * 2 : 256;
+            base->entries = realloc(base->entries,
+                                    base->capacity * sizeof(struct Delta_Entry));
+            if (!base->entries)
+                handle_error("Failed to grow delta base");
+        }
+
+        set_delta_entry(&base->entries[base->count++], from, fd, scanned);
+    }
+}
+
+
+void set_delta_entry(struct Delta_Entry *entry, struct CAN_Entry *from, int fd,
+                     int scanned) {
+    entry->path = from->path;
+    entry->version = from->version;
+    entry->flags = from->flags;
+    entry->mode = from->mode;
+    entry->size = from->content_length;
+    entry->header_hash = from->header_hash;
+    entry->hash = from->hash;
+    entry->fd = fd;
+    entry->payload = from->payload;
+    entry->trailer = scanned ? from->payload + (off_t) from->content_length : -1;
+    entry->mtime = from->mtime;
+
+    if (from->flags & CAN_SIZED_FLAGS) {
+        uint8_t head[CAN_FILE_SIZE_BYTES];
+        if (pread(fd, head, CAN_FILE_SIZE_BYTES, from->payload) != CAN_FILE_SIZE_BYTES)
+            handle_error("Unexpected end of can");
+        entry->size = CAN_file_size(head);
+    }
+}
+
+
+int is_unchanged_file(struct Delta_Entry *entry, char *path, struct stat *s) {
+    if (entry->mode != s->st_mode)
+        return 0;
+    if (S_ISDIR(s->st_mode))
+        return 1;
+    if (entry->size != (uint64_t) s->st_size)
+        return 0;
+
+    if (is_kept_mtime(entry->mtime, s->st_mtim))
+        return 1;
+    if (!is_plain(entry))
+        return 0;
+
+    // A v1 checksum is a single byte, too
+    // weak to tell an edit by.
+    if (entry->version == CAN_FORMAT_V2)
+        return hash_file(entry, path) == entry->hash;
+    return is_same_contents(entry, path);
+}
+
+
+/**
+* Only a plain CAN holds the
+* file as it is on disk.
+*/
+static int is_plain(struct Delta_Entry *entry) {
+    return S_ISREG(entry->mode) &&
+           !(entry->flags & ~(CAN_FLAG_ALIGNED | CAN_FLAG_PREFIXED));
+}
+
+
+/**
+* Works out the checksum the CAN of entry
+* would have holding the file at path,
+* reading the stored one if it isn't
+* known yet. Returns the stored one
+* inverted if the file can't be read.
+*/
+static uint64_t hash_file(struct Delta_Entry *entry, char *path) {
+    if (entry->trailer >= 0) {
+        uint8_t trailer[CAN_SUM64_BYTES];
+        if (pread(entry->fd, trailer, CAN_SUM64_BYTES, entry->trailer)
+            != CAN_SUM64_BYTES)
+            handle_error("Unexpected end of can");
+        entry->hash = get_CAN_sum(trailer, CAN_FORMAT_V2);
+        entry->trailer = -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return ~entry->hash;
+    stats_call(STATS_CALL_OPEN);
+
+    unsigned char *buf = malloc(BLOCK_IO_SIZE);
+    if (!buf)
+        handle_error("Failed to allocate block buffer");
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, CAN_FORMAT_V2, entry->header_hash);
+    ssize_t got;
+    for (;;) {
+        uint64_t since = stats_clock();
+        got = read(fd, buf, BLOCK_IO_SIZE);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        CAN_sum_update(&sum, buf, got);
+    }
+
+    free(buf);
+    close(fd);
+    stats_call(STATS_CALL_CLOSE);
+
+    return got < 0 ? ~entry->hash : CAN_sum_final(&sum);
+}
+
+
+/**
+* Returns 1 if the file at path holds
+* the bytes entry's CAN does, read from
+* both side by side.
+*/
+static int is_same_contents(struct Delta_Entry *entry, char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    stats_call(STATS_CALL_OPEN);
+
+    unsigned char *buf = malloc(2 * BLOCK_IO_SIZE);
+    if (!buf)
+        handle_error("Failed to allocate block buffer");
+    unsigned char *stored = buf + BLOCK_IO_SIZE;
+
+    int same = 1;
+    uint64_t done = 0;
+    while (same && done < entry->size) {
+        uint64_t left = entry->size - done;
+        size_t step = left < BLOCK_IO_SIZE ? left : BLOCK_IO_SIZE;
+
+        uint64_t since = stats_clock();
+        ssize_t got = pread(fd, buf, step, done);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            same = 0;
+            break;
+        }
+        if (pread(entry->fd, stored, got, entry->payload + done) != got)
+            handle_error("Unexpected end of can");
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+
+        same = memcmp(buf, stored, got) == 0;
+        done += got;
+    }
+
+    free(buf);
+    close(fd);
+    stats_call(STATS_CALL_CLOSE);
+
+    return same;
+}
+
+
+/**
+* Orders tombstones by pathname,
+* last first.
+*/
+static int compare_gone(const void *a, const void *b) {
+    const struct Delta_Entry *left = *(const struct Delta_Entry **) a;
+    const struct Delta_Entry *right = *(const struct Delta_Entry **) b;
+
+    return strcmp(right->path, left->path);
+}
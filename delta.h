@@ -0,0 +1,141 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "can.h"
+#include "path_set.h"
+
+/**
+* What a chain of base cans, or the can
+* -u adds to, holds for one pathname.
+* size is that of the file held, payload
+* where its contents start in the can
+* open on fd, and hash is only known once
+* trailer, the offset of its checksum,
+* has been read, being -1 after. mtime
+* is the one the can's index kept for
+* the file, zero if none.
+*/
+struct Delta_Entry {
+    char *path;
+    int version;
+    int flags;
+    long mode;
+    uint64_t size;
+    uint64_t header_hash;
+    uint64_t hash;
+    int fd;
+    off_t payload;
+    off_t trailer;
+    struct timespec mtime;
+};
+
+/**
+* The merged state of a chain of base cans.
+* latest maps each pathname to its entry
+* from the newest can holding it and seen
+* marks the entries a walk came across.
+* Paths that changed are passed on to
+* emit with ctx.
+*/
+struct Delta_Base_Struct {
+    struct Delta_Entry *entries;
+    size_t count;
+    size_t capacity;
+    PATH_SET latest;
+    char *seen;
+    CAN_INDEX *indexes;
+    int *fds;
+    int links;
+    CAN_EMIT emit;
+    void *ctx;
+};
+
+typedef struct Delta_Base_Struct *DELTA_BASE;
+
+
+/**
+* Reads the count cans named by pathnames,
+* oldest first, as the chain a delta is
+* made against. A later can's CAN for a
+* pathname replaces an earlier one's.
+*/
+DELTA_BASE open_delta_base(char **pathnames, int count);
+
+
+/**
+* A CAN_EMIT passing path on to the base's
+* emit unless the chain already holds it
+* as it is, by is_unchanged_file.
+*/
+void delta_emit(void *delta_base, char *path, struct stat *s);
+
+
+/**
+* Fills entry with what the CAN from, of the
+* can open on fd, holds. A scanned can's
+* CAN checksum is read when first needed.
+*/
+void set_delta_entry(struct Delta_Entry *entry, struct CAN_Entry *from, int fd,
+                     int scanned);
+
+
+/**
+* Returns 1 if the file s describes at path
+* is the one entry holds, judged by mode,
+* size, the mtime kept for it and, failing
+* that, the contents of a plain CAN: their
+* checksum in v2, the bytes themselves in v1.
+*/
+int is_unchanged_file(struct Delta_Entry *entry, char *path, struct stat *s);
+
+
+/**
+* Writes a deleted CAN to writer for every
+* pathname the chain holds that the walk
+* never came across, those below a
+* directory ahead of it.
+*/
+void write_tombstones(DELTA_BASE base, CAN_WRITER writer);
+
+
+/**
+* Writes a CAN saying path, which had the
+* given mode, no longer exists.
+*/
+void write_deleted_CAN(CAN_WRITER writer, char *path, long mode);
+
+
+/**
+* Frees a base and closes its cans.
+*/
+void free_delta_base(DELTA_BASE base);
+
+
+/**
+* Maps every pathname held by the deltas of
+* a chain of links cans, every can after the
+* first, to the newest link holding it.
+* Compressed cans are read on workers
+* threads.
+*/
+PATH_SET latest_CAN_links(char **chain, int links, int workers);
+
+
+/**
+* Returns 1 if a CAN with flags and mode for
+* path from the given link of a chain is to
+* be extracted. Only the newest link holding
+* a pathname is, other than a directory that
+* stays one, which the first link holding
+* it makes so what is below can follow.
+*/
+int is_latest_link(PATH_SET latest, char *path, int flags, long mode, size_t link);
+
+
+#endif
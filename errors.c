@@ -0,0 +1,22 @@
+/**
+* errors.c => Ending the run on an error
+*
+* Kept apart from helpers.c so libcan.a,
+* which returns its errors, holds nothing
+* that exits.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "crush.h"
+
+
+/**
+* prints an error msg to standerr.
+*/
+void handle_error(char *error_desc){
+    fprintf(stderr, "ERROR: %s\n", error_desc);
+    exit(1);
+}
@@ -0,0 +1,443 @@
+#include <pthread.h>
+
+#include "can.h"
+#include "copy_range.h"
+#include "crush.h"
+#include "dedup.h"
+#include "pieces.h"
+#include "sparse.h"
+#include "stats.h"
+#include "extract_pool.h"
+
+/**
+* A pieced file whose pieces workers write
+* at once. Whoever writes the last checks
+* the CAN's checksum over the piece
+* checksums, which each leaves in sums.
+*/
+struct Extract_File {
+    struct CAN_Entry *entry;
+    int fd;
+    uint64_t size;
+    uint64_t piece_bytes;
+    uint64_t pieces;
+    uint64_t left;
+    uint64_t since;
+    uint8_t head[PIECES_HEADER_BYTES];
+    uint64_t *sums;
+};
+
+/**
+* One worker's share of the index, a whole
+* CAN or, if file is set, one piece.
+*/
+struct Extract_Task {
+    struct CAN_Entry *entry;
+    struct Extract_File *file;
+    uint64_t piece;
+};
+
+struct Extract_Pool {
+    int *can_fds;
+    int check;
+    struct Extract_Task *tasks;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+/**
+* The part of the can holding one
+* CAN's contents, read with pread.
+*/
+struct Extract_Range {
+    int can_fd;
+    off_t offset;
+    uint64_t remaining;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static void add_task(struct Extract_Pool *pool, struct CAN_Entry *entry,
+                     struct Extract_File *file, uint64_t piece);
+static void add_pieces(struct Extract_Pool *pool, struct CAN_Entry *entry);
+static void *extract_thread(void *arg);
+static void extract_piece(int can_fd, struct Extract_Task *task, unsigned char *buf);
+static void finish_pieces(int can_fd, struct Extract_File *file, unsigned char *buf);
+static void extract_entry(int can_fd, struct CAN_Entry *entry, unsigned char *buf,
+                          int check);
+static void extract_sized_entry(int can_fd, struct CAN_Entry *entry,
+                                struct CAN_Sum *sum, int new_file);
+static size_t range_source(void *ctx, unsigned char *buf, size_t cap);
+static size_t range_pread(void *ctx, unsigned char *buf, size_t len, off_t offset);
+static void read_exact(int can_fd, unsigned char *buf, size_t len, off_t offset);
+static void write_exact(int fd, const unsigned char *buf, size_t len, off_t offset);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+void extract_pool_run(int can_fd, CAN_INDEX index, int workers, int check) {
+    extract_volumes_run(&can_fd, index, workers, check);
+}
+
+
+void extract_volumes_run(int *can_fds, CAN_INDEX index, int workers, int check) {
+    struct Extract_Pool pool = {
+        .can_fds = can_fds,
+        .check = check,
+        .next = 0,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // Every directory exists before any
+    // file is written into it.
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        if (S_ISDIR(entry->mode))
+            make_extracted_dir(entry->path, entry->mode);
+    }
+
+    // A pieced file is shared out a piece
+    // at a time so workers write it at
+    // once, anything else whole.
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        if (entry->flags & CAN_FLAG_PIECED)
+            add_pieces(&pool, entry);
+        else
+            add_task(&pool, entry, NULL, 0);
+    }
+
+    if (workers <= 1) {
+        extract_thread(&pool);
+        pthread_mutex_destroy(&pool.lock);
+        free(pool.tasks);
+        return;
+    }
+
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (!threads)
+        handle_error("Failed to allocate extract threads");
+
+    for (int w = 0; w < workers; w++) {
+        if (pthread_create(&threads[w], NULL, extract_thread, &pool) != 0)
+            handle_error("Failed to start extract thread");
+    }
+
+    for (int w = 0; w < workers; w++)
+        pthread_join(threads[w], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.tasks);
+    free(threads);
+}
+
+
+static void add_task(struct Extract_Pool *pool, struct CAN_Entry *entry,
+                     struct Extract_File *file, uint64_t piece) {
+    if (pool->count == pool->capacity) {
+        pool->capacity = pool->capacity ? pool->capacity * 2 : 256;
+        pool->tasks = realloc(pool->tasks, pool->capacity * sizeof(struct Extract_Task));
+        if (!pool->tasks)
+            handle_error("Failed to grow extract tasks");
+    }
+
+    struct Extract_Task *task = &pool->tasks[pool->count++];
+    task->entry = entry;
+    task->file = file;
+    task->piece = piece;
+}
+
+
+/**
+* Creates a pieced file at its full size,
+* so pieces can be written anywhere in it,
+* and adds a task for each piece.
+*/
+static void add_pieces(struct Extract_Pool *pool, struct CAN_Entry *entry) {
+    struct Extract_File *file = calloc(1, sizeof(*file));
+    if (!file)
+        handle_error("Failed to allocate extract file");
+
+    int can_fd = pool->can_fds[entry->volume];
+    file->entry = entry;
+    file->since = stats_clock();
+    read_exact(can_fd, file->head, PIECES_HEADER_BYTES, entry->payload);
+    if (entry->content_length < PIECES_HEADER_BYTES ||
+        !get_pieces_header(file->head, entry->content_length, &file->size,
+                           &file->piece_bytes))
+        handle_error("Pieced CAN corrupt");
+
+    file->pieces = pieces_count(file->size, file->piece_bytes);
+    file->left = file->pieces;
+    file->sums = calloc(file->pieces ? file->pieces : 1, sizeof(uint64_t));
+    if (!file->sums)
+        handle_error("Failed to allocate extract file");
+
+    file->fd = open_extracted_file(entry->path);
+    if (ftruncate(file->fd, file->size) != 0)
+        handle_error("Failed to write file");
+
+    if (!file->pieces) {
+        unsigned char trailer[CAN_MAX_SUM_BYTES];
+        finish_pieces(can_fd, file, trailer);
+        return;
+    }
+
+    for (uint64_t piece = 0; piece < file->pieces; piece++)
+        add_task(pool, entry, file, piece);
+}
+
+
+/**
+* Takes tasks one at a time
+* until none are left.
+*/
+static void *extract_thread(void *arg) {
+    struct Extract_Pool *pool = arg;
+
+    void *buf = NULL;
+    if (posix_memalign(&buf, BLOCK_IO_ALIGN, BLOCK_IO_SIZE) != 0)
+        handle_error("Failed to allocate block buffer");
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t t = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (t >= pool->count)
+            break;
+
+        struct Extract_Task *task = &pool->tasks[t];
+        int can_fd = pool->can_fds[task->entry->volume];
+        if (task->file)
+            extract_piece(can_fd, task, buf);
+        else
+            extract_entry(can_fd, task->entry, buf, pool->check);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+
+/**
+* Writes one piece of a pieced file where
+* it belongs and checks it, finishing the
+* file if it is the last to be written.
+*/
+static void extract_piece(int can_fd, struct Extract_Task *task, unsigned char *buf) {
+    struct Extract_File *file = task->file;
+    struct CAN_Entry *entry = task->entry;
+
+    off_t from = entry->payload + piece_offset(file->piece_bytes, task->piece);
+    off_t to = task->piece * file->piece_bytes;
+    uint64_t remaining = piece_length(file->size, file->piece_bytes, task->piece);
+
+    struct CAN_Sum sum;
+    piece_sum_start(&sum, entry->header_hash, task->piece);
+    while (remaining) {
+        size_t step = remaining < BLOCK_IO_SIZE ? remaining : BLOCK_IO_SIZE;
+        read_exact(can_fd, buf, step, from);
+
+        CAN_sum_update(&sum, buf, step);
+        write_exact(file->fd, buf, step, to);
+        from += step;
+        to += step;
+        remaining -= step;
+    }
+
+    read_exact(can_fd, buf, CAN_SUM64_BYTES, from);
+    file->sums[task->piece] = get_CAN_sum(buf, CAN_FORMAT_V2);
+    if (file->sums[task->piece] != CAN_sum_final(&sum))
+        handle_error("can hash incorrect");
+
+    if (__atomic_sub_fetch(&file->left, 1, __ATOMIC_ACQ_REL) == 0)
+        finish_pieces(can_fd, file, buf);
+}
+
+
+/**
+* Checks a pieced CAN's own checksum once
+* all its pieces are written, and gives
+* the file its mode.
+*/
+static void finish_pieces(int can_fd, struct Extract_File *file, unsigned char *buf) {
+    struct CAN_Entry *entry = file->entry;
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, CAN_FORMAT_V2, entry->header_hash);
+    CAN_sum_update(&sum, file->head, PIECES_HEADER_BYTES);
+    for (uint64_t piece = 0; piece < file->pieces; piece++) {
+        uint8_t stored[CAN_SUM64_BYTES];
+        put_CAN_sum(stored, CAN_FORMAT_V2, file->sums[piece]);
+        CAN_sum_update(&sum, stored, CAN_SUM64_BYTES);
+    }
+
+    read_exact(can_fd, buf, CAN_SUM64_BYTES, entry->payload + entry->content_length);
+    if (get_CAN_sum(buf, CAN_FORMAT_V2) != CAN_sum_final(&sum))
+        handle_error("can hash incorrect");
+
+    if (chmod(entry->path, entry->mode) != 0)
+        handle_error("Failed to change permissions");
+
+    close(file->fd);
+    stats_call(STATS_CALL_CHMOD);
+    stats_call(STATS_CALL_CLOSE);
+    stats_entry(entry->path, file->size, file->since);
+
+    free(file->sums);
+    free(file);
+}
+
+
+/**
+* Writes out one file CAN and checks its hash,
+* continuing the chain from the header hash
+* recorded when the index was built. An
+* aligned CAN is copied without being
+* read, and checked as check says.
+*/
+static void extract_entry(int can_fd, struct CAN_Entry *entry, unsigned char *buf,
+                          int check) {
+    uint64_t since = stats_clock();
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, entry->version, entry->header_hash);
+    int new_file = -1;
+
+    if (!S_ISDIR(entry->mode))
+        new_file = open_extracted_file(entry->path);
+
+    off_t offset = entry->payload;
+    uint64_t remaining = entry->content_length;
+    if (entry->flags & CAN_SIZED_FLAGS) {
+        extract_sized_entry(can_fd, entry, &sum, new_file);
+        offset += remaining;
+        remaining = 0;
+    } else if (entry->flags & CAN_FLAG_ALIGNED) {
+        copy_range(can_fd, offset, remaining, new_file);
+        if (check == CAN_CHECK_MMAP)
+            sum_mapped_range(&sum, can_fd, offset, remaining);
+        offset += remaining;
+        remaining = 0;
+    }
+
+    while (remaining) {
+        size_t step = remaining < BLOCK_IO_SIZE ? remaining : BLOCK_IO_SIZE;
+        read_exact(can_fd, buf, step, offset);
+
+        CAN_sum_update(&sum, buf, step);
+        write_block(new_file, buf, step);
+        offset += step;
+        remaining -= step;
+    }
+
+    int checked = !(entry->flags & CAN_FLAG_ALIGNED) || check != CAN_CHECK_OFF;
+    read_exact(can_fd, buf, CAN_sum_bytes(entry->version), offset);
+    if (checked && get_CAN_sum(buf, entry->version) != CAN_sum_final(&sum))
+        handle_error("can hash incorrect");
+
+    if (new_file < 0) {
+        stats_entry(entry->path, 0, since);
+        return;
+    }
+
+    if (chmod(entry->path, entry->mode) != 0)
+        handle_error("Failed to change permissions");
+
+    close(new_file);
+    stats_call(STATS_CALL_CHMOD);
+    stats_call(STATS_CALL_CLOSE);
+    stats_entry(entry->path, entry->content_length, since);
+}
+
+
+/**
+* Rebuilds a chunked or sparse file, streaming
+* its contents from the can and reading back
+* any chunks it refers to from wherever
+* they are.
+*/
+static void extract_sized_entry(int can_fd, struct CAN_Entry *entry,
+                                struct CAN_Sum *sum, int new_file) {
+    struct Extract_Range range = {
+        .can_fd = can_fd,
+        .offset = entry->payload,
+        .remaining = entry->content_length,
+    };
+
+    BLOCK_IO contents = block_io_open_source(range_source, NULL, &range);
+    block_io_set_pread(contents, range_pread);
+    if (entry->flags & CAN_FLAG_CHUNKED)
+        extract_chunked(contents, sum, entry->content_length, new_file);
+    else
+        extract_sparse(contents, sum, entry->content_length, new_file);
+    block_io_close(contents);
+}
+
+
+/**
+* Supplies the next part of a range.
+*/
+static size_t range_source(void *ctx, unsigned char *buf, size_t cap) {
+    struct Extract_Range *range = ctx;
+    size_t step = range->remaining < cap ? range->remaining : cap;
+
+    read_exact(range->can_fd, buf, step, range->offset);
+    range->offset += step;
+    range->remaining -= step;
+    return step;
+}
+
+
+/**
+* Reads anywhere in the can
+* a range is part of.
+*/
+static size_t range_pread(void *ctx, unsigned char *buf, size_t len, off_t offset) {
+    struct Extract_Range *range = ctx;
+
+    read_exact(range->can_fd, buf, len, offset);
+    return len;
+}
+
+
+/**
+* preads exactly len bytes from the can.
+*/
+static void read_exact(int can_fd, unsigned char *buf, size_t len, off_t offset) {
+    while (len) {
+        uint64_t since = stats_clock();
+        ssize_t got = pread(can_fd, buf, len, offset);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read can");
+        if (got == 0)
+            handle_error("Unexpected end of can");
+        buf += got;
+        len -= got;
+        offset += got;
+    }
+}
+
+
+/**
+* pwrites exactly len bytes to a file.
+*/
+static void write_exact(int fd, const unsigned char *buf, size_t len, off_t offset) {
+    while (len) {
+        uint64_t since = stats_clock();
+        ssize_t put = pwrite(fd, buf, len, offset);
+        stats_phase(STATS_WRITE, since);
+        stats_call(STATS_CALL_WRITE);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            handle_error("Failed to write file");
+        buf += put;
+        len -= put;
+        offset += put;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef EXTRACT_POOL_H
+#define EXTRACT_POOL_H
+
+
+#include "can_index.h"
+
+/**
+* Extracts every CAN in index from the can
+* open on can_fd. Directories are created
+* first, in archive order, then workers
+* threads write files concurrently with
+* pread, each checking its own CAN's hash.
+* The pieces of a pieced file are shared
+* out to be written concurrently too.
+* A single worker runs on the calling thread.
+* check says how aligned CANs, copied out
+* without being read, are checked.
+*/
+void extract_pool_run(int can_fd, CAN_INDEX index, int workers, int check);
+
+
+/**
+* Extracts every CAN in index like
+* extract_pool_run, each from the can
+* open on can_fds[entry->volume], so
+* the volumes of a multi-volume can
+* are read at once.
+*/
+void extract_volumes_run(int *can_fds, CAN_INDEX index, int workers, int check);
+
+
+#endif
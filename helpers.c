@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_GATHER 1
+#endif
+
+#include "crush.h"
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static void hash_group(int kernel, uint8_t *hashes, const uint8_t **bufs,
+                       const size_t *lens, int lanes);
+static void hash_lanes_scalar(uint8_t *hash, const uint8_t **at, int lanes,
+                              size_t steps);
+#ifdef HAVE_GATHER
+static void hash_lanes_avx2(uint8_t *hash, const uint8_t **at, size_t steps);
+static void hash_lanes_avx512(uint8_t *hash, const uint8_t **at, size_t steps);
+#endif
+/////////////////////////////////////////////////////////////////////////////////
+
+
+//                                  HELPERS
+////////////////////////////////////////////////////////////////////////////////
+
+
+void put_bytes(uint8_t *out, uint64_t value, int bytes) {
+    for (int sub = bytes - 1; sub >= 0; sub--)
+        *out++ = value >> (sub * 8);
+}
+
+
+uint64_t get_bytes(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int byte = 0; byte < bytes; byte++)
+        value = (value << 8) | in[byte];
+
+    return value;
+}
+
+
+// Lookup table for a simple Pearson hash, with
+// padding so a 4 byte gather at any index
+// stays inside it
+
+const uint8_t crush_hash_table[256 + 3] = {
+    241, 18,  181, 164, 92,  237, 100, 216, 183, 107, 2,   12,  43,  246, 90,
+    143, 251, 49,  228, 134, 215, 20,  193, 172, 140, 227, 148, 118, 57,  72,
+    119, 174, 78,  14,  97,  3,   208, 252, 11,  195, 31,  28,  121, 206, 149,
+    23,  83,  154, 223, 109, 89,  10,  178, 243, 42,  194, 221, 131, 212, 94,
+    205, 240, 161, 7,   62,  214, 222, 219, 1,   84,  95,  58,  103, 60,  33,
+    111, 188, 218, 186, 166, 146, 189, 201, 155, 68,  145, 44,  163, 69,  196,
+    115, 231, 61,  157, 165, 213, 139, 112, 173, 191, 142, 88,  106, 250, 8,
+    127, 26,  126, 0,   96,  52,  182, 113, 38,  242, 48,  204, 160, 15,  54,
+    158, 192, 81,  125, 245, 239, 101, 17,  136, 110, 24,  53,  132, 117, 102,
+    153, 226, 4,   203, 199, 16,  249, 211, 167, 55,  255, 254, 116, 122, 13,
+    236, 93,  144, 86,  59,  76,  150, 162, 207, 77,  176, 32,  124, 171, 29,
+    45,  30,  67,  184, 51,  22,  105, 170, 253, 180, 187, 130, 156, 98,  159,
+    220, 40,  133, 135, 114, 147, 75,  73,  210, 21,  129, 39,  138, 91,  41,
+    235, 47,  185, 9,   82,  64,  87,  244, 50,  74,  233, 175, 247, 120, 6,
+    169, 85,  66,  104, 80,  71,  230, 152, 225, 34,  248, 198, 63,  168, 179,
+    141, 137, 5,   19,  79,  232, 128, 202, 46,  70,  37,  209, 217, 123, 27,
+    177, 25,  56,  65,  229, 36,  197, 234, 108, 35,  151, 238, 200, 224, 99,
+    190, 0,   0,   0
+};
+
+// Given the current hash value and a byte
+// crush_hash returns the new hash value
+uint8_t crush_hash(uint8_t hash, uint8_t byte) {
+    return crush_hash_table[hash ^ byte];
+}
+
+
+// Folds every byte of buf into hash, equivalent
+// to calling crush_hash once per byte.
+uint8_t crush_hash_buf(uint8_t hash, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        hash = crush_hash_table[hash ^ buf[i]];
+
+    return hash;
+}
+
+
+int crush_hash_widest_kernel(void) {
+#ifdef HAVE_GATHER
+    if (__builtin_cpu_supports("avx512f"))
+        return CRUSH_HASH_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return CRUSH_HASH_AVX2;
+#endif
+    return CRUSH_HASH_SCALAR;
+}
+
+
+void crush_hash_lanes(uint8_t *hashes, const uint8_t **bufs, const size_t *lens,
+                      int lanes) {
+    crush_hash_lanes_on(CRUSH_HASH_SCALAR, hashes, bufs, lens, lanes);
+}
+
+
+void crush_hash_lanes_on(int kernel, uint8_t *hashes, const uint8_t **bufs,
+                         const size_t *lens, int lanes) {
+    for (int first = 0; first < lanes; first += CRUSH_HASH_LANES) {
+        int group = lanes - first < CRUSH_HASH_LANES ? lanes - first : CRUSH_HASH_LANES;
+        hash_group(kernel, hashes + first, bufs + first, lens + first, group);
+    }
+}
+
+
+/**
+* Hashes up to CRUSH_HASH_LANES buffers in
+* lockstep, as far as the shortest one left
+* goes each time, then retires the lanes
+* that have run out by swapping the last
+* lane in. Once too few lanes are left
+* for a gather they finish on scalar.
+*/
+static void hash_group(int kernel, uint8_t *hashes, const uint8_t **bufs,
+                       const size_t *lens, int lanes) {
+    uint8_t hash[CRUSH_HASH_LANES];
+    const uint8_t *at[CRUSH_HASH_LANES];
+    size_t left[CRUSH_HASH_LANES];
+    int slot[CRUSH_HASH_LANES];
+
+    for (int l = 0; l < lanes; l++) {
+        hash[l] = hashes[l];
+        at[l] = bufs[l];
+        left[l] = lens[l];
+        slot[l] = l;
+    }
+
+    int active = lanes;
+    while (active) {
+        size_t steps = left[0];
+        for (int l = 1; l < active; l++)
+            if (left[l] < steps)
+                steps = left[l];
+
+        if (steps) {
+#ifdef HAVE_GATHER
+            if (kernel == CRUSH_HASH_AVX512 && active == 16 &&
+                __builtin_cpu_supports("avx512f"))
+                hash_lanes_avx512(hash, at, steps);
+            else if (kernel >= CRUSH_HASH_AVX2 && active >= 8 &&
+                     __builtin_cpu_supports("avx2")) {
+                hash_lanes_avx2(hash, at, steps);
+                hash_lanes_scalar(hash + 8, at + 8, active - 8, steps);
+            } else
+#endif
+                hash_lanes_scalar(hash, at, active, steps);
+        }
+
+        for (int l = 0; l < active;) {
+            at[l] += steps;
+            left[l] -= steps;
+            if (left[l]) {
+                l++;
+                continue;
+            }
+
+            hashes[slot[l]] = hash[l];
+            active--;
+            hash[l] = hash[active];
+            at[l] = at[active];
+            left[l] = left[active];
+            slot[l] = slot[active];
+        }
+    }
+}
+
+
+/**
+* Advances each lane's hash over steps bytes,
+* 8 or 4 lanes at a time in registers so
+* their table lookups don't wait on each
+* other.
+*/
+static void hash_lanes_scalar(uint8_t *hash, const uint8_t **at, int lanes,
+                              size_t steps) {
+    int l = 0;
+    for (; l + 8 <= lanes; l += 8) {
+        uint8_t h0 = hash[l], h1 = hash[l + 1], h2 = hash[l + 2], h3 = hash[l + 3];
+        uint8_t h4 = hash[l + 4], h5 = hash[l + 5], h6 = hash[l + 6], h7 = hash[l + 7];
+        const uint8_t *a0 = at[l], *a1 = at[l + 1], *a2 = at[l + 2], *a3 = at[l + 3];
+        const uint8_t *a4 = at[l + 4], *a5 = at[l + 5], *a6 = at[l + 6], *a7 = at[l + 7];
+        for (size_t i = 0; i < steps; i++) {
+            h0 = crush_hash_table[h0 ^ a0[i]];
+            h1 = crush_hash_table[h1 ^ a1[i]];
+            h2 = crush_hash_table[h2 ^ a2[i]];
+            h3 = crush_hash_table[h3 ^ a3[i]];
+            h4 = crush_hash_table[h4 ^ a4[i]];
+            h5 = crush_hash_table[h5 ^ a5[i]];
+            h6 = crush_hash_table[h6 ^ a6[i]];
+            h7 = crush_hash_table[h7 ^ a7[i]];
+        }
+        hash[l] = h0;
+        hash[l + 1] = h1;
+        hash[l + 2] = h2;
+        hash[l + 3] = h3;
+        hash[l + 4] = h4;
+        hash[l + 5] = h5;
+        hash[l + 6] = h6;
+        hash[l + 7] = h7;
+    }
+
+    for (; l + 4 <= lanes; l += 4) {
+        uint8_t h0 = hash[l], h1 = hash[l + 1], h2 = hash[l + 2], h3 = hash[l + 3];
+        const uint8_t *a0 = at[l], *a1 = at[l + 1], *a2 = at[l + 2], *a3 = at[l + 3];
+        for (size_t i = 0; i < steps; i++) {
+            h0 = crush_hash_table[h0 ^ a0[i]];
+            h1 = crush_hash_table[h1 ^ a1[i]];
+            h2 = crush_hash_table[h2 ^ a2[i]];
+            h3 = crush_hash_table[h3 ^ a3[i]];
+        }
+        hash[l] = h0;
+        hash[l + 1] = h1;
+        hash[l + 2] = h2;
+        hash[l + 3] = h3;
+    }
+
+    for (; l < lanes; l++)
+        hash[l] = crush_hash_buf(hash[l], at[l], steps);
+}
+
+
+#ifdef HAVE_GATHER
+
+/**
+* Reads 4 bytes of a lane, which
+* may not be aligned.
+*/
+static inline int load_word(const uint8_t *at) {
+    int word;
+    memcpy(&word, at, sizeof(word));
+    return word;
+}
+
+
+/**
+* Advances the first 8 lanes over steps
+* bytes, each 32 bit lane of a vector
+* holding one hash and every step one
+* gather from the table. 4 bytes of
+* each lane are loaded at a time.
+*/
+__attribute__((target("avx2")))
+static void hash_lanes_avx2(uint8_t *hash, const uint8_t **at, size_t steps) {
+    const int *table = (const int *) crush_hash_table;
+    const __m256i low = _mm256_set1_epi32(0xff);
+    __m256i h = _mm256_setr_epi32(hash[0], hash[1], hash[2], hash[3],
+                                  hash[4], hash[5], hash[6], hash[7]);
+
+    size_t i = 0;
+    for (; i + 4 <= steps; i += 4) {
+        __m256i words = _mm256_setr_epi32(load_word(at[0] + i), load_word(at[1] + i),
+                                          load_word(at[2] + i), load_word(at[3] + i),
+                                          load_word(at[4] + i), load_word(at[5] + i),
+                                          load_word(at[6] + i), load_word(at[7] + i));
+        for (int byte = 0; byte < 4; byte++) {
+            __m256i index = _mm256_and_si256(_mm256_xor_si256(h, words), low);
+            h = _mm256_and_si256(_mm256_i32gather_epi32(table, index, 1), low);
+            words = _mm256_srli_epi32(words, 8);
+        }
+    }
+
+    int out[8];
+    _mm256_storeu_si256((__m256i *) out, h);
+    for (int l = 0; l < 8; l++) {
+        hash[l] = out[l];
+        for (size_t tail = i; tail < steps; tail++)
+            hash[l] = crush_hash_table[hash[l] ^ at[l][tail]];
+    }
+}
+
+
+/**
+* The same as hash_lanes_avx2 for all
+* 16 lanes in one vector.
+*/
+__attribute__((target("avx512f")))
+static void hash_lanes_avx512(uint8_t *hash, const uint8_t **at, size_t steps) {
+    const int *table = (const int *) crush_hash_table;
+    const __m512i low = _mm512_set1_epi32(0xff);
+    __m512i h = _mm512_set_epi32(hash[15], hash[14], hash[13], hash[12],
+                                 hash[11], hash[10], hash[9], hash[8],
+                                 hash[7], hash[6], hash[5], hash[4],
+                                 hash[3], hash[2], hash[1], hash[0]);
+
+    size_t i = 0;
+    for (; i + 4 <= steps; i += 4) {
+        __m512i words = _mm512_set_epi32(load_word(at[15] + i), load_word(at[14] + i),
+                                         load_word(at[13] + i), load_word(at[12] + i),
+                                         load_word(at[11] + i), load_word(at[10] + i),
+                                         load_word(at[9] + i), load_word(at[8] + i),
+                                         load_word(at[7] + i), load_word(at[6] + i),
+                                         load_word(at[5] + i), load_word(at[4] + i),
+                                         load_word(at[3] + i), load_word(at[2] + i),
+                                         load_word(at[1] + i), load_word(at[0] + i));
+        for (int byte = 0; byte < 4; byte++) {
+            __m512i index = _mm512_and_si512(_mm512_xor_si512(h, words), low);
+            h = _mm512_and_si512(_mm512_i32gather_epi32(index, table, 1), low);
+            words = _mm512_srli_epi32(words, 8);
+        }
+    }
+
+    int out[16];
+    _mm512_storeu_si512(out, h);
+    for (int l = 0; l < 16; l++) {
+        hash[l] = out[l];
+        for (size_t tail = i; tail < steps; tail++)
+            hash[l] = crush_hash_table[hash[l] ^ at[l][tail]];
+    }
+}
+
+#endif
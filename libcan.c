@@ -0,0 +1,747 @@
+/**
+* libcan.c => In-process can reader and writer returning error codes
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "can.h"
+#include "can_index.h"
+#include "crush.h"
+#include "crusher.h"
+#include "libcan.h"
+#include "pieces.h"
+
+/**
+* A can being read. The caller's buffer
+* holds bytes from pos up to len, the
+* first of them at offset in the can's
+* file, and remaining is what is left
+* of the current CAN's contents. skip, if
+* set, passes over bytes of the source
+* without reading them, and end is where
+* the file of a can opened on an fd ends.
+* A pieced CAN's pieces are checked by
+* pieces. last is the pathname of the
+* last CAN, which a prefixed CAN's
+* pathname is rebuilt on.
+*/
+struct Libcan_Reader_Struct {
+    LIBCAN_SOURCE source;
+    LIBCAN_SKIP skip;
+    void *ctx;
+    int fd;
+    off_t end;
+
+    unsigned char *buf;
+    size_t size;
+    size_t pos;
+    size_t len;
+    off_t offset;
+    int eof;
+    int started;
+    int error;
+
+    int in_entry;
+    int checked;
+    int version;
+    int flags;
+    uint64_t remaining;
+    struct CAN_Sum sum;
+    struct Piece_Check pieces;
+    struct CAN_Path last;
+};
+
+/**
+* A can being written, buffering
+* pos bytes of the caller's buffer.
+*/
+struct Libcan_Writer_Struct {
+    int fd;
+    int version;
+    unsigned char *buf;
+    size_t size;
+    size_t pos;
+    int error;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static ssize_t fd_source(void *ctx, void *buf, size_t cap);
+static int64_t fd_skip(void *ctx, uint64_t n);
+static int reader_fill(LIBCAN_READER reader, size_t want);
+static int reader_skip(LIBCAN_READER reader, uint64_t n);
+static int reader_fail(LIBCAN_READER reader, int status);
+static int read_contents(LIBCAN_READER reader, void *dst, size_t len, size_t *got,
+                         int stored);
+static size_t take_contents(LIBCAN_READER reader, unsigned char *to,
+                            const unsigned char *from, size_t n, int pieced);
+static int check_sum(LIBCAN_READER reader);
+static int writer_flush(LIBCAN_WRITER writer);
+static int writer_put(LIBCAN_WRITER writer, struct CAN_Sum *sum, const void *src,
+                      size_t len);
+static int writer_header(LIBCAN_WRITER writer, const char *path, mode_t mode,
+                         uint64_t length, struct CAN_Sum *sum);
+static int writer_trailer(LIBCAN_WRITER writer, struct CAN_Sum *sum);
+static int writer_fail(LIBCAN_WRITER writer, int status);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+int can_open(LIBCAN_READER *reader, int fd, void *buf, size_t buf_size) {
+    if (fd < 0)
+        return LIBCAN_ERR_ARGS;
+
+    int status = can_open_source(reader, fd_source, NULL, buf, buf_size);
+    if (status == LIBCAN_OK) {
+        (*reader)->fd = fd;
+        (*reader)->ctx = *reader;
+
+        // Aligned CANs line up with the file,
+        // which a pipe's reader starts on.
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset > 0)
+            (*reader)->offset = offset;
+
+        struct stat s;
+        if (offset >= 0 && fstat(fd, &s) == 0 && S_ISREG(s.st_mode)) {
+            (*reader)->skip = fd_skip;
+            (*reader)->end = s.st_size;
+        }
+    }
+    return status;
+}
+
+
+int can_open_source(LIBCAN_READER *reader, LIBCAN_SOURCE source, void *ctx,
+                    void *buf, size_t buf_size) {
+    if (!reader || !source || !buf || buf_size < LIBCAN_MIN_BUFFER)
+        return LIBCAN_ERR_ARGS;
+
+    LIBCAN_READER opened = calloc(1, sizeof(*opened));
+    if (!opened)
+        return LIBCAN_ERR_NOMEM;
+
+    opened->source = source;
+    opened->ctx = ctx;
+    opened->fd = -1;
+    opened->buf = buf;
+    opened->size = buf_size;
+
+    *reader = opened;
+    return LIBCAN_OK;
+}
+
+
+int can_set_skip(LIBCAN_READER reader, LIBCAN_SKIP skip) {
+    if (!reader)
+        return LIBCAN_ERR_ARGS;
+
+    reader->skip = skip;
+    return LIBCAN_OK;
+}
+
+
+int can_next_entry(LIBCAN_READER reader, struct Libcan_Entry *entry, char *path,
+                   size_t path_size) {
+    if (!reader || !entry || !path)
+        return LIBCAN_ERR_ARGS;
+    if (reader->error)
+        return reader->error;
+
+    for (;;) {
+        // Whatever the caller didn't read of the
+        // last CAN is passed over unchecked.
+        if (reader->in_entry) {
+            uint64_t left = reader->remaining;
+            if (!reader->checked)
+                left += CAN_sum_bytes(reader->version);
+            int status = reader_skip(reader, left);
+            if (status != LIBCAN_OK)
+                return status;
+            reader->in_entry = 0;
+        }
+
+        int status = reader_fill(reader, CAN_MAGIC_NUMBER_BYTES);
+        if (status != LIBCAN_OK)
+            return status;
+        if (reader->pos == reader->len)
+            return LIBCAN_END;
+
+        const unsigned char *header = reader->buf + reader->pos;
+        int version;
+        if (header[0] == CAN_MAGIC_NUMBER) {
+            version = CAN_FORMAT_V1;
+        } else if (header[0] == CAN_V2_MAGIC_NUMBER) {
+            version = CAN_FORMAT_V2;
+        } else {
+            // A compressed can starts with the
+            // crusher's magic instead of a CAN.
+            status = reader_fill(reader, CRUSHER_MAGIC_BYTES);
+            if (status != LIBCAN_OK)
+                return status;
+            if (!reader->started && reader->len - reader->pos >= CRUSHER_MAGIC_BYTES &&
+                memcmp(reader->buf + reader->pos, CRUSHER_MAGIC,
+                       CRUSHER_MAGIC_BYTES) == 0)
+                return reader_fail(reader, LIBCAN_ERR_UNSUPPORTED);
+            return reader_fail(reader, LIBCAN_ERR_FORMAT);
+        }
+        reader->started = 1;
+
+        size_t fixed = CAN_header_length(version, 0);
+        status = reader_fill(reader, fixed);
+        if (status != LIBCAN_OK)
+            return status;
+        if (reader->len - reader->pos < fixed)
+            return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+
+        // Everything after the magic and
+        // any flags is laid out the same.
+        header = reader->buf + reader->pos;
+        int flags = version == CAN_FORMAT_V2 ? header[1] : 0;
+        if (flags & ~CAN_KNOWN_FLAGS)
+            return reader_fail(reader, LIBCAN_ERR_UNSUPPORTED);
+
+        const unsigned char *field = header + fixed - CAN_FIXED_HEADER_LENGTH + 1;
+        mode_t mode = get_bytes(field, CAN_MODE_LENGTH_BYTES);
+        field += CAN_MODE_LENGTH_BYTES;
+        size_t path_length = get_bytes(field, CAN_PATHNAME_LENGTH_BYTES);
+        field += CAN_PATHNAME_LENGTH_BYTES;
+        uint64_t content_length = get_bytes(field, CAN_CONTENT_LENGTH_BYTES);
+
+        status = reader_fill(reader, fixed + path_length);
+        if (status != LIBCAN_OK)
+            return status;
+        if (reader->len - reader->pos < fixed + path_length)
+            return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+
+        // The caller's buffer is checked before
+        // last moves on so a bigger one can be
+        // passed for the same CAN.
+        header = reader->buf + reader->pos;
+        const unsigned char *stored = header + fixed;
+        size_t full_length = path_length;
+        if ((flags & CAN_FLAG_PREFIXED) && path_length >= CAN_PREFIX_BYTES)
+            full_length += (stored[0] << 8 | stored[1]) - CAN_PREFIX_BYTES;
+        if (full_length <= CAN_MAX_PATHNAME_LENGTH && full_length + 1 > path_size)
+            return LIBCAN_ERR_ARGS;
+
+        if (!rebuild_CAN_path(&reader->last, flags, stored, path_length))
+            return reader_fail(reader, LIBCAN_ERR_FORMAT);
+        memcpy(path, reader->last.name, reader->last.length + 1);
+
+        uint64_t header_hash = CAN_header_sum(version, header, fixed + path_length);
+        CAN_sum_start(&reader->sum, version, header_hash);
+        piece_check_start(&reader->pieces, header_hash, content_length);
+        reader->pos += fixed + path_length;
+        status = reader_skip(reader, CAN_pad_bytes(flags, reader->offset + reader->pos));
+        if (status != LIBCAN_OK)
+            return status;
+        reader->in_entry = 1;
+        reader->checked = 0;
+        reader->version = version;
+        reader->flags = flags;
+        reader->remaining = content_length;
+
+        if (is_index_CAN(path, mode))
+            continue;
+
+        // Chunked, sparse and pieced CANs
+        // start with the file's size.
+        uint64_t file_size = content_length;
+        if (flags & CAN_SIZED_FLAGS) {
+            status = reader_fill(reader, CAN_FILE_SIZE_BYTES);
+            if (status != LIBCAN_OK)
+                return status;
+            if (content_length < CAN_FILE_SIZE_BYTES)
+                return reader_fail(reader, LIBCAN_ERR_FORMAT);
+            if (reader->len - reader->pos < CAN_FILE_SIZE_BYTES)
+                return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+            file_size = CAN_file_size(reader->buf + reader->pos);
+        }
+
+        entry->path = path;
+        entry->version = version;
+        entry->flags = flags;
+        entry->mode = mode;
+        entry->content_length = content_length;
+        entry->file_size = file_size;
+        entry->payload = reader->offset + reader->pos;
+        entry->header_sum = header_hash;
+        return LIBCAN_OK;
+    }
+}
+
+
+int can_read(LIBCAN_READER reader, void *dst, size_t len, size_t *got) {
+    return read_contents(reader, dst, len, got, 0);
+}
+
+
+int can_read_stored(LIBCAN_READER reader, void *dst, size_t len, size_t *got) {
+    return read_contents(reader, dst, len, got, 1);
+}
+
+
+int can_close(LIBCAN_READER reader) {
+    if (!reader)
+        return LIBCAN_ERR_ARGS;
+
+    free(reader);
+    return LIBCAN_OK;
+}
+
+
+int can_writer_open(LIBCAN_WRITER *writer, int fd, int version, void *buf,
+                    size_t buf_size) {
+    if (!writer || fd < 0 || !buf || buf_size < LIBCAN_MIN_BUFFER ||
+        (version != CAN_FORMAT_V1 && version != CAN_FORMAT_V2))
+        return LIBCAN_ERR_ARGS;
+
+    LIBCAN_WRITER opened = calloc(1, sizeof(*opened));
+    if (!opened)
+        return LIBCAN_ERR_NOMEM;
+
+    opened->fd = fd;
+    opened->version = version;
+    opened->buf = buf;
+    opened->size = buf_size;
+
+    *writer = opened;
+    return LIBCAN_OK;
+}
+
+
+int can_writer_add(LIBCAN_WRITER writer, const char *path, mode_t mode,
+                   const void *data, uint64_t length) {
+    if (!writer || (length && !data))
+        return LIBCAN_ERR_ARGS;
+
+    struct CAN_Sum sum;
+    int status = writer_header(writer, path, mode, length, &sum);
+    if (status != LIBCAN_OK)
+        return status;
+
+    status = writer_put(writer, &sum, data, length);
+    if (status != LIBCAN_OK)
+        return status;
+
+    return writer_trailer(writer, &sum);
+}
+
+
+int can_writer_add_fd(LIBCAN_WRITER writer, const char *path, mode_t mode, int fd,
+                      uint64_t length) {
+    if (!writer || fd < 0)
+        return LIBCAN_ERR_ARGS;
+
+    struct CAN_Sum sum;
+    int status = writer_header(writer, path, mode, length, &sum);
+    if (status != LIBCAN_OK)
+        return status;
+
+    // Read straight into the free
+    // space of the buffer.
+    while (length) {
+        if (writer->pos == writer->size) {
+            status = writer_flush(writer);
+            if (status != LIBCAN_OK)
+                return status;
+        }
+
+        size_t avail = writer->size - writer->pos;
+        if (avail > length)
+            avail = length;
+
+        ssize_t got = read(fd, writer->buf + writer->pos, avail);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return writer_fail(writer, LIBCAN_ERR_IO);
+        if (got == 0)
+            return writer_fail(writer, LIBCAN_ERR_TRUNCATED);
+
+        CAN_sum_update(&sum, writer->buf + writer->pos, got);
+        writer->pos += got;
+        length -= got;
+    }
+
+    return writer_trailer(writer, &sum);
+}
+
+
+int can_writer_close(LIBCAN_WRITER writer) {
+    if (!writer)
+        return LIBCAN_ERR_ARGS;
+
+    int status = writer->error;
+    if (status == LIBCAN_OK)
+        status = writer_flush(writer);
+
+    free(writer);
+    return status;
+}
+
+
+const char *can_strerror(int status) {
+    switch (status) {
+    case LIBCAN_OK:
+        return "Success";
+    case LIBCAN_END:
+        return "No more CANs";
+    case LIBCAN_ERR_IO:
+        return "Failed to read or write";
+    case LIBCAN_ERR_FORMAT:
+        return "Not a can";
+    case LIBCAN_ERR_TRUNCATED:
+        return "Unexpected end of can";
+    case LIBCAN_ERR_CHECKSUM:
+        return "can hash incorrect";
+    case LIBCAN_ERR_NOMEM:
+        return "Out of memory";
+    case LIBCAN_ERR_ARGS:
+        return "Invalid argument";
+    case LIBCAN_ERR_UNSUPPORTED:
+        return "Can uses a feature libcan doesn't support";
+    default:
+        return "Unknown error";
+    }
+}
+
+
+/**
+* Reads a can straight from
+* the reader's fd.
+*/
+static ssize_t fd_source(void *ctx, void *buf, size_t cap) {
+    LIBCAN_READER reader = ctx;
+    ssize_t got;
+
+    do {
+        got = read(reader->fd, buf, cap);
+    } while (got < 0 && errno == EINTR);
+
+    return got;
+}
+
+
+/**
+* Seeks the reader's fd over up to n
+* bytes, no further than the end of
+* its file.
+*/
+static int64_t fd_skip(void *ctx, uint64_t n) {
+    LIBCAN_READER reader = ctx;
+    off_t at = reader->offset + reader->len;
+    uint64_t left = reader->end > at ? reader->end - at : 0;
+    if (n > left)
+        n = left;
+
+    if (lseek(reader->fd, at + n, SEEK_SET) < 0)
+        return -1;
+    return n;
+}
+
+
+/**
+* Tops up the buffer until it holds want
+* bytes from pos or the can ends, moving
+* what is left to the front first.
+*/
+static int reader_fill(LIBCAN_READER reader, size_t want) {
+    if (reader->len - reader->pos >= want || reader->eof)
+        return LIBCAN_OK;
+
+    memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+    reader->offset += reader->pos;
+    reader->len -= reader->pos;
+    reader->pos = 0;
+
+    while (reader->len < want) {
+        ssize_t got = reader->source(reader->ctx, reader->buf + reader->len,
+                                     reader->size - reader->len);
+        if (got < 0)
+            return reader_fail(reader, LIBCAN_ERR_IO);
+        if (got == 0) {
+            reader->eof = 1;
+            break;
+        }
+        reader->len += got;
+    }
+
+    return LIBCAN_OK;
+}
+
+
+/**
+* Passes over the next n bytes of the can,
+* having the source skip whatever isn't
+* buffered if it can.
+*/
+static int reader_skip(LIBCAN_READER reader, uint64_t n) {
+    size_t buffered = reader->len - reader->pos;
+    if (n > buffered && reader->skip && !reader->eof) {
+        uint64_t rest = n - buffered;
+        int64_t passed = reader->skip(reader->ctx, rest);
+        if (passed < 0)
+            return reader_fail(reader, LIBCAN_ERR_IO);
+
+        reader->offset += reader->len + passed;
+        reader->pos = 0;
+        reader->len = 0;
+        if ((uint64_t) passed < rest)
+            return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+        return LIBCAN_OK;
+    }
+
+    while (n) {
+        if (reader->pos == reader->len) {
+            int status = reader_fill(reader, 1);
+            if (status != LIBCAN_OK)
+                return status;
+            if (reader->pos == reader->len)
+                return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+        }
+
+        size_t step = reader->len - reader->pos;
+        if (step > n)
+            step = n;
+        reader->pos += step;
+        n -= step;
+    }
+
+    return LIBCAN_OK;
+}
+
+
+/**
+* Any error but a bad checksum leaves the
+* reader lost, so it sticks.
+*/
+static int reader_fail(LIBCAN_READER reader, int status) {
+    reader->error = status;
+    return status;
+}
+
+
+/**
+* Reads the current CAN's contents for
+* can_read, or as stored if stored is set.
+* A read at least a buffer long with
+* nothing buffered goes straight into dst.
+*/
+static int read_contents(LIBCAN_READER reader, void *dst, size_t len, size_t *got,
+                         int stored) {
+    if (!reader || !got || (len && !dst))
+        return LIBCAN_ERR_ARGS;
+    *got = 0;
+    if (reader->error)
+        return reader->error;
+    if (!reader->in_entry)
+        return LIBCAN_ERR_ARGS;
+
+    if (!stored && (reader->flags & (CAN_FLAG_CHUNKED | CAN_FLAG_SPARSE)))
+        return LIBCAN_ERR_UNSUPPORTED;
+    int pieced = !stored && (reader->flags & CAN_FLAG_PIECED);
+
+    unsigned char *out = dst;
+    while (reader->remaining && *got < len) {
+        size_t want = len - *got;
+        if (want > reader->remaining)
+            want = reader->remaining;
+
+        if (reader->pos == reader->len && !reader->eof && want >= reader->size / 2) {
+            ssize_t direct = reader->source(reader->ctx, out + *got, want);
+            if (direct < 0)
+                return reader_fail(reader, LIBCAN_ERR_IO);
+            if (direct == 0) {
+                reader->eof = 1;
+                return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+            }
+
+            reader->offset += reader->len + direct;
+            reader->pos = 0;
+            reader->len = 0;
+            reader->remaining -= direct;
+            *got += take_contents(reader, out + *got, out + *got, direct, pieced);
+            continue;
+        }
+
+        if (reader->pos == reader->len) {
+            int status = reader_fill(reader, 1);
+            if (status != LIBCAN_OK)
+                return status;
+            if (reader->pos == reader->len)
+                return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+        }
+
+        size_t step = reader->len - reader->pos;
+        if (step > want)
+            step = want;
+
+        *got += take_contents(reader, out + *got, reader->buf + reader->pos, step,
+                              pieced);
+        reader->pos += step;
+        reader->remaining -= step;
+    }
+
+    if (!reader->remaining && !reader->checked)
+        return check_sum(reader);
+
+    return LIBCAN_OK;
+}
+
+
+/**
+* Checks n bytes of contents at from and
+* moves those of the file to to, which
+* may overlap from, returning how many.
+* Only a pieced CAN's piece contents are
+* the file's, the rest being checked.
+*/
+static size_t take_contents(LIBCAN_READER reader, unsigned char *to,
+                            const unsigned char *from, size_t n, int pieced) {
+    size_t kept = 0;
+
+    while (n) {
+        int data = 1;
+        size_t step = n;
+        if (pieced)
+            step = piece_check_update(&reader->pieces, &reader->sum, from, n, &data);
+        else
+            CAN_sum_update(&reader->sum, from, n);
+
+        if (data) {
+            if (to + kept != from)
+                memmove(to + kept, from, step);
+            kept += step;
+        }
+        from += step;
+        n -= step;
+    }
+
+    return kept;
+}
+
+
+/**
+* Compares the checksum ending the current
+* CAN with the one worked out over it.
+*/
+static int check_sum(LIBCAN_READER reader) {
+    size_t sum_bytes = CAN_sum_bytes(reader->version);
+
+    int status = reader_fill(reader, sum_bytes);
+    if (status != LIBCAN_OK)
+        return status;
+    if (reader->len - reader->pos < sum_bytes)
+        return reader_fail(reader, LIBCAN_ERR_TRUNCATED);
+
+    uint64_t stored = get_CAN_sum(reader->buf + reader->pos, reader->version);
+    reader->pos += sum_bytes;
+    reader->checked = 1;
+
+    if (stored != CAN_sum_final(&reader->sum))
+        return LIBCAN_ERR_CHECKSUM;
+    if ((reader->flags & CAN_FLAG_PIECED) && !piece_check_ok(&reader->pieces))
+        return LIBCAN_ERR_CHECKSUM;
+    return LIBCAN_OK;
+}
+
+
+static int writer_flush(LIBCAN_WRITER writer) {
+    size_t done = 0;
+
+    while (done < writer->pos) {
+        ssize_t put = write(writer->fd, writer->buf + done, writer->pos - done);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return writer_fail(writer, LIBCAN_ERR_IO);
+        done += put;
+    }
+
+    writer->pos = 0;
+    return LIBCAN_OK;
+}
+
+
+/**
+* Buffers len bytes of src, adding
+* them to sum if it isn't NULL.
+*/
+static int writer_put(LIBCAN_WRITER writer, struct CAN_Sum *sum, const void *src,
+                      size_t len) {
+    const unsigned char *from = src;
+
+    if (sum && len)
+        CAN_sum_update(sum, from, len);
+
+    while (len) {
+        if (writer->pos == writer->size) {
+            int status = writer_flush(writer);
+            if (status != LIBCAN_OK)
+                return status;
+        }
+
+        size_t step = writer->size - writer->pos;
+        if (step > len)
+            step = len;
+        memcpy(writer->buf + writer->pos, from, step);
+        writer->pos += step;
+        from += step;
+        len -= step;
+    }
+
+    return LIBCAN_OK;
+}
+
+
+/**
+* Checks a new CAN's fields and encodes
+* its header straight into the buffer,
+* starting sum from it.
+*/
+static int writer_header(LIBCAN_WRITER writer, const char *path, mode_t mode,
+                         uint64_t length, struct CAN_Sum *sum) {
+    if (writer->error)
+        return writer->error;
+    if (!path || !*path || strlen(path) > CAN_MAX_PATHNAME_LENGTH ||
+        length > CAN_MAX_CONTENT_LENGTH || (S_ISDIR(mode) && length))
+        return LIBCAN_ERR_ARGS;
+
+    size_t header_length = CAN_header_length(writer->version, strlen(path));
+    if (writer->size - writer->pos < header_length) {
+        int status = writer_flush(writer);
+        if (status != LIBCAN_OK)
+            return status;
+    }
+
+    unsigned char *header = writer->buf + writer->pos;
+    encode_CAN_header(header, writer->version, 0, (char *) path, mode, length);
+    CAN_sum_start(sum, writer->version,
+                  CAN_header_sum(writer->version, header, header_length));
+    writer->pos += header_length;
+
+    return LIBCAN_OK;
+}
+
+
+static int writer_trailer(LIBCAN_WRITER writer, struct CAN_Sum *sum) {
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+
+    put_CAN_sum(trailer, writer->version, CAN_sum_final(sum));
+    return writer_put(writer, NULL, trailer, CAN_sum_bytes(writer->version));
+}
+
+
+/**
+* A CAN left half written spoils the
+* can, so the error sticks.
+*/
+static int writer_fail(LIBCAN_WRITER writer, int status) {
+    writer->error = status;
+    return status;
+}
@@ -0,0 +1,202 @@
+#ifndef LIBCAN_H
+#define LIBCAN_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+* libcan => Reads and writes cans in-process.
+*
+* Unlike the rest of crush nothing here exits
+* or keeps global state. Every call returns
+* LIBCAN_OK or one of the errors below, and
+* each reader and writer belongs to whoever
+* opened it, so a process can work on many
+* cans at once from its own threads as long
+* as no two threads share a reader or writer.
+*
+* I/O goes through a buffer the caller gives
+* when opening, at least LIBCAN_MIN_BUFFER
+* bytes, which must outlive the reader or
+* writer. Cans compressed with -z, and the
+* files of chunked and sparse CANs, which
+* are rebuilt from elsewhere in the can or
+* around holes, are left to the crush
+* command, which reads the latter as
+* stored.
+*/
+
+// what every libcan call returns
+#define LIBCAN_OK                 0
+#define LIBCAN_END                1
+#define LIBCAN_ERR_IO             -1
+#define LIBCAN_ERR_FORMAT         -2
+#define LIBCAN_ERR_TRUNCATED      -3
+#define LIBCAN_ERR_CHECKSUM       -4
+#define LIBCAN_ERR_NOMEM          -5
+#define LIBCAN_ERR_ARGS           -6
+#define LIBCAN_ERR_UNSUPPORTED    -7
+
+// smallest I/O buffer a reader or writer
+// takes, enough for any CAN's header
+#define LIBCAN_MIN_BUFFER         (1 << 17)
+
+// bytes needed to hold any pathname
+// with its terminating NUL
+#define LIBCAN_PATH_BYTES         65536
+
+/**
+* Supplies up to cap bytes of a can in buf,
+* returning how many, 0 at its end or -1
+* on error.
+*/
+typedef ssize_t (*LIBCAN_SOURCE)(void *ctx, void *buf, size_t cap);
+
+/**
+* Moves a source up to n bytes on without
+* handing them over, returning how many it
+* passed, fewer only at its end, or -1
+* on error.
+*/
+typedef int64_t (*LIBCAN_SKIP)(void *ctx, uint64_t n);
+
+/**
+* One CAN of a can as read by
+* can_next_entry. path points into
+* the caller's buffer. file_size is
+* that of the file the CAN holds,
+* content_length what it stores,
+* starting payload bytes into the can.
+* header_sum is the checksum of its
+* header, which that of its contents
+* continues from.
+*/
+struct Libcan_Entry {
+    char *path;
+    int version;
+    int flags;
+    mode_t mode;
+    uint64_t content_length;
+    uint64_t file_size;
+    uint64_t payload;
+    uint64_t header_sum;
+};
+
+typedef struct Libcan_Reader_Struct *LIBCAN_READER;
+typedef struct Libcan_Writer_Struct *LIBCAN_WRITER;
+
+
+/**
+* Opens a reader on the can at the current
+* offset of fd, which is left open when
+* the reader closes. The contents of CANs
+* skipped in a file are seeked over.
+*/
+int can_open(LIBCAN_READER *reader, int fd, void *buf, size_t buf_size);
+
+
+/**
+* Opens a reader taking the can from source
+* rather than an fd, such as a stream the
+* caller has decompressed. The can is taken
+* to start where source does, as the
+* padding of aligned CANs assumes.
+*/
+int can_open_source(LIBCAN_READER *reader, LIBCAN_SOURCE source, void *ctx,
+                    void *buf, size_t buf_size);
+
+
+/**
+* Has a reader opened with can_open_source
+* pass over the contents of CANs it skips
+* by calling skip with the source's ctx,
+* rather than reading them.
+*/
+int can_set_skip(LIBCAN_READER reader, LIBCAN_SKIP skip);
+
+
+/**
+* Moves on to the next CAN, skipping whatever
+* is left of the last, and fills in entry
+* with its pathname stored in path, which
+* holds path_size bytes. Returns LIBCAN_END
+* once the can has no more CANs. A trailing
+* index isn't returned as an entry.
+*/
+int can_next_entry(LIBCAN_READER reader, struct Libcan_Entry *entry, char *path,
+                   size_t path_size);
+
+
+/**
+* Reads up to len bytes of the file the
+* current CAN holds into dst, setting got to
+* how many were read, 0 once they are all
+* read. The CAN's checksum is checked as its
+* last byte is read, and LIBCAN_ERR_CHECKSUM
+* returned if it doesn't match. A pieced
+* CAN's pieces are checked as they go. A
+* chunked or sparse CAN gives
+* LIBCAN_ERR_UNSUPPORTED instead.
+*/
+int can_read(LIBCAN_READER reader, void *dst, size_t len, size_t *got);
+
+
+/**
+* Reads the current CAN's contents like
+* can_read but as they are stored, so a
+* chunked or sparse CAN's can be rebuilt
+* by the caller. The checksum is still
+* checked at the end.
+*/
+int can_read_stored(LIBCAN_READER reader, void *dst, size_t len, size_t *got);
+
+
+/**
+* Frees a reader.
+*/
+int can_close(LIBCAN_READER reader);
+
+
+/**
+* Opens a writer adding CANs of the given
+* format version at the current offset of
+* fd, which is left open when the writer
+* closes.
+*/
+int can_writer_open(LIBCAN_WRITER *writer, int fd, int version, void *buf,
+                    size_t buf_size);
+
+
+/**
+* Adds a CAN for path with the given mode
+* holding the length bytes of data. A
+* directory's length must be 0.
+*/
+int can_writer_add(LIBCAN_WRITER writer, const char *path, mode_t mode,
+                   const void *data, uint64_t length);
+
+
+/**
+* Adds a CAN for path holding the next
+* length bytes read from fd.
+*/
+int can_writer_add_fd(LIBCAN_WRITER writer, const char *path, mode_t mode, int fd,
+                      uint64_t length);
+
+
+/**
+* Flushes and frees a writer, returning
+* the first error it met if any.
+*/
+int can_writer_close(LIBCAN_WRITER writer);
+
+
+/**
+* Describes a libcan return value.
+*/
+const char *can_strerror(int status);
+
+
+#endif
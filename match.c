@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "crush.h"
+#include "match.h"
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static void add_parents(PATH_SET parents, char *path);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+PATH_MATCHER new_path_matcher(char **patterns) {
+    PATH_MATCHER matcher = calloc(1, sizeof(*matcher));
+    if (!matcher)
+        handle_error("Failed to allocate matcher");
+
+    while (patterns[matcher->count])
+        matcher->count++;
+
+    matcher->patterns = calloc(matcher->count, sizeof(char *));
+    matcher->hits = calloc(matcher->count, sizeof(int));
+    matcher->globs = calloc(matcher->count, sizeof(int));
+    matcher->glob_prefixes = calloc(matcher->count, sizeof(size_t));
+    matcher->literals = new_path_set(matcher->count);
+    if (!matcher->patterns || !matcher->hits || !matcher->globs ||
+        !matcher->glob_prefixes)
+        handle_error("Failed to allocate matcher");
+
+    for (int p = 0; p < matcher->count; p++) {
+        char *pattern = strdup(patterns[p]);
+
+        // "dir/" means the same as "dir".
+        size_t length = strlen(pattern);
+        while (length > 1 && pattern[length - 1] == '/')
+            pattern[--length] = '\0';
+        matcher->patterns[p] = pattern;
+
+        if (strpbrk(pattern, "*?[")) {
+            matcher->globs[matcher->glob_count] = p;
+            matcher->glob_prefixes[matcher->glob_count] = strcspn(pattern, "*?[\\");
+            matcher->glob_count++;
+        } else {
+            path_set_add(matcher->literals, pattern, p);
+        }
+    }
+
+    return matcher;
+}
+
+
+int path_matches(PATH_MATCHER matcher, char *path) {
+    size_t pattern;
+
+    // A literal matches the path itself or
+    // any directory the path is under.
+    size_t length = strlen(path);
+    if (path_set_find(matcher->literals, path, length, &pattern)) {
+        matcher->hits[pattern]++;
+        return 1;
+    }
+    for (size_t c = length; c > 0; c--) {
+        if (path[c - 1] != '/' || c == 1)
+            continue;
+        if (path_set_find(matcher->literals, path, c - 1, &pattern)) {
+            matcher->hits[pattern]++;
+            return 1;
+        }
+    }
+
+    for (int g = 0; g < matcher->glob_count; g++) {
+        int p = matcher->globs[g];
+        if (strncmp(path, matcher->patterns[p], matcher->glob_prefixes[g]) != 0)
+            continue;
+        if (fnmatch(matcher->patterns[p], path, FNM_LEADING_DIR) == 0) {
+            matcher->hits[p]++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void select_CAN_entries(CAN_INDEX index, PATH_MATCHER matcher) {
+    char *selected = calloc(index->count, 1);
+    PATH_SET parents = new_path_set(index->count / 8);
+    if (!selected)
+        handle_error("Failed to allocate selection");
+
+    for (size_t e = 0; e < index->count; e++) {
+        if (path_matches(matcher, index->entries[e].path)) {
+            selected[e] = 1;
+            add_parents(parents, index->entries[e].path);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t e = 0; e < index->count; e++) {
+        struct CAN_Entry *entry = &index->entries[e];
+        if (!selected[e] && S_ISDIR(entry->mode))
+            selected[e] = path_set_find(parents, entry->path,
+                                        strlen(entry->path), NULL);
+
+        if (selected[e])
+            index->entries[kept++] = *entry;
+        else
+            free(entry->path);
+    }
+    index->count = kept;
+
+    free_path_set(parents);
+    free(selected);
+}
+
+
+int report_unmatched(PATH_MATCHER matcher) {
+    int unmatched = 0;
+
+    for (int p = 0; p < matcher->count; p++) {
+        if (matcher->hits[p])
+            continue;
+        fprintf(stderr, "ERROR: %s not found in can\n", matcher->patterns[p]);
+        unmatched++;
+    }
+
+    return unmatched;
+}
+
+
+void free_path_matcher(PATH_MATCHER matcher) {
+    for (int p = 0; p < matcher->count; p++)
+        free(matcher->patterns[p]);
+
+    free_path_set(matcher->literals);
+    free(matcher->patterns);
+    free(matcher->hits);
+    free(matcher->globs);
+    free(matcher->glob_prefixes);
+    free(matcher);
+}
+
+
+/**
+* Adds every directory above path
+* to the parents set.
+*/
+static void add_parents(PATH_SET parents, char *path) {
+    if (!*path)
+        return;
+
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        path_set_add(parents, path, 0);
+        *slash = '/';
+    }
+}
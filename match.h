@@ -0,0 +1,64 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+
+#include "can_index.h"
+#include "path_set.h"
+
+/**
+* A set of member patterns compiled once up
+* front. Literal patterns live in a hash set
+* and globs keep their literal prefix so most
+* paths are rejected without calling fnmatch.
+*/
+struct Path_Matcher_Struct {
+    char **patterns;
+    int *hits;
+    int count;
+
+    PATH_SET literals;
+
+    int *globs;
+    size_t *glob_prefixes;
+    int glob_count;
+};
+
+typedef struct Path_Matcher_Struct *PATH_MATCHER;
+
+
+/**
+* Compiles a NULL-terminated array of
+* pathnames and globs.
+*/
+PATH_MATCHER new_path_matcher(char **patterns);
+
+
+/**
+* Returns 1 if path, or a directory above
+* it, matches one of the patterns.
+*/
+int path_matches(PATH_MATCHER matcher, char *path);
+
+
+/**
+* Drops every entry from index which doesn't
+* match, other than directories that hold
+* a matching entry.
+*/
+void select_CAN_entries(CAN_INDEX index, PATH_MATCHER matcher);
+
+
+/**
+* Prints each pattern that matched nothing
+* to stderr and returns how many there were.
+*/
+int report_unmatched(PATH_MATCHER matcher);
+
+
+/**
+* Frees a compiled matcher.
+*/
+void free_path_matcher(PATH_MATCHER matcher);
+
+
+#endif
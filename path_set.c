@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "crush.h"
+#include "path_set.h"
+
+struct Path_Slot {
+    char *path;
+    size_t length;
+    uint64_t hash;
+    size_t value;
+};
+
+struct Path_Set_Struct {
+    struct Path_Slot *slots;
+    size_t capacity;
+    size_t count;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static uint64_t hash_path(const char *path, size_t len);
+static struct Path_Slot *find_slot(PATH_SET set, const char *path, size_t len,
+                                   uint64_t hash);
+static void grow_set(PATH_SET set);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+PATH_SET new_path_set(size_t expected) {
+    PATH_SET set = malloc(sizeof(*set));
+    if (!set)
+        handle_error("Failed to allocate path set");
+
+    // Keep the table at most half full.
+    set->capacity = 64;
+    while (set->capacity < expected * 2)
+        set->capacity *= 2;
+
+    set->count = 0;
+    set->slots = calloc(set->capacity, sizeof(struct Path_Slot));
+    if (!set->slots)
+        handle_error("Failed to allocate path set");
+
+    return set;
+}
+
+
+int path_set_add(PATH_SET set, const char *path, size_t value) {
+    size_t len = strlen(path);
+    uint64_t hash = hash_path(path, len);
+
+    struct Path_Slot *slot = find_slot(set, path, len, hash);
+    if (slot->path) {
+        slot->value = value;
+        return 0;
+    }
+
+    slot->path = malloc(len + 1);
+    if (!slot->path)
+        handle_error("Failed to allocate path set");
+    memcpy(slot->path, path, len + 1);
+    slot->length = len;
+    slot->hash = hash;
+    slot->value = value;
+
+    if (++set->count * 2 > set->capacity)
+        grow_set(set);
+
+    return 1;
+}
+
+
+int path_set_find(PATH_SET set, const char *path, size_t len, size_t *value) {
+    struct Path_Slot *slot = find_slot(set, path, len, hash_path(path, len));
+    if (!slot->path)
+        return 0;
+
+    if (value)
+        *value = slot->value;
+    return 1;
+}
+
+
+void free_path_set(PATH_SET set) {
+    for (size_t s = 0; s < set->capacity; s++)
+        free(set->slots[s].path);
+
+    free(set->slots);
+    free(set);
+}
+
+
+/**
+* FNV-1a over the first len bytes of path.
+*/
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t c = 0; c < len; c++) {
+        hash ^= (uint8_t) path[c];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/**
+* Linear probes for path, returning either
+* its slot or the empty slot it would take.
+*/
+static struct Path_Slot *find_slot(PATH_SET set, const char *path, size_t len,
+                                   uint64_t hash) {
+    size_t mask = set->capacity - 1;
+    for (size_t s = hash & mask; ; s = (s + 1) & mask) {
+        struct Path_Slot *slot = &set->slots[s];
+        if (!slot->path)
+            return slot;
+        if (slot->hash == hash && slot->length == len &&
+            memcmp(slot->path, path, len) == 0)
+            return slot;
+    }
+}
+
+
+/**
+* Doubles the table, rehashing
+* every key into it.
+*/
+static void grow_set(PATH_SET set) {
+    struct Path_Slot *old = set->slots;
+    size_t old_capacity = set->capacity;
+
+    set->capacity *= 2;
+    set->slots = calloc(set->capacity, sizeof(struct Path_Slot));
+    if (!set->slots)
+        handle_error("Failed to grow path set");
+
+    for (size_t s = 0; s < old_capacity; s++) {
+        if (!old[s].path)
+            continue;
+        *find_slot(set, old[s].path, old[s].length, old[s].hash) = old[s];
+    }
+
+    free(old);
+}
@@ -0,0 +1,44 @@
+#ifndef PATH_SET_H
+#define PATH_SET_H
+
+
+#include <stddef.h>
+
+/**
+* A hash table from pathnames to a size_t,
+* typically the position of an entry in a
+* CAN_INDEX. Keys are copied on insertion.
+*/
+typedef struct Path_Set_Struct *PATH_SET;
+
+
+/**
+* Creates an empty set sized for
+* about expected paths.
+*/
+PATH_SET new_path_set(size_t expected);
+
+
+/**
+* Maps path to value, replacing any value
+* it already had. Returns 1 if path
+* was not in the set before.
+*/
+int path_set_add(PATH_SET set, const char *path, size_t value);
+
+
+/**
+* Looks up the first len bytes of path,
+* storing its value in value if found.
+* Returns 1 if it is in the set.
+*/
+int path_set_find(PATH_SET set, const char *path, size_t len, size_t *value);
+
+
+/**
+* Frees a set and its copied keys.
+*/
+void free_path_set(PATH_SET set);
+
+
+#endif
@@ -0,0 +1,133 @@
+/**
+* pieces.c => Storing big files as pieces checked on their own
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "can.h"
+#include "crush.h"
+#include "pieces.h"
+#include "stats.h"
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static void write_piece(BLOCK_IO can, struct CAN_Sum *sum, int fd, size_t length);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+int is_pieced(CAN_WRITER writer, struct stat *s) {
+    return writer->version == CAN_FORMAT_V2 && !writer->aligned && S_ISREG(s->st_mode) &&
+           (uint64_t) s->st_size > CAN_PIECE_BYTES;
+}
+
+
+void write_pieced_file(CAN_WRITER writer, char *path, struct stat *file_stat,
+                       const uint8_t *data) {
+    uint64_t size = file_stat->st_size;
+    uint64_t count = pieces_count(size, CAN_PIECE_BYTES);
+    uint64_t content_length = pieces_length(size, CAN_PIECE_BYTES);
+    if (content_length > CAN_MAX_CONTENT_LENGTH)
+        handle_error("File too large for a CAN");
+
+    int fd = -1;
+    if (!data) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+            handle_error("Failed to open file steam");
+        stats_call(STATS_CALL_OPEN);
+    }
+
+    BLOCK_IO can_file = writer->io;
+    int flags = CAN_FLAG_PIECED;
+    size_t shared = next_CAN_shared(writer, path, &flags);
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_prefixed_CAN_header(header, writer->version, flags,
+                                                      shared, path, file_stat->st_mode,
+                                                      content_length);
+    block_io_write(can_file, header, header_length);
+    off_t payload = block_io_tell(can_file);
+
+    uint64_t header_hash = CAN_header_sum(writer->version, header, header_length);
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, writer->version, header_hash);
+
+    uint8_t record[PIECES_HEADER_BYTES];
+    put_pieces_header(record, size, CAN_PIECE_BYTES);
+    block_io_write(can_file, record, PIECES_HEADER_BYTES);
+    CAN_sum_update(&sum, record, PIECES_HEADER_BYTES);
+
+    for (uint64_t piece = 0; piece < count; piece++) {
+        size_t length = piece_length(size, CAN_PIECE_BYTES, piece);
+        struct CAN_Sum piece_sum;
+        piece_sum_start(&piece_sum, header_hash, piece);
+
+        if (data) {
+            const uint8_t *from = data + piece * CAN_PIECE_BYTES;
+            block_io_write(can_file, from, length);
+            CAN_sum_update(&piece_sum, from, length);
+        } else {
+            write_piece(can_file, &piece_sum, fd, length);
+        }
+
+        put_CAN_sum(record, CAN_FORMAT_V2, CAN_sum_final(&piece_sum));
+        block_io_write(can_file, record, CAN_SUM64_BYTES);
+        CAN_sum_update(&sum, record, CAN_SUM64_BYTES);
+    }
+
+    if (fd >= 0) {
+        close(fd);
+        stats_call(STATS_CALL_CLOSE);
+    }
+
+    uint64_t hash = CAN_sum_final(&sum);
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, writer->version, hash);
+    block_io_write(can_file, trailer, CAN_sum_bytes(writer->version));
+
+    struct CAN_Entry entry = {
+        .path = path,
+        .flags = flags,
+        .mode = file_stat->st_mode,
+        .content_length = content_length,
+        .offset = payload - header_length,
+        .payload = payload,
+        .header_hash = header_hash,
+        .hash = hash,
+        .mtime = file_stat->st_mtim,
+    };
+    record_CAN(writer, &entry);
+}
+
+
+/**
+* Reads the next length bytes of the file
+* straight into the can's output buffer.
+*/
+static void write_piece(BLOCK_IO can, struct CAN_Sum *sum, int fd, size_t length) {
+    while (length) {
+        size_t avail = 0;
+        unsigned char *block = block_io_space(can, &avail);
+        if (avail > length)
+            avail = length;
+
+        uint64_t since = stats_clock();
+        ssize_t got = read(fd, block, avail);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read file");
+        if (got == 0)
+            handle_error("File changed size while archiving");
+
+        CAN_sum_update(sum, block, got);
+        block_io_commit(can, got);
+        length -= got;
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef PIECES_H
+#define PIECES_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "can.h"
+
+// a pieced CAN's contents start with the size
+// of the file and of its pieces, then hold
+// every piece followed by its own checksum.
+// The CAN's checksum covers everything but
+// the pieces, which their checksums cover,
+// so the pieces can be checked at once.
+#define PIECES_HEADER_BYTES       16
+
+/**
+* Follows the contents of a pieced CAN as
+* they stream past, checking each piece and
+* adding the rest to the CAN's checksum.
+*/
+struct Piece_Check {
+    uint64_t header_hash;
+    uint64_t content_length;
+    uint64_t rest;
+    uint64_t piece_bytes;
+    uint64_t piece;
+    int part;
+    uint64_t left;
+    uint8_t held[PIECES_HEADER_BYTES];
+    size_t held_length;
+    struct CAN_Sum data;
+    int bad;
+};
+
+
+/**
+* Returns non-zero if writer stores the file
+* s describes as a pieced CAN.
+*/
+int is_pieced(CAN_WRITER writer, struct stat *s);
+
+
+/**
+* The number of pieces, their contents' offset
+* within a pieced CAN's contents and the length
+* of the contents of a file of size bytes cut
+* into pieces of piece_bytes.
+*/
+uint64_t pieces_count(uint64_t size, uint64_t piece_bytes);
+uint64_t piece_offset(uint64_t piece_bytes, uint64_t piece);
+uint64_t pieces_length(uint64_t size, uint64_t piece_bytes);
+
+
+/**
+* Returns how many bytes of a file of size
+* bytes the given piece holds.
+*/
+size_t piece_length(uint64_t size, uint64_t piece_bytes, uint64_t piece);
+
+
+/**
+* Starts the checksum of a piece, which is
+* seeded from its CAN's header and its place
+* so it can't be swapped for another.
+*/
+void piece_sum_start(struct CAN_Sum *sum, uint64_t header_hash, uint64_t piece);
+
+
+/**
+* Encodes the start of a pieced CAN's
+* contents for a file of size bytes.
+*/
+void put_pieces_header(uint8_t *out, uint64_t size, uint64_t piece_bytes);
+
+
+/**
+* Reads back what put_pieces_header stored,
+* returning 0 if it doesn't add up to a
+* CAN of content_length bytes.
+*/
+int get_pieces_header(const uint8_t *in, uint64_t content_length, uint64_t *size,
+                      uint64_t *piece_bytes);
+
+
+/**
+* Writes a pieced CAN for path to writer,
+* taking its contents from data if it isn't
+* NULL and otherwise reading the file.
+*/
+void write_pieced_file(CAN_WRITER writer, char *path, struct stat *file_stat,
+                       const uint8_t *data);
+
+
+/**
+* Starts following the content_length byte
+* contents of a pieced CAN whose header
+* hashes to header_hash.
+*/
+void piece_check_start(struct Piece_Check *check, uint64_t header_hash,
+                       uint64_t content_length);
+
+
+/**
+* Takes the next bytes of the contents from
+* buf, no more than len and no further than
+* the end of a piece or its checksum, and
+* returns how many. data is set if they are
+* the file's, and the rest are added to sum.
+*/
+size_t piece_check_update(struct Piece_Check *check, struct CAN_Sum *sum,
+                          const uint8_t *buf, size_t len, int *data);
+
+
+/**
+* Returns non-zero once all the contents
+* have been taken and every piece matched
+* its checksum.
+*/
+int piece_check_ok(struct Piece_Check *check);
+
+
+#endif
@@ -0,0 +1,218 @@
+/**
+* ring.c => io_uring set up and driven through the raw syscalls
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "crush.h"
+#include "ring.h"
+#include "stats.h"
+
+/**
+* The submission and completion queues
+* shared with the kernel.
+*/
+struct Ring_Struct {
+    int fd;
+    unsigned entries;
+
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_local_tail;
+    unsigned queued;
+
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static int ring_enter(RING ring, unsigned submit, unsigned wait);
+static int register_files(RING ring, unsigned files);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+RING new_ring(unsigned depth, unsigned files) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd < 0)
+        return NULL;
+
+    RING ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        handle_error("Failed to allocate ring");
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels share one mapping
+    // between both rings.
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->cq_map = ring->sq_map;
+    if (!single) {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            free_ring(ring);
+            return NULL;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        free_ring(ring);
+        return NULL;
+    }
+
+    unsigned char *sq = ring->sq_map;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    unsigned char *cq = ring->cq_map;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // Sparse direct descriptors arrived after
+    // every op used here, so having them means
+    // the rest will work too.
+    if (register_files(ring, files) != 0) {
+        free_ring(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+
+struct io_uring_sqe *ring_get_sqe(RING ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head == ring->entries) {
+        ring_submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head == ring->entries)
+            handle_error("Ring submission queue stuck");
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->queued++;
+    return sqe;
+}
+
+
+void ring_submit(RING ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned submit = ring->queued;
+    ring->queued = 0;
+
+    do {
+        int done = ring_enter(ring, submit, wait);
+        if (done < 0)
+            handle_error("Failed to submit to ring");
+        submit -= done < (int) submit ? (unsigned) done : submit;
+    } while (submit);
+}
+
+
+int ring_next_cqe(RING ring, uint64_t *user_data, int32_t *res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+void free_ring(RING ring) {
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+
+    close(ring->fd);
+    free(ring);
+}
+
+
+/**
+* Submits submit entries and waits for wait
+* completions, retrying if interrupted.
+* Returns how many were submitted.
+*/
+static int ring_enter(RING ring, unsigned submit, unsigned wait) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+    for (;;) {
+        int done = syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags,
+                           NULL, 0);
+        stats_call(STATS_CALL_RING_ENTER);
+        if (done >= 0 || errno != EINTR)
+            return done;
+    }
+}
+
+
+/**
+* Registers files empty direct
+* descriptor slots.
+*/
+static int register_files(RING ring, unsigned files) {
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = files;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES2,
+                   &reg, sizeof(reg)) < 0 ? -1 : 0;
+}
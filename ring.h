@@ -0,0 +1,56 @@
+#ifndef RING_H
+#define RING_H
+
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+* A minimal io_uring made with the raw syscalls,
+* along with a table of direct descriptors so an
+* open, the reads or writes using its file and
+* the close can be queued together as one
+* linked chain.
+*/
+typedef struct Ring_Struct *RING;
+
+
+/**
+* Sets up a ring of depth submission entries
+* and files direct descriptor slots. Returns
+* NULL if the kernel can't, so callers can
+* fall back to plain syscalls.
+*/
+RING new_ring(unsigned depth, unsigned files);
+
+
+/**
+* Returns the next free submission entry,
+* zeroed, submitting what is queued first
+* if the queue is full.
+*/
+struct io_uring_sqe *ring_get_sqe(RING ring);
+
+
+/**
+* Submits every queued entry and waits until
+* at least wait completions are ready.
+*/
+void ring_submit(RING ring, unsigned wait);
+
+
+/**
+* Takes the oldest completion, storing its
+* user_data and result. Returns 0 if none
+* are ready.
+*/
+int ring_next_cqe(RING ring, uint64_t *user_data, int32_t *res);
+
+
+/**
+* Tears down a ring.
+*/
+void free_ring(RING ring);
+
+
+#endif
@@ -0,0 +1,320 @@
+/**
+* sparse.c => Storing and restoring the holes of sparse files
+*/
+
+
+// for SEEK_DATA and SEEK_HOLE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "can.h"
+#include "crush.h"
+#include "sparse.h"
+#include "stats.h"
+
+/**
+* A run of a file's bytes that holds
+* data, everything else is a hole.
+*/
+struct Extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/**
+* The data extents of a whole file along
+* with how many bytes they hold.
+*/
+struct Extent_List {
+    struct Extent *extents;
+    size_t count;
+    size_t capacity;
+    uint64_t data;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static int find_extents(struct Extent_List *list, int fd, uint64_t size);
+static void add_extent(struct Extent_List *list, uint64_t offset, uint64_t length);
+static void write_extent(BLOCK_IO can, struct CAN_Sum *sum, int fd,
+                         struct Extent *extent);
+static void skip_hole(int fd, uint64_t length);
+static void read_map(BLOCK_IO file_ptr, struct CAN_Sum *sum, uint8_t *dst,
+                     size_t len, uint64_t *remaining);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+int may_be_sparse(struct stat *s) {
+    return S_ISREG(s->st_mode) && (uint64_t) s->st_blocks * 512 < (uint64_t) s->st_size;
+}
+
+
+int write_sparse_file(CAN_WRITER writer, char *path, struct stat *file_stat) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        handle_error("Failed to open file steam");
+    stats_call(STATS_CALL_OPEN);
+
+    uint64_t size = file_stat->st_size;
+    struct Extent_List list = {0};
+    if (!find_extents(&list, fd, size)) {
+        free(list.extents);
+        close(fd);
+        stats_call(STATS_CALL_CLOSE);
+        return 0;
+    }
+
+    uint64_t content_length = SPARSE_MAP_HEADER_BYTES +
+                              list.count * SPARSE_EXTENT_BYTES + list.data;
+
+    BLOCK_IO can_file = writer->io;
+    int flags = CAN_FLAG_SPARSE;
+    size_t shared = next_CAN_shared(writer, path, &flags);
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_prefixed_CAN_header(header, writer->version, flags,
+                                                      shared, path, file_stat->st_mode,
+                                                      content_length);
+    block_io_write(can_file, header, header_length);
+    off_t payload = block_io_tell(can_file);
+
+    uint64_t header_hash = CAN_header_sum(writer->version, header, header_length);
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, writer->version, header_hash);
+
+    // The whole map goes first so extraction
+    // knows where every extent belongs
+    // before its bytes arrive.
+    uint8_t record[SPARSE_MAP_HEADER_BYTES];
+    put_bytes(record, size, 8);
+    put_bytes(record + 8, list.count, 8);
+    block_io_write(can_file, record, SPARSE_MAP_HEADER_BYTES);
+    CAN_sum_update(&sum, record, SPARSE_MAP_HEADER_BYTES);
+
+    for (size_t e = 0; e < list.count; e++) {
+        put_bytes(record, list.extents[e].offset, 8);
+        put_bytes(record + 8, list.extents[e].length, 8);
+        block_io_write(can_file, record, SPARSE_EXTENT_BYTES);
+        CAN_sum_update(&sum, record, SPARSE_EXTENT_BYTES);
+    }
+
+    for (size_t e = 0; e < list.count; e++)
+        write_extent(can_file, &sum, fd, &list.extents[e]);
+
+    free(list.extents);
+    close(fd);
+    stats_call(STATS_CALL_CLOSE);
+
+    uint64_t hash = CAN_sum_final(&sum);
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, writer->version, hash);
+    block_io_write(can_file, trailer, CAN_sum_bytes(writer->version));
+
+    struct CAN_Entry entry = {
+        .path = path,
+        .flags = flags,
+        .mode = file_stat->st_mode,
+        .content_length = content_length,
+        .offset = payload - header_length,
+        .payload = payload,
+        .header_hash = header_hash,
+        .hash = hash,
+        .mtime = file_stat->st_mtim,
+    };
+    record_CAN(writer, &entry);
+    return 1;
+}
+
+
+void extract_sparse(BLOCK_IO file_ptr, struct CAN_Sum *sum,
+                    uint64_t content_length, int fd) {
+    uint64_t remaining = content_length;
+    uint8_t record[SPARSE_MAP_HEADER_BYTES];
+
+    read_map(file_ptr, sum, record, SPARSE_MAP_HEADER_BYTES, &remaining);
+    uint64_t size = get_bytes(record, 8);
+    uint64_t count = get_bytes(record + 8, 8);
+    if (count > remaining / SPARSE_EXTENT_BYTES)
+        handle_error("Sparse CAN corrupt");
+
+    struct Extent *extents = malloc((count ? count : 1) * sizeof(struct Extent));
+    if (!extents)
+        handle_error("Failed to allocate sparse map");
+
+    // Extents must be in order, apart and
+    // inside the file, and hold exactly
+    // the bytes left after the map.
+    uint64_t end = 0;
+    uint64_t data = 0;
+    for (uint64_t e = 0; e < count; e++) {
+        read_map(file_ptr, sum, record, SPARSE_EXTENT_BYTES, &remaining);
+        extents[e].offset = get_bytes(record, 8);
+        extents[e].length = get_bytes(record + 8, 8);
+
+        if (extents[e].offset < end || extents[e].length > size ||
+            extents[e].offset > size - extents[e].length)
+            handle_error("Sparse CAN corrupt");
+        end = extents[e].offset + extents[e].length;
+        data += extents[e].length;
+    }
+    if (data != remaining)
+        handle_error("Sparse CAN corrupt");
+
+    // The file is new and empty, so seeking
+    // past a hole leaves it unallocated.
+    end = 0;
+    for (uint64_t e = 0; e < count; e++) {
+        skip_hole(fd, extents[e].offset - end);
+        end = extents[e].offset + extents[e].length;
+
+        uint64_t left = extents[e].length;
+        while (left) {
+            size_t got = 0;
+            const unsigned char *block = block_io_next(file_ptr,
+                    left < BLOCK_IO_SIZE ? left : BLOCK_IO_SIZE, &got);
+            if (!got)
+                handle_error("Unexpected end of can");
+
+            CAN_sum_update(sum, block, got);
+            write_block(fd, block, got);
+            left -= got;
+        }
+    }
+
+    // Any hole at the end of a file
+    // is made by its size alone.
+    if (lseek(fd, 0, SEEK_CUR) < 0)
+        skip_hole(fd, size - end);
+    else if (ftruncate(fd, size) != 0)
+        handle_error("Failed to write file");
+
+    free(extents);
+}
+
+
+/**
+* Lists the extents of the first size bytes of
+* fd holding data, returning non-zero if there
+* are holes between them. File systems without
+* SEEK_DATA report the whole file as data.
+*/
+static int find_extents(struct Extent_List *list, int fd, uint64_t size) {
+    off_t at = 0;
+
+    while ((uint64_t) at < size) {
+        off_t data = lseek(fd, at, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break;
+        if (data < 0)
+            return 0;
+        if ((uint64_t) data >= size)
+            break;
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+            return 0;
+        if ((uint64_t) hole > size)
+            hole = size;
+
+        add_extent(list, data, hole - data);
+        at = hole;
+    }
+
+    return list->data < size;
+}
+
+
+/**
+* Appends an extent of length
+* bytes starting at offset.
+*/
+static void add_extent(struct Extent_List *list, uint64_t offset, uint64_t length) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->extents = realloc(list->extents,
+                                list->capacity * sizeof(struct Extent));
+        if (!list->extents)
+            handle_error("Failed to grow sparse map");
+    }
+
+    list->extents[list->count].offset = offset;
+    list->extents[list->count].length = length;
+    list->count++;
+    list->data += length;
+}
+
+
+/**
+* preads the bytes of one extent straight
+* into the can's output buffer.
+*/
+static void write_extent(BLOCK_IO can, struct CAN_Sum *sum, int fd,
+                         struct Extent *extent) {
+    off_t offset = extent->offset;
+    uint64_t left = extent->length;
+
+    while (left) {
+        size_t avail = 0;
+        unsigned char *block = block_io_space(can, &avail);
+        if (avail > left)
+            avail = left;
+
+        uint64_t since = stats_clock();
+        ssize_t got = pread(fd, block, avail, offset);
+        stats_phase(STATS_READ, since);
+        stats_call(STATS_CALL_READ);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            handle_error("Failed to read file");
+        if (got == 0)
+            handle_error("File changed size while archiving");
+
+        CAN_sum_update(sum, block, got);
+        block_io_commit(can, got);
+        offset += got;
+        left -= got;
+    }
+}
+
+
+/**
+* Moves fd past a hole of length bytes,
+* writing it out as zeros if fd is a
+* pipe which can't seek.
+*/
+static void skip_hole(int fd, uint64_t length) {
+    static const unsigned char zeros[BLOCK_IO_ALIGN];
+
+    if (!length || lseek(fd, length, SEEK_CUR) >= 0)
+        return;
+    if (errno != ESPIPE)
+        handle_error("Failed to write file");
+
+    while (length) {
+        size_t step = length < sizeof(zeros) ? length : sizeof(zeros);
+        write_block(fd, zeros, step);
+        length -= step;
+    }
+}
+
+
+/**
+* Reads len bytes of a sparse map into
+* dst, adding them to sum and taking
+* them off what is left of the CAN.
+*/
+static void read_map(BLOCK_IO file_ptr, struct CAN_Sum *sum, uint8_t *dst,
+                     size_t len, uint64_t *remaining) {
+    if (len > *remaining)
+        handle_error("Sparse CAN corrupt");
+    if (block_io_read(file_ptr, dst, len) != len)
+        handle_error("Unexpected end of can");
+
+    CAN_sum_update(sum, dst, len);
+    *remaining -= len;
+}
@@ -0,0 +1,47 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "can.h"
+
+// a sparse CAN's contents start with the size
+// of the file and how many extents hold data,
+// then the offset and length of each extent,
+// then the bytes of every extent in order
+#define SPARSE_MAP_HEADER_BYTES   16
+#define SPARSE_EXTENT_BYTES       16
+
+/**
+* Returns non-zero if the file s describes
+* has fewer blocks than its size needs,
+* so it may have holes.
+*/
+int may_be_sparse(struct stat *s);
+
+
+/**
+* Writes a sparse CAN for path to writer,
+* storing only the extents holding data,
+* if the file has any holes. Returns 0,
+* having written nothing, if it doesn't.
+*/
+int write_sparse_file(CAN_WRITER writer, char *path, struct stat *file_stat);
+
+
+/**
+* Recreates a file from the content_length
+* byte contents of a sparse CAN, writing
+* each extent at its offset in fd and
+* leaving the rest as holes, or zeros
+* if fd is a pipe. Every byte read
+* is added to sum.
+*/
+void extract_sparse(BLOCK_IO file_ptr, struct CAN_Sum *sum,
+                    uint64_t content_length, int fd);
+
+
+#endif
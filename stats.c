@@ -0,0 +1,342 @@
+/**
+* stats.c => Counters and timers behind --stats
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "crush.h"
+#include "stats.h"
+
+/**
+* One thread's counters, so adding to
+* them never needs a lock. A report
+* sums every thread's block.
+*/
+struct Stats_Block {
+    uint64_t phases[STATS_PHASES];
+    uint64_t calls[STATS_CALLS];
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t buckets[STATS_BUCKETS];
+    struct Stats_Block *next;
+};
+
+/**
+* One of the largest entries seen.
+*/
+struct Stats_Largest {
+    uint64_t bytes;
+    char *path;
+};
+
+static const char *phase_names[STATS_PHASES] = {
+    "walk", "stat", "read", "hash", "write",
+};
+
+static const char *call_names[STATS_CALLS] = {
+    "open", "close", "stat", "read", "write", "mkdir", "chmod", "io_uring_enter",
+};
+
+static int enabled;
+static uint64_t started;
+
+static struct Stats_Block *blocks;
+static __thread struct Stats_Block *mine;
+
+static struct Stats_Largest largest[STATS_LARGEST];
+static uint64_t largest_floor;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static uint64_t now(void);
+static struct Stats_Block *thread_block(void);
+static void add_largest(const char *path, uint64_t bytes);
+static int by_bytes(const void *a, const void *b);
+static void sum_blocks(struct Stats_Block *total);
+static void report_text(FILE *out, struct Stats_Block *total, struct rusage *usage,
+                        double wall);
+static void report_json(FILE *out, struct Stats_Block *total, struct rusage *usage,
+                        double wall);
+static void put_json_string(FILE *out, const char *s);
+static double seconds(uint64_t ns);
+static double cpu_seconds(struct timeval *tv);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+void stats_enable(void) {
+    enabled = 1;
+    started = now();
+}
+
+
+uint64_t stats_clock(void) {
+    if (!enabled)
+        return 0;
+
+    return now();
+}
+
+
+void stats_phase(stats_phase_t phase, uint64_t since) {
+    struct Stats_Block *block = enabled ? thread_block() : NULL;
+    if (!block)
+        return;
+
+    block->phases[phase] += now() - since;
+}
+
+
+void stats_call(stats_call_t call) {
+    struct Stats_Block *block = enabled ? thread_block() : NULL;
+    if (!block)
+        return;
+
+    block->calls[call]++;
+}
+
+
+void stats_entry(const char *path, uint64_t bytes, uint64_t since) {
+    struct Stats_Block *block = enabled ? thread_block() : NULL;
+    if (!block)
+        return;
+
+    uint64_t took = now() - since;
+    int bucket = took ? 64 - __builtin_clzll(took) : 0;
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+
+    block->entries++;
+    block->bytes += bytes;
+    block->buckets[bucket]++;
+
+    // Only entries bigger than the smallest
+    // listed so far need the lock.
+    if (bytes > __atomic_load_n(&largest_floor, __ATOMIC_RELAXED))
+        add_largest(path, bytes);
+}
+
+
+void stats_report(FILE *out, int json) {
+    if (!enabled)
+        return;
+
+    struct Stats_Block total = {0};
+    sum_blocks(&total);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        memset(&usage, 0, sizeof(usage));
+
+    double wall = seconds(now() - started);
+    qsort(largest, STATS_LARGEST, sizeof(struct Stats_Largest), by_bytes);
+    if (json)
+        report_json(out, &total, &usage, wall);
+    else
+        report_text(out, &total, &usage, wall);
+    fflush(out);
+}
+
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+* Returns the calling thread's block,
+* adding one the first time, or NULL if
+* it can't be had. Stats are best effort
+* and never end the run, which also keeps
+* them fit for libcan.
+*/
+static struct Stats_Block *thread_block(void) {
+    if (mine)
+        return mine;
+
+    mine = calloc(1, sizeof(struct Stats_Block));
+    if (!mine)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    mine->next = blocks;
+    blocks = mine;
+    pthread_mutex_unlock(&lock);
+
+    return mine;
+}
+
+
+/**
+* Puts an entry in place of the smallest
+* of the largest if it is bigger.
+*/
+static void add_largest(const char *path, uint64_t bytes) {
+    pthread_mutex_lock(&lock);
+
+    int smallest = 0;
+    for (int l = 1; l < STATS_LARGEST; l++) {
+        if (largest[l].bytes < largest[smallest].bytes)
+            smallest = l;
+    }
+
+    if (bytes > largest[smallest].bytes) {
+        char *copy = strdup(path);
+        if (!copy) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        free(largest[smallest].path);
+        largest[smallest].path = copy;
+        largest[smallest].bytes = bytes;
+
+        uint64_t floor = largest[0].bytes;
+        for (int l = 1; l < STATS_LARGEST; l++) {
+            if (largest[l].bytes < floor)
+                floor = largest[l].bytes;
+        }
+        __atomic_store_n(&largest_floor, floor, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+
+/**
+* Orders the largest entries
+* biggest first.
+*/
+static int by_bytes(const void *a, const void *b) {
+    const struct Stats_Largest *x = a;
+    const struct Stats_Largest *y = b;
+
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+
+static void sum_blocks(struct Stats_Block *total) {
+    for (struct Stats_Block *block = blocks; block; block = block->next) {
+        for (int p = 0; p < STATS_PHASES; p++)
+            total->phases[p] += block->phases[p];
+        for (int c = 0; c < STATS_CALLS; c++)
+            total->calls[c] += block->calls[c];
+        for (int b = 0; b < STATS_BUCKETS; b++)
+            total->buckets[b] += block->buckets[b];
+        total->entries += block->entries;
+        total->bytes += block->bytes;
+    }
+}
+
+
+/**
+* A line per kind of stat in the key=value
+* style of a verify summary, with each
+* largest entry's path last so it may
+* hold spaces.
+*/
+static void report_text(FILE *out, struct Stats_Block *total, struct rusage *usage,
+                        double wall) {
+    fprintf(out, "stats wall=%.3f user=%.3f sys=%.3f entries=%llu bytes=%llu\n",
+            wall, cpu_seconds(&usage->ru_utime), cpu_seconds(&usage->ru_stime),
+            (unsigned long long) total->entries, (unsigned long long) total->bytes);
+
+    fprintf(out, "stats phases");
+    for (int p = 0; p < STATS_PHASES; p++)
+        fprintf(out, " %s=%.3f", phase_names[p], seconds(total->phases[p]));
+
+    fprintf(out, "\nstats syscalls");
+    for (int c = 0; c < STATS_CALLS; c++)
+        fprintf(out, " %s=%llu", call_names[c], (unsigned long long) total->calls[c]);
+
+    // Each bucket holds entries taking
+    // under its bound in nanoseconds.
+    fprintf(out, "\nstats latency");
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (total->buckets[b])
+            fprintf(out, " lt%lluns=%llu", 1ULL << b,
+                    (unsigned long long) total->buckets[b]);
+    }
+    fprintf(out, "\n");
+
+    for (int l = 0; l < STATS_LARGEST; l++) {
+        if (largest[l].path)
+            fprintf(out, "stats largest bytes=%llu path=%s\n",
+                    (unsigned long long) largest[l].bytes, largest[l].path);
+    }
+}
+
+
+static void report_json(FILE *out, struct Stats_Block *total, struct rusage *usage,
+                        double wall) {
+    fprintf(out, "{\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                 "\"entries\":%llu,\"bytes\":%llu,\"phases\":{",
+            wall, cpu_seconds(&usage->ru_utime), cpu_seconds(&usage->ru_stime),
+            (unsigned long long) total->entries, (unsigned long long) total->bytes);
+
+    for (int p = 0; p < STATS_PHASES; p++)
+        fprintf(out, "%s\"%s\":%.6f", p ? "," : "", phase_names[p],
+                seconds(total->phases[p]));
+
+    fprintf(out, "},\"syscalls\":{");
+    for (int c = 0; c < STATS_CALLS; c++)
+        fprintf(out, "%s\"%s\":%llu", c ? "," : "", call_names[c],
+                (unsigned long long) total->calls[c]);
+
+    fprintf(out, "},\"latency_ns\":[");
+    int first = 1;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        if (!total->buckets[b])
+            continue;
+        fprintf(out, "%s{\"lt\":%llu,\"count\":%llu}", first ? "" : ",", 1ULL << b,
+                (unsigned long long) total->buckets[b]);
+        first = 0;
+    }
+
+    fprintf(out, "],\"largest\":[");
+    first = 1;
+    for (int l = 0; l < STATS_LARGEST; l++) {
+        if (!largest[l].path)
+            continue;
+        fprintf(out, "%s{\"bytes\":%llu,\"path\":", first ? "" : ",",
+                (unsigned long long) largest[l].bytes);
+        put_json_string(out, largest[l].path);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "]}\n");
+}
+
+
+/**
+* Writes s as a quoted JSON string.
+*/
+static void put_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+
+static double seconds(uint64_t ns) {
+    return ns / 1e9;
+}
+
+
+static double cpu_seconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
@@ -0,0 +1,92 @@
+#ifndef STATS_H
+#define STATS_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+
+// how many of the largest entries
+// a report lists
+#define STATS_LARGEST             10
+
+// latency histogram buckets, each
+// twice as wide as the last
+#define STATS_BUCKETS             40
+
+/**
+* Where the time of a run goes. Phases are
+* timed around each call so they add up
+* across threads rather than overlapping.
+*/
+typedef enum stats_phase {
+    STATS_WALK,
+    STATS_STAT,
+    STATS_READ,
+    STATS_HASH,
+    STATS_WRITE,
+    STATS_PHASES
+} stats_phase_t;
+
+/**
+* The syscalls counted by type.
+*/
+typedef enum stats_call {
+    STATS_CALL_OPEN,
+    STATS_CALL_CLOSE,
+    STATS_CALL_STAT,
+    STATS_CALL_READ,
+    STATS_CALL_WRITE,
+    STATS_CALL_MKDIR,
+    STATS_CALL_CHMOD,
+    STATS_CALL_RING_ENTER,
+    STATS_CALLS
+} stats_call_t;
+
+
+/**
+* Starts gathering stats. Until this is
+* called every other stats function
+* returns at once.
+*/
+void stats_enable(void);
+
+
+/**
+* Returns a timestamp in nanoseconds
+* to time a phase or entry from, 0 if
+* stats are off.
+*/
+uint64_t stats_clock(void);
+
+
+/**
+* Adds the time since a stats_clock
+* timestamp to phase.
+*/
+void stats_phase(stats_phase_t phase, uint64_t since);
+
+
+/**
+* Counts one syscall of type call.
+*/
+void stats_call(stats_call_t call);
+
+
+/**
+* Counts an entry of bytes processed
+* since a stats_clock timestamp, for the
+* latency histogram and largest entries.
+*/
+void stats_entry(const char *path, uint64_t bytes, uint64_t since);
+
+
+/**
+* Writes everything gathered to out as
+* text, or as one JSON object if json
+* is non-zero. Every thread that added
+* to the stats must have finished.
+*/
+void stats_report(FILE *out, int json);
+
+
+#endif
@@ -0,0 +1,187 @@
+/**
+* sum64.c => 64-bit xxh64 checksum used by v2 CANs
+*/
+
+
+#include <string.h>
+
+#include "sum64.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static inline uint64_t rotl64(uint64_t value, int bits);
+static inline uint64_t read64(const uint8_t *in);
+static inline uint32_t read32(const uint8_t *in);
+static inline uint64_t sum64_round(uint64_t acc, uint64_t input);
+static inline uint64_t sum64_merge(uint64_t acc, uint64_t lane);
+static const uint8_t *sum64_stripes(uint64_t *lanes, const uint8_t *in,
+                                    const uint8_t *limit);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+void sum64_start(struct Sum64_State *state, uint64_t seed) {
+    state->lanes[0] = seed + PRIME64_1 + PRIME64_2;
+    state->lanes[1] = seed + PRIME64_2;
+    state->lanes[2] = seed;
+    state->lanes[3] = seed - PRIME64_1;
+    state->seed = seed;
+    state->total = 0;
+    state->pending_length = 0;
+}
+
+
+void sum64_update(struct Sum64_State *state, const void *buf, size_t len) {
+    const uint8_t *in = buf;
+    const uint8_t *end = in + len;
+    state->total += len;
+
+    // Top up a part filled stripe first.
+    if (state->pending_length) {
+        size_t fill = SUM64_STRIPE_BYTES - state->pending_length;
+        if (fill > len)
+            fill = len;
+
+        memcpy(state->pending + state->pending_length, in, fill);
+        state->pending_length += fill;
+        in += fill;
+
+        if (state->pending_length < SUM64_STRIPE_BYTES)
+            return;
+
+        sum64_stripes(state->lanes, state->pending,
+                      state->pending + SUM64_STRIPE_BYTES);
+        state->pending_length = 0;
+    }
+
+    if (end - in >= SUM64_STRIPE_BYTES)
+        in = sum64_stripes(state->lanes, in, end - SUM64_STRIPE_BYTES + 1);
+
+    memcpy(state->pending, in, end - in);
+    state->pending_length = end - in;
+}
+
+
+uint64_t sum64_final(const struct Sum64_State *state) {
+    const uint64_t *lanes = state->lanes;
+    uint64_t hash;
+
+    if (state->total >= SUM64_STRIPE_BYTES) {
+        hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) +
+               rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+        for (int lane = 0; lane < 4; lane++)
+            hash = sum64_merge(hash, lanes[lane]);
+    } else {
+        hash = state->seed + PRIME64_5;
+    }
+
+    hash += state->total;
+
+    // Fold in whatever didn't fill a stripe.
+    const uint8_t *in = state->pending;
+    const uint8_t *end = in + state->pending_length;
+    for (; end - in >= 8; in += 8) {
+        hash ^= sum64_round(0, read64(in));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+
+    if (end - in >= 4) {
+        hash ^= (uint64_t) read32(in) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        in += 4;
+    }
+
+    for (; in < end; in++) {
+        hash ^= *in * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+
+uint64_t sum64(uint64_t seed, const void *buf, size_t len) {
+    struct Sum64_State state;
+
+    sum64_start(&state, seed);
+    sum64_update(&state, buf, len);
+    return sum64_final(&state);
+}
+
+
+static inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+/**
+* Little endian loads. memcpy lets the compiler
+* use a plain unaligned load.
+*/
+static inline uint64_t read64(const uint8_t *in) {
+    uint64_t value;
+    memcpy(&value, in, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+
+static inline uint32_t read32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+
+static inline uint64_t sum64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+
+static inline uint64_t sum64_merge(uint64_t acc, uint64_t lane) {
+    acc ^= sum64_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+
+/**
+* Runs whole stripes through the lanes while
+* in is below limit and returns where it
+* stopped. Keeping the lanes in locals
+* lets them live in registers.
+*/
+static const uint8_t *sum64_stripes(uint64_t *lanes, const uint8_t *in,
+                                    const uint8_t *limit) {
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+
+    do {
+        v1 = sum64_round(v1, read64(in));
+        v2 = sum64_round(v2, read64(in + 8));
+        v3 = sum64_round(v3, read64(in + 16));
+        v4 = sum64_round(v4, read64(in + 24));
+        in += SUM64_STRIPE_BYTES;
+    } while (in < limit);
+
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+    return in;
+}
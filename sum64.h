@@ -0,0 +1,53 @@
+#ifndef SUM64_H
+#define SUM64_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+// bytes consumed by each round of the
+// four sum64 lanes
+#define SUM64_STRIPE_BYTES        32
+
+/**
+* Running state of a 64-bit xxh64 checksum.
+* Four independent lanes take 8 bytes each
+* per stripe so the multiplies pipeline
+* instead of forming one long chain like
+* the Pearson table lookups.
+*/
+struct Sum64_State {
+    uint64_t lanes[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t pending[SUM64_STRIPE_BYTES];
+    size_t pending_length;
+};
+
+
+/**
+* Starts a checksum from seed.
+*/
+void sum64_start(struct Sum64_State *state, uint64_t seed);
+
+
+/**
+* Folds len bytes of buf into the checksum.
+*/
+void sum64_update(struct Sum64_State *state, const void *buf, size_t len);
+
+
+/**
+* Returns the checksum of everything
+* passed to sum64_update so far.
+*/
+uint64_t sum64_final(const struct Sum64_State *state);
+
+
+/**
+* Checksums a whole buffer in one call.
+*/
+uint64_t sum64(uint64_t seed, const void *buf, size_t len);
+
+
+#endif
@@ -0,0 +1,601 @@
+/**
+* verify.c => Checks every CAN of a can without extracting it
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "can.h"
+#include "crush.h"
+#include "crusher.h"
+#include "pieces.h"
+#include "verify.h"
+
+/**
+* One CAN found while walking a can. path
+* is its pathname feild as stored, which
+* points into the mapped can, or is owned
+* by the entry when the can was streamed.
+*/
+struct Verify_Entry {
+    off_t offset;
+    int version;
+    int flags;
+    size_t header_length;
+    size_t pad;
+    uint64_t content_length;
+    const char *path;
+    int path_length;
+    int status;
+};
+
+/**
+* Every CAN of the can being verified and
+* how far the walk over it got. next is
+* the next entry a worker should check.
+*/
+struct Verify_Run {
+    const uint8_t *map;
+    off_t map_size;
+    struct Verify_Entry *entries;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    uint64_t bytes;
+    int complete;
+    int streamed;
+    pthread_mutex_t lock;
+};
+
+static const char *verify_reasons[] = {
+    [VERIFY_OK] = "ok",
+    [VERIFY_BAD_MAGIC] = "magic",
+    [VERIFY_BAD_FLAGS] = "flags",
+    [VERIFY_TRUNCATED] = "truncated",
+    [VERIFY_BAD_HASH] = "hash",
+    [VERIFY_BAD_PATH] = "path",
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static double now(void);
+static struct Verify_Entry *append_entry(struct Verify_Run *run, off_t offset);
+static int parse_fixed_header(const uint8_t *header, size_t avail,
+                              struct Verify_Entry *entry);
+static void check_prefix(struct Verify_Entry *entry, size_t *last_length);
+static void walk_map(struct Verify_Run *run, off_t size);
+static void check_entry(const uint8_t *map, struct Verify_Entry *entry);
+static void check_entries(const uint8_t *map, struct Verify_Entry *entries,
+                          size_t count);
+static void sum_contents(struct Verify_Entry *entry, struct CAN_Sum *sum,
+                         struct Piece_Check *pieces, const uint8_t *buf, size_t len);
+static int sums_match(struct Verify_Entry *entry, struct CAN_Sum *sum,
+                      struct Piece_Check *pieces, const uint8_t *stored);
+static void *verify_thread(void *arg);
+static void verify_map(struct Verify_Run *run, int fd, off_t size, int workers);
+static void verify_stream(struct Verify_Run *run, BLOCK_IO file_ptr);
+static size_t report(struct Verify_Run *run, FILE *out, int volume);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+size_t check_can(int fd, int workers, FILE *out) {
+    struct Verify_Summary summary = {.complete = 1};
+    size_t corrupt = check_can_part(fd, workers, out, &summary);
+    print_verify_summary(out, &summary);
+
+    return corrupt;
+}
+
+
+size_t check_can_part(int fd, int workers, FILE *out, struct Verify_Summary *summary) {
+    struct Verify_Run run = {0};
+    pthread_mutex_init(&run.lock, NULL);
+    double start = now();
+
+    struct stat s;
+    if (fstat(fd, &s) != 0)
+        handle_error("Failed to stat can");
+
+    // Only a plain can on disk can be mapped
+    // and have its CANs checked out of order.
+    if (is_compressed(fd)) {
+        BLOCK_IO file_ptr = read_compressed_can(fd, workers);
+        verify_stream(&run, file_ptr);
+        block_io_close(file_ptr);
+    } else if (S_ISREG(s.st_mode)) {
+        verify_map(&run, fd, s.st_size, workers);
+        close(fd);
+    } else {
+        BLOCK_IO file_ptr = block_io_open_read(fd);
+        verify_stream(&run, file_ptr);
+        block_io_close(file_ptr);
+    }
+
+    size_t corrupt = report(&run, out, summary->volume);
+    summary->entries += run.count;
+    summary->corrupt += corrupt;
+    summary->bytes += run.bytes;
+    summary->complete &= run.complete;
+    summary->seconds += now() - start;
+
+    // Mapped entries' paths live in the
+    // map so it goes once they're printed.
+    if (run.map)
+        munmap((void *) run.map, run.map_size);
+    if (run.streamed) {
+        for (size_t e = 0; e < run.count; e++)
+            free((char *) run.entries[e].path);
+    }
+    free(run.entries);
+    pthread_mutex_destroy(&run.lock);
+
+    return corrupt;
+}
+
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+* Adds an entry for the CAN at offset
+* and returns it.
+*/
+static struct Verify_Entry *append_entry(struct Verify_Run *run, off_t offset) {
+    if (run->count == run->capacity) {
+        run->capacity = run->capacity ? run->capacity * 2 : 256;
+        run->entries = realloc(run->entries,
+                               run->capacity * sizeof(struct Verify_Entry));
+        if (!run->entries)
+            handle_error("Failed to grow verify entries");
+    }
+
+    struct Verify_Entry *entry = &run->entries[run->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->offset = offset;
+    return entry;
+}
+
+
+/**
+* Decodes the header feilds before the
+* pathname. Unlike build_CAN a bad header
+* is recorded rather than fatal.
+*/
+static int parse_fixed_header(const uint8_t *header, size_t avail,
+                              struct Verify_Entry *entry) {
+    if (avail < CAN_MAGIC_NUMBER_BYTES)
+        return VERIFY_TRUNCATED;
+
+    if (header[0] == CAN_MAGIC_NUMBER)
+        entry->version = CAN_FORMAT_V1;
+    else if (header[0] == CAN_V2_MAGIC_NUMBER)
+        entry->version = CAN_FORMAT_V2;
+    else
+        return VERIFY_BAD_MAGIC;
+
+    size_t fixed = CAN_header_length(entry->version, 0);
+    if (avail < fixed)
+        return VERIFY_TRUNCATED;
+
+    // Everything after the magic and
+    // any flags is laid out the same.
+    const uint8_t *field = header + fixed - CAN_FIXED_HEADER_LENGTH + 1;
+    uint64_t content_length = 0;
+    for (int byte = 0; byte < CAN_CONTENT_LENGTH_BYTES; byte++)
+        content_length = (content_length << 8) |
+                         field[CAN_MODE_LENGTH_BYTES + CAN_PATHNAME_LENGTH_BYTES + byte];
+
+    entry->path_length = field[CAN_MODE_LENGTH_BYTES] << 8 |
+                         field[CAN_MODE_LENGTH_BYTES + 1];
+    entry->header_length = fixed + entry->path_length;
+    entry->content_length = content_length;
+
+    if (entry->version == CAN_FORMAT_V2)
+        entry->flags = header[1];
+    if (entry->flags & ~CAN_KNOWN_FLAGS)
+        return VERIFY_BAD_FLAGS;
+
+    // Any padding lines the contents
+    // up with the start of the can.
+    entry->pad = CAN_pad_bytes(entry->flags, entry->offset + entry->header_length);
+
+    return VERIFY_OK;
+}
+
+
+/**
+* Follows the length of the full pathname of
+* each CAN so one sharing more than the last
+* pathname had is caught. What a bad one
+* shared isn't known, so any length goes
+* for the CAN after it.
+*/
+static void check_prefix(struct Verify_Entry *entry, size_t *last_length) {
+    size_t length = entry->path_length;
+
+    if (entry->flags & CAN_FLAG_PREFIXED) {
+        const uint8_t *stored = (const uint8_t *) entry->path;
+        size_t shared = 0;
+        if (length >= CAN_PREFIX_BYTES)
+            shared = stored[0] << 8 | stored[1];
+
+        if (length < CAN_PREFIX_BYTES || shared > *last_length ||
+            length - CAN_PREFIX_BYTES + shared > CAN_MAX_PATHNAME_LENGTH) {
+            if (entry->status == VERIFY_OK)
+                entry->status = VERIFY_BAD_PATH;
+            *last_length = CAN_MAX_PATHNAME_LENGTH;
+            return;
+        }
+        length = length - CAN_PREFIX_BYTES + shared;
+    }
+
+    *last_length = length;
+}
+
+
+/**
+* Finds every CAN of a mapped can by hopping
+* from header to header. A bad magic or a CAN
+* running off the end of the can loses track
+* of where the next one starts, so the walk
+* stops there.
+*/
+static void walk_map(struct Verify_Run *run, off_t size) {
+    off_t offset = 0;
+    size_t last_length = 0;
+
+    while (offset < size) {
+        struct Verify_Entry *entry = append_entry(run, offset);
+        size_t avail = size - offset;
+        const uint8_t *header = run->map + offset;
+
+        entry->status = parse_fixed_header(header, avail, entry);
+        if (entry->status == VERIFY_BAD_MAGIC || entry->status == VERIFY_TRUNCATED)
+            break;
+
+        if (entry->header_length <= avail) {
+            entry->path = (const char *) header + entry->header_length -
+                          entry->path_length;
+            check_prefix(entry, &last_length);
+        }
+
+        uint64_t length = entry->header_length + entry->pad + entry->content_length +
+                          CAN_sum_bytes(entry->version);
+        if (length > avail) {
+            entry->status = VERIFY_TRUNCATED;
+            break;
+        }
+
+        offset += length;
+    }
+
+    run->bytes = offset;
+    run->complete = offset == size;
+}
+
+
+/**
+* Checks the checksum of one mapped CAN,
+* leaving alone any already found bad.
+*/
+static void check_entry(const uint8_t *map, struct Verify_Entry *entry) {
+    if (entry->status != VERIFY_OK)
+        return;
+
+    const uint8_t *header = map + entry->offset;
+    const uint8_t *content = header + entry->header_length + entry->pad;
+
+    uint64_t header_hash = CAN_header_sum(entry->version, header, entry->header_length);
+    struct CAN_Sum sum;
+    struct Piece_Check pieces;
+    CAN_sum_start(&sum, entry->version, header_hash);
+    piece_check_start(&pieces, header_hash, entry->content_length);
+    sum_contents(entry, &sum, &pieces, content, entry->content_length);
+
+    if (!sums_match(entry, &sum, &pieces, content + entry->content_length))
+        entry->status = VERIFY_BAD_HASH;
+}
+
+
+/**
+* Checks a batch of mapped CANs, hashing
+* the v1 ones together in lanes since
+* each has a hash chain of its own.
+*/
+static void check_entries(const uint8_t *map, struct Verify_Entry *entries,
+                          size_t count) {
+    struct Verify_Entry *lane_entries[CRUSH_HASH_LANES];
+    const uint8_t *bufs[CRUSH_HASH_LANES];
+    size_t lens[CRUSH_HASH_LANES];
+    uint8_t hashes[CRUSH_HASH_LANES] = {0};
+    int lanes = 0;
+
+    for (size_t e = 0; e < count; e++) {
+        struct Verify_Entry *entry = &entries[e];
+        if (entry->status != VERIFY_OK || entry->version != CAN_FORMAT_V1 ||
+            (entry->flags & CAN_FLAG_PIECED)) {
+            check_entry(map, entry);
+            continue;
+        }
+
+        lane_entries[lanes] = entry;
+        bufs[lanes] = map + entry->offset;
+        lens[lanes++] = entry->header_length;
+    }
+    if (!lanes)
+        return;
+
+    // The header's hash carries on
+    // over the contents after it.
+    crush_hash_lanes(hashes, bufs, lens, lanes);
+    for (int l = 0; l < lanes; l++) {
+        bufs[l] += lens[l] + lane_entries[l]->pad;
+        lens[l] = lane_entries[l]->content_length;
+    }
+    crush_hash_lanes(hashes, bufs, lens, lanes);
+
+    for (int l = 0; l < lanes; l++) {
+        if (hashes[l] != get_CAN_sum(bufs[l] + lens[l], CAN_FORMAT_V1))
+            lane_entries[l]->status = VERIFY_BAD_HASH;
+    }
+}
+
+
+/**
+* Adds a run of a CAN's contents to its
+* checksum, or has pieces check them
+* if the CAN is pieced.
+*/
+static void sum_contents(struct Verify_Entry *entry, struct CAN_Sum *sum,
+                         struct Piece_Check *pieces, const uint8_t *buf, size_t len) {
+    if (!(entry->flags & CAN_FLAG_PIECED)) {
+        CAN_sum_update(sum, buf, len);
+        return;
+    }
+
+    while (len) {
+        int data;
+        size_t step = piece_check_update(pieces, sum, buf, len, &data);
+        buf += step;
+        len -= step;
+    }
+}
+
+
+/**
+* Compares the stored checksum of a CAN
+* whose contents have all been summed,
+* and of its pieces if it has any.
+*/
+static int sums_match(struct Verify_Entry *entry, struct CAN_Sum *sum,
+                      struct Piece_Check *pieces, const uint8_t *stored) {
+    if ((entry->flags & CAN_FLAG_PIECED) && !piece_check_ok(pieces))
+        return 0;
+
+    return CAN_sum_final(sum) == get_CAN_sum(stored, entry->version);
+}
+
+
+/**
+* Takes entries a batch of lanes at a
+* time until none are left to check.
+*/
+static void *verify_thread(void *arg) {
+    struct Verify_Run *run = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&run->lock);
+        size_t e = run->next;
+        run->next += CRUSH_HASH_LANES;
+        pthread_mutex_unlock(&run->lock);
+
+        if (e >= run->count)
+            break;
+
+        size_t count = run->count - e < CRUSH_HASH_LANES ? run->count - e :
+                                                             CRUSH_HASH_LANES;
+        check_entries(run->map, &run->entries[e], count);
+    }
+
+    return NULL;
+}
+
+
+/**
+* Maps the can, walks its headers and then
+* checks the CANs on workers threads. The
+* CANs are independent once their offsets
+* are known.
+*/
+static void verify_map(struct Verify_Run *run, int fd, off_t size, int workers) {
+    if (size == 0) {
+        run->complete = 1;
+        return;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        handle_error("Failed to map can");
+    madvise(map, size, MADV_SEQUENTIAL);
+    run->map = map;
+    run->map_size = size;
+
+    walk_map(run, size);
+
+    if (workers > (int) run->count)
+        workers = run->count;
+
+    if (workers <= 1) {
+        verify_thread(run);
+    } else {
+        pthread_t *threads = calloc(workers, sizeof(pthread_t));
+        if (!threads)
+            handle_error("Failed to allocate verify threads");
+
+        for (int w = 0; w < workers; w++) {
+            if (pthread_create(&threads[w], NULL, verify_thread, run) != 0)
+                handle_error("Failed to start verify thread");
+        }
+
+        for (int w = 0; w < workers; w++)
+            pthread_join(threads[w], NULL);
+
+        free(threads);
+    }
+}
+
+
+/**
+* Checks each CAN of a block stream in turn,
+* for cans that can't be mapped.
+*/
+static void verify_stream(struct Verify_Run *run, BLOCK_IO file_ptr) {
+    size_t last_length = 0;
+    run->streamed = 1;
+
+    for (;;) {
+        off_t offset = block_io_tell(file_ptr);
+        int magic = block_io_getc(file_ptr);
+        if (magic == EOF) {
+            run->complete = 1;
+            break;
+        }
+
+        struct Verify_Entry *entry = append_entry(run, offset);
+        uint8_t header[CAN_MAX_HEADER_LENGTH];
+        header[0] = magic;
+
+        size_t fixed = CAN_header_length(magic == CAN_V2_MAGIC_NUMBER ?
+                                         CAN_FORMAT_V2 : CAN_FORMAT_V1, 0);
+        size_t got = 1 + block_io_read(file_ptr, header + 1, fixed - 1);
+
+        entry->status = parse_fixed_header(header, got, entry);
+        if (entry->status == VERIFY_BAD_MAGIC || entry->status == VERIFY_TRUNCATED)
+            break;
+
+        if (block_io_read(file_ptr, header + fixed, entry->path_length)
+            != (size_t) entry->path_length) {
+            entry->status = VERIFY_TRUNCATED;
+            break;
+        }
+        // A prefixed pathname starts with binary
+        // bytes, so it isn't copied as a string.
+        char *path = malloc(entry->path_length + 1);
+        if (!path)
+            handle_error("Failed to allocate pathname");
+        memcpy(path, header + fixed, entry->path_length);
+        entry->path = path;
+        check_prefix(entry, &last_length);
+
+        // The padding is read off rather than
+        // skipped so a can cut short there is
+        // reported, not an error.
+        uint8_t pad[CAN_ALIGN];
+        if (block_io_read(file_ptr, pad, entry->pad) != entry->pad) {
+            entry->status = VERIFY_TRUNCATED;
+            break;
+        }
+
+        uint64_t header_hash = CAN_header_sum(entry->version, header,
+                                              entry->header_length);
+        struct CAN_Sum sum;
+        struct Piece_Check pieces;
+        CAN_sum_start(&sum, entry->version, header_hash);
+        piece_check_start(&pieces, header_hash, entry->content_length);
+
+        uint64_t remaining = entry->content_length;
+        while (remaining) {
+            size_t step = 0;
+            const unsigned char *block = block_io_next(file_ptr,
+                    remaining < BLOCK_IO_SIZE ? remaining : BLOCK_IO_SIZE, &step);
+            if (!step)
+                break;
+
+            sum_contents(entry, &sum, &pieces, block, step);
+            remaining -= step;
+        }
+
+        uint8_t stored[CAN_MAX_SUM_BYTES];
+        size_t sum_bytes = CAN_sum_bytes(entry->version);
+        if (remaining || block_io_read(file_ptr, stored, sum_bytes) != sum_bytes) {
+            entry->status = VERIFY_TRUNCATED;
+            break;
+        }
+
+        if (entry->status == VERIFY_OK && !sums_match(entry, &sum, &pieces, stored))
+            entry->status = VERIFY_BAD_HASH;
+    }
+
+    run->bytes = block_io_tell(file_ptr);
+}
+
+
+/**
+* Writes a line for each corrupt CAN in can
+* order, naming the volume it is in if it
+* is in one, and returns how many there
+* are. Pathnames come last
+* so they may hold spaces. Front coded ones
+* are rebuilt along the way, and one that
+* can't be is printed as far as it's stored.
+*/
+static size_t report(struct Verify_Run *run, FILE *out, int volume) {
+    size_t corrupt = 0;
+    struct CAN_Path *last = calloc(1, sizeof(*last));
+    if (!last)
+        handle_error("Failed to allocate pathname");
+
+    for (size_t e = 0; e < run->count; e++) {
+        struct Verify_Entry *entry = &run->entries[e];
+        const char *path = "";
+        int path_length = 0;
+
+        if (entry->path) {
+            path = entry->path;
+            path_length = entry->path_length;
+            if (rebuild_CAN_path(last, entry->flags, (const uint8_t *) entry->path,
+                                 entry->path_length)) {
+                path = last->name;
+                path_length = last->length;
+            } else {
+                last->length = 0;
+                if ((entry->flags & CAN_FLAG_PREFIXED) &&
+                    path_length >= CAN_PREFIX_BYTES) {
+                    path += CAN_PREFIX_BYTES;
+                    path_length -= CAN_PREFIX_BYTES;
+                }
+            }
+        }
+
+        if (entry->status == VERIFY_OK)
+            continue;
+
+        corrupt++;
+        fprintf(out, "corrupt offset=%lld reason=%s ", (long long) entry->offset,
+                verify_reasons[entry->status]);
+        if (volume)
+            fprintf(out, "volume=%d ", volume);
+        fprintf(out, "path=%.*s\n", path_length, path);
+    }
+    free(last);
+
+    return corrupt;
+}
+
+
+void print_verify_summary(FILE *out, struct Verify_Summary *summary) {
+    double secs = summary->seconds;
+    fprintf(out, "summary entries=%zu ok=%zu corrupt=%zu bytes=%llu complete=%d "
+                 "seconds=%.3f mbps=%.1f\n",
+            summary->entries, summary->entries - summary->corrupt, summary->corrupt,
+            (unsigned long long) summary->bytes, summary->complete, secs,
+            secs > 0 ? summary->bytes / secs / 1e6 : 0.0);
+}
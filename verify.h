@@ -0,0 +1,64 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// what verify found wrong with a CAN
+#define VERIFY_OK                 0
+#define VERIFY_BAD_MAGIC          1
+#define VERIFY_BAD_FLAGS          2
+#define VERIFY_TRUNCATED          3
+#define VERIFY_BAD_HASH           4
+#define VERIFY_BAD_PATH           5
+
+/**
+* What checking one or more cans found,
+* complete being 0 if any couldn't be
+* walked to its end. volume, if set, is
+* the volume of a multi-volume can that
+* corrupt lines name.
+*/
+struct Verify_Summary {
+    int volume;
+    size_t entries;
+    size_t corrupt;
+    uint64_t bytes;
+    int complete;
+    double seconds;
+};
+
+/**
+* Checks the magic, flags, pathname and checksum
+* of every CAN in the can open on fd without writing
+* anything. A plain can is mapped and its CANs
+* checked by workers threads at once, a
+* compressed can is checked as it streams.
+*
+* Every corrupt CAN is written to out as a
+* "corrupt" line with its offset, followed by
+* a single "summary" line, all as key=value
+* pairs. Returns the number of corrupt CANs.
+*/
+size_t check_can(int fd, int workers, FILE *out);
+
+
+/**
+* check_can for one can of several, adding
+* what it found to summary rather than
+* writing a summary line. Starting from
+* {.complete = 1}, print_verify_summary
+* then gives the verdict on them all.
+*/
+size_t check_can_part(int fd, int workers, FILE *out, struct Verify_Summary *summary);
+
+
+/**
+* Writes the "summary" line for summary.
+*/
+void print_verify_summary(FILE *out, struct Verify_Summary *summary);
+
+
+#endif
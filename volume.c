@@ -0,0 +1,544 @@
+/**
+* volume.c => Cans written as several volumes filled at once
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "can.h"
+#include "crush.h"
+#include "create_pool.h"
+#include "dedup.h"
+#include "volume.h"
+
+// most threads listing the
+// volumes of a can at once
+#define VOLUME_LOAD_THREADS       16
+
+/**
+* The volumes of a can being listed,
+* each taken by whichever thread
+* is free.
+*/
+struct Volume_Load {
+    int *fds;
+    CAN_INDEX *indexes;
+    int count;
+    int next;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static int pick_volume(VOLUME_SET set, uint64_t bytes);
+static void open_volume(VOLUME_SET set);
+static void finish_volume(VOLUME_SET set, int volume);
+static char *volume_name(char *can_pathname, int volume);
+static void write_manifest(VOLUME_SET set);
+static uint8_t *read_manifest(int fd, uint64_t *length);
+static char *volume_pathname(char *can_pathname, const uint8_t *name, size_t length);
+static void load_volumes(VOLUME_CAN can, CAN_INDEX *indexes);
+static void *load_thread(void *arg);
+static void merge_volumes(VOLUME_CAN can, CAN_INDEX *indexes, const uint8_t *order,
+                          uint64_t entries);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+VOLUME_SET new_volume_set(char *can_pathname, int version, int workers,
+                          size_t budget) {
+    VOLUME_SET set = calloc(1, sizeof(*set));
+    if (!set)
+        handle_error("Failed to allocate volumes");
+
+    set->can_pathname = can_pathname;
+    set->version = version;
+    set->workers = workers;
+    set->budget = budget;
+    return set;
+}
+
+
+void volume_add(void *volume_set, char *path, struct stat *s) {
+    VOLUME_SET set = volume_set;
+    uint64_t bytes = CAN_header_length(set->version, strlen(path));
+    if (!S_ISDIR(s->st_mode))
+        bytes += s->st_size;
+
+    int volume = pick_volume(set, bytes);
+    set->bytes[volume] += bytes;
+
+    if (set->entries == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : 4096;
+        set->order = realloc(set->order, set->capacity * VOLUME_NUMBER_BYTES);
+        if (!set->order)
+            handle_error("Failed to grow volume manifest");
+    }
+    put_bytes(set->order + set->entries++ * VOLUME_NUMBER_BYTES, volume,
+              VOLUME_NUMBER_BYTES);
+
+    create_pool_add(set->pools[volume], path, s);
+}
+
+
+void close_volume_set(VOLUME_SET set) {
+    // Every volume asked for is written,
+    // even if nothing went in it.
+    while (set->opened < set->count)
+        open_volume(set);
+
+    for (int volume = 0; volume < set->opened; volume++) {
+        if (set->pools[volume])
+            finish_volume(set, volume);
+    }
+
+    write_manifest(set);
+
+    free(set->writers);
+    free(set->pools);
+    free(set->bytes);
+    free(set->order);
+    free(set);
+}
+
+
+int is_volume_manifest(int fd) {
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t path_length = strlen(VOLUME_MANIFEST_PATHNAME);
+
+    for (int version = CAN_FORMAT_V1; version <= CAN_FORMAT_V2; version++) {
+        size_t length = CAN_header_length(version, path_length);
+        if (pread(fd, header, length, 0) != (ssize_t) length)
+            return 0;
+
+        // Whatever its length, the header
+        // has to be the manifest's.
+        size_t at = length - path_length - CAN_CONTENT_LENGTH_BYTES;
+        uint64_t content_length = get_bytes(header + at, CAN_CONTENT_LENGTH_BYTES);
+
+        uint8_t expected[CAN_MAX_HEADER_LENGTH];
+        encode_CAN_header(expected, version, 0, VOLUME_MANIFEST_PATHNAME,
+                          VOLUME_MANIFEST_MODE, content_length);
+        if (memcmp(header, expected, length) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+int is_manifest_CAN(char *path, long mode) {
+    return mode == VOLUME_MANIFEST_MODE && strcmp(path, VOLUME_MANIFEST_PATHNAME) == 0;
+}
+
+
+VOLUME_CAN open_volume_can(char *can_pathname, int fd) {
+    uint64_t length;
+    uint8_t *manifest = read_manifest(fd, &length);
+
+    size_t fixed = VOLUME_MAGIC_BYTES + VOLUME_COUNT_BYTES + VOLUME_ENTRIES_BYTES;
+    if (length < fixed || memcmp(manifest, VOLUME_MANIFEST_MAGIC, VOLUME_MAGIC_BYTES))
+        handle_error("Volume manifest corrupt");
+
+    VOLUME_CAN can = calloc(1, sizeof(*can));
+    if (!can)
+        handle_error("Failed to allocate volumes");
+    can->count = get_bytes(manifest + VOLUME_MAGIC_BYTES, VOLUME_COUNT_BYTES);
+    uint64_t entries = get_bytes(manifest + VOLUME_MAGIC_BYTES + VOLUME_COUNT_BYTES,
+                                 VOLUME_ENTRIES_BYTES);
+
+    can->fds = calloc(can->count + 1, sizeof(int));
+    CAN_INDEX *indexes = calloc(can->count + 1, sizeof(CAN_INDEX));
+    if (!can->fds || !indexes)
+        handle_error("Failed to allocate volumes");
+
+    const uint8_t *at = manifest + fixed;
+    const uint8_t *end = manifest + length;
+    for (int volume = 0; volume < can->count; volume++) {
+        if (end - at < VOLUME_NAME_LENGTH_BYTES)
+            handle_error("Volume manifest corrupt");
+        size_t name_length = get_bytes(at, VOLUME_NAME_LENGTH_BYTES);
+        at += VOLUME_NAME_LENGTH_BYTES;
+        if ((size_t) (end - at) < name_length)
+            handle_error("Volume manifest corrupt");
+
+        char *pathname = volume_pathname(can_pathname, at, name_length);
+        can->fds[volume] = open(pathname, O_RDONLY);
+        if (can->fds[volume] < 0) {
+            char *message = malloc(strlen(pathname) + sizeof(" is missing"));
+            if (!message)
+                handle_error("Volume missing");
+            sprintf(message, "%s is missing", pathname);
+            handle_error(message);
+        }
+        free(pathname);
+        at += name_length;
+    }
+
+    if ((uint64_t) (end - at) / VOLUME_NUMBER_BYTES != entries ||
+        (end - at) % VOLUME_NUMBER_BYTES)
+        handle_error("Volume manifest corrupt");
+
+    load_volumes(can, indexes);
+    merge_volumes(can, indexes, at, entries);
+
+    free(indexes);
+    free(manifest);
+    return can;
+}
+
+
+void free_volume_can(VOLUME_CAN can) {
+    for (int volume = 0; volume < can->count; volume++)
+        close(can->fds[volume]);
+
+    free_CAN_index(can->index);
+    free(can->fds);
+    free(can);
+}
+
+
+/**
+* Returns the volume the next CAN, of about
+* bytes, goes in, opening volumes as the
+* set needs them.
+*/
+static int pick_volume(VOLUME_SET set, uint64_t bytes) {
+    if (set->count) {
+        while (set->opened < set->count)
+            open_volume(set);
+
+        int volume = 0;
+        for (int v = 1; v < set->count; v++) {
+            if (set->bytes[v] < set->bytes[volume])
+                volume = v;
+        }
+        return volume;
+    }
+
+    // A CAN bigger than a volume
+    // still gets one to itself.
+    if (!set->opened || (set->bytes[set->current] &&
+                         set->bytes[set->current] + bytes > set->size)) {
+        if (set->opened == VOLUME_MAX_COUNT)
+            handle_error("Too many volumes");
+
+        // Two volumes fill at most, the
+        // last finishing as the next
+        // one starts.
+        if (set->opened >= 2)
+            finish_volume(set, set->opened - 2);
+        open_volume(set);
+        set->current = set->opened - 1;
+    }
+
+    return set->current;
+}
+
+
+/**
+* Starts the next volume with a writer
+* and create pool of its own.
+*/
+static void open_volume(VOLUME_SET set) {
+    int volume = set->opened++;
+    set->writers = realloc(set->writers, set->opened * sizeof(CAN_WRITER));
+    set->pools = realloc(set->pools, set->opened * sizeof(CREATE_POOL));
+    set->bytes = realloc(set->bytes, set->opened * sizeof(uint64_t));
+    if (!set->writers || !set->pools || !set->bytes)
+        handle_error("Failed to grow volumes");
+
+    char *pathname = volume_name(set->can_pathname, volume);
+    int fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        handle_error("file stream error");
+    free(pathname);
+
+    // Each volume is a can of its own, with
+    // a trailing index so it can be listed
+    // without reading it all.
+    CAN_WRITER writer = new_CAN_writer(block_io_open_write(fd), 1, set->version);
+    if (set->dedup)
+        writer->chunks = new_chunk_store();
+    writer->sparse = set->sparse;
+    writer->aligned = set->aligned;
+    writer->prefixed = set->prefixed;
+
+    // A fixed number of volumes share out the
+    // readers and budget, otherwise two
+    // volumes are filling at most.
+    int readers = set->workers;
+    size_t budget = set->budget / 2;
+    if (set->count) {
+        readers = set->workers / set->count;
+        budget = set->budget / set->count;
+    }
+    if (readers < 1)
+        readers = 1;
+
+    set->writers[volume] = writer;
+    set->pools[volume] = create_pool_start(writer, readers, budget ? budget : 1,
+                                           set->read_order);
+    set->bytes[volume] = 0;
+}
+
+
+/**
+* Waits for a volume's CANs to be
+* written and closes it.
+*/
+static void finish_volume(VOLUME_SET set, int volume) {
+    create_pool_finish(set->pools[volume]);
+    close_CAN_writer(set->writers[volume]);
+    set->pools[volume] = NULL;
+    set->writers[volume] = NULL;
+}
+
+
+/**
+* Returns the pathname of a volume,
+* which the caller frees.
+*/
+static char *volume_name(char *can_pathname, int volume) {
+    size_t length = strlen(can_pathname) + 16;
+    char *pathname = malloc(length);
+    if (!pathname)
+        handle_error("Failed to allocate volume name");
+
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), VOLUME_SUFFIX, volume + 1);
+    snprintf(pathname, length, "%s%s", can_pathname, suffix);
+    return pathname;
+}
+
+
+/**
+* Writes the manifest as a can of one CAN.
+* Volumes are named without a directory,
+* as they live beside the manifest.
+*/
+static void write_manifest(VOLUME_SET set) {
+    char *base = strrchr(set->can_pathname, '/');
+    base = base ? base + 1 : set->can_pathname;
+
+    size_t length = VOLUME_MAGIC_BYTES + VOLUME_COUNT_BYTES + VOLUME_ENTRIES_BYTES +
+                    set->entries * VOLUME_NUMBER_BYTES;
+    char **names = malloc(set->opened * sizeof(char *));
+    if (!names)
+        handle_error("Failed to allocate volume manifest");
+    for (int volume = 0; volume < set->opened; volume++) {
+        names[volume] = volume_name(base, volume);
+        length += VOLUME_NAME_LENGTH_BYTES + strlen(names[volume]);
+    }
+
+    uint8_t *contents = malloc(length);
+    if (!contents)
+        handle_error("Failed to allocate volume manifest");
+
+    uint8_t *at = contents;
+    memcpy(at, VOLUME_MANIFEST_MAGIC, VOLUME_MAGIC_BYTES);
+    at += VOLUME_MAGIC_BYTES;
+    put_bytes(at, set->opened, VOLUME_COUNT_BYTES);
+    at += VOLUME_COUNT_BYTES;
+    put_bytes(at, set->entries, VOLUME_ENTRIES_BYTES);
+    at += VOLUME_ENTRIES_BYTES;
+    for (int volume = 0; volume < set->opened; volume++) {
+        size_t name_length = strlen(names[volume]);
+        put_bytes(at, name_length, VOLUME_NAME_LENGTH_BYTES);
+        memcpy(at + VOLUME_NAME_LENGTH_BYTES, names[volume], name_length);
+        at += VOLUME_NAME_LENGTH_BYTES + name_length;
+        free(names[volume]);
+    }
+    memcpy(at, set->order, set->entries * VOLUME_NUMBER_BYTES);
+    free(names);
+
+    int fd = open(set->can_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        handle_error("file stream error");
+    BLOCK_IO can_file = block_io_open_write(fd);
+
+    uint8_t header[CAN_MAX_HEADER_LENGTH];
+    size_t header_length = encode_CAN_header(header, set->version, 0,
+                                             VOLUME_MANIFEST_PATHNAME,
+                                             VOLUME_MANIFEST_MODE, length);
+    block_io_write(can_file, header, header_length);
+    block_io_write(can_file, contents, length);
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, set->version, CAN_header_sum(set->version, header,
+                                                     header_length));
+    CAN_sum_update(&sum, contents, length);
+    uint8_t trailer[CAN_MAX_SUM_BYTES];
+    put_CAN_sum(trailer, set->version, CAN_sum_final(&sum));
+    block_io_write(can_file, trailer, CAN_sum_bytes(set->version));
+
+    block_io_close(can_file);
+    free(contents);
+}
+
+
+/**
+* Reads the one CAN of the manifest open
+* on fd, checking it, and returns its
+* contents, which the caller frees.
+*/
+static uint8_t *read_manifest(int fd, uint64_t *length) {
+    // The stream closes its fd,
+    // so give it one of its own.
+    int read_fd = dup(fd);
+    if (read_fd < 0)
+        handle_error("Failed to read can");
+    BLOCK_IO file_ptr = block_io_open_read(read_fd);
+
+    struct CAN_Struct can;
+    struct CAN_Path *last = calloc(1, sizeof(*last));
+    if (!last)
+        handle_error("Failed to allocate pathname");
+    if (!build_CAN(&can, file_ptr))
+        handle_error("Unexpected end of can");
+    char *path_name = read_CAN_path_name(&can, file_ptr, last);
+    if (!is_manifest_CAN(path_name, can.mode))
+        handle_error("Not a multi-volume can");
+    free(last);
+
+    *length = can.content_length;
+    uint8_t *contents = malloc(*length + 1);
+    if (!contents)
+        handle_error("Failed to allocate volume manifest");
+    if (block_io_read(file_ptr, contents, *length) != *length)
+        handle_error("Unexpected end of can");
+
+    struct CAN_Sum sum;
+    CAN_sum_start(&sum, can.version, can.hash);
+    CAN_sum_update(&sum, contents, *length);
+    can.hash = CAN_sum_final(&sum);
+    if (!check_CAN_sum(file_ptr, &can))
+        handle_error("can hash incorrect");
+
+    block_io_close(file_ptr);
+    return contents;
+}
+
+
+/**
+* Returns the pathname of the volume named
+* name beside the manifest can_pathname,
+* which the caller frees.
+*/
+static char *volume_pathname(char *can_pathname, const uint8_t *name, size_t length) {
+    char *slash = strrchr(can_pathname, '/');
+    size_t dir_length = slash ? (size_t) (slash - can_pathname) + 1 : 0;
+
+    char *pathname = malloc(dir_length + length + 1);
+    if (!pathname)
+        handle_error("Failed to allocate volume name");
+    memcpy(pathname, can_pathname, dir_length);
+    memcpy(pathname + dir_length, name, length);
+    pathname[dir_length + length] = '\0';
+
+    // A name can't lead out of
+    // the manifest's directory.
+    if (memchr(name, '/', length) || memchr(name, '\0', length))
+        handle_error("Volume manifest corrupt");
+
+    return pathname;
+}
+
+
+/**
+* Lists every volume of can into indexes,
+* several volumes at once.
+*/
+static void load_volumes(VOLUME_CAN can, CAN_INDEX *indexes) {
+    struct Volume_Load load = {
+        .fds = can->fds,
+        .indexes = indexes,
+        .count = can->count,
+        .next = 0,
+    };
+
+    int threads = can->count < VOLUME_LOAD_THREADS ? can->count : VOLUME_LOAD_THREADS;
+    if (threads <= 1) {
+        load_thread(&load);
+        return;
+    }
+
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    if (!ids)
+        handle_error("Failed to allocate volume threads");
+    for (int t = 0; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, load_thread, &load) != 0)
+            handle_error("Failed to start volume thread");
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(ids[t], NULL);
+
+    free(ids);
+}
+
+
+/**
+* Lists volumes from their trailing index,
+* or by reading them through if they've
+* lost it, until none are left.
+*/
+static void *load_thread(void *arg) {
+    struct Volume_Load *load = arg;
+
+    for (;;) {
+        int volume = __atomic_fetch_add(&load->next, 1, __ATOMIC_RELAXED);
+        if (volume >= load->count)
+            break;
+
+        int fd = load->fds[volume];
+        CAN_INDEX index = read_CAN_index(fd);
+        if (!index) {
+            int scan_fd = dup(fd);
+            if (scan_fd < 0)
+                handle_error("Failed to read can");
+            BLOCK_IO scan = block_io_open_read(scan_fd);
+            index = scan_CAN_index(scan);
+            block_io_close(scan);
+        }
+        load->indexes[volume] = index;
+    }
+
+    return NULL;
+}
+
+
+/**
+* Builds the can's index by taking the next
+* CAN of each volume in turn as order says,
+* so it lists them as they were added.
+*/
+static void merge_volumes(VOLUME_CAN can, CAN_INDEX *indexes, const uint8_t *order,
+                          uint64_t entries) {
+    can->index = calloc(1, sizeof(*can->index));
+    size_t *next = calloc(can->count + 1, sizeof(size_t));
+    if (!can->index || !next)
+        handle_error("Failed to allocate can index");
+
+    for (uint64_t e = 0; e < entries; e++) {
+        int volume = get_bytes(order + e * VOLUME_NUMBER_BYTES, VOLUME_NUMBER_BYTES);
+        if (volume >= can->count || next[volume] == indexes[volume]->count)
+            handle_error("Volume manifest doesn't match its volumes");
+
+        struct CAN_Entry *entry = append_CAN_entry(can->index);
+        *entry = indexes[volume]->entries[next[volume]++];
+        entry->volume = volume;
+    }
+
+    // The paths now belong to the
+    // can's index.
+    for (int volume = 0; volume < can->count; volume++) {
+        if (next[volume] != indexes[volume]->count)
+            handle_error("Volume manifest doesn't match its volumes");
+        indexes[volume]->count = 0;
+        free_CAN_index(indexes[volume]);
+    }
+
+    free(next);
+}
@@ -0,0 +1,142 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "can.h"
+#include "create_pool.h"
+
+// a multi-volume can is a manifest, a can whose
+// one CAN has this pathname, and the volumes
+// it names, each a can of its own
+#define VOLUME_MANIFEST_PATHNAME  ".crush_volumes"
+#define VOLUME_MANIFEST_MODE      0100444
+
+// the manifest's contents start with this magic,
+// the number of volumes and of CANs across them,
+// then give each volume's name and its length,
+// then the volume of each CAN in the order
+// they were added
+#define VOLUME_MANIFEST_MAGIC     "CRUSHVOL"
+#define VOLUME_MAGIC_BYTES        8
+#define VOLUME_COUNT_BYTES        2
+#define VOLUME_ENTRIES_BYTES      8
+#define VOLUME_NAME_LENGTH_BYTES  2
+#define VOLUME_NUMBER_BYTES       2
+#define VOLUME_MAX_COUNT          65535
+
+// volumes are named after the manifest
+// with their number, from 1, added
+#define VOLUME_SUFFIX             ".%03d"
+
+/**
+* The volumes a multi-volume can is being
+* written to, each through its own writer
+* and create pool so they fill at once.
+* With count set the CANs are spread over
+* that many volumes, each going to the one
+* with the fewest bytes so far. Otherwise a
+* volume takes CANs until the next would
+* go past size bytes, then the next volume
+* is started. order keeps the volume of
+* every CAN.
+*/
+struct Volume_Set_Struct {
+    char *can_pathname;
+    int count;
+    uint64_t size;
+    int version;
+    int dedup;
+    int sparse;
+    int aligned;
+    int prefixed;
+    int read_order;
+    int workers;
+    size_t budget;
+
+    int opened;
+    int current;
+    CAN_WRITER *writers;
+    CREATE_POOL *pools;
+    uint64_t *bytes;
+
+    uint8_t *order;
+    size_t entries;
+    size_t capacity;
+};
+
+typedef struct Volume_Set_Struct *VOLUME_SET;
+
+/**
+* A multi-volume can opened for reading.
+* index lists every CAN in the order they
+* were added, each entry's volume saying
+* which of fds holds it.
+*/
+struct Volume_Can_Struct {
+    int count;
+    int *fds;
+    CAN_INDEX index;
+};
+
+typedef struct Volume_Can_Struct *VOLUME_CAN;
+
+
+/**
+* Creates an empty set of volumes for the
+* manifest can_pathname, holding CANs of
+* the given format version. Each volume is
+* loaded by workers reader threads with
+* budget bytes of contents between them.
+* count or size is set before adding.
+*/
+VOLUME_SET new_volume_set(char *can_pathname, int version, int workers,
+                          size_t budget);
+
+
+/**
+* A CAN_EMIT which queues path on
+* a volume of the set passed.
+*/
+void volume_add(void *volume_set, char *path, struct stat *s);
+
+
+/**
+* Waits for every volume to be written,
+* writes the manifest and frees the set.
+*/
+void close_volume_set(VOLUME_SET set);
+
+
+/**
+* Returns 1 if the can open on fd
+* is a multi-volume manifest.
+*/
+int is_volume_manifest(int fd);
+
+
+/**
+* Returns 1 if a CAN with this path and
+* mode is a multi-volume manifest.
+*/
+int is_manifest_CAN(char *path, long mode);
+
+
+/**
+* Reads the manifest can_pathname open on
+* fd, opens its volumes and lists them,
+* a thread to each volume.
+*/
+VOLUME_CAN open_volume_can(char *can_pathname, int fd);
+
+
+/**
+* Closes the volumes and frees the index.
+*/
+void free_volume_can(VOLUME_CAN can);
+
+
+#endif
@@ -0,0 +1,574 @@
+/**
+* walk.c => Directory walker feeding paths to a CAN_EMIT
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "can.h"
+#include "crush.h"
+#include "stats.h"
+#include "walk.h"
+
+// most entries walker threads hold that the
+// emitting thread hasn't taken yet, past which
+// a walker waits for it to catch up
+#define WALK_BUFFERED_RECORDS     (1 << 16)
+
+/**
+* Called for each entry found by walk_tree
+* with its path and stat.
+*/
+typedef void (*WALK_VISIT)(void *arg, char *path, struct stat *s);
+
+/**
+* An open directory of the walk and the
+* length of its path, slash included. A
+* sorted walk reads all of a directory's
+* names first and takes them from names.
+*/
+struct Walk_Frame {
+    DIR *dir;
+    size_t path_length;
+    int sorted;
+    char **names;
+    size_t count;
+    size_t next;
+};
+
+/**
+* An entry found by a walker thread,
+* held until it can be emitted.
+*/
+struct Walk_Record {
+    char *path;
+    struct stat st;
+};
+
+struct Walk_List {
+    struct Walk_Record *records;
+    size_t count;
+    size_t capacity;
+};
+
+/**
+* One subdirectory of the root to be
+* walked by a thread, the records of its
+* list from emitted on not yet emitted.
+*/
+struct Walk_Task {
+    char *name;
+    size_t index;
+    struct Walk_Pool *pool;
+    struct Walk_List list;
+    size_t emitted;
+    int done;
+};
+
+/**
+* Subdirectories of the root, walked in
+* turn by whichever thread is free. head
+* is the task being emitted, whose records
+* are taken as they come, and buffered
+* counts the records held in every list.
+*/
+struct Walk_Pool {
+    int root_fd;
+    char *root_path;
+    int sorted;
+    struct Walk_Task *tasks;
+    size_t count;
+    size_t next;
+    size_t head;
+    size_t buffered;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pthread_cond_t drained;
+};
+
+/**
+* Where a walk's entries go
+* when emitted directly.
+*/
+struct Walk_Target {
+    CAN_EMIT emit;
+    void *ctx;
+};
+
+/////////////////////// Function Prototypes /////////////////////////////////////
+static void walk_tree(int dir_fd, char *path, WALK_VISIT visit, void *arg,
+                      int sorted);
+static void open_frame(struct Walk_Frame *frame, DIR *dir, size_t path_length,
+                       int sorted);
+static char *next_name(struct Walk_Frame *frame);
+static void close_frame(struct Walk_Frame *frame);
+static int compare_names(const void *a, const void *b);
+static int compare_records(const void *a, const void *b);
+static DIR *open_dir_at(int dir_fd, char *name);
+static size_t join_path(char *path, size_t length, char *name);
+static int is_dot(char *name);
+static void emit_entry(void *arg, char *path, struct stat *s);
+static void list_entry(void *arg, char *path, struct stat *s);
+static void queue_entry(void *arg, char *path, struct stat *s);
+static int is_held_back(struct Walk_Pool *pool, struct Walk_Task *task);
+static void *walk_thread(void *arg);
+static void walk_parallel(struct Walk_Target *target, DIR *root, char *dir_path,
+                          int workers, int sorted);
+/////////////////////////////////////////////////////////////////////////////////
+
+
+void walk_dir(CAN_EMIT emit, void *ctx, char *dir_path, int workers, int sorted) {
+    struct Walk_Target target = {emit, ctx};
+
+    if (workers > 1) {
+        walk_parallel(&target, open_dir_at(AT_FDCWD, dir_path), dir_path, workers,
+                      sorted);
+        return;
+    }
+
+    int fd = openat(AT_FDCWD, dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    stats_call(STATS_CALL_OPEN);
+    walk_tree(fd, dir_path, emit_entry, &target, sorted);
+}
+
+
+/**
+* Walks the directory open on dir_fd, whose
+* path is path, passing every entry below
+* it to visit. Keeps a stack of open
+* directories rather than recursing.
+* dir_fd is closed once done.
+*/
+static void walk_tree(int dir_fd, char *path, WALK_VISIT visit, void *arg,
+                      int sorted) {
+    char *running_path = malloc(CAN_MAX_PATHNAME_LENGTH + 1);
+    size_t frame_capacity = 16;
+    struct Walk_Frame *frames = malloc(frame_capacity * sizeof(struct Walk_Frame));
+    if (!running_path || !frames)
+        handle_error("Failed to allocate walk");
+
+    if (dir_fd < 0)
+        handle_error("couldn't open dir");
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir)
+        handle_error("couldn't open dir");
+
+    size_t depth = 1;
+    open_frame(&frames[0], dir, join_path(running_path,
+                                          join_path(running_path, 0, path), ""),
+               sorted);
+
+    while (depth) {
+        struct Walk_Frame *frame = &frames[depth - 1];
+        char *name = next_name(frame);
+
+        if (!name) {
+            close_frame(frame);
+            depth--;
+            continue;
+        }
+
+        size_t length = join_path(running_path, frame->path_length, name);
+
+        struct stat s;
+        uint64_t since = stats_clock();
+        if (fstatat(dirfd(frame->dir), name, &s, 0) != 0)
+            handle_error("failed to get struct stats");
+        stats_phase(STATS_STAT, since);
+        stats_call(STATS_CALL_STAT);
+
+        visit(arg, running_path, &s);
+
+        if (!S_ISDIR(s.st_mode))
+            continue;
+
+        // Descend at once so entries keep
+        // the order of a recursive walk.
+        DIR *child = open_dir_at(dirfd(frame->dir), name);
+        if (depth == frame_capacity) {
+            frame_capacity *= 2;
+            frames = realloc(frames, frame_capacity * sizeof(struct Walk_Frame));
+            if (!frames)
+                handle_error("Failed to allocate walk");
+        }
+
+        open_frame(&frames[depth], child, join_path(running_path, length, ""), sorted);
+        depth++;
+    }
+
+    free(frames);
+    free(running_path);
+}
+
+
+/**
+* Starts a frame for dir, reading and
+* sorting all its names if sorted is set.
+*/
+static void open_frame(struct Walk_Frame *frame, DIR *dir, size_t path_length,
+                       int sorted) {
+    frame->dir = dir;
+    frame->path_length = path_length;
+    frame->sorted = sorted;
+    frame->names = NULL;
+    frame->count = 0;
+    frame->next = 0;
+    if (!sorted)
+        return;
+
+    size_t capacity = 0;
+    for (;;) {
+        uint64_t since = stats_clock();
+        struct dirent *entry = readdir(dir);
+        stats_phase(STATS_WALK, since);
+        if (!entry)
+            break;
+        if (is_dot(entry->d_name))
+            continue;
+
+        if (frame->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            frame->names = realloc(frame->names, capacity * sizeof(char *));
+            if (!frame->names)
+                handle_error("Failed to allocate walk");
+        }
+        frame->names[frame->count] = strdup(entry->d_name);
+        if (!frame->names[frame->count++])
+            handle_error("Failed to allocate walk");
+    }
+
+    if (frame->count)
+        qsort(frame->names, frame->count, sizeof(char *), compare_names);
+}
+
+
+/**
+* Returns the next name of a frame's
+* directory, or NULL once there are none.
+*/
+static char *next_name(struct Walk_Frame *frame) {
+    if (frame->sorted)
+        return frame->next < frame->count ? frame->names[frame->next++] : NULL;
+
+    for (;;) {
+        uint64_t since = stats_clock();
+        struct dirent *entry = readdir(frame->dir);
+        stats_phase(STATS_WALK, since);
+
+        if (!entry)
+            return NULL;
+        if (!is_dot(entry->d_name))
+            return entry->d_name;
+    }
+}
+
+
+static void close_frame(struct Walk_Frame *frame) {
+    for (size_t n = 0; n < frame->count; n++)
+        free(frame->names[n]);
+    free(frame->names);
+
+    closedir(frame->dir);
+    stats_call(STATS_CALL_CLOSE);
+}
+
+
+/**
+* Orders names byte by byte so neighbours
+* share as much of their paths as can be.
+*/
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+static int compare_records(const void *a, const void *b) {
+    return strcmp(((const struct Walk_Record *) a)->path,
+                  ((const struct Walk_Record *) b)->path);
+}
+
+
+/**
+* Opens the directory name relative
+* to the directory open on dir_fd.
+*/
+static DIR *open_dir_at(int dir_fd, char *name) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        handle_error("couldn't open dir");
+    stats_call(STATS_CALL_OPEN);
+
+    DIR *dir = fdopendir(fd);
+    if (!dir)
+        handle_error("couldn't open dir");
+
+    return dir;
+}
+
+
+/**
+* Puts name after the first length bytes of
+* path, then a slash if name is empty and
+* path doesn't end in one, returning the
+* new length.
+*/
+static size_t join_path(char *path, size_t length, char *name) {
+    size_t name_length = strlen(name);
+    if (length + name_length + 1 > CAN_MAX_PATHNAME_LENGTH)
+        handle_error("Pathname too long");
+
+    memcpy(path + length, name, name_length);
+    length += name_length;
+
+    if (!name_length && (!length || path[length - 1] != '/'))
+        path[length++] = '/';
+
+    path[length] = '\0';
+    return length;
+}
+
+
+/**
+* Returns 1 for the . and .. entries.
+*/
+static int is_dot(char *name) {
+    return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+
+static void emit_entry(void *arg, char *path, struct stat *s) {
+    struct Walk_Target *target = arg;
+
+    target->emit(target->ctx, path, s);
+}
+
+
+static void list_entry(void *arg, char *path, struct stat *s) {
+    struct Walk_List *list = arg;
+
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->records = realloc(list->records,
+                                list->capacity * sizeof(struct Walk_Record));
+        if (!list->records)
+            handle_error("Failed to grow walk list");
+    }
+
+    struct Walk_Record *record = &list->records[list->count++];
+    record->path = strdup(path);
+    record->st = *s;
+    if (!record->path)
+        handle_error("Failed to grow walk list");
+}
+
+
+/**
+* Adds an entry a walker thread found to
+* its task's list, first waiting while
+* too many are held.
+*/
+static void queue_entry(void *arg, char *path, struct stat *s) {
+    struct Walk_Task *task = arg;
+    struct Walk_Pool *pool = task->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (is_held_back(pool, task))
+        pthread_cond_wait(&pool->drained, &pool->lock);
+
+    list_entry(&task->list, path, s);
+    pool->buffered++;
+    if (task->index == pool->head)
+        pthread_cond_signal(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+* Returns 1 if a task's walker must wait
+* for the emitting thread. The head task
+* only waits on its own records, which are
+* being taken, so it can't be held back by
+* the tasks after it.
+*/
+static int is_held_back(struct Walk_Pool *pool, struct Walk_Task *task) {
+    if (task->index == pool->head)
+        return task->list.count - task->emitted >= WALK_BUFFERED_RECORDS;
+
+    return pool->buffered >= WALK_BUFFERED_RECORDS;
+}
+
+
+/**
+* Walks subdirectories of the root
+* until none are left.
+*/
+static void *walk_thread(void *arg) {
+    struct Walk_Pool *pool = arg;
+    char *path = malloc(CAN_MAX_PATHNAME_LENGTH + 1);
+    if (!path)
+        handle_error("Failed to allocate walk");
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t t = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (t >= pool->count)
+            break;
+
+        struct Walk_Task *task = &pool->tasks[t];
+        size_t length = join_path(path, 0, pool->root_path);
+        length = join_path(path, length, task->name);
+        join_path(path, length, "");
+
+        int fd = openat(pool->root_fd, task->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        stats_call(STATS_CALL_OPEN);
+        walk_tree(fd, path, queue_entry, task, pool->sorted);
+
+        pthread_mutex_lock(&pool->lock);
+        task->done = 1;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    free(path);
+    return NULL;
+}
+
+
+/**
+* Reads the root's own entries, hands its
+* subdirectories to workers threads and
+* then emits everything in walk order,
+* taking a subdirectory's entries as its
+* thread finds them when its turn comes.
+* Threads walking ahead hold at most
+* WALK_BUFFERED_RECORDS entries between
+* them before waiting.
+*/
+static void walk_parallel(struct Walk_Target *target, DIR *root, char *dir_path,
+                          int workers, int sorted) {
+    struct Walk_List top = {0};
+    struct dirent *entry;
+
+    char *path = malloc(CAN_MAX_PATHNAME_LENGTH + 1);
+    if (!path)
+        handle_error("Failed to allocate walk");
+    size_t root_length = join_path(path, 0, dir_path);
+    root_length = join_path(path, root_length, "");
+
+    for (;;) {
+        uint64_t since = stats_clock();
+        entry = readdir(root);
+        stats_phase(STATS_WALK, since);
+        if (!entry)
+            break;
+        if (is_dot(entry->d_name))
+            continue;
+
+        struct stat s;
+        since = stats_clock();
+        if (fstatat(dirfd(root), entry->d_name, &s, 0) != 0)
+            handle_error("failed to get struct stats");
+        stats_phase(STATS_STAT, since);
+        stats_call(STATS_CALL_STAT);
+
+        join_path(path, root_length, entry->d_name);
+        list_entry(&top, path, &s);
+    }
+    path[root_length] = '\0';
+
+    if (sorted)
+        qsort(top.records, top.count, sizeof(struct Walk_Record), compare_records);
+
+    struct Walk_Pool pool = {
+        .root_fd = dirfd(root),
+        .root_path = path,
+        .sorted = sorted,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.done, NULL);
+    pthread_cond_init(&pool.drained, NULL);
+
+    pool.tasks = calloc(top.count + 1, sizeof(struct Walk_Task));
+    if (!pool.tasks)
+        handle_error("Failed to allocate walk");
+
+    for (size_t r = 0; r < top.count; r++) {
+        if (!S_ISDIR(top.records[r].st.st_mode))
+            continue;
+        struct Walk_Task *task = &pool.tasks[pool.count];
+        task->name = top.records[r].path + root_length;
+        task->index = pool.count++;
+        task->pool = &pool;
+    }
+
+    if (workers > (int) pool.count)
+        workers = pool.count;
+
+    pthread_t *threads = calloc(workers + 1, sizeof(pthread_t));
+    if (!threads)
+        handle_error("Failed to allocate walk threads");
+
+    for (int w = 0; w < workers; w++) {
+        if (pthread_create(&threads[w], NULL, walk_thread, &pool) != 0)
+            handle_error("Failed to start walk thread");
+    }
+
+    size_t t = 0;
+    for (size_t r = 0; r < top.count; r++) {
+        struct Walk_Record *record = &top.records[r];
+        emit_entry(target, record->path, &record->st);
+
+        if (!S_ISDIR(record->st.st_mode))
+            continue;
+
+        struct Walk_Task *task = &pool.tasks[t++];
+        pthread_mutex_lock(&pool.lock);
+        pool.head = task->index;
+        pthread_cond_broadcast(&pool.drained);
+
+        for (;;) {
+            while (task->emitted == task->list.count && !task->done)
+                pthread_cond_wait(&pool.done, &pool.lock);
+            if (task->emitted == task->list.count)
+                break;
+
+            // Once emptied the list starts
+            // over rather than growing.
+            struct Walk_Record below = task->list.records[task->emitted++];
+            if (task->emitted == task->list.count)
+                task->emitted = task->list.count = 0;
+            pool.buffered--;
+            pthread_cond_broadcast(&pool.drained);
+            pthread_mutex_unlock(&pool.lock);
+
+            emit_entry(target, below.path, &below.st);
+            free(below.path);
+            pthread_mutex_lock(&pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+        free(task->list.records);
+    }
+
+    for (int w = 0; w < workers; w++)
+        pthread_join(threads[w], NULL);
+
+    for (size_t r = 0; r < top.count; r++)
+        free(top.records[r].path);
+    free(top.records);
+    free(pool.tasks);
+    free(threads);
+    free(path);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.done);
+    pthread_cond_destroy(&pool.drained);
+    closedir(root);
+    stats_call(STATS_CALL_CLOSE);
+}
@@ -0,0 +1,28 @@
+#ifndef WALK_H
+#define WALK_H
+
+
+#include "can.h"
+
+/**
+* Walks everything below the directory at
+* dir_path, printing each path and passing
+* it with its stat to emit. Directories are
+* read through their fds with openat and
+* fstatat so every entry is stat'ed once and
+* no path is looked up from the root again.
+*
+* Entries reach emit depth first in the order
+* readdir gives them, or with sorted set in
+* byte order of their names, which puts
+* paths sharing the most next to each
+* other. With workers above one
+* the subdirectories of dir_path are walked
+* on that many threads, their entries held
+* until emit reaches them so the order
+* doesn't change.
+*/
+void walk_dir(CAN_EMIT emit, void *ctx, char *dir_path, int workers, int sorted);
+
+
+#endif